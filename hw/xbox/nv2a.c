@@ -24,23 +24,32 @@
 #include "hw/display/vga_int.h"
 #include "qemu/queue.h"
 #include "qemu/thread.h"
+#include "qemu/main-loop.h"
+#include "qemu/range.h"
+#include "qemu/timer.h"
+#include "sysemu/sysemu.h"
 #include "qapi/qmp/qstring.h"
+#include "qapi/qmp/qerror.h"
+#include "qmp-commands.h"
 #include "gl/gloffscreen.h"
+#include "trace.h"
 
 #include "hw/xbox/u_format_r11g11b10f.h"
 #include "hw/xbox/nv2a_vsh.h"
 #include "hw/xbox/nv2a_psh.h"
+#include "hw/xbox/s3tc.h"
+#include "hw/xbox/yuv.h"
 
 #include "hw/xbox/nv2a.h"
 
-#define DEBUG_NV2A
-#ifdef DEBUG_NV2A
-# define NV2A_DPRINTF(format, ...)       printf("nv2a: " format, ## __VA_ARGS__)
+//#define DEBUG_NV2A_GL
+#ifdef DEBUG_NV2A_GL
+/* glGetError waits on the driver, so only check in debug builds */
+# define NV2A_GL_CHECK() assert(glGetError() == GL_NO_ERROR)
 #else
-# define NV2A_DPRINTF(format, ...)       do { } while (0)
+# define NV2A_GL_CHECK() do { } while (0)
 #endif
 
-
 #define NV_NUM_BLOCKS 21
 #define NV_PMC          0   /* card master control */
 #define NV_PBUS         1   /* bus control */
@@ -70,6 +79,8 @@
 #define NV_PMC_INTR_0                                    0x00000100
 #   define NV_PMC_INTR_0_PFIFO                                 (1 << 8)
 #   define NV_PMC_INTR_0_PGRAPH                               (1 << 12)
+#   define NV_PMC_INTR_0_PVIDEO                               (1 << 16)
+#   define NV_PMC_INTR_0_PTIMER                               (1 << 20)
 #   define NV_PMC_INTR_0_PCRTC                                (1 << 24)
 #   define NV_PMC_INTR_0_PBUS                                 (1 << 28)
 #   define NV_PMC_INTR_0_SOFTWARE                             (1 << 31)
@@ -278,6 +289,31 @@
 #define NV_PGRAPH_COMBINECTL                             0x00001940
 #define NV_PGRAPH_COMBINESPECFOG0                        0x00001944
 #define NV_PGRAPH_COMBINESPECFOG1                        0x00001948
+#define NV_PGRAPH_CONTROL_0                              0x0000194C
+#   define NV_PGRAPH_CONTROL_0_ZENABLE                         (1 << 14)
+#   define NV_PGRAPH_CONTROL_0_ZFUNC                          0x000F0000
+#   define NV_PGRAPH_CONTROL_0_ZWRITEENABLE                    (1 << 24)
+#   define NV_PGRAPH_CONTROL_0_STENCIL_WRITE_ENABLE            (1 << 25)
+#define NV_PGRAPH_CONTROL_1                              0x00001950
+#   define NV_PGRAPH_CONTROL_1_STENCIL_TEST_ENABLE              (1 << 0)
+#   define NV_PGRAPH_CONTROL_1_STENCIL_FUNC                   0x000000F0
+#   define NV_PGRAPH_CONTROL_1_STENCIL_REF                    0x0000FF00
+#   define NV_PGRAPH_CONTROL_1_STENCIL_MASK_READ              0x00FF0000
+#   define NV_PGRAPH_CONTROL_1_STENCIL_MASK_WRITE             0xFF000000
+#define NV_PGRAPH_CONTROL_2                              0x00001954
+#   define NV_PGRAPH_CONTROL_2_STENCIL_OP_FAIL                0x0000000F
+#   define NV_PGRAPH_CONTROL_2_STENCIL_OP_ZFAIL               0x000000F0
+#   define NV_PGRAPH_CONTROL_2_STENCIL_OP_ZPASS               0x00000F00
+#       define NV_PGRAPH_CONTROL_2_STENCIL_OP_V_KEEP                1
+#       define NV_PGRAPH_CONTROL_2_STENCIL_OP_V_ZERO                2
+#       define NV_PGRAPH_CONTROL_2_STENCIL_OP_V_REPLACE             3
+#       define NV_PGRAPH_CONTROL_2_STENCIL_OP_V_INCRSAT             4
+#       define NV_PGRAPH_CONTROL_2_STENCIL_OP_V_DECRSAT             5
+#       define NV_PGRAPH_CONTROL_2_STENCIL_OP_V_INVERT              6
+#       define NV_PGRAPH_CONTROL_2_STENCIL_OP_V_INCR                7
+#       define NV_PGRAPH_CONTROL_2_STENCIL_OP_V_DECR                8
+#define NV_PGRAPH_SETUPRASTER                            0x00001990
+#   define NV_PGRAPH_SETUPRASTER_Z_FORMAT                      (1 << 29)
 #define NV_PGRAPH_SHADERCTL                              0x00001998
 #define NV_PGRAPH_SHADERPROG                             0x0000199C
 #define NV_PGRAPH_SPECFOGFACTOR0                         0x000019AC
@@ -294,6 +330,46 @@
 #define NV_PCRTC_CONFIG                                  0x00000804
 
 
+#define NV_PVIDEO_INTR                                   0x00000100
+#   define NV_PVIDEO_INTR_BUFFER_0                              (1 << 0)
+#   define NV_PVIDEO_INTR_BUFFER_1                              (1 << 4)
+#define NV_PVIDEO_INTR_EN                                0x00000140
+#   define NV_PVIDEO_INTR_EN_BUFFER_0                           (1 << 0)
+#   define NV_PVIDEO_INTR_EN_BUFFER_1                           (1 << 4)
+#define NV_PVIDEO_BUFFER                                 0x00000700
+#   define NV_PVIDEO_BUFFER_0_USE                               (1 << 0)
+#   define NV_PVIDEO_BUFFER_1_USE                               (1 << 4)
+#define NV_PVIDEO_STOP                                   0x00000704
+#   define NV_PVIDEO_STOP_OVERLAY_ACTIVE                        (1 << 0)
+#   define NV_PVIDEO_STOP_METHOD_IMMEDIATELY                    (1 << 4)
+#define NV_PVIDEO_BASE(i)                                (0x00000900 + (i) * 4)
+#define NV_PVIDEO_LIMIT(i)                               (0x00000908 + (i) * 4)
+#define NV_PVIDEO_LUMINANCE(i)                           (0x00000910 + (i) * 4)
+#define NV_PVIDEO_CHROMINANCE(i)                         (0x00000918 + (i) * 4)
+#define NV_PVIDEO_OFFSET(i)                              (0x00000920 + (i) * 4)
+#define NV_PVIDEO_SIZE_IN(i)                             (0x00000928 + (i) * 4)
+#   define NV_PVIDEO_SIZE_IN_WIDTH                            0x000007FF
+#   define NV_PVIDEO_SIZE_IN_HEIGHT                           0x07FF0000
+#define NV_PVIDEO_POINT_IN(i)                            (0x00000930 + (i) * 4)
+#   define NV_PVIDEO_POINT_IN_S                               0x00007FFF
+#   define NV_PVIDEO_POINT_IN_T                               0xFFFE0000
+#define NV_PVIDEO_DS_DX(i)                               (0x00000938 + (i) * 4)
+#define NV_PVIDEO_DT_DY(i)                               (0x00000940 + (i) * 4)
+#define NV_PVIDEO_POINT_OUT(i)                           (0x00000948 + (i) * 4)
+#   define NV_PVIDEO_POINT_OUT_X                              0x00000FFF
+#   define NV_PVIDEO_POINT_OUT_Y                              0x0FFF0000
+#define NV_PVIDEO_SIZE_OUT(i)                            (0x00000950 + (i) * 4)
+#   define NV_PVIDEO_SIZE_OUT_WIDTH                           0x00000FFF
+#   define NV_PVIDEO_SIZE_OUT_HEIGHT                          0x0FFF0000
+#define NV_PVIDEO_FORMAT(i)                              (0x00000958 + (i) * 4)
+#   define NV_PVIDEO_FORMAT_PITCH                             0x00001FFF
+#   define NV_PVIDEO_FORMAT_COLOR                             0x00030000
+#       define NV_PVIDEO_FORMAT_COLOR_LE_YB8CR8YA8CB8               0
+#       define NV_PVIDEO_FORMAT_COLOR_LE_CR8YB8CB8YA8               1
+#   define NV_PVIDEO_FORMAT_DISPLAY                            (1 << 20)
+#define NV_PVIDEO_COLOR_KEY                              0x00000B00
+
+
 #define NV_PTIMER_INTR_0                                 0x00000100
 #   define NV_PTIMER_INTR_0_ALARM                               (1 << 0)
 #define NV_PTIMER_INTR_EN_0                              0x00000140
@@ -383,7 +459,16 @@
 #   define NV062_SET_CONTEXT_DMA_IMAGE_DESTIN                 0x00620188
 #   define NV062_SET_COLOR_FORMAT                             0x00620300
 #       define NV062_SET_COLOR_FORMAT_LE_Y8                    0x01
+#       define NV062_SET_COLOR_FORMAT_LE_X1R5G5B5_Z1R5G5B5     0x02
+#       define NV062_SET_COLOR_FORMAT_LE_X1R5G5B5_O1R5G5B5     0x03
+#       define NV062_SET_COLOR_FORMAT_LE_R5G6B5                0x04
+#       define NV062_SET_COLOR_FORMAT_LE_Y16                   0x05
+#       define NV062_SET_COLOR_FORMAT_LE_X8R8G8B8_Z8R8G8B8     0x06
+#       define NV062_SET_COLOR_FORMAT_LE_X8R8G8B8_O8R8G8B8     0x07
+#       define NV062_SET_COLOR_FORMAT_LE_X1A7R8G8B8_Z1A7R8G8B8 0x08
+#       define NV062_SET_COLOR_FORMAT_LE_X1A7R8G8B8_O1A7R8G8B8 0x09
 #       define NV062_SET_COLOR_FORMAT_LE_A8R8G8B8              0x0A
+#       define NV062_SET_COLOR_FORMAT_LE_Y32                   0x0B
 #   define NV062_SET_PITCH                                    0x00620304
 #   define NV062_SET_OFFSET_SOURCE                            0x00620308
 #   define NV062_SET_OFFSET_DESTIN                            0x0062030C
@@ -410,6 +495,7 @@
 #   define NV097_SET_CONTEXT_DMA_VERTEX_A                     0x0097019C
 #   define NV097_SET_CONTEXT_DMA_VERTEX_B                     0x009701A0
 #   define NV097_SET_CONTEXT_DMA_SEMAPHORE                    0x009701A4
+#   define NV097_SET_CONTEXT_DMA_REPORT                       0x009701A8
 #   define NV097_SET_SURFACE_CLIP_HORIZONTAL                  0x00970200
 #       define NV097_SET_SURFACE_CLIP_HORIZONTAL_X                0x0000FFFF
 #       define NV097_SET_SURFACE_CLIP_HORIZONTAL_WIDTH            0xFFFF0000
@@ -429,6 +515,13 @@
 #           define NV097_SET_SURFACE_FORMAT_COLOR_LE_B8                    0x09
 #           define NV097_SET_SURFACE_FORMAT_COLOR_LE_G8B8                  0x0A
 #       define NV097_SET_SURFACE_FORMAT_ZETA                      0x000000F0
+#           define NV097_SET_SURFACE_FORMAT_ZETA_Z16                       0x01
+#           define NV097_SET_SURFACE_FORMAT_ZETA_Z24S8                     0x02
+#       define NV097_SET_SURFACE_FORMAT_TYPE                      0x00000F00
+#           define NV097_SET_SURFACE_FORMAT_TYPE_PITCH                     0x1
+#           define NV097_SET_SURFACE_FORMAT_TYPE_SWIZZLE                   0x2
+#       define NV097_SET_SURFACE_FORMAT_WIDTH                     0x00FF0000
+#       define NV097_SET_SURFACE_FORMAT_HEIGHT                    0xFF000000
 #   define NV097_SET_SURFACE_PITCH                            0x0097020C
 #       define NV097_SET_SURFACE_PITCH_COLOR                      0x0000FFFF
 #       define NV097_SET_SURFACE_PITCH_ZETA                       0xFFFF0000
@@ -437,7 +530,29 @@
 #   define NV097_SET_COMBINER_ALPHA_ICW                       0x00970260
 #   define NV097_SET_COMBINER_SPECULAR_FOG_CW0                0x00970288
 #   define NV097_SET_COMBINER_SPECULAR_FOG_CW1                0x0097028C
+#   define NV097_SET_CONTROL0                                 0x00970290
+#       define NV097_SET_CONTROL0_STENCIL_WRITE_ENABLE            (1 << 0)
+#       define NV097_SET_CONTROL0_Z_FORMAT                        (1 << 12)
+#   define NV097_SET_DEPTH_TEST_ENABLE                        0x0097030C
+#   define NV097_SET_STENCIL_TEST_ENABLE                      0x0097032C
+#   define NV097_SET_DEPTH_FUNC                               0x00970354
 #   define NV097_SET_COLOR_MASK                               0x00970358
+#   define NV097_SET_DEPTH_MASK                               0x0097035C
+#   define NV097_SET_STENCIL_MASK                             0x00970360
+#   define NV097_SET_STENCIL_FUNC                             0x00970364
+#   define NV097_SET_STENCIL_FUNC_REF                         0x00970368
+#   define NV097_SET_STENCIL_FUNC_MASK                        0x0097036C
+#   define NV097_SET_STENCIL_OP_FAIL                          0x00970370
+#   define NV097_SET_STENCIL_OP_ZFAIL                         0x00970374
+#   define NV097_SET_STENCIL_OP_ZPASS                         0x00970378
+#       define NV097_SET_STENCIL_OP_V_KEEP                        0x1E00
+#       define NV097_SET_STENCIL_OP_V_ZERO                        0x0000
+#       define NV097_SET_STENCIL_OP_V_REPLACE                     0x1E01
+#       define NV097_SET_STENCIL_OP_V_INCRSAT                     0x1E02
+#       define NV097_SET_STENCIL_OP_V_DECRSAT                     0x1E03
+#       define NV097_SET_STENCIL_OP_V_INVERT                      0x150A
+#       define NV097_SET_STENCIL_OP_V_INCR                        0x8507
+#       define NV097_SET_STENCIL_OP_V_DECR                        0x8508
 #   define NV097_SET_CLIP_MIN                                 0x00970394
 #   define NV097_SET_CLIP_MAX                                 0x00970398
 #   define NV097_SET_COMPOSITE_MATRIX                         0x00970680
@@ -461,6 +576,8 @@
 #           define NV097_SET_VERTEX_DATA_ARRAY_FORMAT_TYPE_CMP        6
 #       define NV097_SET_VERTEX_DATA_ARRAY_FORMAT_SIZE            0x000000F0
 #       define NV097_SET_VERTEX_DATA_ARRAY_FORMAT_STRIDE          0xFFFFFF00
+#   define NV097_CLEAR_REPORT_VALUE                           0x009717C8
+#       define NV097_CLEAR_REPORT_VALUE_TYPE_ZPASS_PIXEL_CNT      1
 #   define NV097_SET_BEGIN_END                                0x009717fC
 #       define NV097_SET_BEGIN_END_OP_END                         0x00
 #       define NV097_SET_BEGIN_END_OP_POINTS                      0x01
@@ -483,29 +600,51 @@
 #   define NV097_SET_TEXTURE_OFFSET                           0x00971B00
 #   define NV097_SET_TEXTURE_FORMAT                           0x00971B04
 #       define NV097_SET_TEXTURE_FORMAT_CONTEXT_DMA               0x00000003
+#       define NV097_SET_TEXTURE_FORMAT_CUBEMAP_ENABLE           (1 << 2)
 #       define NV097_SET_TEXTURE_FORMAT_DIMENSIONALITY            0x000000F0
 #       define NV097_SET_TEXTURE_FORMAT_COLOR                     0x0000FF00
+#           define NV097_SET_TEXTURE_FORMAT_COLOR_SZ_Y8             0x00
+#           define NV097_SET_TEXTURE_FORMAT_COLOR_SZ_AY8            0x01
 #           define NV097_SET_TEXTURE_FORMAT_COLOR_SZ_A1R5G5B5       0x02
 #           define NV097_SET_TEXTURE_FORMAT_COLOR_SZ_X1R5G5B5       0x03
 #           define NV097_SET_TEXTURE_FORMAT_COLOR_SZ_A4R4G4B4       0x04
 #           define NV097_SET_TEXTURE_FORMAT_COLOR_SZ_R5G6B5         0x05
 #           define NV097_SET_TEXTURE_FORMAT_COLOR_SZ_A8R8G8B8       0x06
 #           define NV097_SET_TEXTURE_FORMAT_COLOR_SZ_X8R8G8B8       0x07
+#           define NV097_SET_TEXTURE_FORMAT_COLOR_SZ_I8_A8R8G8B8    0x0B
 #           define NV097_SET_TEXTURE_FORMAT_COLOR_L_DXT1_A1R5G5B5   0x0C
 #           define NV097_SET_TEXTURE_FORMAT_COLOR_L_DXT23_A8R8G8B8  0x0E
+#           define NV097_SET_TEXTURE_FORMAT_COLOR_L_DXT45_A8R8G8B8  0x0F
+#           define NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_A1R5G5B5 0x10
+#           define NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_R5G6B5   0x11
 #           define NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_A8R8G8B8 0x12
+#           define NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_Y8       0x13
 #           define NV097_SET_TEXTURE_FORMAT_COLOR_SZ_A8             0x19
+#           define NV097_SET_TEXTURE_FORMAT_COLOR_SZ_A8Y8           0x1A
+#           define NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_X1R5G5B5 0x1C
+#           define NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_A4R4G4B4 0x1D
 #           define NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_X8R8G8B8 0x1E
+#           define NV097_SET_TEXTURE_FORMAT_COLOR_LC_IMAGE_CR8YB8CB8YA8 0x24
+#           define NV097_SET_TEXTURE_FORMAT_COLOR_LC_IMAGE_YB8CR8YA8CB8 0x25
 #           define NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_DEPTH_Y16_FIXED 0x30
 #       define NV097_SET_TEXTURE_FORMAT_MIPMAP_LEVELS             0x000F0000
 #       define NV097_SET_TEXTURE_FORMAT_BASE_SIZE_U               0x00F00000
 #       define NV097_SET_TEXTURE_FORMAT_BASE_SIZE_V               0x0F000000
 #       define NV097_SET_TEXTURE_FORMAT_BASE_SIZE_P               0xF0000000
 #   define NV097_SET_TEXTURE_ADDRESS                          0x00971B08
+#       define NV097_SET_TEXTURE_ADDRESS_U                        0x0000000F
+#       define NV097_SET_TEXTURE_ADDRESS_V                        0x00000F00
+#       define NV097_SET_TEXTURE_ADDRESS_P                        0x000F0000
+#           define NV097_SET_TEXTURE_ADDRESS_WRAP                     1
+#           define NV097_SET_TEXTURE_ADDRESS_MIRROR                   2
+#           define NV097_SET_TEXTURE_ADDRESS_CLAMP_TO_EDGE            3
+#           define NV097_SET_TEXTURE_ADDRESS_BORDER                   4
+#           define NV097_SET_TEXTURE_ADDRESS_CLAMP_OGL                5
 #   define NV097_SET_TEXTURE_CONTROL0                         0x00971B0C
 #       define NV097_SET_TEXTURE_CONTROL0_ENABLE                 (1 << 30)
 #       define NV097_SET_TEXTURE_CONTROL0_MIN_LOD_CLAMP           0x3FFC0000
 #       define NV097_SET_TEXTURE_CONTROL0_MAX_LOD_CLAMP           0x0003FFC0
+#       define NV097_SET_TEXTURE_CONTROL0_LOG_MAX_ANISO           0x00000030
 #   define NV097_SET_TEXTURE_CONTROL1                         0x00971B10
 #       define NV097_SET_TEXTURE_CONTROL1_IMAGE_PITCH             0xFFFF0000
 #   define NV097_SET_TEXTURE_FILTER                           0x00971B14
@@ -515,8 +654,21 @@
 #   define NV097_SET_TEXTURE_IMAGE_RECT                       0x00971B1C
 #       define NV097_SET_TEXTURE_IMAGE_RECT_WIDTH                 0xFFFF0000
 #       define NV097_SET_TEXTURE_IMAGE_RECT_HEIGHT                0x0000FFFF
+#   define NV097_SET_TEXTURE_PALETTE                          0x00971B20
+#       define NV097_SET_TEXTURE_PALETTE_CONTEXT_DMA              0x00000001
+#       define NV097_SET_TEXTURE_PALETTE_LENGTH                   0x0000000C
+#           define NV097_SET_TEXTURE_PALETTE_LENGTH_256               0
+#           define NV097_SET_TEXTURE_PALETTE_LENGTH_128               1
+#           define NV097_SET_TEXTURE_PALETTE_LENGTH_64                2
+#           define NV097_SET_TEXTURE_PALETTE_LENGTH_32                3
+#       define NV097_SET_TEXTURE_PALETTE_OFFSET                   0xFFFFFFC0
 #   define NV097_SET_SEMAPHORE_OFFSET                         0x00971D6C
 #   define NV097_BACK_END_WRITE_SEMAPHORE_RELEASE             0x00971D70
+#   define NV097_GET_REPORT                                   0x00971D80
+#       define NV097_GET_REPORT_OFFSET                            0x00FFFFFF
+#       define NV097_GET_REPORT_TYPE                              0xFF000000
+#           define NV097_GET_REPORT_TYPE_ZPASS_PIXEL_CNT              1
+#   define NV097_SET_ZPASS_PIXEL_COUNT_ENABLE                 0x00971D84
 #   define NV097_SET_ZSTENCIL_CLEAR_VALUE                     0x00971D8C
 #   define NV097_SET_COLOR_CLEAR_VALUE                        0x00971D90
 #   define NV097_CLEAR_SURFACE                                0x00971D94
@@ -557,6 +709,18 @@ static const GLenum kelvin_primitive_map[] = {
     GL_POLYGON,
 };
 
+static const GLenum kelvin_stencil_op_map[] = {
+    0,
+    GL_KEEP,
+    GL_ZERO,
+    GL_REPLACE,
+    GL_INCR,
+    GL_DECR,
+    GL_INVERT,
+    GL_INCR_WRAP,
+    GL_DECR_WRAP,
+};
+
 static const GLenum kelvin_texture_min_filter_map[] = {
     0,
     GL_NEAREST,
@@ -576,15 +740,37 @@ static const GLenum kelvin_texture_mag_filter_map[] = {
     GL_LINEAR /* TODO: Convolution filter... */
 };
 
+static const GLenum kelvin_texture_address_map[] = {
+    0,
+    GL_REPEAT,
+    GL_MIRRORED_REPEAT,
+    GL_CLAMP_TO_EDGE,
+    GL_CLAMP_TO_BORDER,
+    GL_CLAMP,
+};
+
+/* Formats GL can't sample directly get expanded to RGBA8 on upload */
+enum TextureConversion {
+    CONVERT_NONE = 0,
+    CONVERT_PALETTE,
+    CONVERT_YUY2,
+    CONVERT_UYVY,
+};
+
 typedef struct ColorFormatInfo {
     unsigned int bytes_per_pixel;
     bool linear;
     GLint gl_internal_format;
     GLenum gl_format;
     GLenum gl_type;
+    enum TextureConversion conversion;
 } ColorFormatInfo;
 
 static const ColorFormatInfo kelvin_color_format_map[66] = {
+    [NV097_SET_TEXTURE_FORMAT_COLOR_SZ_Y8] =
+        {1, false, GL_LUMINANCE8, GL_LUMINANCE, GL_UNSIGNED_BYTE},
+    [NV097_SET_TEXTURE_FORMAT_COLOR_SZ_AY8] =
+        {1, false, GL_INTENSITY8, GL_LUMINANCE, GL_UNSIGNED_BYTE},
     [NV097_SET_TEXTURE_FORMAT_COLOR_SZ_A1R5G5B5] =
         {2, false, GL_RGBA, GL_RGBA, GL_UNSIGNED_SHORT_1_5_5_5_REV},
     [NV097_SET_TEXTURE_FORMAT_COLOR_SZ_X1R5G5B5] =
@@ -598,18 +784,40 @@ static const ColorFormatInfo kelvin_color_format_map[66] = {
     [NV097_SET_TEXTURE_FORMAT_COLOR_SZ_X8R8G8B8] =
         {4, false, GL_RGB,  GL_RGBA, GL_UNSIGNED_INT_8_8_8_8_REV},
 
+    [NV097_SET_TEXTURE_FORMAT_COLOR_SZ_I8_A8R8G8B8] =
+        {1, false, GL_RGBA, GL_RGBA, GL_UNSIGNED_BYTE, CONVERT_PALETTE},
+
     [NV097_SET_TEXTURE_FORMAT_COLOR_L_DXT1_A1R5G5B5] =
         {4, false, GL_COMPRESSED_RGBA_S3TC_DXT1_EXT, 0, GL_RGBA},
     [NV097_SET_TEXTURE_FORMAT_COLOR_L_DXT23_A8R8G8B8] =
         {4, false, GL_COMPRESSED_RGBA_S3TC_DXT3_EXT, 0, GL_RGBA},
+    [NV097_SET_TEXTURE_FORMAT_COLOR_L_DXT45_A8R8G8B8] =
+        {4, false, GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, 0, GL_RGBA},
 
+    [NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_A1R5G5B5] =
+        {2, true, GL_RGBA, GL_RGBA, GL_UNSIGNED_SHORT_1_5_5_5_REV},
+    [NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_R5G6B5] =
+        {2, true, GL_RGB, GL_RGB, GL_UNSIGNED_SHORT_5_6_5_REV},
     [NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_A8R8G8B8] =
         {4, true, GL_RGBA, GL_RGBA, GL_UNSIGNED_INT_8_8_8_8_REV},
+    [NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_Y8] =
+        {1, true, GL_LUMINANCE8, GL_LUMINANCE, GL_UNSIGNED_BYTE},
     /* TODO: how do opengl alpha textures work? */
     [NV097_SET_TEXTURE_FORMAT_COLOR_SZ_A8] =
         {2, false, GL_RED,  GL_RED,  GL_UNSIGNED_BYTE},
+    [NV097_SET_TEXTURE_FORMAT_COLOR_SZ_A8Y8] =
+        {2, false, GL_LUMINANCE8_ALPHA8, GL_LUMINANCE_ALPHA,
+         GL_UNSIGNED_BYTE},
+    [NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_X1R5G5B5] =
+        {2, true, GL_RGB,  GL_RGBA, GL_UNSIGNED_SHORT_1_5_5_5_REV},
+    [NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_A4R4G4B4] =
+        {2, true, GL_RGBA, GL_RGBA, GL_UNSIGNED_SHORT_4_4_4_4_REV},
     [NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_X8R8G8B8] =
         {4, true, GL_RGB,  GL_RGBA, GL_UNSIGNED_INT_8_8_8_8_REV},
+    [NV097_SET_TEXTURE_FORMAT_COLOR_LC_IMAGE_CR8YB8CB8YA8] =
+        {2, true, GL_RGBA, GL_RGBA, GL_UNSIGNED_BYTE, CONVERT_YUY2},
+    [NV097_SET_TEXTURE_FORMAT_COLOR_LC_IMAGE_YB8CR8YA8CB8] =
+        {2, true, GL_RGBA, GL_RGBA, GL_UNSIGNED_BYTE, CONVERT_UYVY},
     [NV097_SET_TEXTURE_FORMAT_COLOR_LU_IMAGE_DEPTH_Y16_FIXED] =
         {2, true, GL_DEPTH_COMPONENT, GL_DEPTH_COMPONENT, GL_SHORT},
 };
@@ -634,6 +842,15 @@ static const ColorFormatInfo kelvin_color_format_map[66] = {
 
 
 #define NV2A_CRYSTAL_FREQ 13500000
+#define NV2A_DEFAULT_VBLANK_RATE 60
+/* falling further behind than this resyncs rather than bursting vblanks */
+#define NV2A_VBLANK_MAX_CATCHUP 4
+/* Frame pacing: flips the guest hasn't had scanned out yet, and how many
+ * vblanks one is held for at most to even out the frame times */
+#define NV2A_FLIP_QUEUE_LEN 2
+#define NV2A_FLIP_MAX_HOLD 4
+/* the guest's vblanks per flip are averaged in 1/16ths */
+#define NV2A_FLIP_INTERVAL_SHIFT 4
 #define NV2A_NUM_CHANNELS 32
 #define NV2A_NUM_SUBCHANNELS 8
 
@@ -643,6 +860,13 @@ static const ColorFormatInfo kelvin_color_format_map[66] = {
 #define NV2A_VERTEXSHADER_CONSTANTS 192
 #define NV2A_VERTEXSHADER_ATTRIBUTES 16
 #define NV2A_MAX_TEXTURES 4
+#define NV2A_CUBEFACE_ALIGN 128
+
+/* passes of the swizzle program */
+#define NV2A_SWIZZLE_PASS_SWIZZLE   0
+#define NV2A_SWIZZLE_PASS_UNSWIZZLE 1
+#define NV2A_SWIZZLE_PASS_FLIP      2
+#define NV2A_SCANOUT_HISTORY 4
 
 #define GET_MASK(v, mask) (((v) & (mask)) >> (ffs(mask)-1))
 
@@ -687,6 +911,24 @@ typedef struct DMAObject {
     hwaddr limit;
 } DMAObject;
 
+/* Decoded RAMIN objects, invalidated through dirty logging on ramin */
+#define NV2A_RAMHT_CACHE_SIZE 64
+#define NV2A_DMA_CACHE_SIZE 64
+
+typedef struct RAMHTCacheEntry {
+    bool valid;
+    uint32_t handle;
+    unsigned int channel_id;
+    hwaddr entry_address;
+    RAMHTEntry entry;
+} RAMHTCacheEntry;
+
+typedef struct DMACacheEntry {
+    bool valid;
+    hwaddr address;
+    DMAObject object;
+} DMACacheEntry;
+
 typedef struct VertexAttribute {
     bool dma_select;
     hwaddr offset;
@@ -730,9 +972,10 @@ typedef struct Texture {
     bool enabled;
 
     unsigned int dimensionality;
+    bool cubemap;
     unsigned int color_format;
     unsigned int levels;
-    unsigned int log_width, log_height;
+    unsigned int log_width, log_height, log_depth;
 
     unsigned int rect_width, rect_height;
 
@@ -741,16 +984,49 @@ typedef struct Texture {
 
     unsigned int lod_bias;
     unsigned int min_filter, mag_filter;
+    uint32_t address;
+    unsigned int log_max_anisotropy;
 
     bool dma_select;
     hwaddr offset;
 
+    bool palette_dma_select;
+    hwaddr palette_offset;
+    unsigned int palette_length;
+
     GLuint gl_texture;
     /* once bound as GL_TEXTURE_RECTANGLE_ARB, it seems textures
      * can't be rebound as GL_TEXTURE_*D... */
     GLuint gl_texture_rect;
+    /* ...and likewise for the other targets */
+    GLuint gl_texture_cube;
+    GLuint gl_texture_3d;
+
+    /* shape of the storage last allocated for the gl texture, so it
+     * can be updated in place while that doesn't change */
+    bool gl_storage_valid;
+    GLenum gl_storage_target;
+    unsigned int gl_storage_format;
+    unsigned int gl_storage_width, gl_storage_height, gl_storage_depth;
+    unsigned int gl_storage_levels;
+    unsigned int gl_base_level, gl_max_level;
+    /* the vram generation the gl texture is up to date with */
+    uint64_t vram_generation;
+    /* the sampler key last set on the gl texture itself, when there are
+     * no sampler objects. Only good while the storage is */
+    uint32_t gl_sampler_key;
 } Texture;
 
+/* The sampler state of a texture, normalised and packed into a key for
+ * the sampler object cache */
+#define SAMPLER_KEY_MIN_FILTER                  0x00000007
+#define SAMPLER_KEY_MAG_FILTER                  0x00000038
+#define SAMPLER_KEY_ADDRESS_U                   0x000001C0
+#define SAMPLER_KEY_ADDRESS_V                   0x00000E00
+#define SAMPLER_KEY_ADDRESS_P                   0x00007000
+#define SAMPLER_KEY_LOG_MAX_ANISO               0x00018000
+#define SAMPLER_KEY_LOD_BIAS                    0x3FFE0000
+
 typedef struct ShaderState {
     /* fragment shader - register combiner stuff */
     uint32_t combiner_control;
@@ -777,6 +1053,70 @@ typedef struct Surface {
     hwaddr offset;
 } Surface;
 
+/* The samples passed queries of the draws between two GET_REPORTs.
+ * Written back once the last of them has a result. */
+typedef struct PendingReport {
+    QSIMPLEQ_ENTRY(PendingReport) entry;
+
+    hwaddr dma_report;
+    hwaddr offset;
+    uint64_t timestamp;
+    /* counting starts again from zero, not from the last report */
+    bool cleared;
+    /* draws were skipped by frameskip, so the count can't be trusted */
+    bool skipped;
+
+    unsigned int num_queries;
+    GLuint *gl_queries;
+} PendingReport;
+
+/* A frame read back for the frame dump, on its way to the writer */
+typedef struct DumpedFrame {
+    QSIMPLEQ_ENTRY(DumpedFrame) entry;
+
+    uint64_t frame;
+    unsigned int width, height;
+    /* the vblank period it was flipped at, in ns */
+    int64_t vblank_period;
+    /* bgra, bottom row first as it came out of gl */
+    uint8_t *data;
+} DumpedFrame;
+
+/* Frame dump: the colour surface of every Nth frame drawn is written to a
+ * file or pipe, as yuv4mpeg if the name ends in .y4m and as raw bgra
+ * otherwise. The readback goes into a ring of pixel buffers and is only
+ * mapped once the ring comes back round to it, by which time the gpu has
+ * long finished it. Converting and writing is left to a thread of its
+ * own, so neither the copy nor the file io holds up the puller. */
+#define NV2A_FRAME_DUMP_BUFFERS 3
+/* frames waiting on the writer before new ones are dropped */
+#define NV2A_FRAME_DUMP_QUEUE 8
+
+typedef struct FrameDump {
+    char *path;
+    uint32_t interval;
+
+    bool enabled;
+    bool y4m;
+    FILE *file;
+
+    GLuint gl_buffers[NV2A_FRAME_DUMP_BUFFERS];
+    DumpedFrame *readback[NV2A_FRAME_DUMP_BUFFERS];
+    unsigned int readback_index;
+
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    QSIMPLEQ_HEAD(, DumpedFrame) queue;
+    unsigned int queued;
+    bool exit;
+
+    /* writer thread only. y4m streams keep the size of their first
+     * frame */
+    unsigned int stream_width, stream_height;
+    uint8_t *planes;
+} FrameDump;
+
 typedef struct InlineVertexBufferEntry {
     uint32_t position[4];
     uint32_t diffuse;
@@ -805,8 +1145,13 @@ typedef struct KelvinState {
     unsigned int inline_array_length;
     uint32_t inline_array[NV2A_MAX_BATCH_LENGTH];
 
+    /* indices stay 16-bit until a 32-bit one that doesn't fit shows up */
     unsigned int inline_elements_length;
-    uint32_t inline_elements[NV2A_MAX_BATCH_LENGTH];
+    bool inline_elements_32;
+    union {
+        uint16_t u16[NV2A_MAX_BATCH_LENGTH];
+        uint32_t u32[NV2A_MAX_BATCH_LENGTH];
+    } inline_elements;
 
     unsigned int inline_buffer_length;
     InlineVertexBufferEntry inline_buffer[NV2A_MAX_BATCH_LENGTH];
@@ -850,8 +1195,255 @@ typedef struct GraphicsSubchannel {
 typedef struct GraphicsContext {
     bool channel_3d;
     unsigned int subchannel;
+
+    /* The objects bound on the channel, with their vertex programs, kept
+     * while other channels run so coming back to it needn't rebuild them.
+     * Allocated when the channel is first used. Only the current
+     * channel's go in a snapshot. */
+    GraphicsSubchannel *subchannel_data;
 } GraphicsContext;
 
+/* What we last told GL, for the state that's set up on every draw, so
+ * calls that wouldn't change anything can be dropped. Everything below
+ * starts at GL's defaults; state changed behind its back has to go
+ * through it too. */
+typedef struct GLShadowState {
+    uint32_t caps;
+    GLuint program;
+    unsigned int active_texture;
+    GLuint textures[NV2A_MAX_TEXTURES][4];
+    GLuint samplers[NV2A_MAX_TEXTURES];
+
+    uint32_t attrib_arrays;
+    uint32_t attrib_values_valid;
+    uint32_t attrib_values[NV2A_VERTEXSHADER_ATTRIBUTES];
+
+    unsigned int color_mask;
+    GLenum depth_func;
+    GLboolean depth_mask;
+    GLenum stencil_func;
+    GLint stencil_ref;
+    GLuint stencil_func_mask;
+    GLenum stencil_op[3];
+    GLuint stencil_mask;
+
+    /* calls dropped since the last flip */
+    unsigned int suppressed;
+} GLShadowState;
+
+static void gl_shadow_init(GLShadowState *s)
+{
+    memset(s, 0, sizeof(*s));
+    s->color_mask = 0xF;
+    s->depth_func = GL_LESS;
+    s->depth_mask = GL_TRUE;
+    s->stencil_func = GL_ALWAYS;
+    s->stencil_func_mask = ~0;
+    s->stencil_op[0] = s->stencil_op[1] = s->stencil_op[2] = GL_KEEP;
+    s->stencil_mask = ~0;
+}
+
+static uint32_t gl_shadow_cap_bit(GLenum cap)
+{
+    switch (cap) {
+    case GL_DEPTH_TEST:
+        return 1 << 0;
+    case GL_STENCIL_TEST:
+        return 1 << 1;
+    case GL_SCISSOR_TEST:
+        return 1 << 2;
+    case GL_VERTEX_PROGRAM_ARB:
+        return 1 << 3;
+    default:
+        assert(false);
+        return 0;
+    }
+}
+
+static void gl_shadow_enable(GLShadowState *s, GLenum cap, bool enable)
+{
+    uint32_t bit = gl_shadow_cap_bit(cap);
+    if (!!(s->caps & bit) == enable) {
+        s->suppressed++;
+        return;
+    }
+    if (enable) {
+        glEnable(cap);
+        s->caps |= bit;
+    } else {
+        glDisable(cap);
+        s->caps &= ~bit;
+    }
+}
+
+static void gl_shadow_use_program(GLShadowState *s, GLuint program)
+{
+    if (s->program == program) {
+        s->suppressed++;
+        return;
+    }
+    glUseProgram(program);
+    s->program = program;
+}
+
+static void gl_shadow_active_texture(GLShadowState *s, unsigned int unit)
+{
+    assert(unit < NV2A_MAX_TEXTURES);
+    if (s->active_texture == unit) {
+        s->suppressed++;
+        return;
+    }
+    glActiveTexture(GL_TEXTURE0 + unit);
+    s->active_texture = unit;
+}
+
+/* Bind to the active unit */
+static void gl_shadow_bind_texture(GLShadowState *s, GLenum target,
+                                   GLuint texture)
+{
+    unsigned int index;
+    switch (target) {
+    case GL_TEXTURE_2D:
+        index = 0;
+        break;
+    case GL_TEXTURE_RECTANGLE_ARB:
+        index = 1;
+        break;
+    case GL_TEXTURE_CUBE_MAP:
+        index = 2;
+        break;
+    case GL_TEXTURE_3D:
+        index = 3;
+        break;
+    default:
+        assert(false);
+        return;
+    }
+
+    GLuint *bound = &s->textures[s->active_texture][index];
+    if (*bound == texture) {
+        s->suppressed++;
+        return;
+    }
+    glBindTexture(target, texture);
+    *bound = texture;
+}
+
+static void gl_shadow_bind_sampler(GLShadowState *s, unsigned int unit,
+                                   GLuint sampler)
+{
+    assert(unit < NV2A_MAX_TEXTURES);
+    if (s->samplers[unit] == sampler) {
+        s->suppressed++;
+        return;
+    }
+    glBindSampler(unit, sampler);
+    s->samplers[unit] = sampler;
+}
+
+static void gl_shadow_vertex_attrib_array(GLShadowState *s,
+                                          unsigned int index, bool enable)
+{
+    uint32_t bit = 1 << index;
+    if (!!(s->attrib_arrays & bit) == enable) {
+        s->suppressed++;
+        return;
+    }
+    if (enable) {
+        glEnableVertexAttribArray(index);
+        s->attrib_arrays |= bit;
+        /* drawing from an array leaves the current value undefined */
+        s->attrib_values_valid &= ~bit;
+    } else {
+        glDisableVertexAttribArray(index);
+        s->attrib_arrays &= ~bit;
+    }
+}
+
+/* Set the current value of an attribute from four packed bytes */
+static void gl_shadow_vertex_attrib_4ub(GLShadowState *s,
+                                        unsigned int index, uint32_t value)
+{
+    uint32_t bit = 1 << index;
+    if ((s->attrib_values_valid & bit) && s->attrib_values[index] == value) {
+        s->suppressed++;
+        return;
+    }
+    glVertexAttrib4ubv(index, (const GLubyte *)&value);
+    s->attrib_values[index] = value;
+    s->attrib_values_valid |= bit;
+}
+
+static void gl_shadow_color_mask(GLShadowState *s, bool r, bool g,
+                                 bool b, bool a)
+{
+    unsigned int mask = r | (g << 1) | (b << 2) | (a << 3);
+    if (s->color_mask == mask) {
+        s->suppressed++;
+        return;
+    }
+    glColorMask(r, g, b, a);
+    s->color_mask = mask;
+}
+
+static void gl_shadow_depth_func(GLShadowState *s, GLenum func)
+{
+    if (s->depth_func == func) {
+        s->suppressed++;
+        return;
+    }
+    glDepthFunc(func);
+    s->depth_func = func;
+}
+
+static void gl_shadow_depth_mask(GLShadowState *s, GLboolean mask)
+{
+    if (s->depth_mask == mask) {
+        s->suppressed++;
+        return;
+    }
+    glDepthMask(mask);
+    s->depth_mask = mask;
+}
+
+static void gl_shadow_stencil_func(GLShadowState *s, GLenum func,
+                                   GLint ref, GLuint mask)
+{
+    if (s->stencil_func == func && s->stencil_ref == ref
+        && s->stencil_func_mask == mask) {
+        s->suppressed++;
+        return;
+    }
+    glStencilFunc(func, ref, mask);
+    s->stencil_func = func;
+    s->stencil_ref = ref;
+    s->stencil_func_mask = mask;
+}
+
+static void gl_shadow_stencil_op(GLShadowState *s, GLenum fail,
+                                 GLenum zfail, GLenum zpass)
+{
+    if (s->stencil_op[0] == fail && s->stencil_op[1] == zfail
+        && s->stencil_op[2] == zpass) {
+        s->suppressed++;
+        return;
+    }
+    glStencilOp(fail, zfail, zpass);
+    s->stencil_op[0] = fail;
+    s->stencil_op[1] = zfail;
+    s->stencil_op[2] = zpass;
+}
+
+static void gl_shadow_stencil_mask(GLShadowState *s, GLuint mask)
+{
+    if (s->stencil_mask == mask) {
+        s->suppressed++;
+        return;
+    }
+    glStencilMask(mask);
+    s->stencil_mask = mask;
+}
+
 
 typedef struct PGRAPHState {
     QemuMutex lock;
@@ -860,6 +1452,12 @@ typedef struct PGRAPHState {
     uint32_t enabled_interrupts;
     QemuCond interrupt_cond;
 
+    /* notify/context switch interrupt latency, raise to guest ack */
+    int64_t interrupt_raise_time;
+    int64_t interrupt_latency_total;
+    int64_t interrupt_latency_max;
+    unsigned int interrupt_latency_count;
+
     hwaddr context_table;
     hwaddr context_address;
 
@@ -874,6 +1472,21 @@ typedef struct PGRAPHState {
     QemuCond fifo_access_cond;
 
     QemuSemaphore read_3d;
+    /* read_3d's count, which a semaphore won't tell us, for savevm */
+    int32_t read_3d_count;
+    /* the puller is waiting on read_3d */
+    bool flip_stalled;
+
+    /* Frameskip: draw only every Nth frame (0 or 1 draws them all).
+     * Only surfaces that have been scanned out are ever skipped, since
+     * anything else may be read back as a texture or by the cpu. */
+    uint32_t frameskip;
+    uint64_t frame_count;
+    bool skip_frame;
+    hwaddr scanout_surfaces[NV2A_SCANOUT_HISTORY];
+    unsigned int scanout_surface_index;
+
+    FrameDump frame_dump;
 
     unsigned int channel_id;
     bool channel_valid;
@@ -884,11 +1497,28 @@ typedef struct PGRAPHState {
     Surface surface_color, surface_zeta;
     unsigned int surface_x, surface_y;
     unsigned int surface_width, surface_height;
+    unsigned int surface_type;
+    unsigned int surface_log_width, surface_log_height;
     uint32_t color_mask;
 
     hwaddr dma_a, dma_b;
     Texture textures[NV2A_MAX_TEXTURES];
 
+    /* Zpass pixel counting. Each draw while it's on gets a samples passed
+     * query. GET_REPORT hands the queries since the last one over to a
+     * pending report, which is written once their results are in. */
+    hwaddr dma_report;
+    bool zpass_pixel_count_enable;
+    GLuint gl_zpass_query;
+    GLuint *gl_zpass_queries;
+    unsigned int zpass_query_count, zpass_query_capacity;
+    bool zpass_cleared;
+    bool zpass_skipped;
+    uint32_t zpass_count;
+    QSIMPLEQ_HEAD(, PendingReport) pending_reports;
+    /* the pending reports were made before a snapshot load */
+    bool reports_stale;
+
     bool shaders_dirty;
     GHashTable *shader_cache;
     GLuint gl_program;
@@ -897,9 +1527,70 @@ typedef struct PGRAPHState {
     GLint composite_matrix_location;
 
     GloContext *gl_context;
+    GLShadowState gl_shadow;
+    bool gl_texture_compression_s3tc;
+    bool gl_sampler_objects;
+    bool gl_texture_filter_anisotropic;
+    GLfloat gl_max_anisotropy;
+    /* sampler objects by sampler key */
+    GHashTable *sampler_cache;
+    bool gl_framebuffer_blit;
+    bool gl_pixel_buffer_object;
     GLuint gl_framebuffer;
     GLuint gl_renderbuffer;
-    GraphicsSubchannel subchannel_data[NV2A_NUM_SUBCHANNELS];
+    GLuint gl_zeta_renderbuffer;
+    GLuint gl_element_buffer;
+
+    /* The buffered path: vertex data is streamed through buffer objects
+     * rather than read from guest memory as client side arrays, and
+     * surfaces are uploaded by blitting from a texture rather than with
+     * glDrawPixels. Picked with the gl-buffered property or from the monitor,
+     * the request is applied at the next flip. */
+    bool gl_buffered_supported;
+    bool gl_buffered;
+    bool gl_buffered_request;
+    GLuint gl_vertex_array;
+    GLuint gl_vertex_buffer;
+    GLuint gl_upload_framebuffer;
+    GLuint gl_upload_texture;
+    GLuint gl_upload_zeta_texture;
+    /* when the puller came back from the last flip, for frame times */
+    int64_t flip_time;
+
+    /* the zeta surface the depth/stencil renderbuffer was loaded from,
+     * so switching surfaces reloads it even if the cpu hasn't touched
+     * the new one */
+    bool gl_zeta_valid;
+    hwaddr gl_zeta_addr;
+    unsigned int gl_zeta_format;
+
+    /* the vram generations the renderbuffers are up to date with */
+    uint64_t gl_color_generation, gl_zeta_generation;
+
+    /* swizzled colour surfaces are converted on the gpu */
+    GLuint gl_swizzle_program;
+    GLint gl_swizzle_mode_location;
+    GLint gl_swizzle_size_location;
+    GLint gl_swizzle_surface_height_location;
+    GLuint gl_swizzle_framebuffer;
+    GLuint gl_swizzle_quad;
+    GLuint gl_swizzle_source;
+    GLuint gl_swizzle_target;
+
+    /* the last swizzled colour surface read back, kept the right way up
+     * so a texture sampling it can be copied from it directly */
+    GLuint gl_alias_texture;
+    bool gl_alias_valid;
+    uint64_t gl_alias_generation;
+    hwaddr gl_alias_addr;
+    unsigned int gl_alias_color_format;
+    unsigned int gl_alias_log_width, gl_alias_log_height;
+
+    /* the current channel's, see GraphicsContext */
+    GraphicsSubchannel *subchannel_data;
+    /* sets of objects from before a snapshot load, which still own gl
+     * programs. Dropped on the puller thread, which has the context. */
+    GSList *stale_subchannel_data;
 
 
     uint32_t regs[0x2000];
@@ -915,6 +1606,16 @@ typedef struct CacheEntry {
     uint32_t parameter;
 } CacheEntry;
 
+enum PullerState {
+    PULLER_IDLE,
+    /* running a method */
+    PULLER_BUSY,
+    /* in a method, waiting on the guest */
+    PULLER_BLOCKED,
+    /* stopped along with the vm, rendering written back */
+    PULLER_PARKED,
+};
+
 typedef struct Cache1State {
     unsigned int channel_id;
     enum FifoMode mode;
@@ -950,6 +1651,16 @@ typedef struct Cache1State {
     QemuCond cache_cond;
     int cache_size;
     QSIMPLEQ_HEAD(, CacheEntry) cache;
+
+    /* Stopping the puller with the vm, protected by cache_lock. A
+     * puller blocked on the guest counts as stopped; the command it's
+     * in is saved at the head of the queue and replayed on restore. */
+    bool puller_alive;
+    bool paused;
+    bool puller_abort;
+    enum PullerState puller_state;
+    CacheEntry *current;
+    QemuCond pause_cond;
 } Cache1State;
 
 typedef struct ChannelControl {
@@ -964,15 +1675,34 @@ typedef struct NV2AState {
     PCIDevice dev;
     qemu_irq irq;
 
+    /* Lets the puller raise interrupts without taking the iothread lock */
+    QEMUBH *irq_bh;
+
     VGACommonState vga;
     GraphicHwOps hw_ops;
 
+    VMChangeStateEntry *vmstate_change;
+
     MemoryRegion *vram;
     MemoryRegion vram_pci;
     uint8_t *vram_ptr;
     MemoryRegion ramin;
     uint8_t *ramin_ptr;
 
+    /* The DIRTY_MEMORY_NV2A log of vram is shared by every texture and
+     * surface and works in whole pages, so none of them may clear it
+     * for itself. vram_sync_dirty() moves dirty pages out of the log
+     * into a generation per page instead, and each reader keeps the
+     * generation it last looked at. */
+    uint64_t *vram_page_generation;
+    uint64_t vram_generation;
+
+    struct {
+        QemuMutex lock;
+        RAMHTCacheEntry ramht[NV2A_RAMHT_CACHE_SIZE];
+        DMACacheEntry dma[NV2A_DMA_CACHE_SIZE];
+    } ramin_cache;
+
     MemoryRegion mmio;
 
     MemoryRegion block_mmio[NV_NUM_BLOCKS];
@@ -996,6 +1726,20 @@ typedef struct NV2AState {
 
         QemuThread puller_thread;
 
+        /* The pusher runs on its own thread, kicked by DMA_PUT writes.
+         * It parses without the lock. Anything that changes its state
+         * first asks it to stop with pusher_holds and waits on
+         * pusher_idle_cond until it's no longer running. */
+        QemuThread pusher_thread;
+        QemuMutex pusher_lock;
+        QemuCond pusher_cond;
+        QemuCond pusher_idle_cond;
+        bool pusher_kick;
+        bool pusher_exit;
+        bool pusher_paused;
+        bool pusher_running;
+        int pusher_holds;
+
         /* Weather the fifo chanels are PIO or DMA */
         uint32_t channel_modes;
 
@@ -1004,6 +1748,22 @@ typedef struct NV2AState {
         Cache1State cache1;
     } pfifo;
 
+    struct {
+        uint32_t pending_interrupts;
+        uint32_t enabled_interrupts;
+
+        uint32_t regs[0x1000];
+
+        /* buffer the overlay is scanning out, latched at vblank, or -1
+         * while it's stopped */
+        int32_t current_buffer;
+        bool stop_pending;
+
+        /* the console is showing our composited copy of the scanout
+         * rather than vga's view of vram */
+        bool composited;
+    } pvideo;
+
     struct {
         uint32_t pending_interrupts;
         uint32_t enabled_interrupts;
@@ -1012,6 +1772,13 @@ typedef struct NV2AState {
         uint32_t denominator;
 
         uint32_t alarm_time;
+
+        /* the clock is ticks_base + ((now - ns_base) * mult >> 32),
+         * rebased whenever the rate changes so reads don't divide */
+        int64_t ns_base;
+        uint64_t ticks_base;
+        uint64_t mult;
+        QEMUTimer *alarm_timer;
     } ptimer;
 
     struct {
@@ -1025,8 +1792,35 @@ typedef struct NV2AState {
         uint32_t enabled_interrupts;
 
         hwaddr start;
+        /* start as latched at the last vblank - what's actually scanned out */
+        hwaddr scanout_start;
+
+        QEMUTimer *vblank_timer;
+        int64_t vblank_next;
+        /* the period vblank_next was last advanced by, for the puller */
+        int64_t vblank_period;
+        uint64_t vblank_count;
+        uint64_t vblanks_dropped;
+
+        /* guest flips, counted by the vblank that latched them */
+        uint64_t flip_count;
+        uint64_t last_flip_vblank;
+
+        /* Starts written but not yet latched, oldest first. With frame
+         * pacing on, each is held until it's been flip_interval vblanks
+         * since the last one was latched, so a guest flipping unevenly
+         * is shown at a steady rate. */
+        hwaddr flip_queue[NV2A_FLIP_QUEUE_LEN];
+        uint32_t flip_queue_len;
+        /* moving average of vblanks between the guest's start writes */
+        uint32_t flip_interval;
+        uint64_t last_start_vblank;
     } pcrtc;
 
+    /* 0 derives the rate from the VPLL and CRTC timings */
+    uint32_t vblank_rate;
+    bool frame_pacing;
+
     struct {
         uint32_t core_clock_coeff;
         uint64_t core_clock_freq;
@@ -1044,11 +1838,14 @@ typedef struct NV2AState {
 #define NV2A_DEVICE(obj) \
     OBJECT_CHECK(NV2AState, (obj), "nv2a")
 
-static void reg_log_read(int block, hwaddr addr, uint64_t val);
-static void reg_log_write(int block, hwaddr addr, uint64_t val);
-static void pgraph_method_log(unsigned int subchannel,
-                              unsigned int graphics_class,
-                              unsigned int method, uint32_t parameter);
+static inline void reg_log_read(int block, hwaddr addr, unsigned int size,
+                                uint64_t val);
+static inline void reg_log_write(int block, hwaddr addr, unsigned int size,
+                                 uint64_t val);
+static void pfifo_puller_block(NV2AState *d, const char *reason);
+static bool pfifo_puller_unblock(NV2AState *d);
+static bool pfifo_puller_aborted(NV2AState *d);
+static uint64_t ptimer_get_clock(NV2AState *d);
 
 static void update_irq(NV2AState *d)
 {
@@ -1066,6 +1863,20 @@ static void update_irq(NV2AState *d)
         d->pmc.pending_interrupts &= ~NV_PMC_INTR_0_PCRTC;
     }
 
+    /* PVIDEO */
+    if (d->pvideo.pending_interrupts & d->pvideo.enabled_interrupts) {
+        d->pmc.pending_interrupts |= NV_PMC_INTR_0_PVIDEO;
+    } else {
+        d->pmc.pending_interrupts &= ~NV_PMC_INTR_0_PVIDEO;
+    }
+
+    /* PTIMER */
+    if (d->ptimer.pending_interrupts & d->ptimer.enabled_interrupts) {
+        d->pmc.pending_interrupts |= NV_PMC_INTR_0_PTIMER;
+    } else {
+        d->pmc.pending_interrupts &= ~NV_PMC_INTR_0_PTIMER;
+    }
+
     /* PGRAPH */
     if (d->pgraph.pending_interrupts & d->pgraph.enabled_interrupts) {
         d->pmc.pending_interrupts |= NV_PMC_INTR_0_PGRAPH;
@@ -1080,6 +1891,53 @@ static void update_irq(NV2AState *d)
     }
 }
 
+static void nv2a_irq_bh(void *opaque)
+{
+    NV2AState *d = opaque;
+
+    /* Don't take the pgraph lock here, the puller may hold it for a
+     * whole draw. qemu_bh_schedule orders the pending bits before us. */
+    smp_rmb();
+    update_irq(d);
+}
+
+/* Called from the puller thread with the pgraph lock held. The irq line
+ * is raised by nv2a_irq_bh in the main loop. */
+static void pgraph_raise_interrupt(NV2AState *d, uint32_t interrupts)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    pg->pending_interrupts |= interrupts;
+    pg->interrupt_raise_time = qemu_get_clock_ns(rt_clock);
+    qemu_bh_schedule(d->irq_bh);
+}
+
+static void pgraph_ack_interrupt_latency(PGRAPHState *pg)
+{
+    int64_t latency;
+
+    if (!pg->interrupt_raise_time) {
+        return;
+    }
+
+    latency = qemu_get_clock_ns(rt_clock) - pg->interrupt_raise_time;
+    pg->interrupt_raise_time = 0;
+
+    pg->interrupt_latency_total += latency;
+    pg->interrupt_latency_max = MAX(pg->interrupt_latency_max, latency);
+    pg->interrupt_latency_count++;
+
+    if (pg->interrupt_latency_count == 1024) {
+        trace_nv2a_pgraph_interrupt_latency(
+            pg->interrupt_latency_total / pg->interrupt_latency_count,
+            pg->interrupt_latency_max,
+            pg->interrupt_latency_count);
+        pg->interrupt_latency_total = 0;
+        pg->interrupt_latency_max = 0;
+        pg->interrupt_latency_count = 0;
+    }
+}
+
 static uint32_t ramht_hash(NV2AState *d, uint32_t handle)
 {
     uint32_t hash = 0;
@@ -1096,46 +1954,128 @@ static uint32_t ramht_hash(NV2AState *d, uint32_t handle)
 }
 
 
+/* Drop any cached objects decoded from a ramin page the guest has written
+ * since. Called with the ramin cache lock held. */
+static void ramin_cache_check_page(NV2AState *d, hwaddr address)
+{
+    int i;
+    hwaddr page = address & TARGET_PAGE_MASK;
+
+    if (!memory_region_get_dirty(&d->ramin, page, TARGET_PAGE_SIZE,
+                                 DIRTY_MEMORY_NV2A)) {
+        return;
+    }
+    memory_region_reset_dirty(&d->ramin, page, TARGET_PAGE_SIZE,
+                              DIRTY_MEMORY_NV2A);
+
+    for (i = 0; i < NV2A_RAMHT_CACHE_SIZE; i++) {
+        RAMHTCacheEntry *c = &d->ramin_cache.ramht[i];
+        if ((c->entry_address & TARGET_PAGE_MASK) == page) {
+            c->valid = false;
+        }
+    }
+    for (i = 0; i < NV2A_DMA_CACHE_SIZE; i++) {
+        DMACacheEntry *c = &d->ramin_cache.dma[i];
+        if ((c->address & TARGET_PAGE_MASK) == page) {
+            c->valid = false;
+        }
+    }
+}
+
 static RAMHTEntry ramht_lookup(NV2AState *d, uint32_t handle)
 {
     uint32_t hash;
+    hwaddr entry_address;
     uint8_t *entry_ptr;
     uint32_t entry_handle;
     uint32_t entry_context;
+    RAMHTCacheEntry *cached;
+    RAMHTEntry entry;
 
+    unsigned int channel_id = d->pfifo.cache1.channel_id;
 
     hash = ramht_hash(d, handle);
     assert(hash * 8 < d->pfifo.ramht_size);
 
-    entry_ptr = d->ramin_ptr + d->pfifo.ramht_address + hash * 8;
+    entry_address = d->pfifo.ramht_address + hash * 8;
+
+    qemu_mutex_lock(&d->ramin_cache.lock);
+    ramin_cache_check_page(d, entry_address);
+
+    cached = &d->ramin_cache.ramht[
+        (handle ^ (handle >> 6) ^ channel_id) & (NV2A_RAMHT_CACHE_SIZE - 1)];
+    if (cached->valid
+        && cached->handle == handle
+        && cached->channel_id == channel_id
+        && cached->entry_address == entry_address) {
+        entry = cached->entry;
+        qemu_mutex_unlock(&d->ramin_cache.lock);
+        return entry;
+    }
+
+    entry_ptr = d->ramin_ptr + entry_address;
 
     entry_handle = le32_to_cpupu((uint32_t*)entry_ptr);
     entry_context = le32_to_cpupu((uint32_t*)(entry_ptr + 4));
 
-    return (RAMHTEntry){
+    entry = (RAMHTEntry){
         .handle = entry_handle,
         .instance = (entry_context & NV_RAMHT_INSTANCE) << 4,
         .engine = (entry_context & NV_RAMHT_ENGINE) >> 16,
         .channel_id = (entry_context & NV_RAMHT_CHID) >> 24,
         .valid = entry_context & NV_RAMHT_STATUS,
     };
+
+    *cached = (RAMHTCacheEntry){
+        .valid = true,
+        .handle = handle,
+        .channel_id = channel_id,
+        .entry_address = entry_address,
+        .entry = entry,
+    };
+    qemu_mutex_unlock(&d->ramin_cache.lock);
+
+    return entry;
 }
 
 static DMAObject nv_dma_load(NV2AState *d, hwaddr dma_obj_address)
 {
+    DMACacheEntry *cached;
+    DMAObject object;
+
     assert(dma_obj_address < memory_region_size(&d->ramin));
 
+    qemu_mutex_lock(&d->ramin_cache.lock);
+    ramin_cache_check_page(d, dma_obj_address);
+
+    cached = &d->ramin_cache.dma[
+        (dma_obj_address >> 4) & (NV2A_DMA_CACHE_SIZE - 1)];
+    if (cached->valid && cached->address == dma_obj_address) {
+        object = cached->object;
+        qemu_mutex_unlock(&d->ramin_cache.lock);
+        return object;
+    }
+
     uint32_t *dma_obj = (uint32_t*)(d->ramin_ptr + dma_obj_address);
     uint32_t flags = le32_to_cpupu(dma_obj);
     uint32_t limit = le32_to_cpupu(dma_obj + 1);
     uint32_t frame = le32_to_cpupu(dma_obj + 2);
 
-    return (DMAObject){
+    object = (DMAObject){
         .dma_class = GET_MASK(flags, NV_DMA_CLASS),
         .dma_target = GET_MASK(flags, NV_DMA_TARGET),
         .address = (frame & NV_DMA_ADDRESS) | GET_MASK(flags, NV_DMA_ADJUST),
         .limit = limit,
     };
+
+    *cached = (DMACacheEntry){
+        .valid = true,
+        .address = dma_obj_address,
+        .object = object,
+    };
+    qemu_mutex_unlock(&d->ramin_cache.lock);
+
+    return object;
 }
 
 static void *nv_dma_map(NV2AState *d, hwaddr dma_obj_address, hwaddr *len)
@@ -1178,7 +2118,7 @@ static void load_graphics_object(NV2AState *d, hwaddr instance_address,
             VertexShader *shader = &kelvin->vertexshaders[i];
             glGenProgramsARB(1, &shader->gl_program);
         }
-        assert(glGetError() == GL_NO_ERROR);
+        NV2A_GL_CHECK();
 
         /* temp hack? */
         kelvin->vertex_attributes[NV2A_VERTEX_ATTR_DIFFUSE].inline_value = 0xFFFFFFF;
@@ -1189,6 +2129,78 @@ static void load_graphics_object(NV2AState *d, hwaddr instance_address,
     }
 }
 
+/* The class of the object at instance_address in RAMIN */
+static uint8_t graphics_object_class(NV2AState *d, hwaddr instance_address)
+{
+    assert(instance_address < memory_region_size(&d->ramin));
+    return le32_to_cpupu((uint32_t*)(d->ramin_ptr + instance_address))
+            & NV_PGRAPH_CTX_SWITCH1_GRCLASS;
+}
+
+/* Free the gl programs and conversion buffers a kelvin object owns */
+static void release_graphics_object(GraphicsObject *obj)
+{
+    int i;
+    KelvinState *kelvin = &obj->data.kelvin;
+
+    if (obj->graphics_class != NV_KELVIN_PRIMITIVE) {
+        return;
+    }
+    for (i = 0; i < NV2A_VERTEXSHADER_SLOTS; i++) {
+        VertexShader *shader = &kelvin->vertexshaders[i];
+        if (shader->gl_program) {
+            glDeleteProgramsARB(1, &shader->gl_program);
+            shader->gl_program = 0;
+        }
+    }
+    for (i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
+        free(kelvin->vertex_attributes[i].converted_buffer);
+        kelvin->vertex_attributes[i].converted_buffer = NULL;
+        kelvin->vertex_attributes[i].converted_elements = 0;
+    }
+}
+
+/* Release and free a channel's set of objects */
+static void free_subchannel_data(GraphicsSubchannel *subchannel_data)
+{
+    int i;
+
+    for (i = 0; i < NV2A_NUM_SUBCHANNELS; i++) {
+        release_graphics_object(&subchannel_data[i].object);
+    }
+    g_free(subchannel_data);
+}
+
+static void pgraph_drop_stale_objects(PGRAPHState *pg)
+{
+    GSList *l;
+
+    for (l = pg->stale_subchannel_data; l; l = l->next) {
+        free_subchannel_data(l->data);
+    }
+    g_slist_free(pg->stale_subchannel_data);
+    pg->stale_subchannel_data = NULL;
+}
+
+/* Make the objects of the channel the guest switched to current. The
+ * last channel's stay where they are for when it comes back. */
+static void pgraph_bind_channel(PGRAPHState *pg, unsigned int channel_id)
+{
+    GraphicsContext *context = &pg->context[channel_id];
+
+    if (pg->subchannel_data == context->subchannel_data) {
+        return;
+    }
+
+    trace_nv2a_pgraph_bind_channel(channel_id,
+                                   context->subchannel_data != NULL);
+    if (!context->subchannel_data) {
+        context->subchannel_data = g_new0(GraphicsSubchannel,
+                                          NV2A_NUM_SUBCHANNELS);
+    }
+    pg->subchannel_data = context->subchannel_data;
+}
+
 static GraphicsObject* lookup_graphics_object(PGRAPHState *s,
                                               hwaddr instance_address)
 {
@@ -1202,69 +2214,319 @@ static GraphicsObject* lookup_graphics_object(PGRAPHState *s,
 }
 
 
-static void kelvin_bind_converted_vertex_attributes(NV2AState *d,
-                                                    KelvinState *kelvin,
-                                                    bool inline_data,
-                                                    unsigned int num_elements)
+/* Where an attribute's vertices are, in guest memory or the inline array */
+static uint8_t *kelvin_vertex_attribute_data(NV2AState *d,
+                                             KelvinState *kelvin,
+                                             VertexAttribute *attribute,
+                                             bool inline_data)
 {
-    int i, j;
-    for (i=0; i<NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
-        VertexAttribute *attribute = &kelvin->vertex_attributes[i];
-        if (attribute->count && attribute->needs_conversion) {
+    uint8_t *data;
+    hwaddr dma_len;
 
-            uint8_t *data;
-            if (inline_data) {
-                data = (uint8_t*)kelvin->inline_array
-                        + attribute->inline_array_offset;
-            } else {
-                hwaddr dma_len;
-                if (attribute->dma_select) {
-                    data = nv_dma_map(d, kelvin->dma_vertex_b, &dma_len);
-                } else {
-                    data = nv_dma_map(d, kelvin->dma_vertex_a, &dma_len);
-                }
+    if (inline_data) {
+        return (uint8_t*)kelvin->inline_array
+                + attribute->inline_array_offset;
+    }
 
-                assert(attribute->offset < dma_len);
-                data += attribute->offset;
-            }
+    /* TODO: cache coherence */
+    if (attribute->dma_select) {
+        data = nv_dma_map(d, kelvin->dma_vertex_b, &dma_len);
+    } else {
+        data = nv_dma_map(d, kelvin->dma_vertex_a, &dma_len);
+    }
+    assert(attribute->offset < dma_len);
+    return data + attribute->offset;
+}
 
-            unsigned int stride = attribute->converted_size
-                                    * attribute->converted_count;
-            
-            if (num_elements > attribute->converted_elements) {
-                attribute->converted_buffer = realloc(
-                    attribute->converted_buffer,
-                    num_elements * stride);
-            }
+/* Convert the first num_elements vertices of an attribute GL can't read
+ * as it is into its converted_buffer */
+static void kelvin_convert_vertex_attribute(NV2AState *d,
+                                            KelvinState *kelvin,
+                                            VertexAttribute *attribute,
+                                            bool inline_data,
+                                            unsigned int num_elements)
+{
+    int j;
+    uint8_t *data = kelvin_vertex_attribute_data(d, kelvin, attribute,
+                                                 inline_data);
 
-            for (j=attribute->converted_elements; j<num_elements; j++) {
-                uint8_t *in = data + j * attribute->stride;
-                uint8_t *out = attribute->converted_buffer + j * stride;
+    unsigned int stride = attribute->converted_size
+                            * attribute->converted_count;
 
-                switch (attribute->format) {
-                case NV097_SET_VERTEX_DATA_ARRAY_FORMAT_TYPE_CMP:
-                    r11g11b10f_to_float3(le32_to_cpupu((uint32_t*)in),
-                                         (float*)out);
-                    break;
-                default:
-                    assert(false);
-                }
-            }
+    if (num_elements > attribute->converted_elements) {
+        attribute->converted_buffer = realloc(
+            attribute->converted_buffer,
+            num_elements * stride);
+    }
+
+    for (j=attribute->converted_elements; j<num_elements; j++) {
+        uint8_t *in = data + j * attribute->stride;
+        uint8_t *out = attribute->converted_buffer + j * stride;
+
+        switch (attribute->format) {
+        case NV097_SET_VERTEX_DATA_ARRAY_FORMAT_TYPE_CMP:
+            r11g11b10f_to_float3(le32_to_cpupu((uint32_t*)in),
+                                 (float*)out);
+            break;
+        default:
+            assert(false);
+        }
+    }
+
+    attribute->converted_elements = num_elements;
+}
 
-            attribute->converted_elements = num_elements;
+static void kelvin_bind_converted_vertex_attributes(NV2AState *d,
+                                                    KelvinState *kelvin,
+                                                    bool inline_data,
+                                                    unsigned int num_elements)
+{
+    int i;
+    for (i=0; i<NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
+        VertexAttribute *attribute = &kelvin->vertex_attributes[i];
+        if (attribute->count && attribute->needs_conversion) {
+            kelvin_convert_vertex_attribute(d, kelvin, attribute,
+                                            inline_data, num_elements);
 
             glVertexAttribPointer(i,
                 attribute->converted_count,
                 attribute->gl_type,
                 attribute->gl_normalize,
-                stride,
-                data);
+                attribute->converted_size * attribute->converted_count,
+                attribute->converted_buffer);
+        }
+    }
+}
+
+/* The buffered path's client side arrays: copy vertices [first, first+count)
+ * of every enabled attribute into the streaming vertex buffer and point
+ * the attributes there, so vertex first is drawn as vertex 0 */
+static void kelvin_bind_vertex_buffer(NV2AState *d, KelvinState *kelvin,
+                                      bool inline_data, unsigned int first,
+                                      unsigned int count)
+{
+    PGRAPHState *pg = &d->pgraph;
+    const uint8_t *sources[NV2A_VERTEXSHADER_ATTRIBUTES];
+    GLsizeiptr offsets[NV2A_VERTEXSHADER_ATTRIBUTES];
+    GLsizeiptr lengths[NV2A_VERTEXSHADER_ATTRIBUTES];
+    GLsizei strides[NV2A_VERTEXSHADER_ATTRIBUTES];
+    GLsizeiptr total = 0;
+    int i;
+
+    assert(count > 0);
+
+    for (i=0; i<NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
+        VertexAttribute *attribute = &kelvin->vertex_attributes[i];
+        const uint8_t *data;
+        unsigned int element_size;
+
+        lengths[i] = 0;
+        if (!attribute->count) {
+            continue;
+        }
+
+        if (attribute->needs_conversion) {
+            kelvin_convert_vertex_attribute(d, kelvin, attribute,
+                                            inline_data, first + count);
+            data = attribute->converted_buffer;
+            element_size = attribute->converted_size
+                            * attribute->converted_count;
+            strides[i] = element_size;
+        } else {
+            data = kelvin_vertex_attribute_data(d, kelvin, attribute,
+                                                inline_data);
+            element_size = attribute->size * attribute->count;
+            /* as in GL, no stride means tightly packed */
+            strides[i] = attribute->stride ? attribute->stride
+                                           : element_size;
+        }
+
+        sources[i] = data + first * strides[i];
+        lengths[i] = (count - 1) * strides[i] + element_size;
+        offsets[i] = total;
+        total += ROUND_UP(lengths[i], 4);
+    }
+
+    if (total == 0) {
+        return;
+    }
+
+    /* orphaned like the element buffer */
+    glBindBuffer(GL_ARRAY_BUFFER, pg->gl_vertex_buffer);
+    glBufferData(GL_ARRAY_BUFFER, total, NULL, GL_STREAM_DRAW);
+
+    for (i=0; i<NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
+        VertexAttribute *attribute = &kelvin->vertex_attributes[i];
+        if (!lengths[i]) {
+            continue;
+        }
+        glBufferSubData(GL_ARRAY_BUFFER, offsets[i], lengths[i], sources[i]);
+        glVertexAttribPointer(i,
+            attribute->needs_conversion ? attribute->converted_count
+                                        : attribute->count,
+            attribute->gl_type,
+            attribute->gl_normalize,
+            strides[i],
+            (void*)offsets[i]);
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+/* Find the smallest and largest index in an element batch so the draw can
+ * be bounded with glDrawRangeElements. Unsigned compares are done with
+ * SSE2's signed ones by flipping the sign bit first. */
+static void kelvin_index_range16(const uint16_t *elements, unsigned int count,
+                                 uint32_t *min_out, uint32_t *max_out)
+{
+    unsigned int i = 0;
+    uint16_t min_element = 0xFFFF;
+    uint16_t max_element = 0;
+
+#ifdef __SSE2__
+    if (count >= 8) {
+        const __m128i bias = _mm_set1_epi16((short)0x8000);
+        __m128i vmin = _mm_set1_epi16(0x7FFF);
+        __m128i vmax = _mm_set1_epi16((short)0x8000);
+        uint16_t lanes_min[8], lanes_max[8];
+        int j;
+
+        for (; i + 8 <= count; i += 8) {
+            __m128i v = _mm_loadu_si128((const __m128i *)&elements[i]);
+            v = _mm_xor_si128(v, bias);
+            vmin = _mm_min_epi16(vmin, v);
+            vmax = _mm_max_epi16(vmax, v);
+        }
+        _mm_storeu_si128((__m128i *)lanes_min, _mm_xor_si128(vmin, bias));
+        _mm_storeu_si128((__m128i *)lanes_max, _mm_xor_si128(vmax, bias));
+        for (j = 0; j < 8; j++) {
+            min_element = MIN(min_element, lanes_min[j]);
+            max_element = MAX(max_element, lanes_max[j]);
+        }
+    }
+#endif
+
+    for (; i < count; i++) {
+        min_element = MIN(min_element, elements[i]);
+        max_element = MAX(max_element, elements[i]);
+    }
+
+    *min_out = min_element;
+    *max_out = max_element;
+}
+
+static void kelvin_index_range32(const uint32_t *elements, unsigned int count,
+                                 uint32_t *min_out, uint32_t *max_out)
+{
+    unsigned int i = 0;
+    uint32_t min_element = (uint32_t)-1;
+    uint32_t max_element = 0;
+
+#ifdef __SSE2__
+    if (count >= 4) {
+        /* no 32-bit min/max before SSE4.1, so select with compare masks */
+        const __m128i bias = _mm_set1_epi32((int)0x80000000);
+        __m128i vmin = _mm_set1_epi32(0x7FFFFFFF);
+        __m128i vmax = _mm_set1_epi32((int)0x80000000);
+        uint32_t lanes_min[4], lanes_max[4];
+        int j;
 
+        for (; i + 4 <= count; i += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i *)&elements[i]);
+            v = _mm_xor_si128(v, bias);
+            __m128i lt = _mm_cmplt_epi32(v, vmin);
+            __m128i gt = _mm_cmpgt_epi32(v, vmax);
+            vmin = _mm_or_si128(_mm_and_si128(lt, v),
+                                _mm_andnot_si128(lt, vmin));
+            vmax = _mm_or_si128(_mm_and_si128(gt, v),
+                                _mm_andnot_si128(gt, vmax));
         }
+        _mm_storeu_si128((__m128i *)lanes_min, _mm_xor_si128(vmin, bias));
+        _mm_storeu_si128((__m128i *)lanes_max, _mm_xor_si128(vmax, bias));
+        for (j = 0; j < 4; j++) {
+            min_element = MIN(min_element, lanes_min[j]);
+            max_element = MAX(max_element, lanes_max[j]);
+        }
+    }
+#endif
+
+    for (; i < count; i++) {
+        min_element = MIN(min_element, elements[i]);
+        max_element = MAX(max_element, elements[i]);
+    }
+
+    *min_out = min_element;
+    *max_out = max_element;
+}
+
+/* Widen the pending 16-bit indices in place. Walk backwards so nothing
+ * is overwritten before it's been read. */
+static void kelvin_promote_elements(KelvinState *kelvin)
+{
+    int i;
+    assert(!kelvin->inline_elements_32);
+    for (i = kelvin->inline_elements_length - 1; i >= 0; i--) {
+        kelvin->inline_elements.u32[i] = kelvin->inline_elements.u16[i];
+    }
+    kelvin->inline_elements_32 = true;
+}
+
+static void kelvin_draw_inline_elements(NV2AState *d, KelvinState *kelvin)
+{
+    PGRAPHState *pg = &d->pgraph;
+    uint32_t min_element, max_element;
+    GLenum gl_type;
+    size_t size;
+
+    if (kelvin->inline_elements_32) {
+        kelvin_index_range32(kelvin->inline_elements.u32,
+                             kelvin->inline_elements_length,
+                             &min_element, &max_element);
+        gl_type = GL_UNSIGNED_INT;
+        size = kelvin->inline_elements_length * sizeof(uint32_t);
+    } else {
+        kelvin_index_range16(kelvin->inline_elements.u16,
+                             kelvin->inline_elements_length,
+                             &min_element, &max_element);
+        gl_type = GL_UNSIGNED_SHORT;
+        size = kelvin->inline_elements_length * sizeof(uint16_t);
+    }
+
+    if (pg->gl_buffered) {
+        kelvin_bind_vertex_buffer(d, kelvin, false, min_element,
+                                  max_element - min_element + 1);
+    } else {
+        kelvin_bind_converted_vertex_attributes(d, kelvin,
+            false, max_element+1);
+    }
+
+    /* orphan the previous contents so the driver doesn't have to wait
+     * on the last draw before letting us write */
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, pg->gl_element_buffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW);
+    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, size,
+                    &kelvin->inline_elements);
+
+    if (pg->gl_buffered) {
+        /* the vertex buffer starts at min_element */
+        glDrawElementsBaseVertex(kelvin->gl_primitive_mode,
+                                 kelvin->inline_elements_length,
+                                 gl_type,
+                                 (void*)0,
+                                 -(GLint)min_element);
+    } else {
+        glDrawRangeElements(kelvin->gl_primitive_mode,
+                            min_element, max_element,
+                            kelvin->inline_elements_length,
+                            gl_type,
+                            (void*)0);
     }
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 }
 
-static unsigned int kelvin_bind_inline_array(KelvinState *kelvin)
+static unsigned int kelvin_bind_inline_array(PGRAPHState *pg,
+                                             KelvinState *kelvin)
 {
     int i;
     unsigned int offset = 0;
@@ -1272,11 +2534,12 @@ static unsigned int kelvin_bind_inline_array(KelvinState *kelvin)
         VertexAttribute *attribute = &kelvin->vertex_attributes[i];
         if (attribute->count) {
 
-            glEnableVertexAttribArray(i);
+            gl_shadow_vertex_attrib_array(&pg->gl_shadow, i, true);
 
             attribute->inline_array_offset = offset;
 
-            if (!attribute->needs_conversion) {
+            /* the buffered path points them at the vertex buffer later */
+            if (!pg->gl_buffered && !attribute->needs_conversion) {
                 glVertexAttribPointer(i,
                     attribute->count,
                     attribute->gl_type,
@@ -1291,6 +2554,42 @@ static unsigned int kelvin_bind_inline_array(KelvinState *kelvin)
     return offset;
 }
 
+static void kelvin_bind_inline_buffer(PGRAPHState *pg, KelvinState *kelvin)
+{
+    const void *position = kelvin->inline_buffer;
+    const void *diffuse = &kelvin->inline_buffer[0].diffuse;
+
+    if (pg->gl_buffered) {
+        GLsizeiptr size = kelvin->inline_buffer_length
+                            * sizeof(InlineVertexBufferEntry);
+        glBindBuffer(GL_ARRAY_BUFFER, pg->gl_vertex_buffer);
+        glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, size, kelvin->inline_buffer);
+        position = (void*)0;
+        diffuse = (void*)offsetof(InlineVertexBufferEntry, diffuse);
+    }
+
+    gl_shadow_vertex_attrib_array(&pg->gl_shadow,
+                                  NV2A_VERTEX_ATTR_POSITION, true);
+    glVertexAttribPointer(NV2A_VERTEX_ATTR_POSITION,
+            4,
+            GL_FLOAT,
+            GL_FALSE,
+            sizeof(InlineVertexBufferEntry),
+            position);
+
+    gl_shadow_vertex_attrib_array(&pg->gl_shadow,
+                                  NV2A_VERTEX_ATTR_DIFFUSE, true);
+    glVertexAttribPointer(NV2A_VERTEX_ATTR_DIFFUSE,
+            4,
+            GL_UNSIGNED_BYTE,
+            GL_TRUE,
+            sizeof(InlineVertexBufferEntry),
+            diffuse);
+
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
 static void kelvin_bind_vertex_attributes(NV2AState *d,
                                                  KelvinState *kelvin)
 {
@@ -1299,32 +2598,23 @@ static void kelvin_bind_vertex_attributes(NV2AState *d,
     for (i=0; i<NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
         VertexAttribute *attribute = &kelvin->vertex_attributes[i];
         if (attribute->count) {
-            glEnableVertexAttribArray(i);
-
-            if (!attribute->needs_conversion) {
-                hwaddr dma_len;
-                uint8_t *vertex_data;
-
-                /* TODO: cache coherence */
-                if (attribute->dma_select) {
-                    vertex_data = nv_dma_map(d, kelvin->dma_vertex_b, &dma_len);
-                } else {
-                    vertex_data = nv_dma_map(d, kelvin->dma_vertex_a, &dma_len);
-                }
-                assert(attribute->offset < dma_len);
-                vertex_data += attribute->offset;
+            gl_shadow_vertex_attrib_array(&d->pgraph.gl_shadow, i, true);
 
+            /* the buffered path binds its vertex buffer at each draw */
+            if (!d->pgraph.gl_buffered && !attribute->needs_conversion) {
                 glVertexAttribPointer(i,
                     attribute->count,
                     attribute->gl_type,
                     attribute->gl_normalize,
                     attribute->stride,
-                    vertex_data);
+                    kelvin_vertex_attribute_data(d, kelvin, attribute,
+                                                 false));
             }
         } else {
-            glDisableVertexAttribArray(i);
+            gl_shadow_vertex_attrib_array(&d->pgraph.gl_shadow, i, false);
 
-            glVertexAttrib4ubv(i, (GLubyte *)&attribute->inline_value);
+            gl_shadow_vertex_attrib_4ub(&d->pgraph.gl_shadow, i,
+                                        attribute->inline_value);
         }
     }
 }
@@ -1336,6 +2626,10 @@ static void kelvin_bind_vertex_program(KelvinState *kelvin)
 
     shader = &kelvin->vertexshaders[kelvin->vertexshader_start_slot];
 
+    /* objects restored from a snapshot get their programs here */
+    if (!shader->gl_program) {
+        glGenProgramsARB(1, &shader->gl_program);
+    }
     glBindProgramARB(GL_VERTEX_PROGRAM_ARB, shader->gl_program);
 
     if (shader->dirty) {
@@ -1344,9 +2638,8 @@ static void kelvin_bind_vertex_program(KelvinState *kelvin)
                                              shader->program_length);
         const char* program_code_str = qstring_get_str(program_code);
 
-        NV2A_DPRINTF("bind vertex program %d, code:\n%s\n",
-                     kelvin->vertexshader_start_slot,
-                     program_code_str);
+        trace_nv2a_pgraph_vertex_program(kelvin->vertexshader_start_slot,
+                                         program_code_str);
 
         glProgramStringARB(GL_VERTEX_PROGRAM_ARB,
                            GL_PROGRAM_FORMAT_ASCII_ARB,
@@ -1374,7 +2667,7 @@ static void kelvin_bind_vertex_program(KelvinState *kelvin)
                           &native);
         assert(native);
 
-        assert(glGetError() == GL_NO_ERROR);
+        NV2A_GL_CHECK();
 
         QDECREF(program_code);
         shader->dirty = false;
@@ -1391,78 +2684,59 @@ static void kelvin_bind_vertex_program(KelvinState *kelvin)
         constant->dirty = false;
     }
 
-    assert(glGetError() == GL_NO_ERROR);
+    NV2A_GL_CHECK();
 }
 
 
-static void unswizzle_rect(
-    uint8_t *src_buf,
-    unsigned int width,
-    unsigned int height,
-    unsigned int depth,
-    uint8_t *dst_buf,
-    unsigned int pitch,
-    unsigned int bytes_per_pixel)
+/* Which bits of a swizzled texel index come from u, v and w. The low
+ * bits alternate between the axes until each runs out. */
+static void swizzle_masks(unsigned int width,
+                          unsigned int height,
+                          unsigned int depth,
+                          uint32_t *mask_u,
+                          uint32_t *mask_v,
+                          uint32_t *mask_w)
 {
-    unsigned int offset_u = 0, offset_v = 0, offset_w = 0;
-    uint32_t mask_u = 0, mask_v = 0, mask_w = 0;
-
     unsigned int i = 1, j = 1;
 
+    *mask_u = *mask_v = *mask_w = 0;
     while( (i <= width) || (i <= height) || (i <= depth) ) {
         if(i < width) {
-            mask_u |= j;
+            *mask_u |= j;
             j<<=1;
         }
         if(i < height) {
-            mask_v |= j;
+            *mask_v |= j;
             j<<=1;
         }
         if(i < depth) {
-            mask_w |= j;
+            *mask_w |= j;
             j<<=1;
         }
         i<<=1;
     }
+}
 
-    uint32_t start_u = 0;
-    uint32_t start_v = 0;
-    uint32_t start_w = 0;
-    uint32_t mask_max = 0;
-
-    // get the biggest mask
-    if(mask_u > mask_v)
-        mask_max = mask_u;
-    else
-        mask_max = mask_v;
-    if(mask_w > mask_max)
-        mask_max = mask_w;
-
-    for(i = 1; i <= mask_max; i<<=1) {
-        if(i<=mask_u) {
-            if(mask_u & i) start_u |= (offset_u & i);
-            else offset_u <<= 1;
-        }
-
-        if(i <= mask_v) {
-            if(mask_v & i) start_v |= (offset_v & i);
-            else offset_v<<=1;
-        }
-
-        if(i <= mask_w) {
-            if(mask_w & i) start_w |= (offset_w & i);
-            else offset_w <<= 1;
-        }
-    }
+static void unswizzle_rect(
+    uint8_t *src_buf,
+    unsigned int width,
+    unsigned int height,
+    unsigned int depth,
+    uint8_t *dst_buf,
+    unsigned int pitch,
+    unsigned int bytes_per_pixel)
+{
+    uint32_t mask_u, mask_v, mask_w;
+    swizzle_masks(width, height, depth, &mask_u, &mask_v, &mask_w);
 
-    uint32_t w = start_w;
+    uint32_t w = 0;
     unsigned int z;
     for(z=0; z<depth; z++) {
-        uint32_t v = start_v;
+        uint32_t v = 0;
 
         unsigned int y;
         for(y=0; y<height; y++) {
-            uint32_t u = start_u;
+            uint32_t u = 0;
 
             unsigned int x;
             for (x=0; x<width; x++) {
@@ -1481,166 +2755,875 @@ static void unswizzle_rect(
     }
 }
 
-static void pgraph_bind_textures(NV2AState *d)
+/* The inverse of unswizzle_rect: src_buf is linear with rows pitch
+ * bytes apart, dst_buf gets the swizzled image */
+static void swizzle_rect(
+    uint8_t *src_buf,
+    unsigned int width,
+    unsigned int height,
+    unsigned int depth,
+    uint8_t *dst_buf,
+    unsigned int pitch,
+    unsigned int bytes_per_pixel)
 {
-    int i;
-
-    for (i=0; i<NV2A_MAX_TEXTURES; i++) {
-        Texture *texture = &d->pgraph.textures[i];
+    uint32_t mask_u, mask_v, mask_w;
+    swizzle_masks(width, height, depth, &mask_u, &mask_v, &mask_w);
 
-        if (texture->dimensionality != 2) continue;
-        
-        glActiveTexture(GL_TEXTURE0_ARB + i);
-        if (texture->enabled) {
-            
-            assert(texture->color_format
-                    < sizeof(kelvin_color_format_map)/sizeof(ColorFormatInfo));
+    uint32_t w = 0;
+    unsigned int z;
+    for(z=0; z<depth; z++) {
+        uint32_t v = 0;
 
-            ColorFormatInfo f = kelvin_color_format_map[texture->color_format];
-            assert(f.bytes_per_pixel != 0);
+        unsigned int y;
+        for(y=0; y<height; y++) {
+            uint32_t u = 0;
 
-            GLenum gl_target;
-            GLuint gl_texture;
-            unsigned int width, height;
-            if (f.linear) {
-                /* linear textures use unnormalised texcoords.
-                 * GL_TEXTURE_RECTANGLE_ARB conveniently also does, but
-                 * does not allow repeat and mirror wrap modes.
-                 *  (or mipmapping, but xbox d3d says 'Non swizzled and non
-                 *   compressed textures cannot be mip mapped.')
-                 * Not sure if that'll be an issue. */
-                gl_target = GL_TEXTURE_RECTANGLE_ARB;
-                gl_texture = texture->gl_texture_rect;
-                
-                width = texture->rect_width;
-                height = texture->rect_height;
-            } else {
-                gl_target = GL_TEXTURE_2D;
-                gl_texture = texture->gl_texture;
+            unsigned int x;
+            for (x=0; x<width; x++) {
+                memcpy(dst_buf + ( (u|v|w)*bytes_per_pixel ),
+                       src_buf,
+                       bytes_per_pixel);
+                src_buf += bytes_per_pixel;
 
-                width = 1 << texture->log_width;
-                height = 1 << texture->log_height;
+                u = (u - mask_u) & mask_u;
             }
+            src_buf += pitch - width * bytes_per_pixel;
 
-            glBindTexture(gl_target, gl_texture);
-
-            if (!texture->dirty) continue;
-
-            glTexParameteri(gl_target, GL_TEXTURE_MIN_FILTER,
-                kelvin_texture_min_filter_map[texture->min_filter]);
-            glTexParameteri(gl_target, GL_TEXTURE_MAG_FILTER,
-                kelvin_texture_mag_filter_map[texture->mag_filter]);
-
-            /* load texture data*/
+            v = (v - mask_v) & mask_v;
+        }
+        w = (w - mask_w) & mask_w;
+    }
+}
 
-            hwaddr dma_len;
-            uint8_t *texture_data;
-            if (texture->dma_select) {
-                texture_data = nv_dma_map(d, d->pgraph.dma_b, &dma_len);
+/* Expand a texture format GL can't sample natively into RGBA8.
+ * data is linear (already unswizzled) with rows row_pitch bytes apart.
+ * Returns a buffer to be g_free'd. */
+static uint8_t *convert_texture_data(const Texture *texture,
+                                     ColorFormatInfo f,
+                                     const uint8_t *data,
+                                     const uint8_t *palette_data,
+                                     unsigned int width,
+                                     unsigned int height,
+                                     unsigned int row_pitch)
+{
+    uint8_t *converted = g_malloc(width * height * 4);
+    uint8_t *out = converted;
+    unsigned int x, y;
+
+    switch (f.conversion) {
+    case CONVERT_PALETTE:
+        assert(palette_data);
+        for (y = 0; y < height; y++) {
+            const uint8_t *line = data + y * row_pitch;
+            for (x = 0; x < width; x++) {
+                unsigned int index = line[x] % texture->palette_length;
+                uint32_t color = le32_to_cpupu(
+                    (const uint32_t*)(palette_data + index * 4));
+                out[0] = (color >> 16) & 0xFF;
+                out[1] = (color >> 8) & 0xFF;
+                out[2] = color & 0xFF;
+                out[3] = color >> 24;
+                out += 4;
+            }
+        }
+        break;
+    case CONVERT_YUY2:
+    case CONVERT_UYVY: {
+        /* two texels share each 4 byte macropixel, so the converter works
+         * in whole pairs */
+        uint32_t *rgb = g_malloc(((width + 1) & ~1) * sizeof(uint32_t));
+        for (y = 0; y < height; y++) {
+            const uint8_t *line = data + y * row_pitch;
+            if (f.conversion == CONVERT_YUY2) {
+                yuv_convert_yuy2(line, width, rgb);
             } else {
-                texture_data = nv_dma_map(d, d->pgraph.dma_a, &dma_len);
+                yuv_convert_uyvy(line, width, rgb);
             }
-            assert(texture->offset < dma_len);
-            texture_data += texture->offset;
-
-            NV2A_DPRINTF(" texture %d is format 0x%x, (%d, %d; %d),"
-                            " filter %x %x, levels %d-%d %d bias %d\n",
-                         i, texture->color_format,
-                         width, height, texture->pitch,
-                         texture->min_filter, texture->mag_filter,
-                         texture->min_mipmap_level, texture->max_mipmap_level, texture->levels,
-                         texture->lod_bias);
+            for (x = 0; x < width; x++) {
+                out[0] = (rgb[x] >> 16) & 0xFF;
+                out[1] = (rgb[x] >> 8) & 0xFF;
+                out[2] = rgb[x] & 0xFF;
+                out[3] = 255;
+                out += 4;
+            }
+        }
+        g_free(rgb);
+        break;
+    }
+    default:
+        assert(false);
+    }
 
-            if (f.linear) {
-                /* Can't handle retarded strides */
-                assert(texture->pitch % f.bytes_per_pixel == 0);
-                glPixelStorei(GL_UNPACK_ROW_LENGTH,
-                              texture->pitch / f.bytes_per_pixel);
+    return converted;
+}
 
-                glTexImage2D(gl_target, 0, f.gl_internal_format,
-                             width, height, 0,
-                             f.gl_format, f.gl_type,
-                             texture_data);
+static unsigned int texture_block_size(GLint gl_internal_format)
+{
+    if (gl_internal_format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT) {
+        return 8;
+    }
+    return 16;
+}
 
-                glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
-            } else {
-                unsigned int levels = texture->levels;
-                if (texture->max_mipmap_level < levels) {
-                    levels = texture->max_mipmap_level;
-                }
+/* Bytes in one mip level of a swizzled or compressed texture */
+static unsigned int texture_level_size(ColorFormatInfo f,
+                                       unsigned int width,
+                                       unsigned int height,
+                                       unsigned int depth)
+{
+    if (f.gl_format == 0) {
+        /* compressed. levels under 4x4 still take a whole block */
+        return ((width + 3) / 4) * ((height + 3) / 4) * depth
+                * texture_block_size(f.gl_internal_format);
+    }
+    return width * height * depth * f.bytes_per_pixel;
+}
 
-                glTexParameteri(gl_target, GL_TEXTURE_BASE_LEVEL,
-                    texture->min_mipmap_level);
-                glTexParameteri(gl_target, GL_TEXTURE_MAX_LEVEL,
-                    levels-1);
+/* Volume textures are compressed a slice at a time, the slices stored
+ * one after the other */
+static uint8_t *decompress_texture_data(GLint gl_internal_format,
+                                        const uint8_t *data,
+                                        unsigned int width,
+                                        unsigned int height,
+                                        unsigned int depth)
+{
+    uint8_t *converted = g_malloc(width * height * depth * 4);
+    unsigned int slice_size = ((width + 3) / 4) * ((height + 3) / 4)
+                              * texture_block_size(gl_internal_format);
+    unsigned int z;
 
+    for (z = 0; z < depth; z++) {
+        const uint8_t *in = data + z * slice_size;
+        uint8_t *out = converted + z * width * height * 4;
 
-                int level;
-                for (level = 0; level < levels; level++) {
-                    if (f.gl_format == 0) { /* retarded way of indicating compressed */
-                        unsigned int block_size;
-                        if (f.gl_internal_format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT) {
-                            block_size = 8;
-                        } else {
-                            block_size = 16;
-                        }
+        switch (gl_internal_format) {
+        case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
+            s3tc_decompress_dxt1(in, width, height, out);
+            break;
+        case GL_COMPRESSED_RGBA_S3TC_DXT3_EXT:
+            s3tc_decompress_dxt3(in, width, height, out);
+            break;
+        case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+            s3tc_decompress_dxt5(in, width, height, out);
+            break;
+        default:
+            assert(false);
+        }
+    }
 
-                        if (width < 4) width = 4;
-                        if (height < 4) height = 4;
-
-                        glCompressedTexImage2D(gl_target, level, f.gl_internal_format,
-                                               width, height, 0,
-                                               width/4 * height/4 * block_size,
-                                               texture_data);
-                    } else {
-                        unsigned int pitch = width * f.bytes_per_pixel;
-                        uint8_t *unswizzled = g_malloc(height * pitch);
-                        unswizzle_rect(texture_data, width, height, 1,
-                                       unswizzled, pitch, f.bytes_per_pixel);
-
-                        glTexImage2D(gl_target, level, f.gl_internal_format,
-                                     width, height, 0,
-                                     f.gl_format, f.gl_type,
-                                     unswizzled);
-
-                        g_free(unswizzled);
-                    }
+    return converted;
+}
 
-                    texture_data += width * height * f.bytes_per_pixel;
-                    width /= 2;
-                    height /= 2;
-                }
+/* Force a full reupload of any texture that might sample
+ * [addr, addr + len), for when the gpu side writes vram. */
+static void pgraph_invalidate_textures(NV2AState *d, hwaddr addr, hwaddr len)
+{
+    int i;
 
-            }
+    if (d->pgraph.gl_alias_valid
+        && ranges_overlap(d->pgraph.gl_alias_addr,
+                          4 << (d->pgraph.gl_alias_log_width
+                                + d->pgraph.gl_alias_log_height),
+                          addr, len)) {
+        d->pgraph.gl_alias_valid = false;
+    }
 
-            texture->dirty = false;
-        } else {
-            glBindTexture(GL_TEXTURE_2D, 0);
-            glBindTexture(GL_TEXTURE_RECTANGLE_ARB, 0);
+    for (i = 0; i < NV2A_MAX_TEXTURES; i++) {
+        Texture *texture = &d->pgraph.textures[i];
+        if (!texture->enabled || !texture->gl_storage_valid) {
+            continue;
+        }
+        DMAObject dma = nv_dma_load(d, texture->dma_select ? d->pgraph.dma_b
+                                                           : d->pgraph.dma_a);
+        /* the whole mip chain is at most 4/3 the base level, allow for
+         * 4 bytes per texel */
+        hwaddr texture_addr = dma.address + texture->offset;
+        hwaddr texture_len = texture->gl_storage_width
+                             * texture->gl_storage_height
+                             * texture->gl_storage_depth * 4 * 4 / 3;
+        if (texture->cubemap) {
+            texture_len = (texture_len + NV2A_CUBEFACE_ALIGN) * 6;
+        }
+        if (ranges_overlap(texture_addr, texture_len, addr, len)) {
+            texture->dirty = true;
         }
-
     }
 }
 
-static guint shader_hash(gconstpointer key)
+/* Clip [addr, addr + len) to vram. Returns false if nothing is left. */
+static bool vram_clip_range(NV2AState *d, hwaddr addr, hwaddr *len)
 {
-    /* 64 bit Fowler/Noll/Vo FNV-1a hash code */
-    uint64_t hval = 0xcbf29ce484222325ULL;
-    const uint8_t *bp = key;
-    const uint8_t *be = key + sizeof(ShaderState);
-    while (bp < be) {
-        hval ^= (uint64_t) *bp++;
-        hval += (hval << 1) + (hval << 4) + (hval << 5) +
-            (hval << 7) + (hval << 8) + (hval << 40);
-    }
+    hwaddr size = memory_region_size(d->vram);
 
-    return (guint)hval;
+    if (addr >= size || *len == 0) {
+        return false;
+    }
+    *len = MIN(*len, size - addr);
+    return true;
 }
 
-static gboolean shader_equal(gconstpointer a, gconstpointer b)
+/* Move the pages of [addr, addr + len) the cpu has written out of the
+ * dirty log, giving them a new generation */
+static void vram_sync_dirty(NV2AState *d, hwaddr addr, hwaddr len)
 {
-    const ShaderState *as = a, *bs = b;
-    return memcmp(as, bs, sizeof(ShaderState)) == 0;
+    hwaddr page, end, run_start = 0;
+    bool run = false;
+    bool bumped = false;
+
+    if (!vram_clip_range(d, addr, &len)) {
+        return;
+    }
+    end = addr + len;
+
+    for (page = addr & TARGET_PAGE_MASK; page < end;
+         page += TARGET_PAGE_SIZE) {
+        bool dirty = memory_region_get_dirty(d->vram, page, TARGET_PAGE_SIZE,
+                                             DIRTY_MEMORY_NV2A);
+        if (dirty) {
+            if (!bumped) {
+                d->vram_generation++;
+                bumped = true;
+            }
+            d->vram_page_generation[page >> TARGET_PAGE_BITS] =
+                d->vram_generation;
+            if (!run) {
+                run_start = page;
+                run = true;
+            }
+        } else if (run) {
+            memory_region_reset_dirty(d->vram, run_start, page - run_start,
+                                      DIRTY_MEMORY_NV2A);
+            run = false;
+        }
+    }
+    if (run) {
+        memory_region_reset_dirty(d->vram, run_start, page - run_start,
+                                  DIRTY_MEMORY_NV2A);
+    }
+}
+
+/* Whether any page of [addr, addr + len) has been written since
+ * generation. Only sees what vram_sync_dirty() has moved out of the log. */
+static bool vram_dirty_since(NV2AState *d, hwaddr addr, hwaddr len,
+                             uint64_t generation)
+{
+    hwaddr page;
+
+    if (!vram_clip_range(d, addr, &len)) {
+        return false;
+    }
+    for (page = addr & TARGET_PAGE_MASK; page < addr + len;
+         page += TARGET_PAGE_SIZE) {
+        if (d->vram_page_generation[page >> TARGET_PAGE_BITS] > generation) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* For readers of a single range: whether it has been written since
+ * *generation, which is brought up to date */
+static bool vram_test_dirty(NV2AState *d, hwaddr addr, hwaddr len,
+                            uint64_t *generation)
+{
+    bool dirty;
+
+    vram_sync_dirty(d, addr, len);
+    dirty = vram_dirty_since(d, addr, len, *generation);
+    *generation = d->vram_generation;
+    return dirty;
+}
+
+/* Bytes of vram a swizzled or compressed texture spans, counting every
+ * level of every face */
+static hwaddr texture_vram_len(const Texture *texture, ColorFormatInfo f,
+                               unsigned int width, unsigned int height,
+                               unsigned int depth)
+{
+    hwaddr face_len = 0;
+    int level;
+
+    for (level = 0; level < MAX(texture->levels, 1); level++) {
+        face_len += texture_level_size(f, width, height, depth);
+        width = MAX(width / 2, 1);
+        height = MAX(height / 2, 1);
+        depth = MAX(depth / 2, 1);
+    }
+    if (texture->cubemap) {
+        return ROUND_UP(face_len, NV2A_CUBEFACE_ALIGN) * 6;
+    }
+    return face_len;
+}
+
+/* Rows of a linear texture on pages written since generation. Returns
+ * false if there are none. */
+static bool texture_dirty_rows(NV2AState *d, hwaddr addr,
+                               unsigned int pitch, unsigned int height,
+                               uint64_t generation,
+                               unsigned int *first_row,
+                               unsigned int *last_row)
+{
+    hwaddr len = (hwaddr)pitch * height;
+    hwaddr page;
+    bool dirty = false;
+
+    *first_row = height;
+    *last_row = 0;
+
+    for (page = addr & TARGET_PAGE_MASK; page < addr + len;
+         page += TARGET_PAGE_SIZE) {
+        hwaddr start = MAX(page, addr) - addr;
+        hwaddr end = MIN(page + TARGET_PAGE_SIZE, addr + len) - addr;
+        if (!vram_dirty_since(d, addr + start, end - start, generation)) {
+            continue;
+        }
+        *first_row = MIN(*first_row, start / pitch);
+        *last_row = MAX(*last_row, (end - 1) / pitch);
+        dirty = true;
+    }
+
+    return dirty;
+}
+
+/* Upload one mip level of a swizzled or compressed texture. target is
+ * the image target: GL_TEXTURE_2D, GL_TEXTURE_3D or a cube face. */
+static void pgraph_upload_texture_level(NV2AState *d, const Texture *texture,
+                                        ColorFormatInfo f, GLenum target,
+                                        int level, const uint8_t *data,
+                                        const uint8_t *palette_data,
+                                        unsigned int width,
+                                        unsigned int height,
+                                        unsigned int depth,
+                                        unsigned int level_size,
+                                        bool allocate)
+{
+    bool compressed = (f.gl_format == 0); /* retarded way of indicating compressed */
+    bool volume = (target == GL_TEXTURE_3D);
+
+    if (compressed && d->pgraph.gl_texture_compression_s3tc) {
+        if (volume && allocate) {
+            glCompressedTexImage3D(target, level, f.gl_internal_format,
+                                   width, height, depth, 0,
+                                   level_size, data);
+        } else if (volume) {
+            glCompressedTexSubImage3D(target, level, 0, 0, 0,
+                                      width, height, depth,
+                                      f.gl_internal_format,
+                                      level_size, data);
+        } else if (allocate) {
+            glCompressedTexImage2D(target, level, f.gl_internal_format,
+                                   width, height, 0,
+                                   level_size, data);
+        } else {
+            glCompressedTexSubImage2D(target, level, 0, 0, width, height,
+                                      f.gl_internal_format,
+                                      level_size, data);
+        }
+        return;
+    }
+
+    uint8_t *level_data;
+    GLint gl_internal_format = f.gl_internal_format;
+    GLenum gl_format = f.gl_format;
+    GLenum gl_type = f.gl_type;
+
+    if (compressed) {
+        level_data = decompress_texture_data(f.gl_internal_format, data,
+                                             width, height, depth);
+        gl_internal_format = GL_RGBA;
+        gl_format = GL_RGBA;
+        gl_type = GL_UNSIGNED_BYTE;
+    } else {
+        unsigned int pitch = width * f.bytes_per_pixel;
+        level_data = g_malloc(height * depth * pitch);
+        unswizzle_rect((uint8_t *)data, width, height, depth,
+                       level_data, pitch, f.bytes_per_pixel);
+
+        if (f.conversion != CONVERT_NONE) {
+            /* the slices are just more rows */
+            uint8_t *converted = convert_texture_data(
+                texture, f, level_data, palette_data,
+                width, height * depth, pitch);
+            g_free(level_data);
+            level_data = converted;
+        }
+    }
+
+    if (volume && allocate) {
+        glTexImage3D(target, level, gl_internal_format,
+                     width, height, depth, 0,
+                     gl_format, gl_type, level_data);
+    } else if (volume) {
+        glTexSubImage3D(target, level, 0, 0, 0, width, height, depth,
+                        gl_format, gl_type, level_data);
+    } else if (allocate) {
+        glTexImage2D(target, level, gl_internal_format,
+                     width, height, 0,
+                     gl_format, gl_type, level_data);
+    } else {
+        glTexSubImage2D(target, level, 0, 0, width, height,
+                        gl_format, gl_type, level_data);
+    }
+
+    g_free(level_data);
+}
+
+/* A swizzled render target that was read back and hasn't been touched
+ * by the cpu since can be copied into a texture sampling it on the gpu,
+ * skipping both the readback's round trip and the unswizzle. The
+ * texture is bound. Returns false if it has to come from vram. */
+static bool pgraph_bind_texture_alias(NV2AState *d, const Texture *texture,
+                                      ColorFormatInfo f, hwaddr texture_addr,
+                                      unsigned int levels, bool upload_all)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    if (!pg->gl_alias_valid
+        || texture_addr != pg->gl_alias_addr
+        || texture->color_format != pg->gl_alias_color_format
+        || texture->log_width != pg->gl_alias_log_width
+        || texture->log_height != pg->gl_alias_log_height
+        || texture->dimensionality != 2
+        || texture->cubemap
+        || levels != 1) {
+        return false;
+    }
+
+    unsigned int width = 1 << texture->log_width;
+    unsigned int height = 1 << texture->log_height;
+    if (vram_dirty_since(d, texture_addr,
+                         width * height * f.bytes_per_pixel,
+                         pg->gl_alias_generation)) {
+        /* the cpu has written over it since */
+        pg->gl_alias_valid = false;
+        return false;
+    }
+
+    if (upload_all) {
+        glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, pg->gl_swizzle_framebuffer);
+        glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT,
+                                  GL_COLOR_ATTACHMENT0_EXT,
+                                  GL_TEXTURE_2D, pg->gl_alias_texture, 0);
+        glCopyTexImage2D(GL_TEXTURE_2D, 0, f.gl_internal_format,
+                         0, 0, width, height, 0);
+        glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, pg->gl_framebuffer);
+        NV2A_GL_CHECK();
+    }
+    return true;
+}
+
+static unsigned int texture_address_mode(uint32_t address, uint32_t mask,
+                                         bool linear)
+{
+    unsigned int mode = GET_MASK(address, mask);
+
+    /* rectangle textures can't repeat or mirror */
+    if (linear && (mode == NV097_SET_TEXTURE_ADDRESS_WRAP
+                   || mode == NV097_SET_TEXTURE_ADDRESS_MIRROR)) {
+        return NV097_SET_TEXTURE_ADDRESS_CLAMP_TO_EDGE;
+    }
+    /* never set, keep the gl default */
+    if (mode == 0 || mode >= ARRAY_SIZE(kelvin_texture_address_map)) {
+        return linear ? NV097_SET_TEXTURE_ADDRESS_CLAMP_TO_EDGE
+                      : NV097_SET_TEXTURE_ADDRESS_WRAP;
+    }
+    return mode;
+}
+
+static uint32_t texture_sampler_key(const Texture *texture, bool linear)
+{
+    unsigned int min_filter = texture->min_filter;
+    unsigned int mag_filter = texture->mag_filter;
+    uint32_t key = 0;
+
+    if (min_filter == 0 || min_filter >= ARRAY_SIZE(
+                                kelvin_texture_min_filter_map)) {
+        /* the gl defaults */
+        min_filter = linear ? 2 : 5;
+    } else if (linear && min_filter >= 3 && min_filter <= 6) {
+        /* rectangle textures have no mipmaps to filter between */
+        min_filter = (min_filter == 3 || min_filter == 5) ? 1 : 2;
+    }
+    if (mag_filter >= ARRAY_SIZE(kelvin_texture_mag_filter_map)
+        || kelvin_texture_mag_filter_map[mag_filter] == 0) {
+        mag_filter = 2;
+    }
+
+    SET_MASK(key, SAMPLER_KEY_MIN_FILTER, min_filter);
+    SET_MASK(key, SAMPLER_KEY_MAG_FILTER, mag_filter);
+    SET_MASK(key, SAMPLER_KEY_ADDRESS_U,
+             texture_address_mode(texture->address,
+                                  NV097_SET_TEXTURE_ADDRESS_U, linear));
+    SET_MASK(key, SAMPLER_KEY_ADDRESS_V,
+             texture_address_mode(texture->address,
+                                  NV097_SET_TEXTURE_ADDRESS_V, linear));
+    SET_MASK(key, SAMPLER_KEY_ADDRESS_P,
+             texture_address_mode(texture->address,
+                                  NV097_SET_TEXTURE_ADDRESS_P, linear));
+    if (!linear) {
+        SET_MASK(key, SAMPLER_KEY_LOG_MAX_ANISO,
+                 texture->log_max_anisotropy);
+        SET_MASK(key, SAMPLER_KEY_LOD_BIAS, texture->lod_bias);
+    }
+    return key;
+}
+
+static void sampler_parameteri(GLuint sampler, GLenum target,
+                               GLenum pname, GLint value)
+{
+    if (sampler) {
+        glSamplerParameteri(sampler, pname, value);
+    } else {
+        glTexParameteri(target, pname, value);
+    }
+}
+
+static void sampler_parameterf(GLuint sampler, GLenum target,
+                               GLenum pname, GLfloat value)
+{
+    if (sampler) {
+        glSamplerParameterf(sampler, pname, value);
+    } else {
+        glTexParameterf(target, pname, value);
+    }
+}
+
+/* Set the state a sampler key describes on a sampler object, or on the
+ * texture bound to target if sampler is 0 */
+static void pgraph_apply_sampler(PGRAPHState *pg, GLuint sampler,
+                                 GLenum target, uint32_t key)
+{
+    sampler_parameteri(sampler, target, GL_TEXTURE_MIN_FILTER,
+        kelvin_texture_min_filter_map[
+            GET_MASK(key, SAMPLER_KEY_MIN_FILTER)]);
+    sampler_parameteri(sampler, target, GL_TEXTURE_MAG_FILTER,
+        kelvin_texture_mag_filter_map[
+            GET_MASK(key, SAMPLER_KEY_MAG_FILTER)]);
+    sampler_parameteri(sampler, target, GL_TEXTURE_WRAP_S,
+        kelvin_texture_address_map[GET_MASK(key, SAMPLER_KEY_ADDRESS_U)]);
+    sampler_parameteri(sampler, target, GL_TEXTURE_WRAP_T,
+        kelvin_texture_address_map[GET_MASK(key, SAMPLER_KEY_ADDRESS_V)]);
+    sampler_parameteri(sampler, target, GL_TEXTURE_WRAP_R,
+        kelvin_texture_address_map[GET_MASK(key, SAMPLER_KEY_ADDRESS_P)]);
+
+    if (target == GL_TEXTURE_RECTANGLE_ARB) {
+        return;
+    }
+
+    /* 5.8 signed fixed point */
+    int32_t lod_bias = sextract32(GET_MASK(key, SAMPLER_KEY_LOD_BIAS), 0, 13);
+    sampler_parameterf(sampler, target, GL_TEXTURE_LOD_BIAS,
+                       lod_bias / 256.0f);
+
+    if (pg->gl_texture_filter_anisotropic) {
+        GLfloat anisotropy = 1 << GET_MASK(key, SAMPLER_KEY_LOG_MAX_ANISO);
+        sampler_parameterf(sampler, target, GL_TEXTURE_MAX_ANISOTROPY_EXT,
+                           MIN(anisotropy, pg->gl_max_anisotropy));
+    }
+}
+
+static GLuint pgraph_get_sampler(PGRAPHState *pg, uint32_t key)
+{
+    gpointer cached = g_hash_table_lookup(pg->sampler_cache,
+                                          GUINT_TO_POINTER(key));
+    if (cached) {
+        return GPOINTER_TO_UINT(cached);
+    }
+
+    GLuint sampler;
+    glGenSamplers(1, &sampler);
+    /* the same sampler may end up on a rectangle texture as well, so the
+     * state they don't have is set too */
+    pgraph_apply_sampler(pg, sampler, GL_TEXTURE_2D, key);
+    g_hash_table_insert(pg->sampler_cache, GUINT_TO_POINTER(key),
+                        GUINT_TO_POINTER(sampler));
+    return sampler;
+}
+
+static void pgraph_delete_sampler(gpointer key, gpointer value,
+                                  gpointer opaque)
+{
+    GLuint sampler = GPOINTER_TO_UINT(value);
+    glDeleteSamplers(1, &sampler);
+}
+
+static void pgraph_bind_textures(NV2AState *d)
+{
+    int i;
+
+    for (i=0; i<NV2A_MAX_TEXTURES; i++) {
+        Texture *texture = &d->pgraph.textures[i];
+
+        gl_shadow_active_texture(&d->pgraph.gl_shadow, i);
+        if (texture->enabled) {
+            
+            assert(texture->color_format
+                    < sizeof(kelvin_color_format_map)/sizeof(ColorFormatInfo));
+
+            ColorFormatInfo f = kelvin_color_format_map[texture->color_format];
+            assert(f.bytes_per_pixel != 0);
+
+            GLenum gl_target;
+            GLuint gl_texture;
+            unsigned int width, height, depth = 1;
+            if (f.linear) {
+                /* linear textures use unnormalised texcoords.
+                 * GL_TEXTURE_RECTANGLE_ARB conveniently also does, but
+                 * does not allow repeat and mirror wrap modes.
+                 *  (or mipmapping, but xbox d3d says 'Non swizzled and non
+                 *   compressed textures cannot be mip mapped.')
+                 * Not sure if that'll be an issue. */
+                gl_target = GL_TEXTURE_RECTANGLE_ARB;
+                gl_texture = texture->gl_texture_rect;
+                
+                width = texture->rect_width;
+                height = texture->rect_height;
+            } else {
+                if (texture->cubemap) {
+                    gl_target = GL_TEXTURE_CUBE_MAP;
+                    gl_texture = texture->gl_texture_cube;
+                } else if (texture->dimensionality == 3) {
+                    gl_target = GL_TEXTURE_3D;
+                    gl_texture = texture->gl_texture_3d;
+                    depth = 1 << texture->log_depth;
+                } else {
+                    gl_target = GL_TEXTURE_2D;
+                    gl_texture = texture->gl_texture;
+                }
+
+                width = 1 << texture->log_width;
+                height = 1 << texture->log_height;
+            }
+
+            gl_shadow_bind_texture(&d->pgraph.gl_shadow, gl_target, gl_texture);
+
+            unsigned int levels = 1;
+            if (!f.linear) {
+                levels = texture->levels;
+                if (texture->max_mipmap_level < levels) {
+                    levels = texture->max_mipmap_level;
+                }
+            }
+
+            /* Reuse the gl storage as long as its shape hasn't changed,
+             * otherwise every level gets respecified below. */
+            bool allocate = !texture->gl_storage_valid
+                || texture->gl_storage_target != gl_target
+                || texture->gl_storage_format != texture->color_format
+                || texture->gl_storage_width != width
+                || texture->gl_storage_height != height
+                || texture->gl_storage_depth != depth
+                || texture->gl_storage_levels != levels;
+
+            if (!f.linear && (allocate
+                    || texture->gl_base_level != texture->min_mipmap_level
+                    || texture->gl_max_level != levels - 1)) {
+                glTexParameteri(gl_target, GL_TEXTURE_BASE_LEVEL,
+                    texture->min_mipmap_level);
+                glTexParameteri(gl_target, GL_TEXTURE_MAX_LEVEL,
+                    levels-1);
+                texture->gl_base_level = texture->min_mipmap_level;
+                texture->gl_max_level = levels - 1;
+            }
+
+            /* filtering and addressing never touch the texture data */
+            uint32_t sampler_key = texture_sampler_key(texture, f.linear);
+            if (d->pgraph.gl_sampler_objects) {
+                gl_shadow_bind_sampler(&d->pgraph.gl_shadow, i,
+                    pgraph_get_sampler(&d->pgraph, sampler_key));
+            } else if (allocate || texture->gl_sampler_key != sampler_key) {
+                pgraph_apply_sampler(&d->pgraph, 0, gl_target, sampler_key);
+                texture->gl_sampler_key = sampler_key;
+            }
+
+            /* load texture data*/
+
+            hwaddr dma_len;
+            uint8_t *texture_data;
+            if (texture->dma_select) {
+                texture_data = nv_dma_map(d, d->pgraph.dma_b, &dma_len);
+            } else {
+                texture_data = nv_dma_map(d, d->pgraph.dma_a, &dma_len);
+            }
+            assert(texture->offset < dma_len);
+            texture_data += texture->offset;
+
+            uint8_t *palette_data = NULL;
+            if (f.conversion == CONVERT_PALETTE) {
+                if (texture->palette_dma_select) {
+                    palette_data = nv_dma_map(d, d->pgraph.dma_b, &dma_len);
+                } else {
+                    palette_data = nv_dma_map(d, d->pgraph.dma_a, &dma_len);
+                }
+                assert(texture->palette_offset
+                        + texture->palette_length * 4 <= dma_len);
+                palette_data += texture->palette_offset;
+
+            }
+
+            /* pick up every cpu write to the texture at once, so checking
+             * one level can't hide writes to another on the same page */
+            hwaddr texture_addr = texture_data - d->vram_ptr;
+            vram_sync_dirty(d, texture_addr,
+                            f.linear ? (hwaddr)texture->pitch * height
+                                     : texture_vram_len(texture, f, width,
+                                                        height, depth));
+            if (palette_data) {
+                vram_sync_dirty(d, palette_data - d->vram_ptr,
+                                texture->palette_length * 4);
+            }
+            uint64_t generation = texture->vram_generation;
+            texture->vram_generation = d->vram_generation;
+
+            /* a palette edit changes every texel */
+            if (palette_data
+                && vram_dirty_since(d, palette_data - d->vram_ptr,
+                                    texture->palette_length * 4,
+                                    generation)) {
+                texture->dirty = true;
+            }
+
+            /* a state change may have moved the texture, so pull in all
+             * of it. Otherwise only what the cpu has written since. */
+            bool upload_all = allocate || texture->dirty;
+
+            trace_nv2a_pgraph_texture_bind(i, texture->color_format,
+                                           width, height, levels,
+                                           upload_all);
+
+            if (f.linear) {
+                unsigned int first_row = 0, last_row = height - 1;
+
+                if (!upload_all
+                    && !texture_dirty_rows(d, texture_addr,
+                                           texture->pitch, height,
+                                           generation,
+                                           &first_row, &last_row)) {
+                    continue;
+                }
+                unsigned int rows = last_row - first_row + 1;
+                uint8_t *row_data = texture_data + first_row * texture->pitch;
+
+                uint8_t *converted = NULL;
+                if (f.conversion != CONVERT_NONE) {
+                    converted = convert_texture_data(texture, f, row_data,
+                                                     palette_data,
+                                                     width, rows,
+                                                     texture->pitch);
+                    row_data = converted;
+                } else {
+                    /* Can't handle retarded strides */
+                    assert(texture->pitch % f.bytes_per_pixel == 0);
+                    glPixelStorei(GL_UNPACK_ROW_LENGTH,
+                                  texture->pitch / f.bytes_per_pixel);
+                }
+
+                if (allocate) {
+                    glTexImage2D(gl_target, 0, f.gl_internal_format,
+                                 width, height, 0,
+                                 f.gl_format, f.gl_type,
+                                 row_data);
+                } else {
+                    glTexSubImage2D(gl_target, 0, 0, first_row,
+                                    width, rows,
+                                    f.gl_format, f.gl_type,
+                                    row_data);
+                }
+
+                glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+                g_free(converted);
+            } else if (pgraph_bind_texture_alias(d, texture, f,
+                                                 texture_addr,
+                                                 levels, upload_all)) {
+                /* copied from the render target on the gpu */
+            } else {
+                /* cube faces each have a whole mip chain, starting on an
+                 * aligned boundary */
+                unsigned int faces = texture->cubemap ? 6 : 1;
+                unsigned int face;
+                for (face = 0; face < faces; face++) {
+                    GLenum image_target = texture->cubemap
+                        ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + face : gl_target;
+                    uint8_t *face_data = texture_data;
+                    unsigned int level_width = width;
+                    unsigned int level_height = height;
+                    unsigned int level_depth = depth;
+                    int level;
+
+                    /* walk the levels we don't use too, to find the
+                     * next face */
+                    for (level = 0; level < MAX(texture->levels, 1); level++) {
+                        hwaddr level_addr = texture_data - d->vram_ptr;
+                        unsigned int level_size = texture_level_size(
+                            f, level_width, level_height, level_depth);
+
+                        if (level < levels) {
+                            if (upload_all || vram_dirty_since(
+                                    d, level_addr, level_size, generation)) {
+                                pgraph_upload_texture_level(
+                                    d, texture, f, image_target, level,
+                                    texture_data, palette_data,
+                                    level_width, level_height, level_depth,
+                                    level_size, allocate);
+                            }
+                        } else if (!texture->cubemap) {
+                            break;
+                        }
+
+                        texture_data += level_size;
+                        level_width = MAX(level_width / 2, 1);
+                        level_height = MAX(level_height / 2, 1);
+                        level_depth = MAX(level_depth / 2, 1);
+                    }
+
+                    texture_data = face_data
+                        + ROUND_UP(texture_data - face_data,
+                                   NV2A_CUBEFACE_ALIGN);
+                }
+            }
+
+            texture->gl_storage_valid = true;
+            texture->gl_storage_target = gl_target;
+            texture->gl_storage_format = texture->color_format;
+            texture->gl_storage_width = f.linear ? texture->rect_width
+                                                 : 1 << texture->log_width;
+            texture->gl_storage_height = f.linear ? texture->rect_height
+                                                  : 1 << texture->log_height;
+            texture->gl_storage_depth = depth;
+            texture->gl_storage_levels = levels;
+
+            texture->dirty = false;
+        } else {
+            gl_shadow_bind_texture(&d->pgraph.gl_shadow, GL_TEXTURE_2D, 0);
+            gl_shadow_bind_texture(&d->pgraph.gl_shadow,
+                                   GL_TEXTURE_RECTANGLE_ARB, 0);
+            gl_shadow_bind_texture(&d->pgraph.gl_shadow,
+                                   GL_TEXTURE_CUBE_MAP, 0);
+            gl_shadow_bind_texture(&d->pgraph.gl_shadow, GL_TEXTURE_3D, 0);
+        }
+
+    }
+}
+
+static guint shader_hash(gconstpointer key)
+{
+    /* 64 bit Fowler/Noll/Vo FNV-1a hash code */
+    uint64_t hval = 0xcbf29ce484222325ULL;
+    const uint8_t *bp = key;
+    const uint8_t *be = key + sizeof(ShaderState);
+    while (bp < be) {
+        hval ^= (uint64_t) *bp++;
+        hval += (hval << 1) + (hval << 4) + (hval << 5) +
+            (hval << 7) + (hval << 8) + (hval << 40);
+    }
+
+    return (guint)hval;
+}
+
+static gboolean shader_equal(gconstpointer a, gconstpointer b)
+{
+    const ShaderState *as = a, *bs = b;
+    return memcmp(as, bs, sizeof(ShaderState)) == 0;
 }
 
 static GLuint generate_shaders(ShaderState state)
@@ -1684,7 +3667,7 @@ static GLuint generate_shaders(ShaderState state)
         glShaderSource(vertex_shader, 1, &vertex_shader_code, 0);
         glCompileShader(vertex_shader);
 
-        NV2A_DPRINTF("bind new vertex shader, code:\n%s\n", vertex_shader_code);
+        trace_nv2a_pgraph_shader_compile("vertex", vertex_shader_code);
 
         /* Check it compiled */
         GLint compiled = 0;
@@ -1723,7 +3706,7 @@ static GLuint generate_shaders(ShaderState state)
 
     const char *fragment_shader_code_str = qstring_get_str(fragment_shader_code);
 
-    NV2A_DPRINTF("bind new fragment shader, code:\n%s\n", fragment_shader_code_str);
+    trace_nv2a_pgraph_shader_compile("fragment", fragment_shader_code_str);
 
     glShaderSource(fragment_shader, 1, &fragment_shader_code_str, 0);
     glCompileShader(fragment_shader);
@@ -1753,6 +3736,7 @@ static GLuint generate_shaders(ShaderState state)
         abort();
     }
 
+    /* the caller binds it through the shadow state straight after */
     glUseProgram(program);
 
     /* set texture samplers */
@@ -1831,7 +3815,7 @@ static void pgraph_bind_shaders(PGRAPHState *pg)
         }
     }
 
-    glUseProgram(pg->gl_program);
+    gl_shadow_use_program(&pg->gl_shadow, pg->gl_program);
 
 
     /* update combiner constants */
@@ -1900,134 +3884,1700 @@ static void pgraph_bind_shaders(PGRAPHState *pg)
     pg->shaders_dirty = false;
 }
 
-static void pgraph_update_surface(NV2AState *d, bool upload)
+static void pgraph_get_surface_color_format(PGRAPHState *pg,
+                                            GLenum *gl_format,
+                                            GLenum *gl_type,
+                                            unsigned int *bytes_per_pixel)
 {
-    if (d->pgraph.surface_color.format != 0 && d->pgraph.color_mask
-        && (upload || d->pgraph.surface_color.draw_dirty)) {
+    switch (pg->surface_color.format) {
+    case NV097_SET_SURFACE_FORMAT_COLOR_LE_R5G6B5:
+        *bytes_per_pixel = 2;
+        *gl_format = GL_RGB;
+        *gl_type = GL_UNSIGNED_SHORT_5_6_5_REV;
+        break;
+    case NV097_SET_SURFACE_FORMAT_COLOR_LE_X8R8G8B8_Z8R8G8B8:
+    case NV097_SET_SURFACE_FORMAT_COLOR_LE_A8R8G8B8:
+        *bytes_per_pixel = 4;
+        *gl_format = GL_RGBA;
+        *gl_type = GL_UNSIGNED_INT_8_8_8_8_REV;
+        break;
+    default:
+        assert(false);
+    }
+}
 
-        /* There's a bunch of bugs that could cause us to hit this function
-         * at the wrong time and get a invalid dma object.
-         * Check that it's sane. */
-        DMAObject color_dma = nv_dma_load(d, d->pgraph.dma_color);
-        assert(color_dma.dma_class == NV_DMA_IN_MEMORY_CLASS);
+static bool pgraph_surface_swizzled(PGRAPHState *pg)
+{
+    return pg->surface_type == NV097_SET_SURFACE_FORMAT_TYPE_SWIZZLE;
+}
 
+/* Bytes of vram a surface covers. Swizzled surfaces are packed, their
+ * pitch is ignored. */
+static hwaddr pgraph_surface_len(PGRAPHState *pg, const Surface *surface,
+                                 unsigned int bytes_per_pixel)
+{
+    if (pgraph_surface_swizzled(pg)) {
+        return (hwaddr)bytes_per_pixel
+            << (pg->surface_log_width + pg->surface_log_height);
+    }
+    return surface->pitch * pg->surface_height;
+}
 
-        assert(color_dma.address + d->pgraph.surface_color.offset != 0);
-        assert(d->pgraph.surface_color.offset <= color_dma.limit);
-        assert(d->pgraph.surface_color.offset
-                + d->pgraph.surface_color.pitch * d->pgraph.surface_height
-                    <= color_dma.limit + 1);
+/* Draw width x height of the bound framebuffer with the swizzle program,
+ * sampling the rect texture source. */
+static void pgraph_swizzle_pass(PGRAPHState *pg, int mode, GLuint source,
+                                unsigned int width, unsigned int height)
+{
+    gl_shadow_use_program(&pg->gl_shadow, pg->gl_swizzle_program);
+    glUniform1i(pg->gl_swizzle_mode_location, mode);
+    glUniform2f(pg->gl_swizzle_size_location,
+                1 << pg->surface_log_width, 1 << pg->surface_log_height);
+    glUniform1f(pg->gl_swizzle_surface_height_location, pg->surface_height);
+
+    gl_shadow_active_texture(&pg->gl_shadow, 0);
+    gl_shadow_bind_texture(&pg->gl_shadow, GL_TEXTURE_RECTANGLE_ARB, source);
+    if (pg->gl_sampler_objects) {
+        gl_shadow_bind_sampler(&pg->gl_shadow, 0, 0);
+    }
 
+    gl_shadow_enable(&pg->gl_shadow, GL_DEPTH_TEST, false);
+    gl_shadow_enable(&pg->gl_shadow, GL_STENCIL_TEST, false);
+    gl_shadow_color_mask(&pg->gl_shadow, true, true, true, true);
 
-        hwaddr color_len;
-        uint8_t *color_data = nv_dma_map(d, d->pgraph.dma_color, &color_len);
-        
-        GLenum gl_format;
-        GLenum gl_type;
-        unsigned int bytes_per_pixel;
-        switch (d->pgraph.surface_color.format) {
-        case NV097_SET_SURFACE_FORMAT_COLOR_LE_R5G6B5:
-            bytes_per_pixel = 2;
-            gl_format = GL_RGB;
-            gl_type = GL_UNSIGNED_SHORT_5_6_5_REV;
-            break;
-        case NV097_SET_SURFACE_FORMAT_COLOR_LE_X8R8G8B8_Z8R8G8B8:
-        case NV097_SET_SURFACE_FORMAT_COLOR_LE_A8R8G8B8:
-            bytes_per_pixel = 4;
-            gl_format = GL_RGBA;
-            gl_type = GL_UNSIGNED_INT_8_8_8_8_REV;
-            break;
-        default:
-            assert(false);
-        }
+    gl_shadow_vertex_attrib_array(&pg->gl_shadow, 0, true);
+    glBindBuffer(GL_ARRAY_BUFFER, pg->gl_swizzle_quad);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-        /* TODO */
-        assert(d->pgraph.surface_x == 0 && d->pgraph.surface_y == 0);
+    glViewport(0, 0, width, height);
+    glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+    glViewport(0, 0, 640, 480);
 
-        if (upload && memory_region_test_and_clear_dirty(d->vram,
-                                               color_dma.address
-                                                 + d->pgraph.surface_color.offset,
-                                               d->pgraph.surface_color.pitch
-                                                 * d->pgraph.surface_height,
-                                               DIRTY_MEMORY_NV2A)) {
-            /* surface modified (or moved) by the cpu.
-             * copy it into the opengl renderbuffer */
-            assert(!d->pgraph.surface_color.draw_dirty);
-
-            assert(d->pgraph.surface_color.pitch % bytes_per_pixel == 0);
-
-            //glDisable(GL_FRAGMENT_PROGRAM_ARB);
-            glUseProgram(0);
-
-            int rl, pa;
-            glGetIntegerv(GL_UNPACK_ROW_LENGTH, &rl);
-            glGetIntegerv(GL_UNPACK_ALIGNMENT, &pa);
-            glPixelStorei(GL_UNPACK_ROW_LENGTH,
-                          d->pgraph.surface_color.pitch / bytes_per_pixel);
-            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-
-            /* glDrawPixels is crazy deprecated, but there really isn't
-             * an easy alternative */
-
-            glWindowPos2i(0, d->pgraph.surface_height);
-            glPixelZoom(1, -1);
-            glDrawPixels(d->pgraph.surface_width,
-                         d->pgraph.surface_height,
-                         gl_format, gl_type,
-                         color_data + d->pgraph.surface_color.offset);
-            assert(glGetError() == GL_NO_ERROR);
-
-            glPixelStorei(GL_UNPACK_ROW_LENGTH, rl);
-            glPixelStorei(GL_UNPACK_ALIGNMENT, pa);
-
-            uint8_t *out = color_data + d->pgraph.surface_color.offset;
-            NV2A_DPRINTF("upload_surface 0x%llx - 0x%llx, "
-                          "(0x%llx - 0x%llx, %d %d, %d %d, %d) - %x %x %x %x\n",
-                color_dma.address, color_dma.address + color_dma.limit,
-                color_dma.address + d->pgraph.surface_color.offset,
-                color_dma.address + d->pgraph.surface_color.pitch * d->pgraph.surface_height,
-                d->pgraph.surface_x, d->pgraph.surface_y,
-                d->pgraph.surface_width, d->pgraph.surface_height,
-                d->pgraph.surface_color.pitch,
-                out[0], out[1], out[2], out[3]);
-        }
-
-        if (!upload && d->pgraph.surface_color.draw_dirty) {
-            /* read the opengl renderbuffer into the surface */
+    NV2A_GL_CHECK();
+}
 
-            glo_readpixels(gl_format, gl_type,
-                           bytes_per_pixel, d->pgraph.surface_color.pitch,
-                           d->pgraph.surface_width, d->pgraph.surface_height,
-                           color_data + d->pgraph.surface_color.offset);
-            assert(glGetError() == GL_NO_ERROR);
+/* Upload part of a surface on the buffered path: stage the pixels in a
+ * texture and blit them into the framebuffer, flipped. x and y are top
+ * down, like the surface. */
+static void pgraph_blit_surface_upload(PGRAPHState *pg, bool zeta,
+                                       GLbitfield mask,
+                                       unsigned int x, unsigned int y,
+                                       unsigned int width,
+                                       unsigned int height,
+                                       GLenum gl_format, GLenum gl_type,
+                                       const uint8_t *data)
+{
+    GLuint texture = zeta ? pg->gl_upload_zeta_texture
+                          : pg->gl_upload_texture;
+
+    gl_shadow_active_texture(&pg->gl_shadow, 0);
+    gl_shadow_bind_texture(&pg->gl_shadow, GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0,
+                 zeta ? GL_DEPTH24_STENCIL8_EXT : GL_RGBA8,
+                 width, height, 0, gl_format, gl_type, data);
+
+    glBindFramebufferEXT(GL_READ_FRAMEBUFFER_EXT, pg->gl_upload_framebuffer);
+    if (zeta) {
+        glFramebufferTexture2DEXT(GL_READ_FRAMEBUFFER_EXT,
+                                  GL_DEPTH_ATTACHMENT_EXT,
+                                  GL_TEXTURE_2D, texture, 0);
+        glFramebufferTexture2DEXT(GL_READ_FRAMEBUFFER_EXT,
+                                  GL_STENCIL_ATTACHMENT_EXT,
+                                  GL_TEXTURE_2D, texture, 0);
+        glFramebufferTexture2DEXT(GL_READ_FRAMEBUFFER_EXT,
+                                  GL_COLOR_ATTACHMENT0_EXT,
+                                  GL_TEXTURE_2D, 0, 0);
+        glReadBuffer(GL_NONE);
+    } else {
+        glFramebufferTexture2DEXT(GL_READ_FRAMEBUFFER_EXT,
+                                  GL_COLOR_ATTACHMENT0_EXT,
+                                  GL_TEXTURE_2D, texture, 0);
+        glFramebufferTexture2DEXT(GL_READ_FRAMEBUFFER_EXT,
+                                  GL_DEPTH_ATTACHMENT_EXT,
+                                  GL_TEXTURE_2D, 0, 0);
+        glFramebufferTexture2DEXT(GL_READ_FRAMEBUFFER_EXT,
+                                  GL_STENCIL_ATTACHMENT_EXT,
+                                  GL_TEXTURE_2D, 0, 0);
+        glReadBuffer(GL_COLOR_ATTACHMENT0_EXT);
+    }
 
-            memory_region_set_client_dirty(d->vram,
-                                           color_dma.address
-                                                + d->pgraph.surface_color.offset,
-                                           d->pgraph.surface_color.pitch
-                                                * d->pgraph.surface_height,
-                                           DIRTY_MEMORY_VGA);
+    glBlitFramebufferEXT(0, 0, width, height,
+                         x, pg->surface_height - y,
+                         x + width, pg->surface_height - y - height,
+                         mask, GL_NEAREST);
 
-            d->pgraph.surface_color.draw_dirty = false;
+    glBindFramebufferEXT(GL_READ_FRAMEBUFFER_EXT, pg->gl_framebuffer);
+    NV2A_GL_CHECK();
+}
 
-            uint8_t *out = color_data + d->pgraph.surface_color.offset;
-            NV2A_DPRINTF("read_surface 0x%llx - 0x%llx, "
-                          "(0x%llx - 0x%llx, %d %d, %d %d, %d) - %x %x %x %x\n",
-                color_dma.address, color_dma.address + color_dma.limit,
-                color_dma.address + d->pgraph.surface_color.offset,
-                color_dma.address + d->pgraph.surface_color.pitch * d->pgraph.surface_height,
-                d->pgraph.surface_x, d->pgraph.surface_y,
-                d->pgraph.surface_width, d->pgraph.surface_height,
-                d->pgraph.surface_color.pitch,
-                out[0], out[1], out[2], out[3]);
-        }
+/* Load a swizzled colour surface into the renderbuffer: the raw bytes
+ * go up as they are and get unswizzled by the gpu */
+static void pgraph_upload_surface_swizzled(NV2AState *d,
+                                           uint8_t *surface_data)
+{
+    PGRAPHState *pg = &d->pgraph;
+    GLenum gl_format;
+    GLenum gl_type;
+    unsigned int bytes_per_pixel;
 
+    pgraph_get_surface_color_format(pg, &gl_format, &gl_type,
+                                    &bytes_per_pixel);
 
-    }
-}
+    trace_nv2a_pgraph_surface_upload(pg->surface_color.offset, 0, 0,
+                                     pg->surface_width, pg->surface_height);
 
+    int rl, pa;
+    glGetIntegerv(GL_UNPACK_ROW_LENGTH, &rl);
+    glGetIntegerv(GL_UNPACK_ALIGNMENT, &pa);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 
-static void pgraph_init(PGRAPHState *pg)
+    gl_shadow_bind_texture(&pg->gl_shadow, GL_TEXTURE_RECTANGLE_ARB,
+                           pg->gl_swizzle_source);
+    glTexImage2D(GL_TEXTURE_RECTANGLE_ARB, 0, GL_RGBA8,
+                 1 << pg->surface_log_width, 1 << pg->surface_log_height, 0,
+                 gl_format, gl_type, surface_data);
+
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, rl);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, pa);
+
+    pgraph_swizzle_pass(pg, NV2A_SWIZZLE_PASS_UNSWIZZLE,
+                        pg->gl_swizzle_source,
+                        pg->surface_width, pg->surface_height);
+}
+
+/* Surfaces bigger than the 640x480 renderbuffer can't go through the
+ * swizzle pass. Read back what there is and swizzle it on the cpu, like
+ * the zeta surface. */
+static void pgraph_readback_surface_swizzled_cpu(NV2AState *d,
+                                                 uint8_t *surface_data)
+{
+    PGRAPHState *pg = &d->pgraph;
+    GLenum gl_format;
+    GLenum gl_type;
+    unsigned int bytes_per_pixel;
+    unsigned int width = 1 << pg->surface_log_width;
+    unsigned int height = 1 << pg->surface_log_height;
+
+    pgraph_get_surface_color_format(pg, &gl_format, &gl_type,
+                                    &bytes_per_pixel);
+
+    unsigned int pitch = bytes_per_pixel * width;
+    uint8_t *linear_data = g_malloc0(pitch * height);
+
+    glo_readpixels(gl_format, gl_type, bytes_per_pixel, pitch,
+                   MIN(pg->surface_width, width),
+                   MIN(pg->surface_height, height),
+                   linear_data);
+    NV2A_GL_CHECK();
+
+    swizzle_rect(linear_data, width, height, 1,
+                 surface_data, pitch, bytes_per_pixel);
+    g_free(linear_data);
+
+    pg->gl_alias_valid = false;
+}
+
+/* Write the renderbuffer back to a swizzled colour surface. The gpu
+ * does the swizzle, so the result reads straight into vram. */
+static void pgraph_readback_surface_swizzled(NV2AState *d,
+                                             uint8_t *surface_data,
+                                             hwaddr surface_addr)
+{
+    PGRAPHState *pg = &d->pgraph;
+    GLenum gl_format;
+    GLenum gl_type;
+    unsigned int bytes_per_pixel;
+    unsigned int width = 1 << pg->surface_log_width;
+    unsigned int height = 1 << pg->surface_log_height;
+
+    if (width > 640 || pg->surface_height > 480) {
+        trace_nv2a_pgraph_surface_swizzle_cpu(surface_addr, width,
+                                              pg->surface_height);
+        pgraph_readback_surface_swizzled_cpu(d, surface_data);
+        return;
+    }
+
+    pgraph_get_surface_color_format(pg, &gl_format, &gl_type,
+                                    &bytes_per_pixel);
+
+    gl_shadow_bind_texture(&pg->gl_shadow, GL_TEXTURE_RECTANGLE_ARB,
+                           pg->gl_swizzle_source);
+    glCopyTexImage2D(GL_TEXTURE_RECTANGLE_ARB, 0, GL_RGBA8,
+                     0, 0, width, pg->surface_height, 0);
+
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, pg->gl_swizzle_framebuffer);
+
+    gl_shadow_bind_texture(&pg->gl_shadow, GL_TEXTURE_RECTANGLE_ARB,
+                           pg->gl_swizzle_target);
+    glTexImage2D(GL_TEXTURE_RECTANGLE_ARB, 0, GL_RGBA8, width, height, 0,
+                 GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT,
+                              GL_TEXTURE_RECTANGLE_ARB,
+                              pg->gl_swizzle_target, 0);
+    pgraph_swizzle_pass(pg, NV2A_SWIZZLE_PASS_SWIZZLE,
+                        pg->gl_swizzle_source, width, height);
+
+    int rl, pa;
+    glGetIntegerv(GL_PACK_ROW_LENGTH, &rl);
+    glGetIntegerv(GL_PACK_ALIGNMENT, &pa);
+    glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, gl_format, gl_type, surface_data);
+    glPixelStorei(GL_PACK_ROW_LENGTH, rl);
+    glPixelStorei(GL_PACK_ALIGNMENT, pa);
+
+    /* keep the image for textures sampling this surface */
+    gl_shadow_bind_texture(&pg->gl_shadow, GL_TEXTURE_2D,
+                           pg->gl_alias_texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0,
+                 GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT,
+                              GL_TEXTURE_2D, pg->gl_alias_texture, 0);
+    pgraph_swizzle_pass(pg, NV2A_SWIZZLE_PASS_FLIP,
+                        pg->gl_swizzle_source, width, height);
+
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, pg->gl_framebuffer);
+    NV2A_GL_CHECK();
+
+    switch (pg->surface_color.format) {
+    case NV097_SET_SURFACE_FORMAT_COLOR_LE_R5G6B5:
+        pg->gl_alias_color_format = NV097_SET_TEXTURE_FORMAT_COLOR_SZ_R5G6B5;
+        break;
+    case NV097_SET_SURFACE_FORMAT_COLOR_LE_X8R8G8B8_Z8R8G8B8:
+        pg->gl_alias_color_format = NV097_SET_TEXTURE_FORMAT_COLOR_SZ_X8R8G8B8;
+        break;
+    case NV097_SET_SURFACE_FORMAT_COLOR_LE_A8R8G8B8:
+        pg->gl_alias_color_format = NV097_SET_TEXTURE_FORMAT_COLOR_SZ_A8R8G8B8;
+        break;
+    default:
+        assert(false);
+    }
+    pg->gl_alias_valid = true;
+    pg->gl_alias_generation = d->vram_generation;
+    pg->gl_alias_addr = surface_addr;
+    pg->gl_alias_log_width = pg->surface_log_width;
+    pg->gl_alias_log_height = pg->surface_log_height;
+}
+
+/* Copy a rect of the colour surface from vram into the opengl
+ * renderbuffer. x/y are in surface space, top-down. */
+static void pgraph_upload_surface_rect(NV2AState *d, uint8_t *surface_data,
+                                       unsigned int x, unsigned int y,
+                                       unsigned int width,
+                                       unsigned int height)
+{
+    PGRAPHState *pg = &d->pgraph;
+    GLenum gl_format;
+    GLenum gl_type;
+    unsigned int bytes_per_pixel;
+
+    if (width == 0 || height == 0) {
+        return;
+    }
+
+    trace_nv2a_pgraph_surface_upload(pg->surface_color.offset,
+                                     x, y, width, height);
+
+    pgraph_get_surface_color_format(pg, &gl_format, &gl_type,
+                                    &bytes_per_pixel);
+    assert(pg->surface_color.pitch % bytes_per_pixel == 0);
+
+    int rl, pa;
+    glGetIntegerv(GL_UNPACK_ROW_LENGTH, &rl);
+    glGetIntegerv(GL_UNPACK_ALIGNMENT, &pa);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH,
+                  pg->surface_color.pitch / bytes_per_pixel);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    const uint8_t *data = surface_data + y * pg->surface_color.pitch
+                                       + x * bytes_per_pixel;
+    if (pg->gl_buffered) {
+        pgraph_blit_surface_upload(pg, false, GL_COLOR_BUFFER_BIT,
+                                   x, y, width, height,
+                                   gl_format, gl_type, data);
+    } else {
+        //glDisable(GL_FRAGMENT_PROGRAM_ARB);
+        gl_shadow_use_program(&pg->gl_shadow, 0);
+        gl_shadow_enable(&pg->gl_shadow, GL_DEPTH_TEST, false);
+        gl_shadow_enable(&pg->gl_shadow, GL_STENCIL_TEST, false);
+
+        /* glDrawPixels is crazy deprecated, the buffered path stages the
+         * pixels in a texture instead */
+        glWindowPos2i(x, pg->surface_height - y);
+        glPixelZoom(1, -1);
+        glDrawPixels(width, height, gl_format, gl_type, data);
+        NV2A_GL_CHECK();
+    }
+
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, rl);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, pa);
+}
+
+/* Check the colour surface dma object is sane and return a pointer to
+ * the surface in vram */
+static uint8_t *pgraph_map_surface_color(NV2AState *d, DMAObject *color_dma)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    /* There's a bunch of bugs that could cause us to hit this function
+     * at the wrong time and get a invalid dma object.
+     * Check that it's sane. */
+    *color_dma = nv_dma_load(d, pg->dma_color);
+    assert(color_dma->dma_class == NV_DMA_IN_MEMORY_CLASS);
+
+    assert(color_dma->address + pg->surface_color.offset != 0);
+    assert(pg->surface_color.offset <= color_dma->limit);
+    assert(pg->surface_color.offset
+            + pg->surface_color.pitch * pg->surface_height
+                <= color_dma->limit + 1);
+
+    /* TODO */
+    assert(pg->surface_x == 0 && pg->surface_y == 0);
+
+    hwaddr color_len;
+    uint8_t *color_data = nv_dma_map(d, pg->dma_color, &color_len);
+    return color_data + pg->surface_color.offset;
+}
+
+static void pgraph_update_surface_color(NV2AState *d, bool upload)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    if (pg->surface_color.format != 0 && pg->color_mask
+        && (upload || pg->surface_color.draw_dirty)) {
+
+        DMAObject color_dma;
+        uint8_t *surface_data = pgraph_map_surface_color(d, &color_dma);
+        hwaddr surface_addr = color_dma.address + pg->surface_color.offset;
+
+        GLenum gl_format;
+        GLenum gl_type;
+        unsigned int bytes_per_pixel;
+        pgraph_get_surface_color_format(pg, &gl_format, &gl_type,
+                                        &bytes_per_pixel);
+        hwaddr surface_size = pgraph_surface_len(pg, &pg->surface_color,
+                                                 bytes_per_pixel);
+
+        if (upload && vram_test_dirty(d, surface_addr, surface_size,
+                                      &pg->gl_color_generation)) {
+            /* surface modified (or moved) by the cpu.
+             * copy it into the opengl renderbuffer */
+            assert(!pg->surface_color.draw_dirty);
+
+            if (pgraph_surface_swizzled(pg)) {
+                pgraph_upload_surface_swizzled(d, surface_data);
+            } else {
+                pgraph_upload_surface_rect(d, surface_data, 0, 0,
+                                           pg->surface_width,
+                                           pg->surface_height);
+            }
+        }
+
+        if (!upload && pg->surface_color.draw_dirty) {
+            /* read the opengl renderbuffer into the surface */
+            trace_nv2a_pgraph_surface_readback(surface_addr,
+                                               pg->surface_width,
+                                               pg->surface_height,
+                                               pg->surface_color.pitch);
+
+            /* we write vram behind the dirty log's back, so textures
+             * sampling this surface have to be told directly */
+            pgraph_invalidate_textures(d, surface_addr, surface_size);
+
+            if (pgraph_surface_swizzled(pg)) {
+                pgraph_readback_surface_swizzled(d, surface_data,
+                                                 surface_addr);
+            } else {
+                glo_readpixels(gl_format, gl_type,
+                               bytes_per_pixel, pg->surface_color.pitch,
+                               pg->surface_width, pg->surface_height,
+                               surface_data);
+                NV2A_GL_CHECK();
+            }
+
+            memory_region_set_client_dirty(d->vram,
+                                           surface_addr, surface_size,
+                                           DIRTY_MEMORY_VGA);
+
+            pg->surface_color.draw_dirty = false;
+        }
+
+
+    }
+}
+
+static void pgraph_get_surface_zeta_format(PGRAPHState *pg,
+                                           GLenum *gl_format,
+                                           GLenum *gl_type,
+                                           unsigned int *bytes_per_pixel)
+{
+    switch (pg->surface_zeta.format) {
+    case NV097_SET_SURFACE_FORMAT_ZETA_Z16:
+        *bytes_per_pixel = 2;
+        *gl_format = GL_DEPTH_COMPONENT;
+        *gl_type = GL_UNSIGNED_SHORT;
+        break;
+    case NV097_SET_SURFACE_FORMAT_ZETA_Z24S8:
+        /* depth in the top 24 bits and stencil in the bottom 8, the same
+         * as the xbox */
+        *bytes_per_pixel = 4;
+        *gl_format = GL_DEPTH_STENCIL_EXT;
+        *gl_type = GL_UNSIGNED_INT_24_8_EXT;
+        break;
+    default:
+        assert(false);
+    }
+}
+
+/* Float Z24S8 keeps a positive float in the depth bits: a float32 with
+ * the bottom 7 mantissa bits dropped, scaled so the largest one is the
+ * far plane. Float Z16 is taken as fixed point. */
+static bool pgraph_zeta_float(PGRAPHState *pg)
+{
+    return pg->surface_zeta.format == NV097_SET_SURFACE_FORMAT_ZETA_Z24S8
+        && (pg->regs[NV_PGRAPH_SETUPRASTER] & NV_PGRAPH_SETUPRASTER_Z_FORMAT);
+}
+
+#define NV2A_Z24_FLOAT_MAX 3.4027977e38f
+
+static void zeta_float_to_fixed(uint8_t *data, unsigned int pitch,
+                                unsigned int width, unsigned int height)
+{
+    unsigned int x, y;
+    for (y = 0; y < height; y++) {
+        uint32_t *line = (uint32_t *)(data + y * pitch);
+        for (x = 0; x < width; x++) {
+            uint32_t p = le32_to_cpu(line[x]);
+            union { uint32_t i; float f; } z = { .i = (p >> 8) << 7 };
+            double depth = MIN(z.f / NV2A_Z24_FLOAT_MAX, 1.0);
+            uint32_t fixed = depth * 0xFFFFFF;
+            line[x] = cpu_to_le32((fixed << 8) | (p & 0xFF));
+        }
+    }
+}
+
+static void zeta_fixed_to_float(uint8_t *data, unsigned int pitch,
+                                unsigned int width, unsigned int height)
+{
+    unsigned int x, y;
+    for (y = 0; y < height; y++) {
+        uint32_t *line = (uint32_t *)(data + y * pitch);
+        for (x = 0; x < width; x++) {
+            uint32_t p = le32_to_cpu(line[x]);
+            union { uint32_t i; float f; } z;
+            z.f = (p >> 8) / (double)0xFFFFFF * NV2A_Z24_FLOAT_MAX;
+            line[x] = cpu_to_le32(((z.i >> 7) << 8) | (p & 0xFF));
+        }
+    }
+}
+
+/* The zeta surface in vram, or NULL if the zeta dma object doesn't
+ * cover it */
+static uint8_t *pgraph_map_surface_zeta(NV2AState *d, hwaddr *zeta_addr)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    if (pg->dma_zeta == 0) {
+        return NULL;
+    }
+    GLenum gl_format;
+    GLenum gl_type;
+    unsigned int bytes_per_pixel;
+    pgraph_get_surface_zeta_format(pg, &gl_format, &gl_type,
+                                   &bytes_per_pixel);
+
+    DMAObject zeta_dma = nv_dma_load(d, pg->dma_zeta);
+    if (zeta_dma.dma_class != NV_DMA_IN_MEMORY_CLASS
+        || pg->surface_zeta.offset
+            + pgraph_surface_len(pg, &pg->surface_zeta, bytes_per_pixel)
+                > zeta_dma.limit + 1) {
+        return NULL;
+    }
+
+    hwaddr zeta_len;
+    uint8_t *zeta_data = nv_dma_map(d, pg->dma_zeta, &zeta_len);
+    *zeta_addr = zeta_dma.address + pg->surface_zeta.offset;
+    return zeta_data + pg->surface_zeta.offset;
+}
+
+/* Copy the zeta surface from vram into the depth/stencil renderbuffer */
+static void pgraph_upload_surface_zeta(NV2AState *d, uint8_t *zeta_data)
+{
+    PGRAPHState *pg = &d->pgraph;
+    GLenum gl_format;
+    GLenum gl_type;
+    unsigned int bytes_per_pixel;
+
+    pgraph_get_surface_zeta_format(pg, &gl_format, &gl_type,
+                                   &bytes_per_pixel);
+
+    unsigned int pitch = pg->surface_zeta.pitch;
+    uint8_t *converted = NULL;
+    if (pgraph_surface_swizzled(pg)) {
+        /* depth can't go through the colour swizzle program */
+        unsigned int width = 1 << pg->surface_log_width;
+        unsigned int height = 1 << pg->surface_log_height;
+        pitch = width * bytes_per_pixel;
+        converted = g_malloc(pitch * height);
+        unswizzle_rect(zeta_data, width, height, 1,
+                       converted, pitch, bytes_per_pixel);
+        zeta_data = converted;
+    }
+    assert(pitch % bytes_per_pixel == 0);
+
+    if (pgraph_zeta_float(pg)) {
+        if (!converted) {
+            converted = g_malloc(pitch * pg->surface_height);
+            memcpy(converted, zeta_data, pitch * pg->surface_height);
+            zeta_data = converted;
+        }
+        zeta_float_to_fixed(converted, pitch,
+                            pg->surface_width, pg->surface_height);
+    }
+
+    GLbitfield mask = GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT;
+    if (pg->gl_buffered && bytes_per_pixel == 2) {
+        /* a blit needs the same depth format at both ends, so Z16 goes
+         * up widened to 24_8 and only the depth is copied */
+        unsigned int x, y;
+        uint32_t *widened = g_malloc(pg->surface_width * pg->surface_height
+                                        * sizeof(uint32_t));
+        for (y = 0; y < pg->surface_height; y++) {
+            const uint16_t *row = (const uint16_t *)(zeta_data + y * pitch);
+            for (x = 0; x < pg->surface_width; x++) {
+                uint32_t z = row[x];
+                widened[y * pg->surface_width + x] = ((z << 8) | (z >> 8)) << 8;
+            }
+        }
+        g_free(converted);
+        converted = (uint8_t *)widened;
+        zeta_data = converted;
+        bytes_per_pixel = 4;
+        pitch = pg->surface_width * bytes_per_pixel;
+        gl_format = GL_DEPTH_STENCIL_EXT;
+        gl_type = GL_UNSIGNED_INT_24_8_EXT;
+        mask = GL_DEPTH_BUFFER_BIT;
+    }
+
+    int rl, pa;
+    glGetIntegerv(GL_UNPACK_ROW_LENGTH, &rl);
+    glGetIntegerv(GL_UNPACK_ALIGNMENT, &pa);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, pitch / bytes_per_pixel);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    if (pg->gl_buffered) {
+        pgraph_blit_surface_upload(pg, true, mask,
+                                   0, 0, pg->surface_width, pg->surface_height,
+                                   gl_format, gl_type, zeta_data);
+    } else {
+        gl_shadow_use_program(&pg->gl_shadow, 0);
+        gl_shadow_color_mask(&pg->gl_shadow, false, false, false, false);
+        gl_shadow_enable(&pg->gl_shadow, GL_DEPTH_TEST, true);
+        gl_shadow_depth_func(&pg->gl_shadow, GL_ALWAYS);
+        gl_shadow_depth_mask(&pg->gl_shadow, GL_TRUE);
+        gl_shadow_enable(&pg->gl_shadow, GL_STENCIL_TEST, false);
+        gl_shadow_stencil_mask(&pg->gl_shadow, 0xFF);
+
+        glWindowPos2i(0, pg->surface_height);
+        glPixelZoom(1, -1);
+        glDrawPixels(pg->surface_width, pg->surface_height,
+                     gl_format, gl_type, zeta_data);
+        NV2A_GL_CHECK();
+
+        gl_shadow_color_mask(&pg->gl_shadow, true, true, true, true);
+        gl_shadow_enable(&pg->gl_shadow, GL_DEPTH_TEST, false);
+    }
+
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, rl);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, pa);
+
+    g_free(converted);
+}
+
+/* Like the colour surface, the zeta surface lives in the renderbuffer
+ * while it's drawn to and only goes back to vram when something else
+ * needs it there */
+static void pgraph_update_surface_zeta(NV2AState *d, bool upload)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    if (pg->surface_zeta.format == 0
+        || !(upload || pg->surface_zeta.draw_dirty)) {
+        return;
+    }
+
+    hwaddr zeta_addr;
+    uint8_t *zeta_data = pgraph_map_surface_zeta(d, &zeta_addr);
+    if (!zeta_data) {
+        return;
+    }
+
+    GLenum gl_format;
+    GLenum gl_type;
+    unsigned int bytes_per_pixel;
+    pgraph_get_surface_zeta_format(pg, &gl_format, &gl_type,
+                                   &bytes_per_pixel);
+    hwaddr zeta_size = pgraph_surface_len(pg, &pg->surface_zeta,
+                                          bytes_per_pixel);
+
+    if (upload) {
+        bool moved = !pg->gl_zeta_valid
+            || pg->gl_zeta_addr != zeta_addr
+            || pg->gl_zeta_format != pg->surface_zeta.format;
+        /* always test so old writes don't cause a pointless upload
+         * next time */
+        bool dirty = vram_test_dirty(d, zeta_addr, zeta_size,
+                                     &pg->gl_zeta_generation);
+        if (moved || dirty) {
+            assert(!pg->surface_zeta.draw_dirty);
+            trace_nv2a_pgraph_surface_upload(pg->surface_zeta.offset, 0, 0,
+                                             pg->surface_width,
+                                             pg->surface_height);
+            pgraph_upload_surface_zeta(d, zeta_data);
+
+            pg->gl_zeta_valid = true;
+            pg->gl_zeta_addr = zeta_addr;
+            pg->gl_zeta_format = pg->surface_zeta.format;
+        }
+    }
+
+    if (!upload && pg->surface_zeta.draw_dirty) {
+        trace_nv2a_pgraph_surface_readback(zeta_addr,
+                                           pg->surface_width,
+                                           pg->surface_height,
+                                           pg->surface_zeta.pitch);
+
+        unsigned int pitch = pg->surface_zeta.pitch;
+        uint8_t *linear_data = zeta_data;
+        if (pgraph_surface_swizzled(pg)) {
+            pitch = bytes_per_pixel << pg->surface_log_width;
+            linear_data = g_malloc0(zeta_size);
+        }
+
+        glo_readpixels(gl_format, gl_type,
+                       bytes_per_pixel, pitch,
+                       pg->surface_width, pg->surface_height,
+                       linear_data);
+        NV2A_GL_CHECK();
+
+        if (pgraph_zeta_float(pg)) {
+            zeta_fixed_to_float(linear_data, pitch,
+                                pg->surface_width, pg->surface_height);
+        }
+
+        if (linear_data != zeta_data) {
+            swizzle_rect(linear_data, 1 << pg->surface_log_width,
+                         1 << pg->surface_log_height, 1,
+                         zeta_data, pitch, bytes_per_pixel);
+            g_free(linear_data);
+        }
+
+        /* shadow maps sample this */
+        pgraph_invalidate_textures(d, zeta_addr, zeta_size);
+
+        pg->surface_zeta.draw_dirty = false;
+    }
+}
+
+static void pgraph_update_surface(NV2AState *d, bool upload)
+{
+    pgraph_update_surface_color(d, upload);
+    pgraph_update_surface_zeta(d, upload);
+}
+
+/* Whether a draw with the current state can write the zeta surface */
+static bool pgraph_zeta_writable(PGRAPHState *pg)
+{
+    if (pg->surface_zeta.format == 0) {
+        return false;
+    }
+    uint32_t control_0 = pg->regs[NV_PGRAPH_CONTROL_0];
+    uint32_t control_1 = pg->regs[NV_PGRAPH_CONTROL_1];
+    return ((control_0 & NV_PGRAPH_CONTROL_0_ZENABLE)
+            && (control_0 & NV_PGRAPH_CONTROL_0_ZWRITEENABLE))
+        || ((control_1 & NV_PGRAPH_CONTROL_1_STENCIL_TEST_ENABLE)
+            && (control_0 & NV_PGRAPH_CONTROL_0_STENCIL_WRITE_ENABLE));
+}
+
+static void pgraph_bind_zeta_state(PGRAPHState *pg)
+{
+    uint32_t control_0 = pg->regs[NV_PGRAPH_CONTROL_0];
+    uint32_t control_1 = pg->regs[NV_PGRAPH_CONTROL_1];
+    uint32_t control_2 = pg->regs[NV_PGRAPH_CONTROL_2];
+
+    GLShadowState *gls = &pg->gl_shadow;
+
+    if (pg->surface_zeta.format != 0
+        && (control_0 & NV_PGRAPH_CONTROL_0_ZENABLE)) {
+        gl_shadow_enable(gls, GL_DEPTH_TEST, true);
+        gl_shadow_depth_func(gls, GL_NEVER
+                    + GET_MASK(control_0, NV_PGRAPH_CONTROL_0_ZFUNC));
+        gl_shadow_depth_mask(gls,
+                    !!(control_0 & NV_PGRAPH_CONTROL_0_ZWRITEENABLE));
+    } else {
+        gl_shadow_enable(gls, GL_DEPTH_TEST, false);
+    }
+
+    if (pg->surface_zeta.format == NV097_SET_SURFACE_FORMAT_ZETA_Z24S8
+        && (control_1 & NV_PGRAPH_CONTROL_1_STENCIL_TEST_ENABLE)) {
+        unsigned int op_fail = GET_MASK(control_2,
+                                        NV_PGRAPH_CONTROL_2_STENCIL_OP_FAIL);
+        unsigned int op_zfail = GET_MASK(control_2,
+                                         NV_PGRAPH_CONTROL_2_STENCIL_OP_ZFAIL);
+        unsigned int op_zpass = GET_MASK(control_2,
+                                         NV_PGRAPH_CONTROL_2_STENCIL_OP_ZPASS);
+        assert(op_fail < ARRAY_SIZE(kelvin_stencil_op_map));
+        assert(op_zfail < ARRAY_SIZE(kelvin_stencil_op_map));
+        assert(op_zpass < ARRAY_SIZE(kelvin_stencil_op_map));
+
+        gl_shadow_enable(gls, GL_STENCIL_TEST, true);
+        gl_shadow_stencil_func(gls, GL_NEVER
+                        + GET_MASK(control_1,
+                                   NV_PGRAPH_CONTROL_1_STENCIL_FUNC),
+                      GET_MASK(control_1, NV_PGRAPH_CONTROL_1_STENCIL_REF),
+                      GET_MASK(control_1,
+                               NV_PGRAPH_CONTROL_1_STENCIL_MASK_READ));
+        gl_shadow_stencil_op(gls, kelvin_stencil_op_map[op_fail],
+                             kelvin_stencil_op_map[op_zfail],
+                             kelvin_stencil_op_map[op_zpass]);
+        if (control_0 & NV_PGRAPH_CONTROL_0_STENCIL_WRITE_ENABLE) {
+            gl_shadow_stencil_mask(gls, GET_MASK(control_1,
+                                   NV_PGRAPH_CONTROL_1_STENCIL_MASK_WRITE));
+        } else {
+            gl_shadow_stencil_mask(gls, 0);
+        }
+    } else {
+        gl_shadow_enable(gls, GL_STENCIL_TEST, false);
+    }
+}
+
+static unsigned int kelvin_map_stencil_op(uint32_t parameter)
+{
+    switch (parameter) {
+    case NV097_SET_STENCIL_OP_V_KEEP:
+        return NV_PGRAPH_CONTROL_2_STENCIL_OP_V_KEEP;
+    case NV097_SET_STENCIL_OP_V_ZERO:
+        return NV_PGRAPH_CONTROL_2_STENCIL_OP_V_ZERO;
+    case NV097_SET_STENCIL_OP_V_REPLACE:
+        return NV_PGRAPH_CONTROL_2_STENCIL_OP_V_REPLACE;
+    case NV097_SET_STENCIL_OP_V_INCRSAT:
+        return NV_PGRAPH_CONTROL_2_STENCIL_OP_V_INCRSAT;
+    case NV097_SET_STENCIL_OP_V_DECRSAT:
+        return NV_PGRAPH_CONTROL_2_STENCIL_OP_V_DECRSAT;
+    case NV097_SET_STENCIL_OP_V_INVERT:
+        return NV_PGRAPH_CONTROL_2_STENCIL_OP_V_INVERT;
+    case NV097_SET_STENCIL_OP_V_INCR:
+        return NV_PGRAPH_CONTROL_2_STENCIL_OP_V_INCR;
+    case NV097_SET_STENCIL_OP_V_DECR:
+        return NV_PGRAPH_CONTROL_2_STENCIL_OP_V_DECR;
+    default:
+        assert(false);
+        return 0;
+    }
+}
+
+/* Before a colour clear of the given rect (surface space, exclusive max):
+ * anything the cpu wrote inside the rect is about to be overwritten, so
+ * only the part of the surface outside it needs uploading. */
+static void pgraph_update_surface_for_clear(NV2AState *d,
+                                            unsigned int xmin,
+                                            unsigned int ymin,
+                                            unsigned int xmax,
+                                            unsigned int ymax)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    if (pg->surface_color.format == 0 || !pg->color_mask) {
+        return;
+    }
+
+    if (pgraph_surface_swizzled(pg)) {
+        /* swizzled uploads are all or nothing */
+        pgraph_update_surface_color(d, true);
+        return;
+    }
+
+    DMAObject color_dma;
+    uint8_t *surface_data = pgraph_map_surface_color(d, &color_dma);
+
+    if (!vram_test_dirty(d, color_dma.address + pg->surface_color.offset,
+                         pg->surface_color.pitch * pg->surface_height,
+                         &pg->gl_color_generation)) {
+        return;
+    }
+    assert(!pg->surface_color.draw_dirty);
+
+    xmax = MIN(xmax, pg->surface_width);
+    ymax = MIN(ymax, pg->surface_height);
+    if (xmin >= xmax || ymin >= ymax) {
+        /* nothing covered */
+        xmin = xmax = ymin = ymax = 0;
+    }
+
+    /* bands above and below the cleared rect, then left and right of it */
+    pgraph_upload_surface_rect(d, surface_data,
+                               0, 0, pg->surface_width, ymin);
+    pgraph_upload_surface_rect(d, surface_data,
+                               0, ymax, pg->surface_width,
+                               pg->surface_height - ymax);
+    pgraph_upload_surface_rect(d, surface_data,
+                               0, ymin, xmin, ymax - ymin);
+    pgraph_upload_surface_rect(d, surface_data,
+                               xmax, ymin, pg->surface_width - xmax,
+                               ymax - ymin);
+}
+
+static unsigned int nv062_bytes_per_pixel(unsigned int color_format)
+{
+    switch (color_format) {
+    case NV062_SET_COLOR_FORMAT_LE_Y8:
+        return 1;
+    case NV062_SET_COLOR_FORMAT_LE_X1R5G5B5_Z1R5G5B5:
+    case NV062_SET_COLOR_FORMAT_LE_X1R5G5B5_O1R5G5B5:
+    case NV062_SET_COLOR_FORMAT_LE_R5G6B5:
+    case NV062_SET_COLOR_FORMAT_LE_Y16:
+        return 2;
+    case NV062_SET_COLOR_FORMAT_LE_X8R8G8B8_Z8R8G8B8:
+    case NV062_SET_COLOR_FORMAT_LE_X8R8G8B8_O8R8G8B8:
+    case NV062_SET_COLOR_FORMAT_LE_X1A7R8G8B8_Z1A7R8G8B8:
+    case NV062_SET_COLOR_FORMAT_LE_X1A7R8G8B8_O1A7R8G8B8:
+    case NV062_SET_COLOR_FORMAT_LE_A8R8G8B8:
+    case NV062_SET_COLOR_FORMAT_LE_Y32:
+        return 4;
+    default:
+        assert(false);
+        return 0;
+    }
+}
+
+/* Copy a rectangle between (possibly overlapping) pitched images.
+ * Rows are walked backwards when the destination is below the source
+ * so overlapping scrolls work, each row is a single memmove. */
+static void blit_rect(uint8_t *source, unsigned int source_pitch,
+                      uint8_t *dest, unsigned int dest_pitch,
+                      unsigned int row_bytes, unsigned int height)
+{
+    int y;
+
+    if (source_pitch == dest_pitch && source_pitch == row_bytes) {
+        memmove(dest, source, row_bytes * height);
+        return;
+    }
+
+    if (dest > source) {
+        for (y = height - 1; y >= 0; y--) {
+            memmove(dest + y * dest_pitch, source + y * source_pitch,
+                    row_bytes);
+        }
+    } else {
+        for (y = 0; y < height; y++) {
+            memmove(dest + y * dest_pitch, source + y * source_pitch,
+                    row_bytes);
+        }
+    }
+}
+
+/* The vram range covered by the current colour surface, or false if
+ * there is no colour surface bound. */
+static bool pgraph_color_surface_range(NV2AState *d,
+                                       hwaddr *start, hwaddr *len)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    if (pg->surface_color.format == 0 || pg->dma_color == 0) {
+        return false;
+    }
+
+    GLenum gl_format;
+    GLenum gl_type;
+    unsigned int bytes_per_pixel;
+    pgraph_get_surface_color_format(pg, &gl_format, &gl_type,
+                                    &bytes_per_pixel);
+
+    DMAObject color_dma = nv_dma_load(d, pg->dma_color);
+    *start = color_dma.address + pg->surface_color.offset;
+    *len = pgraph_surface_len(pg, &pg->surface_color, bytes_per_pixel);
+    return true;
+}
+
+/* Whether host rendering into the current colour surface can be skipped
+ * for this frame. */
+static bool pgraph_skip_draw(NV2AState *d)
+{
+    PGRAPHState *pg = &d->pgraph;
+    hwaddr surface_start, surface_len;
+    int i;
+
+    if (!pg->skip_frame || atomic_read(&pg->frameskip) <= 1) {
+        return false;
+    }
+    if (!pgraph_color_surface_range(d, &surface_start, &surface_len)) {
+        return false;
+    }
+    for (i = 0; i < NV2A_SCANOUT_HISTORY; i++) {
+        if (atomic_read(&pg->scanout_surfaces[i]) == surface_start) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Start counting the samples a draw passes, if zpass counting is on */
+static void pgraph_begin_zpass_query(NV2AState *d, bool skipped)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    if (!pg->zpass_pixel_count_enable) {
+        return;
+    }
+    if (skipped) {
+        pg->zpass_skipped = true;
+        return;
+    }
+
+    if (pg->gl_zpass_query) {
+        /* a begin without an end. Nothing has been drawn since the open
+         * query started, so let it count this draw too */
+        trace_nv2a_pgraph_zpass_query_open(pg->gl_zpass_query);
+        return;
+    }
+    glGenQueries(1, &pg->gl_zpass_query);
+    glBeginQuery(GL_SAMPLES_PASSED, pg->gl_zpass_query);
+}
+
+static void pgraph_end_zpass_query(NV2AState *d)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    if (!pg->gl_zpass_query) {
+        return;
+    }
+
+    glEndQuery(GL_SAMPLES_PASSED);
+    if (pg->zpass_query_count == pg->zpass_query_capacity) {
+        pg->zpass_query_capacity = MAX(16, pg->zpass_query_capacity * 2);
+        pg->gl_zpass_queries = g_renew(GLuint, pg->gl_zpass_queries,
+                                       pg->zpass_query_capacity);
+    }
+    pg->gl_zpass_queries[pg->zpass_query_count++] = pg->gl_zpass_query;
+    pg->gl_zpass_query = 0;
+}
+
+/* Forget the queries not yet handed to a report */
+static void pgraph_clear_zpass_queries(PGRAPHState *pg)
+{
+    glDeleteQueries(pg->zpass_query_count, pg->gl_zpass_queries);
+    pg->zpass_query_count = 0;
+    pg->zpass_skipped = false;
+    pg->zpass_cleared = true;
+}
+
+static void pgraph_write_report(NV2AState *d, const PendingReport *report,
+                                uint32_t value)
+{
+    hwaddr report_dma_len;
+    uint8_t *report_data = nv_dma_map(d, report->dma_report,
+                                      &report_dma_len);
+    if (report->offset + 16 > report_dma_len) {
+        /* the guest's report dma object doesn't reach that far */
+        trace_nv2a_pgraph_report_dropped(report->offset, report_dma_len);
+        return;
+    }
+    report_data += report->offset;
+
+    stq_le_p(report_data, report->timestamp);
+    stl_le_p(report_data + 8, value);
+    stl_le_p(report_data + 12, 0);
+}
+
+static void pgraph_drop_report(PGRAPHState *pg)
+{
+    PendingReport *report = QSIMPLEQ_FIRST(&pg->pending_reports);
+
+    QSIMPLEQ_REMOVE_HEAD(&pg->pending_reports, entry);
+    glDeleteQueries(report->num_queries, report->gl_queries);
+    g_free(report->gl_queries);
+    g_free(report);
+}
+
+/* Throw away the queries of the guest from before a snapshot load. The
+ * count and flags they would have fed into were loaded with the rest. */
+static void pgraph_drop_stale_reports(PGRAPHState *pg)
+{
+    while (!QSIMPLEQ_EMPTY(&pg->pending_reports)) {
+        pgraph_drop_report(pg);
+    }
+    if (pg->gl_zpass_query) {
+        glEndQuery(GL_SAMPLES_PASSED);
+        glDeleteQueries(1, &pg->gl_zpass_query);
+        pg->gl_zpass_query = 0;
+    }
+    glDeleteQueries(pg->zpass_query_count, pg->gl_zpass_queries);
+    pg->zpass_query_count = 0;
+    pg->reports_stale = false;
+}
+
+/* Write back the pending reports whose queries have finished, in order.
+ * With wait, block until they all have. */
+static void pgraph_process_reports(NV2AState *d, bool wait)
+{
+    PGRAPHState *pg = &d->pgraph;
+    PendingReport *report;
+    int i;
+
+    if (pg->reports_stale) {
+        pgraph_drop_stale_reports(pg);
+        return;
+    }
+
+    while ((report = QSIMPLEQ_FIRST(&pg->pending_reports))) {
+        if (!wait && report->num_queries) {
+            /* queries finish in order, the last one is enough */
+            GLuint available = GL_FALSE;
+            glGetQueryObjectuiv(report->gl_queries[report->num_queries - 1],
+                                GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available) {
+                break;
+            }
+        }
+
+        uint32_t count = report->cleared ? 0 : pg->zpass_count;
+        for (i = 0; i < report->num_queries; i++) {
+            GLuint samples;
+            glGetQueryObjectuiv(report->gl_queries[i],
+                                GL_QUERY_RESULT, &samples);
+            count += samples;
+        }
+        pg->zpass_count = count;
+
+        trace_nv2a_pgraph_report(report->offset, count, report->skipped);
+        /* frameskip left draws uncounted, call it all visible rather than
+         * have the title cull it */
+        pgraph_write_report(d, report, report->skipped
+            ? pg->surface_width * pg->surface_height : count);
+
+        pgraph_drop_report(pg);
+    }
+}
+
+
+static void pgraph_get_report(NV2AState *d, uint32_t parameter)
+{
+    PGRAPHState *pg = &d->pgraph;
+    PendingReport *report;
+
+    if (GET_MASK(parameter, NV097_GET_REPORT_TYPE)
+            != NV097_GET_REPORT_TYPE_ZPASS_PIXEL_CNT) {
+        return;
+    }
+
+    report = g_new0(PendingReport, 1);
+    report->dma_report = pg->dma_report;
+    report->offset = GET_MASK(parameter, NV097_GET_REPORT_OFFSET);
+    report->timestamp = ptimer_get_clock(d);
+    report->cleared = pg->zpass_cleared;
+    report->skipped = pg->zpass_skipped;
+    report->num_queries = pg->zpass_query_count;
+    report->gl_queries = g_memdup(pg->gl_zpass_queries,
+                                  pg->zpass_query_count * sizeof(GLuint));
+    QSIMPLEQ_INSERT_TAIL(&pg->pending_reports, report, entry);
+
+    /* later reports count on from this one */
+    pg->zpass_query_count = 0;
+    pg->zpass_cleared = false;
+    pg->zpass_skipped = false;
+
+    pgraph_process_reports(d, false);
+}
+
+/* Try to do a blit that's entirely within the colour surface on the
+ * gpu, without reading the surface back. */
+static bool pgraph_image_blit_gl(NV2AState *d, ImageBlitState *image_blit,
+                                 ContextSurfaces2DState *context_surfaces,
+                                 hwaddr source_addr, hwaddr dest_addr,
+                                 unsigned int bytes_per_pixel)
+{
+    PGRAPHState *pg = &d->pgraph;
+    hwaddr surface_start, surface_len;
+
+    if (!pg->gl_framebuffer_blit || !pg->surface_color.draw_dirty
+        || pgraph_surface_swizzled(pg)) {
+        return false;
+    }
+    if (!pgraph_color_surface_range(d, &surface_start, &surface_len)) {
+        return false;
+    }
+
+    /* both sides have to alias the colour surface exactly */
+    if (source_addr != surface_start || dest_addr != surface_start
+        || context_surfaces->source_pitch != pg->surface_color.pitch
+        || context_surfaces->dest_pitch != pg->surface_color.pitch) {
+        return false;
+    }
+
+    unsigned int surface_bpp;
+    switch (pg->surface_color.format) {
+    case NV097_SET_SURFACE_FORMAT_COLOR_LE_R5G6B5:
+        surface_bpp = 2;
+        break;
+    case NV097_SET_SURFACE_FORMAT_COLOR_LE_X8R8G8B8_Z8R8G8B8:
+    case NV097_SET_SURFACE_FORMAT_COLOR_LE_A8R8G8B8:
+        surface_bpp = 4;
+        break;
+    default:
+        return false;
+    }
+    if (surface_bpp != bytes_per_pixel) {
+        return false;
+    }
+
+    if (image_blit->in_x + image_blit->width > pg->surface_width
+        || image_blit->out_x + image_blit->width > pg->surface_width
+        || image_blit->in_y + image_blit->height > pg->surface_height
+        || image_blit->out_y + image_blit->height > pg->surface_height) {
+        return false;
+    }
+
+    /* self-blits with overlapping rects are undefined in GL */
+    if (image_blit->in_x < image_blit->out_x + image_blit->width
+        && image_blit->out_x < image_blit->in_x + image_blit->width
+        && image_blit->in_y < image_blit->out_y + image_blit->height
+        && image_blit->out_y < image_blit->in_y + image_blit->height) {
+        return false;
+    }
+
+    /* gl rows are bottom-up */
+    GLint src_y = pg->surface_height - image_blit->in_y - image_blit->height;
+    GLint dst_y = pg->surface_height - image_blit->out_y - image_blit->height;
+
+    glBindFramebufferEXT(GL_READ_FRAMEBUFFER_EXT, pg->gl_framebuffer);
+    glBindFramebufferEXT(GL_DRAW_FRAMEBUFFER_EXT, pg->gl_framebuffer);
+    glBlitFramebufferEXT(image_blit->in_x, src_y,
+                         image_blit->in_x + image_blit->width,
+                         src_y + image_blit->height,
+                         image_blit->out_x, dst_y,
+                         image_blit->out_x + image_blit->width,
+                         dst_y + image_blit->height,
+                         GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, pg->gl_framebuffer);
+    NV2A_GL_CHECK();
+
+    return true;
+}
+
+static void pgraph_image_blit(NV2AState *d, ImageBlitState *image_blit)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    GraphicsObject *context_surfaces_obj =
+        lookup_graphics_object(pg, image_blit->context_surfaces);
+    assert(context_surfaces_obj);
+    assert(context_surfaces_obj->graphics_class
+        == NV_CONTEXT_SURFACES_2D);
+
+    ContextSurfaces2DState *context_surfaces =
+        &context_surfaces_obj->data.context_surfaces_2d;
+
+    unsigned int bytes_per_pixel =
+        nv062_bytes_per_pixel(context_surfaces->color_format);
+
+    DMAObject source_dma = nv_dma_load(d, context_surfaces->dma_image_source);
+    DMAObject dest_dma = nv_dma_load(d, context_surfaces->dma_image_dest);
+    hwaddr source_addr = source_dma.address + context_surfaces->source_offset;
+    hwaddr dest_addr = dest_dma.address + context_surfaces->dest_offset;
+
+    if (pgraph_image_blit_gl(d, image_blit, context_surfaces,
+                             source_addr, dest_addr, bytes_per_pixel)) {
+        return;
+    }
+
+    /* cpu path. The colour surface may be more up to date in gl than in
+     * vram; flush it if either side of the blit touches it. */
+    hwaddr source_start = source_addr
+        + image_blit->in_y * context_surfaces->source_pitch;
+    hwaddr dest_start = dest_addr
+        + image_blit->out_y * context_surfaces->dest_pitch;
+    hwaddr source_len = image_blit->height * context_surfaces->source_pitch;
+    hwaddr dest_len = image_blit->height * context_surfaces->dest_pitch;
+
+    hwaddr surface_start, surface_len;
+    if (pgraph_color_surface_range(d, &surface_start, &surface_len)) {
+        if (ranges_overlap(dest_start, dest_len, surface_start, surface_len)
+            || ranges_overlap(source_start, source_len,
+                              surface_start, surface_len)) {
+            pgraph_update_surface(d, false);
+        }
+    }
+
+    hwaddr source_dma_len, dest_dma_len;
+    uint8_t *source, *dest;
+
+    source = nv_dma_map(d, context_surfaces->dma_image_source,
+                        &source_dma_len);
+    assert(context_surfaces->source_offset < source_dma_len);
+    source += context_surfaces->source_offset;
+
+    dest = nv_dma_map(d, context_surfaces->dma_image_dest,
+                      &dest_dma_len);
+    assert(context_surfaces->dest_offset < dest_dma_len);
+    dest += context_surfaces->dest_offset;
+
+    blit_rect(source
+                + image_blit->in_y * context_surfaces->source_pitch
+                + image_blit->in_x * bytes_per_pixel,
+              context_surfaces->source_pitch,
+              dest
+                + image_blit->out_y * context_surfaces->dest_pitch
+                + image_blit->out_x * bytes_per_pixel,
+              context_surfaces->dest_pitch,
+              image_blit->width * bytes_per_pixel,
+              image_blit->height);
+
+    /* let the display and the next surface upload see the new data */
+    memory_region_set_dirty(d->vram, dest_start, dest_len);
+}
+
+/* Converts colour surfaces between swizzled and linear layout on the
+ * gpu. texel (x, y) of a swizzled image is at index swizzle(x, y), the
+ * low bits of which alternate between x and y until one runs out.
+ * Swizzling draws into a size-shaped image that's read back in order,
+ * so fragment (x, y) is index y * width + x. */
+static const char *swizzle_fragment_shader_code =
+"#extension GL_ARB_texture_rectangle : require\n"
+"uniform sampler2DRect source;\n"
+"uniform int mode;\n"
+"uniform vec2 size;\n"
+"uniform float surface_height;\n"
+"\n"
+"float swizzle(vec2 pos) {\n"
+"    float index = 0.0;\n"
+"    float out_bit = 1.0;\n"
+"    vec2 bit = vec2(1.0);\n"
+"    for (int i = 0; i < 12; i++) {\n"
+"        if (bit.x < size.x) {\n"
+"            index += out_bit * mod(pos.x, 2.0);\n"
+"            pos.x = floor(pos.x / 2.0);\n"
+"            bit.x *= 2.0;\n"
+"            out_bit *= 2.0;\n"
+"        }\n"
+"        if (bit.y < size.y) {\n"
+"            index += out_bit * mod(pos.y, 2.0);\n"
+"            pos.y = floor(pos.y / 2.0);\n"
+"            bit.y *= 2.0;\n"
+"            out_bit *= 2.0;\n"
+"        }\n"
+"    }\n"
+"    return index;\n"
+"}\n"
+"\n"
+"vec2 unswizzle(float index) {\n"
+"    vec2 pos = vec2(0.0);\n"
+"    vec2 bit = vec2(1.0);\n"
+"    for (int i = 0; i < 12; i++) {\n"
+"        if (bit.x < size.x) {\n"
+"            pos.x += bit.x * mod(index, 2.0);\n"
+"            index = floor(index / 2.0);\n"
+"            bit.x *= 2.0;\n"
+"        }\n"
+"        if (bit.y < size.y) {\n"
+"            pos.y += bit.y * mod(index, 2.0);\n"
+"            index = floor(index / 2.0);\n"
+"            bit.y *= 2.0;\n"
+"        }\n"
+"    }\n"
+"    return pos;\n"
+"}\n"
+"\n"
+"void main() {\n"
+"    vec2 frag = floor(gl_FragCoord.xy);\n"
+"    vec2 texel;\n"
+"    if (mode == 0) {\n"
+/* NV2A_SWIZZLE_PASS_SWIZZLE: the source is the surface, bottom-up */
+"        vec2 pos = unswizzle(frag.y * size.x + frag.x);\n"
+"        texel = vec2(pos.x, surface_height - 1.0 - pos.y);\n"
+"    } else if (mode == 1) {\n"
+/* NV2A_SWIZZLE_PASS_UNSWIZZLE: the source is the raw swizzled bytes */
+"        float index = swizzle(vec2(frag.x, surface_height - 1.0 - frag.y));\n"
+"        texel = vec2(mod(index, size.x), floor(index / size.x));\n"
+"    } else {\n"
+/* NV2A_SWIZZLE_PASS_FLIP: the surface, top-down */
+"        texel = vec2(frag.x, surface_height - 1.0 - frag.y);\n"
+"    }\n"
+"    gl_FragColor = texture2DRect(source, texel + 0.5);\n"
+"}\n";
+
+/* the pass is a single quad drawn from attribute 0 */
+static const char *swizzle_vertex_shader_code =
+"#version 110\n"
+"attribute vec2 position;\n"
+"void main() {\n"
+"    gl_Position = vec4(position, 0.0, 1.0);\n"
+"}\n";
+
+static const GLfloat swizzle_quad[] = {
+    -1.0f, -1.0f,
+     1.0f, -1.0f,
+     1.0f,  1.0f,
+    -1.0f,  1.0f,
+};
+
+static GLuint pgraph_compile_swizzle_shader(GLenum type, const char *code)
+{
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &code, 0);
+    glCompileShader(shader);
+
+    GLint compiled = 0;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+    if (!compiled) {
+        GLchar log[1024];
+        glGetShaderInfoLog(shader, 1024, NULL, log);
+        fprintf(stderr, "nv2a: swizzle shader compilation failed: %s\n",
+                log);
+        abort();
+    }
+    return shader;
+}
+
+static void pgraph_init_swizzle(PGRAPHState *pg)
+{
+    GLuint program = glCreateProgram();
+    GLuint vertex_shader = pgraph_compile_swizzle_shader(GL_VERTEX_SHADER,
+        swizzle_vertex_shader_code);
+    GLuint fragment_shader = pgraph_compile_swizzle_shader(GL_FRAGMENT_SHADER,
+        swizzle_fragment_shader_code);
+    glAttachShader(program, vertex_shader);
+    glAttachShader(program, fragment_shader);
+    glBindAttribLocation(program, 0, "position");
+
+    glLinkProgram(program);
+    GLint linked = 0;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    if (!linked) {
+        GLchar log[1024];
+        glGetProgramInfoLog(program, 1024, NULL, log);
+        fprintf(stderr, "nv2a: swizzle shader linking failed: %s\n", log);
+        abort();
+    }
+    glDeleteShader(vertex_shader);
+    glDeleteShader(fragment_shader);
+
+    pg->gl_swizzle_program = program;
+    pg->gl_swizzle_mode_location = glGetUniformLocation(program, "mode");
+    pg->gl_swizzle_size_location = glGetUniformLocation(program, "size");
+    pg->gl_swizzle_surface_height_location =
+        glGetUniformLocation(program, "surface_height");
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "source"), 0);
+    glUseProgram(0);
+
+    glGenFramebuffersEXT(1, &pg->gl_swizzle_framebuffer);
+
+    glGenBuffers(1, &pg->gl_swizzle_quad);
+    glBindBuffer(GL_ARRAY_BUFFER, pg->gl_swizzle_quad);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(swizzle_quad), swizzle_quad,
+                 GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    glGenTextures(1, &pg->gl_swizzle_source);
+    glGenTextures(1, &pg->gl_swizzle_target);
+    glGenTextures(1, &pg->gl_alias_texture);
+
+    GLuint rect_textures[] = { pg->gl_swizzle_source, pg->gl_swizzle_target };
+    int i;
+    for (i = 0; i < ARRAY_SIZE(rect_textures); i++) {
+        glBindTexture(GL_TEXTURE_RECTANGLE_ARB, rect_textures[i]);
+        glTexParameteri(GL_TEXTURE_RECTANGLE_ARB,
+                        GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_RECTANGLE_ARB,
+                        GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    }
+    glBindTexture(GL_TEXTURE_RECTANGLE_ARB, 0);
+
+    glBindTexture(GL_TEXTURE_2D, pg->gl_alias_texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    NV2A_GL_CHECK();
+}
+
+/* Move between the legacy and buffered paths. Every array is disabled in the
+ * vertex array object being left, so the shadow state is right for the
+ * other one too. */
+static void pgraph_set_gl_buffered(PGRAPHState *pg, bool buffered)
+{
+    int i;
+
+    if (buffered == pg->gl_buffered) {
+        return;
+    }
+    assert(!buffered || pg->gl_buffered_supported);
+
+    for (i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
+        gl_shadow_vertex_attrib_array(&pg->gl_shadow, i, false);
+    }
+    glBindVertexArray(buffered ? pg->gl_vertex_array : 0);
+    pg->gl_buffered = buffered;
+}
+
+static void frame_dump_write_y4m(FrameDump *dump, DumpedFrame *frame)
+{
+    unsigned int x, y;
+    size_t plane_size;
+    uint8_t *py, *pu, *pv;
+
+    if (!dump->stream_width) {
+        /* the frame rate in mHz, over one in every interval frames */
+        uint64_t rate_num = muldiv64(1000, get_ticks_per_sec(),
+                                     frame->vblank_period);
+        uint64_t rate_den = 1000 * (uint64_t)dump->interval;
+        uint64_t a = rate_num, b = rate_den;
+        while (b) {
+            uint64_t t = a % b;
+            a = b;
+            b = t;
+        }
+
+        dump->stream_width = frame->width;
+        dump->stream_height = frame->height;
+        dump->planes = g_malloc(frame->width * frame->height * 3);
+        fprintf(dump->file, "YUV4MPEG2 W%u H%u F%" PRIu64 ":%" PRIu64
+                " Ip A1:1 C444\n", frame->width, frame->height,
+                rate_num / a, rate_den / a);
+    }
+    if (frame->width != dump->stream_width
+        || frame->height != dump->stream_height) {
+        trace_nv2a_pgraph_frame_dump_dropped(frame->frame, "size changed");
+        return;
+    }
+
+    /* bt.601, studio swing */
+    plane_size = frame->width * frame->height;
+    py = dump->planes;
+    pu = py + plane_size;
+    pv = pu + plane_size;
+    for (y = 0; y < frame->height; y++) {
+        const uint8_t *in = frame->data
+                             + (frame->height - 1 - y) * frame->width * 4;
+        for (x = 0; x < frame->width; x++, in += 4) {
+            int b = in[0], g = in[1], r = in[2];
+            *py++ = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+            *pu++ = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+            *pv++ = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+        }
+    }
+
+    fputs("FRAME\n", dump->file);
+    fwrite(dump->planes, plane_size, 3, dump->file);
+}
+
+static void frame_dump_write_raw(FrameDump *dump, DumpedFrame *frame)
+{
+    unsigned int y;
+    size_t row = frame->width * 4;
+
+    for (y = frame->height; y > 0; y--) {
+        fwrite(frame->data + (y - 1) * row, row, 1, dump->file);
+    }
+}
+
+static void *frame_dump_thread(void *opaque)
+{
+    FrameDump *dump = opaque;
+    DumpedFrame *frame;
+
+    qemu_mutex_lock(&dump->lock);
+    while (true) {
+        frame = QSIMPLEQ_FIRST(&dump->queue);
+        if (!frame) {
+            if (dump->exit) {
+                break;
+            }
+            qemu_cond_wait(&dump->cond, &dump->lock);
+            continue;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&dump->queue, entry);
+        dump->queued--;
+        qemu_mutex_unlock(&dump->lock);
+
+        if (!ferror(dump->file)) {
+            if (dump->y4m) {
+                frame_dump_write_y4m(dump, frame);
+            } else {
+                frame_dump_write_raw(dump, frame);
+            }
+            fflush(dump->file);
+            if (ferror(dump->file)) {
+                fprintf(stderr, "nv2a: writing frame dump %s failed, "
+                                "no more frames will be written\n",
+                        dump->path);
+            }
+        }
+        g_free(frame->data);
+        g_free(frame);
+
+        qemu_mutex_lock(&dump->lock);
+    }
+    qemu_mutex_unlock(&dump->lock);
+
+    return NULL;
+}
+
+static void frame_dump_init(FrameDump *dump, bool pixel_buffer_object)
+{
+    if (!dump->path) {
+        return;
+    }
+
+    dump->file = fopen(dump->path, "wb");
+    if (!dump->file) {
+        fprintf(stderr, "nv2a: can't open frame dump %s: %s\n",
+                dump->path, strerror(errno));
+        return;
+    }
+    dump->y4m = g_str_has_suffix(dump->path, ".y4m");
+    if (!dump->interval) {
+        dump->interval = 1;
+    }
+
+    if (pixel_buffer_object) {
+        glGenBuffers(NV2A_FRAME_DUMP_BUFFERS, dump->gl_buffers);
+    }
+
+    qemu_mutex_init(&dump->lock);
+    qemu_cond_init(&dump->cond);
+    QSIMPLEQ_INIT(&dump->queue);
+    qemu_thread_create(&dump->thread, frame_dump_thread, dump,
+                       QEMU_THREAD_JOINABLE);
+    dump->enabled = true;
+}
+
+static void frame_dump_queue(FrameDump *dump, DumpedFrame *frame)
+{
+    qemu_mutex_lock(&dump->lock);
+    if (dump->queued >= NV2A_FRAME_DUMP_QUEUE) {
+        qemu_mutex_unlock(&dump->lock);
+        trace_nv2a_pgraph_frame_dump_dropped(frame->frame, "writer behind");
+        g_free(frame->data);
+        g_free(frame);
+        return;
+    }
+    QSIMPLEQ_INSERT_TAIL(&dump->queue, frame, entry);
+    dump->queued++;
+    qemu_cond_signal(&dump->cond);
+    qemu_mutex_unlock(&dump->lock);
+}
+
+/* Hand the frame read back into one of the pixel buffers to the writer */
+static void frame_dump_collect(FrameDump *dump, unsigned int index)
+{
+    DumpedFrame *frame = dump->readback[index];
+    size_t size;
+
+    if (!frame) {
+        return;
+    }
+    dump->readback[index] = NULL;
+
+    size = frame->width * frame->height * 4;
+    frame->data = g_malloc(size);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER_ARB, dump->gl_buffers[index]);
+    const uint8_t *mapped = glMapBuffer(GL_PIXEL_PACK_BUFFER_ARB,
+                                        GL_READ_ONLY);
+    assert(mapped);
+    memcpy(frame->data, mapped, size);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER_ARB);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER_ARB, 0);
+
+    frame_dump_queue(dump, frame);
+}
+
+/* Called at the flip with the colour surface of the frame that's ending
+ * bound for reading */
+static void frame_dump_capture(PGRAPHState *pg, int64_t vblank_period)
+{
+    FrameDump *dump = &pg->frame_dump;
+    unsigned int index;
+
+    if (!dump->enabled || pg->frame_count % dump->interval != 0) {
+        return;
+    }
+    /* nothing was drawn, the surface holds some earlier frame */
+    if (pg->skip_frame) {
+        trace_nv2a_pgraph_frame_dump_dropped(pg->frame_count, "skipped");
+        return;
+    }
+    if (pg->surface_color.format == 0
+        || !pg->surface_width || !pg->surface_height) {
+        return;
+    }
+
+    DumpedFrame *frame = g_new0(DumpedFrame, 1);
+    frame->frame = pg->frame_count;
+    frame->width = pg->surface_width;
+    frame->height = pg->surface_height;
+    frame->vblank_period = vblank_period;
+    size_t size = frame->width * frame->height * 4;
+
+    trace_nv2a_pgraph_frame_dump(frame->frame, frame->width, frame->height);
+
+    glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+
+    if (!dump->gl_buffers[0]) {
+        /* no pixel buffers, read back synchronously */
+        frame->data = g_malloc(size);
+        glReadPixels(0, 0, frame->width, frame->height,
+                     GL_BGRA, GL_UNSIGNED_BYTE, frame->data);
+        frame_dump_queue(dump, frame);
+        return;
+    }
+
+    index = dump->readback_index++ % NV2A_FRAME_DUMP_BUFFERS;
+    frame_dump_collect(dump, index);
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER_ARB, dump->gl_buffers[index]);
+    glBufferData(GL_PIXEL_PACK_BUFFER_ARB, size, NULL, GL_STREAM_READ);
+    glReadPixels(0, 0, frame->width, frame->height,
+                 GL_BGRA, GL_UNSIGNED_BYTE, NULL);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER_ARB, 0);
+    dump->readback[index] = frame;
+
+    NV2A_GL_CHECK();
+}
+
+static void frame_dump_destroy(FrameDump *dump)
+{
+    unsigned int i;
+
+    if (!dump->enabled) {
+        return;
+    }
+
+    /* whatever is still in the pixel buffers, oldest first */
+    for (i = 0; i < NV2A_FRAME_DUMP_BUFFERS; i++) {
+        frame_dump_collect(dump, (dump->readback_index + i)
+                                    % NV2A_FRAME_DUMP_BUFFERS);
+    }
+    if (dump->gl_buffers[0]) {
+        glDeleteBuffers(NV2A_FRAME_DUMP_BUFFERS, dump->gl_buffers);
+    }
+
+    qemu_mutex_lock(&dump->lock);
+    dump->exit = true;
+    qemu_cond_signal(&dump->cond);
+    qemu_mutex_unlock(&dump->lock);
+    qemu_thread_join(&dump->thread);
+    qemu_mutex_destroy(&dump->lock);
+    qemu_cond_destroy(&dump->cond);
+
+    fclose(dump->file);
+    g_free(dump->planes);
+    dump->enabled = false;
+}
+
+static void pgraph_init(PGRAPHState *pg)
 {
     int i;
 
@@ -2044,9 +5594,10 @@ static void pgraph_init(PGRAPHState *pg)
     /* Check context capabilities */
     const GLubyte *extensions = glGetString(GL_EXTENSIONS);
 
-    assert(glo_check_extension((const GLubyte *)
-                             "GL_EXT_texture_compression_s3tc",
-                             extensions));
+    /* optional, DXTn textures get decompressed on the cpu without it */
+    pg->gl_texture_compression_s3tc = glo_check_extension((const GLubyte *)
+                                          "GL_EXT_texture_compression_s3tc",
+                                          extensions);
 
     assert(glo_check_extension((const GLubyte *)
                              "GL_EXT_framebuffer_object",
@@ -2064,6 +5615,43 @@ static void pgraph_init(PGRAPHState *pg)
                              "GL_ARB_texture_rectangle",
                              extensions));
 
+    assert(glo_check_extension((const GLubyte *)
+                             "GL_EXT_packed_depth_stencil",
+                             extensions));
+
+    /* optional, filter and address state is set on the textures
+     * themselves without it */
+    pg->gl_sampler_objects = glo_check_extension((const GLubyte *)
+                                                 "GL_ARB_sampler_objects",
+                                                 extensions);
+
+    /* optional, anisotropic filtering is ignored without it */
+    pg->gl_texture_filter_anisotropic = glo_check_extension(
+        (const GLubyte *)"GL_EXT_texture_filter_anisotropic", extensions);
+    if (pg->gl_texture_filter_anisotropic) {
+        glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT,
+                    &pg->gl_max_anisotropy);
+    }
+
+    /* optional, used for 2d blits within the colour surface */
+    pg->gl_framebuffer_blit = glo_check_extension((const GLubyte *)
+                                                  "GL_EXT_framebuffer_blit",
+                                                  extensions);
+
+    /* optional, frame dumps are read back synchronously without it */
+    pg->gl_pixel_buffer_object = glo_check_extension((const GLubyte *)
+                                     "GL_ARB_pixel_buffer_object",
+                                     extensions);
+
+    /* the buffered path is only offered on top of these */
+    pg->gl_buffered_supported = pg->gl_framebuffer_blit
+        && glo_check_extension((const GLubyte *)
+                               "GL_ARB_vertex_array_object",
+                               extensions)
+        && glo_check_extension((const GLubyte *)
+                               "GL_ARB_draw_elements_base_vertex",
+                               extensions);
+
     GLint max_vertex_attributes;
     glGetIntegerv(GL_MAX_VERTEX_ATTRIBS, &max_vertex_attributes);
     assert(max_vertex_attributes >= NV2A_VERTEXSHADER_ATTRIBUTES);
@@ -2080,12 +5668,49 @@ static void pgraph_init(PGRAPHState *pg)
                                  GL_RENDERBUFFER_EXT,
                                  pg->gl_renderbuffer);
 
+    /* the zeta surface. Z16 fits in it as well */
+    glGenRenderbuffersEXT(1, &pg->gl_zeta_renderbuffer);
+    glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, pg->gl_zeta_renderbuffer);
+    glRenderbufferStorageEXT(GL_RENDERBUFFER_EXT, GL_DEPTH24_STENCIL8_EXT,
+                             640, 480);
+    glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT,
+                                 GL_DEPTH_ATTACHMENT_EXT,
+                                 GL_RENDERBUFFER_EXT,
+                                 pg->gl_zeta_renderbuffer);
+    glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT,
+                                 GL_STENCIL_ATTACHMENT_EXT,
+                                 GL_RENDERBUFFER_EXT,
+                                 pg->gl_zeta_renderbuffer);
+
     assert(glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT)
             == GL_FRAMEBUFFER_COMPLETE_EXT);
 
     glViewport(0, 0, 640, 480);
     //glPolygonMode( GL_FRONT_AND_BACK, GL_LINE );
 
+    pgraph_init_swizzle(pg);
+
+    gl_shadow_init(&pg->gl_shadow);
+
+    /* streaming buffer for inline index batches */
+    glGenBuffers(1, &pg->gl_element_buffer);
+
+    if (pg->gl_buffered_supported) {
+        glGenVertexArrays(1, &pg->gl_vertex_array);
+        glGenBuffers(1, &pg->gl_vertex_buffer);
+        glGenFramebuffersEXT(1, &pg->gl_upload_framebuffer);
+        glGenTextures(1, &pg->gl_upload_texture);
+        glGenTextures(1, &pg->gl_upload_zeta_texture);
+    } else if (pg->gl_buffered_request) {
+        fprintf(stderr, "nv2a: the buffered gl path isn't supported here, "
+                        "using the legacy one\n");
+        pg->gl_buffered_request = false;
+    }
+    pgraph_set_gl_buffered(pg, pg->gl_buffered_request);
+    pg->flip_time = qemu_get_clock_ns(rt_clock);
+
+    frame_dump_init(&pg->frame_dump, pg->gl_pixel_buffer_object);
+
     pg->shaders_dirty = true;
 
     /* generate textures */
@@ -2093,11 +5718,20 @@ static void pgraph_init(PGRAPHState *pg)
         Texture *texture = &pg->textures[i];
         glGenTextures(1, &texture->gl_texture);
         glGenTextures(1, &texture->gl_texture_rect);
+        glGenTextures(1, &texture->gl_texture_cube);
+        glGenTextures(1, &texture->gl_texture_3d);
     }
 
     pg->shader_cache = g_hash_table_new(shader_hash, shader_equal);
+    pg->sampler_cache = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    QSIMPLEQ_INIT(&pg->pending_reports);
+
+    pg->context[0].subchannel_data = g_new0(GraphicsSubchannel,
+                                            NV2A_NUM_SUBCHANNELS);
+    pg->subchannel_data = pg->context[0].subchannel_data;
 
-    assert(glGetError() == GL_NO_ERROR);
+    NV2A_GL_CHECK();
 
     glo_set_current(NULL);
 }
@@ -2113,13 +5747,48 @@ static void pgraph_destroy(PGRAPHState *pg)
 
     glo_set_current(pg->gl_context);
 
+    frame_dump_destroy(&pg->frame_dump);
+
+    g_hash_table_foreach(pg->sampler_cache, pgraph_delete_sampler, NULL);
+    g_hash_table_destroy(pg->sampler_cache);
+
     glDeleteRenderbuffersEXT(1, &pg->gl_renderbuffer);
+    glDeleteRenderbuffersEXT(1, &pg->gl_zeta_renderbuffer);
     glDeleteFramebuffersEXT(1, &pg->gl_framebuffer);
+    glDeleteBuffers(1, &pg->gl_element_buffer);
+
+    if (pg->gl_buffered_supported) {
+        glBindVertexArray(0);
+        glDeleteVertexArrays(1, &pg->gl_vertex_array);
+        glDeleteBuffers(1, &pg->gl_vertex_buffer);
+        glDeleteFramebuffersEXT(1, &pg->gl_upload_framebuffer);
+        glDeleteTextures(1, &pg->gl_upload_texture);
+        glDeleteTextures(1, &pg->gl_upload_zeta_texture);
+    }
+
+    glDeleteProgram(pg->gl_swizzle_program);
+    glDeleteFramebuffersEXT(1, &pg->gl_swizzle_framebuffer);
+    glDeleteBuffers(1, &pg->gl_swizzle_quad);
+    glDeleteTextures(1, &pg->gl_swizzle_source);
+    glDeleteTextures(1, &pg->gl_swizzle_target);
+    glDeleteTextures(1, &pg->gl_alias_texture);
+
+    pgraph_drop_stale_reports(pg);
+    g_free(pg->gl_zpass_queries);
+
+    for (i = 0; i < NV2A_NUM_CHANNELS; i++) {
+        if (pg->context[i].subchannel_data) {
+            free_subchannel_data(pg->context[i].subchannel_data);
+        }
+    }
+    pgraph_drop_stale_objects(pg);
 
     for (i = 0; i < NV2A_MAX_TEXTURES; i++) {
         Texture *texture = &pg->textures[i];
         glDeleteTextures(1, &texture->gl_texture);
         glDeleteTextures(1, &texture->gl_texture_rect);
+        glDeleteTextures(1, &texture->gl_texture_cube);
+        glDeleteTextures(1, &texture->gl_texture_3d);
     }
 
     glo_set_current(NULL);
@@ -2145,7 +5814,17 @@ static void pgraph_method(NV2AState *d,
 
     qemu_mutex_lock(&pg->lock);
 
+    glo_set_current(pg->gl_context);
+
+    if (pg->reports_stale) {
+        pgraph_drop_stale_reports(pg);
+    }
+    if (pg->stale_subchannel_data) {
+        pgraph_drop_stale_objects(pg);
+    }
+
     assert(pg->channel_valid);
+    pgraph_bind_channel(pg, pg->channel_id);
     subchannel_data = &pg->subchannel_data[subchannel];
     object = &subchannel_data->object;
 
@@ -2156,13 +5835,24 @@ static void pgraph_method(NV2AState *d,
 
 
 
-    pgraph_method_log(subchannel, object->graphics_class, method, parameter);
-
-    glo_set_current(pg->gl_context);
+    trace_nv2a_pgraph_method(subchannel, object->graphics_class,
+                             method, parameter);
 
     if (method == NV_SET_OBJECT) {
+        /* binding the object that's already there again, as after a
+         * channel switch, keeps its state and compiled programs */
+        if (subchannel_data->object_instance == parameter
+            && object->graphics_class
+            && object->graphics_class == graphics_object_class(d, parameter)) {
+            qemu_mutex_unlock(&pg->lock);
+            return;
+        }
+
         subchannel_data->object_instance = parameter;
 
+        /* whatever was bound here before gives up its programs */
+        release_graphics_object(object);
+
         qemu_mutex_unlock(&pg->lock);
         //qemu_mutex_lock_iothread();
         load_graphics_object(d, parameter, object);
@@ -2211,55 +5901,8 @@ static void pgraph_method(NV2AState *d,
         image_blit->height = parameter >> 16;
 
         /* I guess this kicks it off? */
-        if (image_blit->operation == NV09F_SET_OPERATION_SRCCOPY) { 
-            GraphicsObject *context_surfaces_obj =
-                lookup_graphics_object(pg, image_blit->context_surfaces);
-            assert(context_surfaces_obj);
-            assert(context_surfaces_obj->graphics_class
-                == NV_CONTEXT_SURFACES_2D);
-
-            ContextSurfaces2DState *context_surfaces =
-                &context_surfaces_obj->data.context_surfaces_2d;
-
-            unsigned int bytes_per_pixel;
-            switch (context_surfaces->color_format) {
-            case NV062_SET_COLOR_FORMAT_LE_Y8:
-                bytes_per_pixel = 1;
-                break;
-            case NV062_SET_COLOR_FORMAT_LE_A8R8G8B8:
-                bytes_per_pixel = 4;
-                break;
-            default:
-                assert(false);
-            }
-
-            hwaddr source_dma_len, dest_dma_len;
-            uint8_t *source, *dest;
-
-            source = nv_dma_map(d, context_surfaces->dma_image_source,
-                                &source_dma_len);
-            assert(context_surfaces->source_offset < source_dma_len);
-            source += context_surfaces->source_offset;
-
-            dest = nv_dma_map(d, context_surfaces->dma_image_dest,
-                              &dest_dma_len);
-            assert(context_surfaces->dest_offset < dest_dma_len);
-            dest += context_surfaces->dest_offset;
-
-            int y;
-            for (y=0; y<image_blit->height; y++) {
-                uint8_t *source_row = source
-                    + (image_blit->in_y + y) * context_surfaces->source_pitch
-                    + image_blit->in_x * bytes_per_pixel;
-                
-                uint8_t *dest_row = dest
-                    + (image_blit->out_y + y) * context_surfaces->dest_pitch
-                    + image_blit->out_x * bytes_per_pixel;
-
-                memmove(dest_row, source_row,
-                        image_blit->width * bytes_per_pixel);
-            }
-
+        if (image_blit->operation == NV09F_SET_OPERATION_SRCCOPY) {
+            pgraph_image_blit(d, image_blit);
         } else {
             assert(false);
         }
@@ -2275,39 +5918,65 @@ static void pgraph_method(NV2AState *d,
          * but nothing obvious sticks out. Weird.
          */
         if (parameter != 0) {
-            assert(!(pg->pending_interrupts & NV_PGRAPH_INTR_NOTIFY));
-
-            pg->trapped_channel_id = pg->channel_id;
-            pg->trapped_subchannel = subchannel;
-            pg->trapped_method = method;
-            pg->trapped_data[0] = parameter;
-            pg->notify_source = NV_PGRAPH_NSOURCE_NOTIFICATION; /* TODO: check this */
-            pg->pending_interrupts |= NV_PGRAPH_INTR_NOTIFY;
-
-            qemu_mutex_unlock(&pg->lock);
-            qemu_mutex_lock_iothread();
-            update_irq(d);
-            qemu_mutex_lock(&pg->lock);
-            qemu_mutex_unlock_iothread();
+            /* a restored snapshot replays the nop it was saved in, with
+             * the notify still pending */
+            if (!(pg->pending_interrupts & NV_PGRAPH_INTR_NOTIFY)) {
+                pg->trapped_channel_id = pg->channel_id;
+                pg->trapped_subchannel = subchannel;
+                pg->trapped_method = method;
+                pg->trapped_data[0] = parameter;
+                pg->notify_source = NV_PGRAPH_NSOURCE_NOTIFICATION; /* TODO: check this */
+                pgraph_raise_interrupt(d, NV_PGRAPH_INTR_NOTIFY);
+            }
 
-            while (pg->pending_interrupts & NV_PGRAPH_INTR_NOTIFY) {
+            pfifo_puller_block(d, "notify");
+            while ((pg->pending_interrupts & NV_PGRAPH_INTR_NOTIFY)
+                   && !pfifo_puller_aborted(d)) {
                 qemu_cond_wait(&pg->interrupt_cond, &pg->lock);
             }
+            pfifo_puller_unblock(d);
         }
         break;
     
     case NV097_WAIT_FOR_IDLE:
         glFinish();
         pgraph_update_surface(d, false);
+        pgraph_process_reports(d, true);
         break;
 
-    case NV097_FLIP_STALL:
+    case NV097_FLIP_STALL: {
         pgraph_update_surface(d, false);
 
+        trace_nv2a_pgraph_gl_suppressed(pg->frame_count,
+                                        pg->gl_shadow.suppressed);
+        pg->gl_shadow.suppressed = 0;
+
+        /* only the time spent on the frame, not waiting for vblank */
+        trace_nv2a_pgraph_frame_time(pg->frame_count,
+                                     pg->gl_buffered ? "buffered" : "legacy",
+                                     qemu_get_clock_ns(rt_clock)
+                                        - pg->flip_time);
+        pgraph_set_gl_buffered(pg, atomic_read(&pg->gl_buffered_request));
+
+        pgraph_process_reports(d, false);
+
+        frame_dump_capture(pg, atomic_read(&d->pcrtc.vblank_period));
+
+        uint32_t frameskip = atomic_read(&pg->frameskip);
+        pg->frame_count++;
+        pg->skip_frame = frameskip > 1 && (pg->frame_count % frameskip) != 0;
+
+        pg->flip_stalled = true;
+        pfifo_puller_block(d, "flip_stall");
         qemu_mutex_unlock(&pg->lock);
         qemu_sem_wait(&pg->read_3d);
+        atomic_dec(&pg->read_3d_count);
         qemu_mutex_lock(&pg->lock);
+        pg->flip_stalled = false;
+        pg->flip_time = qemu_get_clock_ns(rt_clock);
+        pfifo_puller_unblock(d);
         break;
+    }
     
     case NV097_SET_CONTEXT_DMA_NOTIFIES:
         kelvin->dma_notifies = parameter;
@@ -2328,6 +5997,8 @@ static void pgraph_method(NV2AState *d,
         pg->dma_color = parameter;
         break;
     case NV097_SET_CONTEXT_DMA_ZETA:
+        pgraph_update_surface(d, false);
+
         pg->dma_zeta = parameter;
         break;
     case NV097_SET_CONTEXT_DMA_VERTEX_A:
@@ -2339,6 +6010,9 @@ static void pgraph_method(NV2AState *d,
     case NV097_SET_CONTEXT_DMA_SEMAPHORE:
         kelvin->dma_semaphore = parameter;
         break;
+    case NV097_SET_CONTEXT_DMA_REPORT:
+        pg->dma_report = parameter;
+        break;
 
     case NV097_SET_SURFACE_CLIP_HORIZONTAL:
         pgraph_update_surface(d, false);
@@ -2363,6 +6037,12 @@ static void pgraph_method(NV2AState *d,
             GET_MASK(parameter, NV097_SET_SURFACE_FORMAT_COLOR);
         pg->surface_zeta.format =
             GET_MASK(parameter, NV097_SET_SURFACE_FORMAT_ZETA);
+        pg->surface_type =
+            GET_MASK(parameter, NV097_SET_SURFACE_FORMAT_TYPE);
+        pg->surface_log_width =
+            GET_MASK(parameter, NV097_SET_SURFACE_FORMAT_WIDTH);
+        pg->surface_log_height =
+            GET_MASK(parameter, NV097_SET_SURFACE_FORMAT_HEIGHT);
         break;
     case NV097_SET_SURFACE_PITCH:
         pgraph_update_surface(d, false);
@@ -2383,6 +6063,65 @@ static void pgraph_method(NV2AState *d,
         pg->surface_zeta.offset = parameter;
         break;
 
+    case NV097_SET_CONTROL0:
+        /* the float/fixed z format changes the surface's meaning */
+        pgraph_update_surface(d, false);
+
+        SET_MASK(pg->regs[NV_PGRAPH_CONTROL_0],
+                 NV_PGRAPH_CONTROL_0_STENCIL_WRITE_ENABLE,
+                 !!(parameter & NV097_SET_CONTROL0_STENCIL_WRITE_ENABLE));
+        SET_MASK(pg->regs[NV_PGRAPH_SETUPRASTER],
+                 NV_PGRAPH_SETUPRASTER_Z_FORMAT,
+                 !!(parameter & NV097_SET_CONTROL0_Z_FORMAT));
+        break;
+    case NV097_SET_DEPTH_TEST_ENABLE:
+        SET_MASK(pg->regs[NV_PGRAPH_CONTROL_0], NV_PGRAPH_CONTROL_0_ZENABLE,
+                 !!parameter);
+        break;
+    case NV097_SET_DEPTH_FUNC:
+        SET_MASK(pg->regs[NV_PGRAPH_CONTROL_0], NV_PGRAPH_CONTROL_0_ZFUNC,
+                 parameter & 0xF);
+        break;
+    case NV097_SET_DEPTH_MASK:
+        SET_MASK(pg->regs[NV_PGRAPH_CONTROL_0],
+                 NV_PGRAPH_CONTROL_0_ZWRITEENABLE, !!parameter);
+        break;
+    case NV097_SET_STENCIL_TEST_ENABLE:
+        SET_MASK(pg->regs[NV_PGRAPH_CONTROL_1],
+                 NV_PGRAPH_CONTROL_1_STENCIL_TEST_ENABLE, !!parameter);
+        break;
+    case NV097_SET_STENCIL_MASK:
+        SET_MASK(pg->regs[NV_PGRAPH_CONTROL_1],
+                 NV_PGRAPH_CONTROL_1_STENCIL_MASK_WRITE, parameter);
+        break;
+    case NV097_SET_STENCIL_FUNC:
+        SET_MASK(pg->regs[NV_PGRAPH_CONTROL_1],
+                 NV_PGRAPH_CONTROL_1_STENCIL_FUNC, parameter & 0xF);
+        break;
+    case NV097_SET_STENCIL_FUNC_REF:
+        SET_MASK(pg->regs[NV_PGRAPH_CONTROL_1],
+                 NV_PGRAPH_CONTROL_1_STENCIL_REF, parameter);
+        break;
+    case NV097_SET_STENCIL_FUNC_MASK:
+        SET_MASK(pg->regs[NV_PGRAPH_CONTROL_1],
+                 NV_PGRAPH_CONTROL_1_STENCIL_MASK_READ, parameter);
+        break;
+    case NV097_SET_STENCIL_OP_FAIL:
+        SET_MASK(pg->regs[NV_PGRAPH_CONTROL_2],
+                 NV_PGRAPH_CONTROL_2_STENCIL_OP_FAIL,
+                 kelvin_map_stencil_op(parameter));
+        break;
+    case NV097_SET_STENCIL_OP_ZFAIL:
+        SET_MASK(pg->regs[NV_PGRAPH_CONTROL_2],
+                 NV_PGRAPH_CONTROL_2_STENCIL_OP_ZFAIL,
+                 kelvin_map_stencil_op(parameter));
+        break;
+    case NV097_SET_STENCIL_OP_ZPASS:
+        SET_MASK(pg->regs[NV_PGRAPH_CONTROL_2],
+                 NV_PGRAPH_CONTROL_2_STENCIL_OP_ZPASS,
+                 kelvin_map_stencil_op(parameter));
+        break;
+
     case NV097_SET_COMBINER_ALPHA_ICW ...
             NV097_SET_COMBINER_ALPHA_ICW + 28:
         slot = (class_method - NV097_SET_COMBINER_ALPHA_ICW) / 4;
@@ -2585,84 +6324,86 @@ static void pgraph_method(NV2AState *d,
         break;
 
     case NV097_SET_BEGIN_END:
+        if (pgraph_skip_draw(d)) {
+            if (parameter == NV097_SET_BEGIN_END_OP_END) {
+                kelvin->inline_elements_length = 0;
+                kelvin->inline_elements_32 = false;
+                kelvin->inline_array_length = 0;
+                kelvin->inline_buffer_length = 0;
+            } else {
+                kelvin->gl_primitive_mode = kelvin_primitive_map[parameter];
+                pgraph_begin_zpass_query(d, true);
+            }
+            break;
+        }
+
         if (parameter == NV097_SET_BEGIN_END_OP_END) {
 
             if (kelvin->inline_buffer_length) {
-                glEnableVertexAttribArray(NV2A_VERTEX_ATTR_POSITION);
-                glVertexAttribPointer(NV2A_VERTEX_ATTR_POSITION,
-                        4,
-                        GL_FLOAT,
-                        GL_FALSE,
-                        sizeof(InlineVertexBufferEntry),
-                        kelvin->inline_buffer);
-
-                glEnableVertexAttribArray(NV2A_VERTEX_ATTR_DIFFUSE);
-                glVertexAttribPointer(NV2A_VERTEX_ATTR_DIFFUSE,
-                        4,
-                        GL_UNSIGNED_BYTE,
-                        GL_TRUE,
-                        sizeof(InlineVertexBufferEntry),
-                        &kelvin->inline_buffer[0].diffuse);
-
+                trace_nv2a_pgraph_draw_inline("buffer",
+                                              kelvin->inline_buffer_length);
+                kelvin_bind_inline_buffer(pg, kelvin);
                 glDrawArrays(kelvin->gl_primitive_mode,
                              0, kelvin->inline_buffer_length);
             } else if (kelvin->inline_array_length) {
                 unsigned int vertex_size =
-                    kelvin_bind_inline_array(kelvin);
+                    kelvin_bind_inline_array(pg, kelvin);
                 unsigned int index_count =
                     kelvin->inline_array_length*4 / vertex_size;
-                
-                kelvin_bind_converted_vertex_attributes(d, kelvin,
-                    true, index_count);
+                trace_nv2a_pgraph_draw_inline("array", index_count);
+
+                if (pg->gl_buffered) {
+                    kelvin_bind_vertex_buffer(d, kelvin, true,
+                                              0, index_count);
+                } else {
+                    kelvin_bind_converted_vertex_attributes(d, kelvin,
+                        true, index_count);
+                }
                 glDrawArrays(kelvin->gl_primitive_mode,
                              0, index_count);
             } else if (kelvin->inline_elements_length) {
-
-
-                uint32_t max_element = 0;
-                uint32_t min_element = (uint32_t)-1;
-                for (i=0; i<kelvin->inline_elements_length; i++) {
-                    max_element = MAX(kelvin->inline_elements[i], max_element);
-                    min_element = MIN(kelvin->inline_elements[i], min_element);
-                }
-
-                kelvin_bind_converted_vertex_attributes(d, kelvin,
-                    false, max_element+1);
-                glDrawElements(kelvin->gl_primitive_mode,
-                               kelvin->inline_elements_length,
-                               GL_UNSIGNED_INT,
-                               kelvin->inline_elements);
+                trace_nv2a_pgraph_draw_inline("elements",
+                                              kelvin->inline_elements_length);
+                kelvin_draw_inline_elements(d, kelvin);
             }/* else {
                 assert(false);
             }*/
-            assert(glGetError() == GL_NO_ERROR);
+            pgraph_end_zpass_query(d);
+            NV2A_GL_CHECK();
         } else {
             assert(parameter <= NV097_SET_BEGIN_END_OP_POLYGON);
+            trace_nv2a_pgraph_begin(parameter);
 
             pgraph_update_surface(d, true);
 
             bool use_vertex_program = GET_MASK(pg->regs[NV_PGRAPH_CSV0_D],
                                                NV_PGRAPH_CSV0_D_MODE) == 2;
+            gl_shadow_enable(&pg->gl_shadow, GL_VERTEX_PROGRAM_ARB,
+                             use_vertex_program);
             if (use_vertex_program) {
-                glEnable(GL_VERTEX_PROGRAM_ARB);
                 kelvin_bind_vertex_program(kelvin);
-            } else {
-                glDisable(GL_VERTEX_PROGRAM_ARB);
             }
 
             pgraph_bind_shaders(pg);
 
             pgraph_bind_textures(d);
+            pgraph_bind_zeta_state(pg);
             kelvin_bind_vertex_attributes(d, kelvin);
 
 
             kelvin->gl_primitive_mode = kelvin_primitive_map[parameter];
 
             kelvin->inline_elements_length = 0;
+            kelvin->inline_elements_32 = false;
             kelvin->inline_array_length = 0;
             kelvin->inline_buffer_length = 0;
+
+            pgraph_begin_zpass_query(d, false);
         }
         pg->surface_color.draw_dirty = true;
+        if (pgraph_zeta_writable(pg)) {
+            pg->surface_zeta.draw_dirty = true;
+        }
         break;
     CASE_4(NV097_SET_TEXTURE_OFFSET, 64):
         slot = (class_method - NV097_SET_TEXTURE_OFFSET) / 64;
@@ -2676,6 +6417,8 @@ static void pgraph_method(NV2AState *d,
             GET_MASK(parameter, NV097_SET_TEXTURE_FORMAT_CONTEXT_DMA) == 2;
         pg->textures[slot].dimensionality =
             GET_MASK(parameter, NV097_SET_TEXTURE_FORMAT_DIMENSIONALITY);
+        pg->textures[slot].cubemap =
+            parameter & NV097_SET_TEXTURE_FORMAT_CUBEMAP_ENABLE;
         pg->textures[slot].color_format = 
             GET_MASK(parameter, NV097_SET_TEXTURE_FORMAT_COLOR);
         pg->textures[slot].levels =
@@ -2684,6 +6427,8 @@ static void pgraph_method(NV2AState *d,
             GET_MASK(parameter, NV097_SET_TEXTURE_FORMAT_BASE_SIZE_U);
         pg->textures[slot].log_height =
             GET_MASK(parameter, NV097_SET_TEXTURE_FORMAT_BASE_SIZE_V);
+        pg->textures[slot].log_depth =
+            GET_MASK(parameter, NV097_SET_TEXTURE_FORMAT_BASE_SIZE_P);
 
         pg->textures[slot].dirty = true;
         pg->shaders_dirty = true;
@@ -2697,14 +6442,21 @@ static void pgraph_method(NV2AState *d,
             GET_MASK(parameter, NV097_SET_TEXTURE_CONTROL0_MIN_LOD_CLAMP);
         pg->textures[slot].max_mipmap_level =
             GET_MASK(parameter, NV097_SET_TEXTURE_CONTROL0_MAX_LOD_CLAMP);
+        pg->textures[slot].log_max_anisotropy =
+            GET_MASK(parameter, NV097_SET_TEXTURE_CONTROL0_LOG_MAX_ANISO);
 
         pg->shaders_dirty = true;
         break;
+    CASE_4(NV097_SET_TEXTURE_ADDRESS, 64):
+        slot = (class_method - NV097_SET_TEXTURE_ADDRESS) / 64;
+        pg->textures[slot].address = parameter;
+        break;
     CASE_4(NV097_SET_TEXTURE_CONTROL1, 64):
         slot = (class_method - NV097_SET_TEXTURE_CONTROL1) / 64;
 
         pg->textures[slot].pitch =
             GET_MASK(parameter, NV097_SET_TEXTURE_CONTROL1_IMAGE_PITCH);
+        pg->textures[slot].dirty = true;
 
         break;
     CASE_4(NV097_SET_TEXTURE_FILTER, 64):
@@ -2728,27 +6480,66 @@ static void pgraph_method(NV2AState *d,
         
         pg->textures[slot].dirty = true;
         break;
+    CASE_4(NV097_SET_TEXTURE_PALETTE, 64): {
+        slot = (class_method - NV097_SET_TEXTURE_PALETTE) / 64;
+
+        pg->textures[slot].palette_dma_select =
+            GET_MASK(parameter, NV097_SET_TEXTURE_PALETTE_CONTEXT_DMA);
+        unsigned int length =
+            GET_MASK(parameter, NV097_SET_TEXTURE_PALETTE_LENGTH);
+        pg->textures[slot].palette_length = 256 >> length;
+        pg->textures[slot].palette_offset =
+            parameter & NV097_SET_TEXTURE_PALETTE_OFFSET;
+
+        pg->textures[slot].dirty = true;
+        break;
+    }
 
     case NV097_ARRAY_ELEMENT16:
-        assert(kelvin->inline_elements_length < NV2A_MAX_BATCH_LENGTH);
-        kelvin->inline_elements[
-            kelvin->inline_elements_length++] = parameter & 0xFFFF;
-        kelvin->inline_elements[
-            kelvin->inline_elements_length++] = parameter >> 16;
+        assert(kelvin->inline_elements_length + 2 <= NV2A_MAX_BATCH_LENGTH);
+        if (kelvin->inline_elements_32) {
+            kelvin->inline_elements.u32[
+                kelvin->inline_elements_length++] = parameter & 0xFFFF;
+            kelvin->inline_elements.u32[
+                kelvin->inline_elements_length++] = parameter >> 16;
+        } else {
+            kelvin->inline_elements.u16[
+                kelvin->inline_elements_length++] = parameter & 0xFFFF;
+            kelvin->inline_elements.u16[
+                kelvin->inline_elements_length++] = parameter >> 16;
+        }
         break;
     case NV097_ARRAY_ELEMENT32:
         assert(kelvin->inline_elements_length < NV2A_MAX_BATCH_LENGTH);
-        kelvin->inline_elements[
-            kelvin->inline_elements_length++] = parameter;
+        /* commonly used for the odd index at the end of a 16-bit batch */
+        if (!kelvin->inline_elements_32 && parameter > 0xFFFF) {
+            kelvin_promote_elements(kelvin);
+        }
+        if (kelvin->inline_elements_32) {
+            kelvin->inline_elements.u32[
+                kelvin->inline_elements_length++] = parameter;
+        } else {
+            kelvin->inline_elements.u16[
+                kelvin->inline_elements_length++] = parameter;
+        }
         break;
     case NV097_DRAW_ARRAYS: {
         unsigned int start = GET_MASK(parameter, NV097_DRAW_ARRAYS_START_INDEX);
         unsigned int count = GET_MASK(parameter, NV097_DRAW_ARRAYS_COUNT)+1;
 
+        if (pgraph_skip_draw(d)) {
+            break;
+        }
 
-        kelvin_bind_converted_vertex_attributes(d, kelvin,
-            false, start + count);
-        glDrawArrays(kelvin->gl_primitive_mode, start, count);
+        trace_nv2a_pgraph_draw_arrays(start, count);
+        if (pg->gl_buffered) {
+            kelvin_bind_vertex_buffer(d, kelvin, false, start, count);
+            glDrawArrays(kelvin->gl_primitive_mode, 0, count);
+        } else {
+            kelvin_bind_converted_vertex_attributes(d, kelvin,
+                false, start + count);
+            glDrawArrays(kelvin->gl_primitive_mode, start, count);
+        }
 
         break;
     }
@@ -2787,6 +6578,18 @@ static void pgraph_method(NV2AState *d,
 
         break;
     }
+    case NV097_GET_REPORT:
+        pgraph_get_report(d, parameter);
+        break;
+    case NV097_SET_ZPASS_PIXEL_COUNT_ENABLE:
+        pg->zpass_pixel_count_enable = parameter;
+        break;
+    case NV097_CLEAR_REPORT_VALUE:
+        if (parameter == NV097_CLEAR_REPORT_VALUE_TYPE_ZPASS_PIXEL_CNT) {
+            pgraph_clear_zpass_queries(pg);
+        }
+        break;
+
     case NV097_SET_ZSTENCIL_CLEAR_VALUE:
         pg->regs[NV_PGRAPH_ZSTENCILCLEARVALUE] = parameter;
         break;
@@ -2795,24 +6598,72 @@ static void pgraph_method(NV2AState *d,
         pg->regs[NV_PGRAPH_COLORCLEARVALUE] = parameter;
         break;
 
-    case NV097_CLEAR_SURFACE:
-        /* QQQ */
-        NV2A_DPRINTF("------------------CLEAR 0x%x---------------\n", parameter);
-        //glClearColor(1, 0, 0, 1);
+    case NV097_CLEAR_SURFACE: {
+        if (pgraph_skip_draw(d)) {
+            break;
+        }
+
+        /* the clear rect is inclusive */
+        unsigned int xmin = GET_MASK(pg->regs[NV_PGRAPH_CLEARRECTX],
+                NV_PGRAPH_CLEARRECTX_XMIN);
+        unsigned int xmax = GET_MASK(pg->regs[NV_PGRAPH_CLEARRECTX],
+                NV_PGRAPH_CLEARRECTX_XMAX) + 1;
+        unsigned int ymin = GET_MASK(pg->regs[NV_PGRAPH_CLEARRECTY],
+                NV_PGRAPH_CLEARRECTY_YMIN);
+        unsigned int ymax = GET_MASK(pg->regs[NV_PGRAPH_CLEARRECTY],
+                NV_PGRAPH_CLEARRECTY_YMAX) + 1;
 
         GLbitfield gl_mask = 0;
+
+        uint32_t clear_zstencil = pg->regs[NV_PGRAPH_ZSTENCILCLEARVALUE];
+        GLint gl_clear_stencil;
+        GLdouble gl_clear_depth;
+        switch (pg->surface_zeta.format) {
+        case NV097_SET_SURFACE_FORMAT_ZETA_Z16:
+            gl_clear_stencil = 0;
+            gl_clear_depth = (clear_zstencil & 0xFFFF) / (double)0xFFFF;
+            break;
+        case NV097_SET_SURFACE_FORMAT_ZETA_Z24S8:
+        default:
+            gl_clear_stencil = clear_zstencil & 0xFF;
+            gl_clear_depth = (clear_zstencil >> 8) / (double)0xFFFFFF;
+            break;
+        }
+        if (parameter & (NV097_CLEAR_SURFACE_Z
+                         | NV097_CLEAR_SURFACE_STENCIL)) {
+            /* whatever's outside the clear rect has to survive it */
+            pgraph_update_surface_zeta(d, true);
+        }
         if (parameter & NV097_CLEAR_SURFACE_Z) {
             gl_mask |= GL_DEPTH_BUFFER_BIT;
+            gl_shadow_depth_mask(&pg->gl_shadow, GL_TRUE);
+            glClearDepth(gl_clear_depth);
         }
         if (parameter & NV097_CLEAR_SURFACE_STENCIL) {
             gl_mask |= GL_STENCIL_BUFFER_BIT;
+            gl_shadow_stencil_mask(&pg->gl_shadow, 0xFF);
+            glClearStencil(gl_clear_stencil);
         }
 
-        if (parameter & (NV097_CLEAR_SURFACE_COLOR)) {
+        if (parameter & NV097_CLEAR_SURFACE_COLOR) {
             gl_mask |= GL_COLOR_BUFFER_BIT;
-            pgraph_update_surface(d, true);
 
-            uint32_t clear_color = d->pgraph.regs[NV_PGRAPH_COLORCLEARVALUE];
+            if ((parameter & NV097_CLEAR_SURFACE_COLOR)
+                    == NV097_CLEAR_SURFACE_COLOR) {
+                /* every channel inside the rect gets overwritten, don't
+                 * bother uploading what the cpu put there */
+                pgraph_update_surface_for_clear(d, xmin, ymin, xmax, ymax);
+            } else {
+                pgraph_update_surface(d, true);
+            }
+
+            gl_shadow_color_mask(&pg->gl_shadow,
+                                 parameter & NV097_CLEAR_SURFACE_R,
+                                 parameter & NV097_CLEAR_SURFACE_G,
+                                 parameter & NV097_CLEAR_SURFACE_B,
+                                 parameter & NV097_CLEAR_SURFACE_A);
+
+            uint32_t clear_color = pg->regs[NV_PGRAPH_COLORCLEARVALUE];
             glClearColor( ((clear_color >> 16) & 0xFF) / 255.0f, /* red */
                           ((clear_color >> 8) & 0xFF) / 255.0f,  /* green */
                           (clear_color & 0xFF) / 255.0f,         /* blue */
@@ -2820,30 +6671,27 @@ static void pgraph_method(NV2AState *d,
 
         }
 
-        glEnable(GL_SCISSOR_TEST);
-
-        unsigned int xmin = GET_MASK(d->pgraph.regs[NV_PGRAPH_CLEARRECTX],
-                NV_PGRAPH_CLEARRECTX_XMIN);
-        unsigned int xmax = GET_MASK(d->pgraph.regs[NV_PGRAPH_CLEARRECTX],
-                NV_PGRAPH_CLEARRECTX_XMAX);
-        unsigned int ymin = GET_MASK(d->pgraph.regs[NV_PGRAPH_CLEARRECTY],
-                NV_PGRAPH_CLEARRECTY_YMIN);
-        unsigned int ymax = GET_MASK(d->pgraph.regs[NV_PGRAPH_CLEARRECTY],
-                NV_PGRAPH_CLEARRECTY_YMAX);
+        gl_shadow_enable(&pg->gl_shadow, GL_SCISSOR_TEST, true);
         glScissor(xmin, pg->surface_height-ymax, xmax-xmin, ymax-ymin);
 
-        NV2A_DPRINTF("------------------CLEAR 0x%x %d,%d - %d,%d  %x---------------\n",
-            parameter, xmin, ymin, xmax, ymax, d->pgraph.regs[NV_PGRAPH_COLORCLEARVALUE]);
+        trace_nv2a_pgraph_clear(parameter, xmin, ymin, xmax, ymax,
+                                pg->regs[NV_PGRAPH_COLORCLEARVALUE]);
 
         glClear(gl_mask);
 
-        glDisable(GL_SCISSOR_TEST);
+        gl_shadow_enable(&pg->gl_shadow, GL_SCISSOR_TEST, false);
+        gl_shadow_color_mask(&pg->gl_shadow, true, true, true, true);
 
 
         if (parameter & NV097_CLEAR_SURFACE_COLOR) {
             pg->surface_color.draw_dirty = true;
         }
+        if ((gl_mask & (GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT))
+            && pg->surface_zeta.format != 0) {
+            pg->surface_zeta.draw_dirty = true;
+        }
         break;
+    }
 
     case NV097_SET_CLEAR_RECT_HORIZONTAL:
         pg->regs[NV_PGRAPH_CLEARRECTX] = parameter;
@@ -2909,12 +6757,11 @@ static void pgraph_method(NV2AState *d,
     case NV097_SET_TRANSFORM_CONSTANT_LOAD:
         assert(parameter < NV2A_VERTEXSHADER_CONSTANTS);
         kelvin->constant_load_slot = parameter;
-        NV2A_DPRINTF("load to %d\n", parameter);
         break;
 
     default:
-        NV2A_DPRINTF("    unhandled  (0x%02x 0x%08x)\n",
-                     object->graphics_class, method);
+        trace_nv2a_pgraph_method_unhandled(object->graphics_class,
+                                           method, parameter);
         break;
     }
     qemu_mutex_unlock(&d->pgraph.lock);
@@ -2922,9 +6769,63 @@ static void pgraph_method(NV2AState *d,
 }
 
 
-static void pgraph_context_switch(NV2AState *d, unsigned int channel_id)
+/* Called with the cache lock held */
+static void pfifo_puller_set_state(Cache1State *state,
+                                   enum PullerState puller_state)
+{
+    state->puller_state = puller_state;
+    qemu_cond_broadcast(&state->pause_cond);
+}
+
+/* Called with the cache lock held */
+static void pfifo_puller_exit(Cache1State *state)
+{
+    atomic_set(&state->puller_alive, false);
+    pfifo_puller_set_state(state, PULLER_IDLE);
+}
+
+/* Called by the puller with the pgraph lock held, before it waits on
+ * the guest */
+static void pfifo_puller_block(NV2AState *d, const char *reason)
+{
+    Cache1State *state = &d->pfifo.cache1;
+
+    trace_nv2a_puller_stall(reason);
+
+    qemu_mutex_lock(&state->cache_lock);
+    pfifo_puller_set_state(state, PULLER_BLOCKED);
+    qemu_mutex_unlock(&state->cache_lock);
+}
+
+/* Once the guest has let it go, the puller stays put until the vm runs.
+ * Returns false if a snapshot was loaded over the command it was in. */
+static bool pfifo_puller_unblock(NV2AState *d)
+{
+    Cache1State *state = &d->pfifo.cache1;
+    bool ok;
+
+    qemu_mutex_lock(&state->cache_lock);
+    while (state->paused && !state->puller_abort) {
+        qemu_cond_wait(&state->pause_cond, &state->cache_lock);
+    }
+    ok = !state->puller_abort;
+    pfifo_puller_set_state(state, PULLER_BUSY);
+    qemu_mutex_unlock(&state->cache_lock);
+
+    trace_nv2a_puller_resume();
+    return ok;
+}
+
+static bool pfifo_puller_aborted(NV2AState *d)
+{
+    return atomic_read(&d->pfifo.cache1.puller_abort);
+}
+
+/* Returns false if the command was abandoned for a snapshot load */
+static bool pgraph_context_switch(NV2AState *d, unsigned int channel_id)
 {
     bool valid;
+    bool ok = true;
     qemu_mutex_lock(&d->pgraph.lock);
     valid = d->pgraph.channel_valid && d->pgraph.channel_id == channel_id;
     if (!valid) {
@@ -2932,27 +6833,56 @@ static void pgraph_context_switch(NV2AState *d, unsigned int channel_id)
     }
     qemu_mutex_unlock(&d->pgraph.lock);
     if (!valid) {
-        NV2A_DPRINTF("puller needs to switch to ch %d\n", channel_id);
-        
-        qemu_mutex_lock_iothread();
-        d->pgraph.pending_interrupts |= NV_PGRAPH_INTR_CONTEXT_SWITCH;
-        update_irq(d);
-        qemu_mutex_unlock_iothread();
+        trace_nv2a_pgraph_context_switch(channel_id);
 
         qemu_mutex_lock(&d->pgraph.lock);
-        while (d->pgraph.pending_interrupts & NV_PGRAPH_INTR_CONTEXT_SWITCH) {
+        pgraph_raise_interrupt(d, NV_PGRAPH_INTR_CONTEXT_SWITCH);
+        pfifo_puller_block(d, "context_switch");
+        while ((d->pgraph.pending_interrupts & NV_PGRAPH_INTR_CONTEXT_SWITCH)
+               && !pfifo_puller_aborted(d)) {
             qemu_cond_wait(&d->pgraph.interrupt_cond, &d->pgraph.lock);
         }
+        ok = pfifo_puller_unblock(d);
         qemu_mutex_unlock(&d->pgraph.lock);
     }
+    return ok;
 }
 
-static void pgraph_wait_fifo_access(NV2AState *d) {
+static bool pgraph_wait_fifo_access(NV2AState *d) {
+    bool ok = true;
     qemu_mutex_lock(&d->pgraph.lock);
-    while (!d->pgraph.fifo_access) {
-        qemu_cond_wait(&d->pgraph.fifo_access_cond, &d->pgraph.lock);
+    if (!d->pgraph.fifo_access) {
+        pfifo_puller_block(d, "fifo_access");
+        while (!d->pgraph.fifo_access && !pfifo_puller_aborted(d)) {
+            qemu_cond_wait(&d->pgraph.fifo_access_cond, &d->pgraph.lock);
+        }
+        ok = pfifo_puller_unblock(d);
     }
     qemu_mutex_unlock(&d->pgraph.lock);
+    return ok;
+}
+
+/* Write back whatever has been rendered, a snapshot only has vram */
+static void pgraph_flush_surface(NV2AState *d)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    qemu_mutex_lock(&pg->lock);
+    glo_set_current(pg->gl_context);
+    pgraph_update_surface(d, false);
+    pgraph_process_reports(d, true);
+    qemu_mutex_unlock(&pg->lock);
+}
+
+/* With nothing else to do, the guest may well be spinning on a report */
+static void pgraph_flush_reports(NV2AState *d)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    qemu_mutex_lock(&pg->lock);
+    glo_set_current(pg->gl_context);
+    pgraph_process_reports(d, true);
+    qemu_mutex_unlock(&pg->lock);
 }
 
 static void *pfifo_puller_thread(void *arg)
@@ -2962,30 +6892,66 @@ static void *pfifo_puller_thread(void *arg)
     CacheEntry *command;
     RAMHTEntry entry;
 
+    qemu_mutex_lock(&state->cache_lock);
+    pfifo_puller_set_state(state, PULLER_IDLE);
+    qemu_mutex_unlock(&state->cache_lock);
+
     while (true) {
         qemu_mutex_lock(&state->pull_lock);
         if (!state->pull_enabled) {
             qemu_mutex_unlock(&state->pull_lock);
+            qemu_mutex_lock(&state->cache_lock);
+            pfifo_puller_exit(state);
+            qemu_mutex_unlock(&state->cache_lock);
             return NULL;
         }
         qemu_mutex_unlock(&state->pull_lock);
 
         qemu_mutex_lock(&state->cache_lock);
-        while (QSIMPLEQ_EMPTY(&state->cache)) {
+        while (QSIMPLEQ_EMPTY(&state->cache) || state->paused) {
+            if (state->paused && state->puller_state != PULLER_PARKED) {
+                /* don't write back over a snapshot being loaded */
+                if (!state->puller_abort) {
+                    qemu_mutex_unlock(&state->cache_lock);
+                    pgraph_flush_surface(d);
+                    /* so a snapshot has them in guest memory */
+                    pgraph_flush_reports(d);
+                    qemu_mutex_lock(&state->cache_lock);
+                }
+                if (state->paused) {
+                    pfifo_puller_set_state(state, PULLER_PARKED);
+                }
+                continue;
+            }
+
+            if (!QSIMPLEQ_EMPTY(&d->pgraph.pending_reports)) {
+                qemu_mutex_unlock(&state->cache_lock);
+                pgraph_flush_reports(d);
+                qemu_mutex_lock(&state->cache_lock);
+                continue;
+            }
+
             qemu_cond_wait(&state->cache_cond, &state->cache_lock);
 
             /* we could have been woken up to tell us we should die */
             qemu_mutex_lock(&state->pull_lock);
             if (!state->pull_enabled) {
                 qemu_mutex_unlock(&state->pull_lock);
+                pfifo_puller_exit(state);
                 qemu_mutex_unlock(&state->cache_lock);
                 return NULL;
             }
             qemu_mutex_unlock(&state->pull_lock);
+
+            if (!state->paused && state->puller_state == PULLER_PARKED) {
+                pfifo_puller_set_state(state, PULLER_IDLE);
+            }
         }
         command = QSIMPLEQ_FIRST(&state->cache);
         QSIMPLEQ_REMOVE_HEAD(&state->cache, entry);
         state->cache_size--;
+        state->current = command;
+        pfifo_puller_set_state(state, PULLER_BUSY);
         qemu_mutex_unlock(&state->cache_lock);
 
         if (command->method == 0) {
@@ -2998,9 +6964,10 @@ static void *pfifo_puller_thread(void *arg)
 
             switch (entry.engine) {
             case ENGINE_GRAPHICS:
-                pgraph_context_switch(d, entry.channel_id);
-                pgraph_wait_fifo_access(d);
-                pgraph_method(d, command->subchannel, 0, entry.instance);
+                if (pgraph_context_switch(d, entry.channel_id)
+                    && pgraph_wait_fifo_access(d)) {
+                    pgraph_method(d, command->subchannel, 0, entry.instance);
+                }
                 break;
             default:
                 assert(false);
@@ -3034,9 +7001,10 @@ static void *pfifo_puller_thread(void *arg)
 
             switch (engine) {
             case ENGINE_GRAPHICS:
-                pgraph_wait_fifo_access(d);
-                pgraph_method(d, command->subchannel,
-                                   command->method, parameter);
+                if (pgraph_wait_fifo_access(d)) {
+                    pgraph_method(d, command->subchannel,
+                                       command->method, parameter);
+                }
                 break;
             default:
                 assert(false);
@@ -3048,21 +7016,29 @@ static void *pfifo_puller_thread(void *arg)
             qemu_mutex_unlock(&state->pull_lock);
         }
 
+        qemu_mutex_lock(&state->cache_lock);
+        state->current = NULL;
+        pfifo_puller_set_state(state, PULLER_IDLE);
+        qemu_mutex_unlock(&state->cache_lock);
+
         g_free(command);
     }
 
     return NULL;
 }
 
-/* pusher should be fine to run from a mimo handler
- * whenever's it's convenient */
-static void pfifo_run_pusher(NV2AState *d) {
+/* Runs on the pusher thread. dma_get is published with atomic_set after
+ * every command so the guest can poll it while we're still going.
+ * Returns false if it stopped early because someone wants to change
+ * pusher state. */
+static bool pfifo_run_pusher(NV2AState *d) {
     uint8_t channel_id;
     ChannelControl *control;
     Cache1State *state;
     CacheEntry *command;
     uint8_t *dma;
     hwaddr dma_len;
+    hwaddr dma_get, dma_put;
     uint32_t word;
 
     /* TODO: How is cache1 selected? */
@@ -3070,7 +7046,7 @@ static void pfifo_run_pusher(NV2AState *d) {
     channel_id = state->channel_id;
     control = &d->user.channel_control[channel_id];
 
-    if (!state->push_enabled) return;
+    if (!state->push_enabled) return true;
 
 
     /* only handling DMA for now... */
@@ -3079,27 +7055,35 @@ static void pfifo_run_pusher(NV2AState *d) {
     assert(d->pfifo.channel_modes & (1 << channel_id));
     assert(state->mode == FIFO_DMA);
 
-    if (!state->dma_push_enabled) return;
-    if (state->dma_push_suspended) return;
+    if (!state->dma_push_enabled) return true;
+    if (state->dma_push_suspended) return true;
 
     /* We're running so there should be no pending errors... */
     assert(state->error == NV_PFIFO_CACHE1_DMA_STATE_ERROR_NONE);
 
     dma = nv_dma_map(d, state->dma_instance, &dma_len);
 
-    NV2A_DPRINTF("DMA pusher: max 0x%llx, 0x%llx - 0x%llx\n",
-                 dma_len, control->dma_get, control->dma_put);
+    dma_get = atomic_read(&control->dma_get);
+    dma_put = atomic_read(&control->dma_put);
+
+    trace_nv2a_pfifo_pusher_run(dma_get, dma_put, dma_len);
 
     /* based on the convenient pseudocode in envytools */
-    while (control->dma_get != control->dma_put) {
-        if (control->dma_get >= dma_len) {
+    while (dma_get != dma_put) {
+        if (atomic_read(&d->pfifo.pusher_holds)) {
+            /* everything so far is in state, pick up from there later */
+            atomic_set(&control->dma_get, dma_get);
+            return false;
+        }
+
+        if (dma_get >= dma_len) {
 
             state->error = NV_PFIFO_CACHE1_DMA_STATE_ERROR_PROTECTION;
             break;
         }
 
-        word = le32_to_cpupu((uint32_t*)(dma + control->dma_get));
-        control->dma_get += 4;
+        word = le32_to_cpupu((uint32_t*)(dma + dma_get));
+        dma_get += 4;
 
         if (state->method_count) {
             /* data word of methods command */
@@ -3127,33 +7111,33 @@ static void pfifo_run_pusher(NV2AState *d) {
             /* match all forms */
             if ((word & 0xe0000003) == 0x20000000) {
                 /* old jump */
-                state->get_jmp_shadow = control->dma_get;
-                control->dma_get = word & 0x1fffffff;
-                NV2A_DPRINTF("pb OLD_JMP 0x%llx\n", control->dma_get);
+                state->get_jmp_shadow = dma_get;
+                dma_get = word & 0x1fffffff;
+                trace_nv2a_pfifo_pusher_jump("old_jump", dma_get);
             } else if ((word & 3) == 1) {
                 /* jump */
-                state->get_jmp_shadow = control->dma_get;
-                control->dma_get = word & 0xfffffffc;
-                NV2A_DPRINTF("pb JMP 0x%llx\n", control->dma_get);
+                state->get_jmp_shadow = dma_get;
+                dma_get = word & 0xfffffffc;
+                trace_nv2a_pfifo_pusher_jump("jump", dma_get);
             } else if ((word & 3) == 2) {
                 /* call */
                 if (state->subroutine_active) {
                     state->error = NV_PFIFO_CACHE1_DMA_STATE_ERROR_CALL;
                     break;
                 }
-                state->subroutine_return = control->dma_get;
+                state->subroutine_return = dma_get;
                 state->subroutine_active = true;
-                control->dma_get = word & 0xfffffffc;
-                NV2A_DPRINTF("pb CALL 0x%llx\n", control->dma_get);
+                dma_get = word & 0xfffffffc;
+                trace_nv2a_pfifo_pusher_jump("call", dma_get);
             } else if (word == 0x00020000) {
                 /* return */
                 if (!state->subroutine_active) {
                     state->error = NV_PFIFO_CACHE1_DMA_STATE_ERROR_RETURN;
                     break;
                 }
-                control->dma_get = state->subroutine_return;
+                dma_get = state->subroutine_return;
                 state->subroutine_active = false;
-                NV2A_DPRINTF("pb RET 0x%llx\n", control->dma_get);
+                trace_nv2a_pfifo_pusher_jump("return", dma_get);
             } else if ((word & 0xe0030003) == 0) {
                 /* increasing methods */
                 state->method = word & 0x1fff;
@@ -3169,23 +7153,94 @@ static void pfifo_run_pusher(NV2AState *d) {
                 state->method_nonincreasing = true;
                 state->dcount = 0;
             } else {
-                NV2A_DPRINTF("pb reserved cmd 0x%llx - 0x%x\n",
-                             control->dma_get, word);
                 state->error = NV_PFIFO_CACHE1_DMA_STATE_ERROR_RESERVED_CMD;
                 break;
             }
         }
+
+        if (state->method_count == 0) {
+            atomic_set(&control->dma_get, dma_get);
+        }
+
+        /* pick up any PUT writes made while we were running */
+        if (dma_get == dma_put) {
+            dma_put = atomic_read(&control->dma_put);
+        }
     }
 
+    atomic_set(&control->dma_get, dma_get);
+
     if (state->error) {
-        NV2A_DPRINTF("pb error: %d\n", state->error);
+        trace_nv2a_pfifo_pusher_error(state->error, dma_get);
         assert(false);
 
         state->dma_push_suspended = true;
 
-        d->pfifo.pending_interrupts |= NV_PFIFO_INTR_0_DMA_PUSHER;
-        update_irq(d);
+        atomic_or(&d->pfifo.pending_interrupts, NV_PFIFO_INTR_0_DMA_PUSHER);
+        qemu_bh_schedule(d->irq_bh);
+    }
+    return true;
+}
+
+static void *pfifo_pusher_thread(void *arg)
+{
+    NV2AState *d = arg;
+
+    qemu_mutex_lock(&d->pfifo.pusher_lock);
+    while (true) {
+        /* a held pusher would only stop again at the first word, so
+         * sleep until the last hold is released */
+        while ((!d->pfifo.pusher_kick || d->pfifo.pusher_paused
+                || atomic_read(&d->pfifo.pusher_holds))
+               && !d->pfifo.pusher_exit) {
+            qemu_cond_wait(&d->pfifo.pusher_cond, &d->pfifo.pusher_lock);
+        }
+        if (d->pfifo.pusher_exit) {
+            break;
+        }
+        d->pfifo.pusher_kick = false;
+        d->pfifo.pusher_running = true;
+        qemu_mutex_unlock(&d->pfifo.pusher_lock);
+
+        bool finished = pfifo_run_pusher(d);
+
+        qemu_mutex_lock(&d->pfifo.pusher_lock);
+        d->pfifo.pusher_running = false;
+        if (!finished) {
+            /* carry on once whoever stopped us is done */
+            d->pfifo.pusher_kick = true;
+        }
+        qemu_cond_broadcast(&d->pfifo.pusher_idle_cond);
+    }
+    qemu_mutex_unlock(&d->pfifo.pusher_lock);
+
+    return NULL;
+}
+
+/* Called with the pusher lock held */
+static void pfifo_kick_pusher(NV2AState *d)
+{
+    d->pfifo.pusher_kick = true;
+    qemu_cond_signal(&d->pfifo.pusher_cond);
+}
+
+/* Stop the pusher at the next word and wait until it isn't running, so
+ * its state can be changed. Returns with the pusher lock held. */
+static void pfifo_pusher_hold(NV2AState *d)
+{
+    atomic_inc(&d->pfifo.pusher_holds);
+    qemu_mutex_lock(&d->pfifo.pusher_lock);
+    while (d->pfifo.pusher_running) {
+        qemu_cond_wait(&d->pfifo.pusher_idle_cond, &d->pfifo.pusher_lock);
+    }
+}
+
+static void pfifo_pusher_release(NV2AState *d)
+{
+    if (atomic_fetch_dec(&d->pfifo.pusher_holds) == 1) {
+        qemu_cond_broadcast(&d->pfifo.pusher_cond);
     }
+    qemu_mutex_unlock(&d->pfifo.pusher_lock);
 }
 
 
@@ -3218,7 +7273,7 @@ static uint64_t pmc_read(void *opaque,
         break;
     }
 
-    reg_log_read(NV_PMC, addr, r);
+    reg_log_read(NV_PMC, addr, size, r);
     return r;
 }
 static void pmc_write(void *opaque, hwaddr addr,
@@ -3226,7 +7281,7 @@ static void pmc_write(void *opaque, hwaddr addr,
 {
     NV2AState *d = opaque;
 
-    reg_log_write(NV_PMC, addr, val);
+    reg_log_write(NV_PMC, addr, size, val);
 
     switch (addr) {
     case NV_PMC_INTR_0:
@@ -3265,7 +7320,7 @@ static uint64_t pbus_read(void *opaque,
         break;
     }
 
-    reg_log_read(NV_PBUS, addr, r);
+    reg_log_read(NV_PBUS, addr, size, r);
     return r;
 }
 static void pbus_write(void *opaque, hwaddr addr,
@@ -3273,7 +7328,7 @@ static void pbus_write(void *opaque, hwaddr addr,
 {
     NV2AState *d = opaque;
 
-    reg_log_write(NV_PBUS, addr, val);
+    reg_log_write(NV_PBUS, addr, size, val);
 
     switch (addr) {
     case NV_PBUS_PCI_NV_1:
@@ -3397,46 +7452,22 @@ static uint64_t pfifo_read(void *opaque,
         break;
     }
 
-    reg_log_read(NV_PFIFO, addr, r);
+    reg_log_read(NV_PFIFO, addr, size, r);
     return r;
 }
-static void pfifo_write(void *opaque, hwaddr addr,
-                        uint64_t val, unsigned int size)
+/* Writes to registers the pusher works from. Made with the pusher
+ * stopped, so they don't change state under its feet. */
+static void pfifo_write_pusher_state(NV2AState *d, hwaddr addr, uint64_t val)
 {
-    int i;
-    NV2AState *d = opaque;
+    ChannelControl *control;
 
-    reg_log_write(NV_PFIFO, addr, val);
+    pfifo_pusher_hold(d);
+    control = &d->user.channel_control[d->pfifo.cache1.channel_id];
 
     switch (addr) {
-    case NV_PFIFO_INTR_0:
-        d->pfifo.pending_interrupts &= ~val;
-        update_irq(d);
-        break;
-    case NV_PFIFO_INTR_EN_0:
-        d->pfifo.enabled_interrupts = val;
-        update_irq(d);
-        break;
-    case NV_PFIFO_RAMHT:
-        d->pfifo.ramht_address =
-            GET_MASK(val, NV_PFIFO_RAMHT_BASE_ADDRESS) << 12;
-        d->pfifo.ramht_size = 1 << (GET_MASK(val, NV_PFIFO_RAMHT_SIZE)+12);
-        d->pfifo.ramht_search = GET_MASK(val, NV_PFIFO_RAMHT_SEARCH);
-        break;
-    case NV_PFIFO_RAMFC:
-        d->pfifo.ramfc_address1 =
-            GET_MASK(val, NV_PFIFO_RAMFC_BASE_ADDRESS1) << 10;
-        d->pfifo.ramfc_address2 =
-            GET_MASK(val, NV_PFIFO_RAMFC_BASE_ADDRESS2) << 10;
-        d->pfifo.ramfc_size = GET_MASK(val, NV_PFIFO_RAMFC_SIZE);
-        break;
     case NV_PFIFO_MODE:
         d->pfifo.channel_modes = val;
         break;
-    case NV_PFIFO_DMA:
-        d->pfifo.channels_pending_push = val;
-        break;
-
     case NV_PFIFO_CACHE1_PUSH0:
         d->pfifo.cache1.push_enabled = val & NV_PFIFO_CACHE1_PUSH0_ACCESS;
         break;
@@ -3451,7 +7482,7 @@ static void pfifo_write(void *opaque, hwaddr addr,
         if (d->pfifo.cache1.dma_push_suspended
              && !GET_MASK(val, NV_PFIFO_CACHE1_DMA_PUSH_STATUS)) {
             d->pfifo.cache1.dma_push_suspended = false;
-            pfifo_run_pusher(d);
+            pfifo_kick_pusher(d);
         }
         d->pfifo.cache1.dma_push_suspended =
             GET_MASK(val, NV_PFIFO_CACHE1_DMA_PUSH_STATUS);
@@ -3473,10 +7504,10 @@ static void pfifo_write(void *opaque, hwaddr addr,
             GET_MASK(val, NV_PFIFO_CACHE1_DMA_INSTANCE_ADDRESS) << 4;
         break;
     case NV_PFIFO_CACHE1_DMA_PUT:
-        d->user.channel_control[d->pfifo.cache1.channel_id].dma_put = val;
+        atomic_set(&control->dma_put, val);
         break;
     case NV_PFIFO_CACHE1_DMA_GET:
-        d->user.channel_control[d->pfifo.cache1.channel_id].dma_get = val;
+        atomic_set(&control->dma_get, val);
         break;
     case NV_PFIFO_CACHE1_DMA_SUBROUTINE:
         d->pfifo.cache1.subroutine_return =
@@ -3484,6 +7515,60 @@ static void pfifo_write(void *opaque, hwaddr addr,
         d->pfifo.cache1.subroutine_active =
             (val & NV_PFIFO_CACHE1_DMA_SUBROUTINE_STATE);
         break;
+    case NV_PFIFO_CACHE1_DMA_DCOUNT:
+        d->pfifo.cache1.dcount =
+            (val & NV_PFIFO_CACHE1_DMA_DCOUNT_VALUE);
+        break;
+    case NV_PFIFO_CACHE1_DMA_GET_JMP_SHADOW:
+        d->pfifo.cache1.get_jmp_shadow =
+            (val & NV_PFIFO_CACHE1_DMA_GET_JMP_SHADOW_OFFSET);
+        break;
+    case NV_PFIFO_CACHE1_DMA_RSVD_SHADOW:
+        d->pfifo.cache1.rsvd_shadow = val;
+        break;
+    case NV_PFIFO_CACHE1_DMA_DATA_SHADOW:
+        d->pfifo.cache1.data_shadow = val;
+        break;
+    default:
+        break;
+    }
+
+    pfifo_pusher_release(d);
+}
+
+static void pfifo_write(void *opaque, hwaddr addr,
+                        uint64_t val, unsigned int size)
+{
+    int i;
+    NV2AState *d = opaque;
+
+    reg_log_write(NV_PFIFO, addr, size, val);
+
+    switch (addr) {
+    case NV_PFIFO_INTR_0:
+        atomic_and(&d->pfifo.pending_interrupts, ~val);
+        update_irq(d);
+        break;
+    case NV_PFIFO_INTR_EN_0:
+        d->pfifo.enabled_interrupts = val;
+        update_irq(d);
+        break;
+    case NV_PFIFO_RAMHT:
+        d->pfifo.ramht_address =
+            GET_MASK(val, NV_PFIFO_RAMHT_BASE_ADDRESS) << 12;
+        d->pfifo.ramht_size = 1 << (GET_MASK(val, NV_PFIFO_RAMHT_SIZE)+12);
+        d->pfifo.ramht_search = GET_MASK(val, NV_PFIFO_RAMHT_SEARCH);
+        break;
+    case NV_PFIFO_RAMFC:
+        d->pfifo.ramfc_address1 =
+            GET_MASK(val, NV_PFIFO_RAMFC_BASE_ADDRESS1) << 10;
+        d->pfifo.ramfc_address2 =
+            GET_MASK(val, NV_PFIFO_RAMFC_BASE_ADDRESS2) << 10;
+        d->pfifo.ramfc_size = GET_MASK(val, NV_PFIFO_RAMFC_SIZE);
+        break;
+    case NV_PFIFO_DMA:
+        d->pfifo.channels_pending_push = val;
+        break;
     case NV_PFIFO_CACHE1_PULL0:
         qemu_mutex_lock(&d->pfifo.cache1.pull_lock);
         if ((val & NV_PFIFO_CACHE1_PULL0_ACCESS)
@@ -3491,6 +7576,7 @@ static void pfifo_write(void *opaque, hwaddr addr,
             d->pfifo.cache1.pull_enabled = true;
 
             /* fire up puller thread */
+            atomic_set(&d->pfifo.cache1.puller_alive, true);
             qemu_thread_create(&d->pfifo.puller_thread,
                                pfifo_puller_thread,
                                d, QEMU_THREAD_DETACHED);
@@ -3510,60 +7596,199 @@ static void pfifo_write(void *opaque, hwaddr addr,
         }
         qemu_mutex_unlock(&d->pfifo.cache1.pull_lock);
         break;
-    case NV_PFIFO_CACHE1_DMA_DCOUNT:
-        d->pfifo.cache1.dcount =
-            (val & NV_PFIFO_CACHE1_DMA_DCOUNT_VALUE);
+    default:
+        pfifo_write_pusher_state(d, addr, val);
+        break;
+    }
+}
+
+
+static uint64_t prma_read(void *opaque,
+                                  hwaddr addr, unsigned int size)
+{
+    reg_log_read(NV_PRMA, addr, size, 0);
+    return 0;
+}
+static void prma_write(void *opaque, hwaddr addr,
+                               uint64_t val, unsigned int size)
+{
+    reg_log_write(NV_PRMA, addr, size, val);
+}
+
+
+static void pvideo_stop(NV2AState *d)
+{
+    d->pvideo.current_buffer = -1;
+    d->pvideo.stop_pending = false;
+    d->pvideo.regs[NV_PVIDEO_BUFFER] = 0;
+}
+
+static uint32_t pvideo_buffer_use(int i)
+{
+    return i ? NV_PVIDEO_BUFFER_1_USE : NV_PVIDEO_BUFFER_0_USE;
+}
+
+/* Called at vblank. Scan out the next buffer the guest has handed over
+ * and tell it that the buffer has been taken. */
+static void pvideo_vblank(NV2AState *d)
+{
+    uint32_t buffer = d->pvideo.regs[NV_PVIDEO_BUFFER];
+    int i;
+
+    if (d->pvideo.stop_pending) {
+        pvideo_stop(d);
+        return;
+    }
+
+    /* if both are queued, alternate */
+    i = d->pvideo.current_buffer == 0 ? 1 : 0;
+    if (!(buffer & pvideo_buffer_use(i))) {
+        i ^= 1;
+        if (!(buffer & pvideo_buffer_use(i))) {
+            return;
+        }
+    }
+
+    trace_nv2a_pvideo_buffer(i);
+    d->pvideo.current_buffer = i;
+    d->pvideo.regs[NV_PVIDEO_BUFFER] &= ~pvideo_buffer_use(i);
+    d->pvideo.pending_interrupts |= i ? NV_PVIDEO_INTR_BUFFER_1
+                                      : NV_PVIDEO_INTR_BUFFER_0;
+}
+
+static uint64_t pvideo_read(void *opaque,
+                                  hwaddr addr, unsigned int size)
+{
+    NV2AState *d = opaque;
+
+    uint64_t r = 0;
+    switch (addr) {
+    case NV_PVIDEO_INTR:
+        r = d->pvideo.pending_interrupts;
+        break;
+    case NV_PVIDEO_INTR_EN:
+        r = d->pvideo.enabled_interrupts;
+        break;
+    case NV_PVIDEO_STOP:
+        r = d->pvideo.current_buffer >= 0 ? 0 : NV_PVIDEO_STOP_OVERLAY_ACTIVE;
+        break;
+    default:
+        r = d->pvideo.regs[addr];
         break;
-    case NV_PFIFO_CACHE1_DMA_GET_JMP_SHADOW:
-        d->pfifo.cache1.get_jmp_shadow =
-            (val & NV_PFIFO_CACHE1_DMA_GET_JMP_SHADOW_OFFSET);
+    }
+
+    reg_log_read(NV_PVIDEO, addr, size, r);
+    return r;
+}
+static void pvideo_write(void *opaque, hwaddr addr,
+                               uint64_t val, unsigned int size)
+{
+    NV2AState *d = opaque;
+
+    reg_log_write(NV_PVIDEO, addr, size, val);
+
+    switch (addr) {
+    case NV_PVIDEO_INTR:
+        d->pvideo.pending_interrupts &= ~val;
+        update_irq(d);
         break;
-    case NV_PFIFO_CACHE1_DMA_RSVD_SHADOW:
-        d->pfifo.cache1.rsvd_shadow = val;
+    case NV_PVIDEO_INTR_EN:
+        d->pvideo.enabled_interrupts = val;
+        update_irq(d);
         break;
-    case NV_PFIFO_CACHE1_DMA_DATA_SHADOW:
-        d->pfifo.cache1.data_shadow = val;
+    case NV_PVIDEO_STOP:
+        if (val & NV_PVIDEO_STOP_OVERLAY_ACTIVE) {
+            if (val & NV_PVIDEO_STOP_METHOD_IMMEDIATELY) {
+                pvideo_stop(d);
+            } else {
+                d->pvideo.stop_pending = true;
+            }
+        }
         break;
     default:
+        d->pvideo.regs[addr] = val;
         break;
     }
 }
 
 
-static uint64_t prma_read(void *opaque,
-                                  hwaddr addr, unsigned int size)
+
+
+/* PIMTER - time measurement and time-based alarms */
+
+/* (ns * mult) >> 32, without overflowing */
+static uint64_t ptimer_scale(uint64_t ns, uint64_t mult)
 {
-    reg_log_read(NV_PRMA, addr, 0);
-    return 0;
+    uint64_t ns_hi = ns >> 32, ns_lo = ns & 0xffffffff;
+    uint64_t mult_hi = mult >> 32, mult_lo = mult & 0xffffffff;
+
+    return ((ns_hi * mult_hi) << 32) + ns_hi * mult_lo + ns_lo * mult_hi
+        + ((ns_lo * mult_lo) >> 32);
 }
-static void prma_write(void *opaque, hwaddr addr,
-                               uint64_t val, unsigned int size)
+
+static uint64_t ptimer_get_clock(NV2AState *d)
 {
-    reg_log_write(NV_PRMA, addr, val);
+    return d->ptimer.ticks_base
+        + ptimer_scale(qemu_get_clock_ns(vm_clock) - d->ptimer.ns_base,
+                       d->ptimer.mult);
 }
 
-
-static uint64_t pvideo_read(void *opaque,
-                                  hwaddr addr, unsigned int size)
+/* Clock ticks per ns, as a 32.32 fixed point multiplier. The clock is
+ * stopped until the driver has programmed the ratio. */
+static void ptimer_update_mult(NV2AState *d)
 {
-    reg_log_read(NV_PVIDEO, addr, 0);
-    return 0;
+    if (d->ptimer.numerator == 0 || d->ptimer.denominator == 0) {
+        d->ptimer.mult = 0;
+        return;
+    }
+    d->ptimer.mult = muldiv64(muldiv64(1ULL << 32, d->ptimer.numerator,
+                                       d->ptimer.denominator),
+                              d->pramdac.core_clock_freq,
+                              get_ticks_per_sec());
 }
-static void pvideo_write(void *opaque, hwaddr addr,
-                               uint64_t val, unsigned int size)
+
+/* Schedule the alarm for when TIME_0 next equals ALARM_0 */
+static void ptimer_arm_alarm(NV2AState *d)
 {
-    reg_log_write(NV_PVIDEO, addr, val);
+    if (d->ptimer.mult == 0) {
+        qemu_del_timer(d->ptimer.alarm_timer);
+        return;
+    }
+
+    int64_t now = qemu_get_clock_ns(vm_clock);
+    uint64_t ticks = d->ptimer.ticks_base
+        + ptimer_scale(now - d->ptimer.ns_base, d->ptimer.mult);
+
+    /* TIME_0 holds the low 27 bits of the clock, so the alarm comes
+     * round again every 2^27 ticks */
+    uint64_t delta = ((d->ptimer.alarm_time >> 5) - ticks) & 0x7ffffff;
+    if (delta == 0) {
+        delta = 0x8000000;
+    }
+
+    qemu_mod_timer(d->ptimer.alarm_timer,
+                   now + DIV_ROUND_UP(delta << 32, d->ptimer.mult));
 }
 
+static void ptimer_alarm(void *opaque)
+{
+    NV2AState *d = opaque;
 
+    trace_nv2a_ptimer_alarm(d->ptimer.alarm_time);
 
+    d->ptimer.pending_interrupts |= NV_PTIMER_INTR_0_ALARM;
+    update_irq(d);
 
-/* PIMTER - time measurement and time-based alarms */
-static uint64_t ptimer_get_clock(NV2AState *d)
+    ptimer_arm_alarm(d);
+}
+
+/* Restart the clock from ticks at the current rate */
+static void ptimer_set_clock(NV2AState *d, uint64_t ticks)
 {
-    return muldiv64(qemu_get_clock_ns(vm_clock),
-                    d->pramdac.core_clock_freq * d->ptimer.numerator,
-                    get_ticks_per_sec() * d->ptimer.denominator);
+    d->ptimer.ns_base = qemu_get_clock_ns(vm_clock);
+    d->ptimer.ticks_base = ticks;
+    ptimer_update_mult(d);
+    ptimer_arm_alarm(d);
 }
 static uint64_t ptimer_read(void *opaque,
                                   hwaddr addr, unsigned int size)
@@ -3594,7 +7819,7 @@ static uint64_t ptimer_read(void *opaque,
         break;
     }
 
-    reg_log_read(NV_PTIMER, addr, r);
+    reg_log_read(NV_PTIMER, addr, size, r);
     return r;
 }
 static void ptimer_write(void *opaque, hwaddr addr,
@@ -3602,7 +7827,7 @@ static void ptimer_write(void *opaque, hwaddr addr,
 {
     NV2AState *d = opaque;
 
-    reg_log_write(NV_PTIMER, addr, val);
+    reg_log_write(NV_PTIMER, addr, size, val);
 
     switch (addr) {
     case NV_PTIMER_INTR_0:
@@ -3613,14 +7838,29 @@ static void ptimer_write(void *opaque, hwaddr addr,
         d->ptimer.enabled_interrupts = val;
         update_irq(d);
         break;
-    case NV_PTIMER_DENOMINATOR:
+    case NV_PTIMER_DENOMINATOR: {
+        uint64_t ticks = ptimer_get_clock(d);
         d->ptimer.denominator = val;
+        ptimer_set_clock(d, ticks);
         break;
-    case NV_PTIMER_NUMERATOR:
+    }
+    case NV_PTIMER_NUMERATOR: {
+        uint64_t ticks = ptimer_get_clock(d);
         d->ptimer.numerator = val;
+        ptimer_set_clock(d, ticks);
+        break;
+    }
+    case NV_PTIMER_TIME_0:
+        ptimer_set_clock(d, (ptimer_get_clock(d) & ~0x7ffffffULL)
+                            | ((val >> 5) & 0x7ffffff));
+        break;
+    case NV_PTIMER_TIME_1:
+        ptimer_set_clock(d, (ptimer_get_clock(d) & 0x7ffffff)
+                            | ((val & 0x1fffffff) << 27));
         break;
     case NV_PTIMER_ALARM_0:
         d->ptimer.alarm_time = val;
+        ptimer_arm_alarm(d);
         break;
     default:
         break;
@@ -3631,52 +7871,52 @@ static void ptimer_write(void *opaque, hwaddr addr,
 static uint64_t pcounter_read(void *opaque,
                                   hwaddr addr, unsigned int size)
 {
-    reg_log_read(NV_PCOUNTER, addr, 0);
+    reg_log_read(NV_PCOUNTER, addr, size, 0);
     return 0;
 }
 static void pcounter_write(void *opaque, hwaddr addr,
                                uint64_t val, unsigned int size)
 {
-    reg_log_write(NV_PCOUNTER, addr, val);
+    reg_log_write(NV_PCOUNTER, addr, size, val);
 }
 
 
 static uint64_t pvpe_read(void *opaque,
                                   hwaddr addr, unsigned int size)
 {
-    reg_log_read(NV_PVPE, addr, 0);
+    reg_log_read(NV_PVPE, addr, size, 0);
     return 0;
 }
 static void pvpe_write(void *opaque, hwaddr addr,
                                uint64_t val, unsigned int size)
 {
-    reg_log_write(NV_PVPE, addr, val);
+    reg_log_write(NV_PVPE, addr, size, val);
 }
 
 
 static uint64_t ptv_read(void *opaque,
                                   hwaddr addr, unsigned int size)
 {
-    reg_log_read(NV_PTV, addr, 0);
+    reg_log_read(NV_PTV, addr, size, 0);
     return 0;
 }
 static void ptv_write(void *opaque, hwaddr addr,
                                uint64_t val, unsigned int size)
 {
-    reg_log_write(NV_PTV, addr, val);
+    reg_log_write(NV_PTV, addr, size, val);
 }
 
 
 static uint64_t prmfb_read(void *opaque,
                                   hwaddr addr, unsigned int size)
 {
-    reg_log_read(NV_PRMFB, addr, 0);
+    reg_log_read(NV_PRMFB, addr, size, 0);
     return 0;
 }
 static void prmfb_write(void *opaque, hwaddr addr,
                                uint64_t val, unsigned int size)
 {
-    reg_log_write(NV_PRMFB, addr, val);
+    reg_log_write(NV_PRMFB, addr, size, val);
 }
 
 
@@ -3687,7 +7927,7 @@ static uint64_t prmvio_read(void *opaque,
     NV2AState *d = opaque;
     uint64_t r = vga_ioport_read(&d->vga, addr);
 
-    reg_log_read(NV_PRMVIO, addr, r);
+    reg_log_read(NV_PRMVIO, addr, size, r);
     return r;
 }
 static void prmvio_write(void *opaque, hwaddr addr,
@@ -3695,7 +7935,7 @@ static void prmvio_write(void *opaque, hwaddr addr,
 {
     NV2AState *d = opaque;
 
-    reg_log_write(NV_PRMVIO, addr, val);
+    reg_log_write(NV_PRMVIO, addr, size, val);
 
     vga_ioport_write(&d->vga, addr, val);
 }
@@ -3723,7 +7963,7 @@ static uint64_t pfb_read(void *opaque,
         break;
     }
 
-    reg_log_read(NV_PFB, addr, r);
+    reg_log_read(NV_PFB, addr, size, r);
     return r;
 }
 static void pfb_write(void *opaque, hwaddr addr,
@@ -3731,7 +7971,7 @@ static void pfb_write(void *opaque, hwaddr addr,
 {
     NV2AState *d = opaque;
 
-    reg_log_write(NV_PFB, addr, val);
+    reg_log_write(NV_PFB, addr, size, val);
 
     switch (addr) {
     default:
@@ -3744,13 +7984,13 @@ static void pfb_write(void *opaque, hwaddr addr,
 static uint64_t pstraps_read(void *opaque,
                                   hwaddr addr, unsigned int size)
 {
-    reg_log_read(NV_PSTRAPS, addr, 0);
+    reg_log_read(NV_PSTRAPS, addr, size, 0);
     return 0;
 }
 static void pstraps_write(void *opaque, hwaddr addr,
                                uint64_t val, unsigned int size)
 {
-    reg_log_write(NV_PSTRAPS, addr, val);
+    reg_log_write(NV_PSTRAPS, addr, size, val);
 }
 
 /* PGRAPH - accelerated 2d/3d drawing engine */
@@ -3802,7 +8042,7 @@ static uint64_t pgraph_read(void *opaque,
         break;
     }
 
-    reg_log_read(NV_PGRAPH, addr, r);
+    reg_log_read(NV_PGRAPH, addr, size, r);
     return r;
 }
 static void pgraph_set_context_user(NV2AState *d, uint32_t val)
@@ -3819,17 +8059,22 @@ static void pgraph_write(void *opaque, hwaddr addr,
 {
     NV2AState *d = opaque;
 
-    reg_log_write(NV_PGRAPH, addr, val);
+    reg_log_write(NV_PGRAPH, addr, size, val);
 
     switch (addr) {
     case NV_PGRAPH_INTR:
         qemu_mutex_lock(&d->pgraph.lock);
         d->pgraph.pending_interrupts &= ~val;
+        pgraph_ack_interrupt_latency(&d->pgraph);
+        update_irq(d);
         qemu_cond_broadcast(&d->pgraph.interrupt_cond);
         qemu_mutex_unlock(&d->pgraph.lock);
         break;
     case NV_PGRAPH_INTR_EN:
+        qemu_mutex_lock(&d->pgraph.lock);
         d->pgraph.enabled_interrupts = val;
+        update_irq(d);
+        qemu_mutex_unlock(&d->pgraph.lock);
         break;
     case NV_PGRAPH_CTX_CONTROL:
         qemu_mutex_lock(&d->pgraph.lock);
@@ -3843,6 +8088,7 @@ static void pgraph_write(void *opaque, hwaddr addr,
         break;
     case NV_PGRAPH_INCREMENT:
         if (val & NV_PGRAPH_INCREMENT_READ_3D) {
+            atomic_inc(&d->pgraph.read_3d_count);
             qemu_sem_post(&d->pgraph.read_3d);
         }
         break;
@@ -3864,14 +8110,12 @@ static void pgraph_write(void *opaque, hwaddr addr,
         qemu_mutex_lock(&d->pgraph.lock);
 
         if (val & NV_PGRAPH_CHANNEL_CTX_TRIGGER_READ_IN) {
-            NV2A_DPRINTF("PGRAPH: read channel %d context from %llx\n",
-                         d->pgraph.channel_id, d->pgraph.context_address);
-
             uint8_t *context_ptr = d->ramin_ptr + d->pgraph.context_address;
             uint32_t context_user = le32_to_cpupu((uint32_t*)context_ptr);
 
-            NV2A_DPRINTF("    - CTX_USER = 0x%x\n", context_user);
-
+            trace_nv2a_pgraph_context_load(d->pgraph.channel_id,
+                                           d->pgraph.context_address,
+                                           context_user);
 
             pgraph_set_context_user(d, context_user);
         }
@@ -3888,6 +8132,73 @@ static void pgraph_write(void *opaque, hwaddr addr,
 }
 
 
+
+/* Queue a start write to be latched at a coming vblank */
+static void pcrtc_queue_flip(NV2AState *d, hwaddr start)
+{
+    uint64_t interval = d->pcrtc.vblank_count - d->pcrtc.last_start_vblank;
+    uint32_t avg = d->pcrtc.flip_interval;
+
+    d->pcrtc.last_start_vblank = d->pcrtc.vblank_count;
+
+    if (!d->frame_pacing) {
+        /* the last write before vblank wins, as on hardware */
+        d->pcrtc.flip_queue[0] = start;
+        d->pcrtc.flip_queue_len = 1;
+        return;
+    }
+
+    /* longer gaps are loading screens and the like, not the frame rate */
+    if (interval > 0 && interval <= NV2A_FLIP_MAX_HOLD) {
+        int32_t delta = (int32_t)(interval << NV2A_FLIP_INTERVAL_SHIFT)
+                        - (int32_t)avg;
+        d->pcrtc.flip_interval = avg + delta / 4;
+    }
+
+    if (d->pcrtc.flip_queue_len == NV2A_FLIP_QUEUE_LEN) {
+        /* the guest has got ahead of the display, the newest start
+         * replaces the one before it */
+        d->pcrtc.flip_queue[NV2A_FLIP_QUEUE_LEN - 1] = start;
+        trace_nv2a_pcrtc_flip_replaced(start);
+    } else {
+        d->pcrtc.flip_queue[d->pcrtc.flip_queue_len++] = start;
+    }
+}
+
+/* Called at vblank. Latch the oldest queued start into the scanout
+ * address once it's been held long enough. */
+static void pcrtc_latch_flip(NV2AState *d)
+{
+    uint64_t held = d->pcrtc.vblank_count - d->pcrtc.last_flip_vblank;
+    uint32_t target = 1;
+    int i;
+
+    if (d->pcrtc.flip_queue_len == 0) {
+        return;
+    }
+
+    if (d->frame_pacing) {
+        target = (d->pcrtc.flip_interval
+                  + (1 << (NV2A_FLIP_INTERVAL_SHIFT - 1)))
+                    >> NV2A_FLIP_INTERVAL_SHIFT;
+        target = MIN(MAX(target, 1), NV2A_FLIP_MAX_HOLD);
+    }
+    /* a full queue is shown right away rather than dropping frames */
+    if (held < target && d->pcrtc.flip_queue_len < NV2A_FLIP_QUEUE_LEN) {
+        return;
+    }
+
+    d->pcrtc.scanout_start = d->pcrtc.flip_queue[0];
+    d->pcrtc.flip_queue_len--;
+    for (i = 0; i < d->pcrtc.flip_queue_len; i++) {
+        d->pcrtc.flip_queue[i] = d->pcrtc.flip_queue[i + 1];
+    }
+
+    trace_nv2a_pcrtc_flip(d->pcrtc.flip_count, held, target);
+    d->pcrtc.flip_count++;
+    d->pcrtc.last_flip_vblank = d->pcrtc.vblank_count;
+}
+
 static uint64_t pcrtc_read(void *opaque,
                                 hwaddr addr, unsigned int size)
 {
@@ -3908,15 +8219,16 @@ static uint64_t pcrtc_read(void *opaque,
             break;
     }
 
-    reg_log_read(NV_PCRTC, addr, r);
+    reg_log_read(NV_PCRTC, addr, size, r);
     return r;
 }
 static void pcrtc_write(void *opaque, hwaddr addr,
                              uint64_t val, unsigned int size)
 {
     NV2AState *d = opaque;
+    int i;
 
-    reg_log_write(NV_PCRTC, addr, val);
+    reg_log_write(NV_PCRTC, addr, size, val);
 
     switch (addr) {
     case NV_PCRTC_INTR_0:
@@ -3931,6 +8243,18 @@ static void pcrtc_write(void *opaque, hwaddr addr,
         val &= 0x03FFFFFF;
         assert(val < memory_region_size(d->vram));
         d->pcrtc.start = val;
+        pcrtc_queue_flip(d, val);
+
+        /* remember the swap chain for frameskip */
+        for (i = 0; i < NV2A_SCANOUT_HISTORY; i++) {
+            if (atomic_read(&d->pgraph.scanout_surfaces[i]) == val) {
+                break;
+            }
+        }
+        if (i == NV2A_SCANOUT_HISTORY) {
+            i = d->pgraph.scanout_surface_index++ % NV2A_SCANOUT_HISTORY;
+            atomic_set(&d->pgraph.scanout_surfaces[i], val);
+        }
         break;
     default:
         break;
@@ -3945,7 +8269,7 @@ static uint64_t prmcio_read(void *opaque,
     NV2AState *d = opaque;
     uint64_t r = vga_ioport_read(&d->vga, addr);
 
-    reg_log_read(NV_PRMCIO, addr, r);
+    reg_log_read(NV_PRMCIO, addr, size, r);
     return r;
 }
 static void prmcio_write(void *opaque, hwaddr addr,
@@ -3953,7 +8277,7 @@ static void prmcio_write(void *opaque, hwaddr addr,
 {
     NV2AState *d = opaque;
 
-    reg_log_write(NV_PRMCIO, addr, val);
+    reg_log_write(NV_PRMCIO, addr, size, val);
 
     switch (addr) {
     case VGA_ATT_W:
@@ -4004,7 +8328,7 @@ static uint64_t pramdac_read(void *opaque,
     /* Surprisingly, QEMU doesn't handle unaligned access for you properly */
     r >>= 32 - 8 * size - 8 * (addr & 3);
 
-    NV2A_DPRINTF("PRAMDAC: read %d [0x%llx] -> %llx\n", size, addr, r);
+    reg_log_read(NV_PRAMDAC, addr, size, r);
     return r;
 }
 static void pramdac_write(void *opaque, hwaddr addr,
@@ -4013,7 +8337,7 @@ static void pramdac_write(void *opaque, hwaddr addr,
     NV2AState *d = opaque;
     uint32_t m, n, p;
 
-    reg_log_write(NV_PRAMDAC, addr, val);
+    reg_log_write(NV_PRAMDAC, addr, size, val);
 
     switch (addr) {
     case NV_PRAMDAC_NVPLL_COEFF:
@@ -4023,12 +8347,15 @@ static void pramdac_write(void *opaque, hwaddr addr,
         n = (val & NV_PRAMDAC_NVPLL_COEFF_NDIV) >> 8;
         p = (val & NV_PRAMDAC_NVPLL_COEFF_PDIV) >> 16;
 
+        uint64_t ticks = ptimer_get_clock(d);
         if (m == 0) {
             d->pramdac.core_clock_freq = 0;
         } else {
             d->pramdac.core_clock_freq = (NV2A_CRYSTAL_FREQ * n)
                                           / (1 << p) / m;
         }
+        /* ptimer is derived from the core clock */
+        ptimer_set_clock(d, ticks);
 
         break;
     case NV_PRAMDAC_MPLL_COEFF:
@@ -4046,13 +8373,13 @@ static void pramdac_write(void *opaque, hwaddr addr,
 static uint64_t prmdio_read(void *opaque,
                                   hwaddr addr, unsigned int size)
 {
-    reg_log_read(NV_PRMDIO, addr, 0);
+    reg_log_read(NV_PRMDIO, addr, size, 0);
     return 0;
 }
 static void prmdio_write(void *opaque, hwaddr addr,
                                uint64_t val, unsigned int size)
 {
-    reg_log_write(NV_PRMDIO, addr, val);
+    reg_log_write(NV_PRMDIO, addr, size, val);
 }
 
 
@@ -4061,13 +8388,11 @@ static void prmdio_write(void *opaque, hwaddr addr,
 static uint64_t pramin_read(void *opaque,
                                  hwaddr addr, unsigned int size)
 {
-    NV2A_DPRINTF("nv2a PRAMIN: read [0x%llx] -> 0x%llx\n", addr, r);
     return 0;
 }
 static void pramin_write(void *opaque, hwaddr addr,
                               uint64_t val, unsigned int size)
 {
-    NV2A_DPRINTF("nv2a PRAMIN: [0x%llx] = 0x%02llx\n", addr, val);
 }*/
 
 
@@ -4087,10 +8412,10 @@ static uint64_t user_read(void *opaque,
         /* DMA Mode */
         switch (addr & 0xFFFF) {
         case NV_USER_DMA_PUT:
-            r = control->dma_put;
+            r = atomic_read(&control->dma_put);
             break;
         case NV_USER_DMA_GET:
-            r = control->dma_get;
+            r = atomic_read(&control->dma_get);
             break;
         case NV_USER_REF:
             r = control->ref;
@@ -4103,7 +8428,7 @@ static uint64_t user_read(void *opaque,
         assert(false);
     }
 
-    reg_log_read(NV_USER, addr, r);
+    reg_log_read(NV_USER, addr, size, r);
     return r;
 }
 static void user_write(void *opaque, hwaddr addr,
@@ -4111,7 +8436,7 @@ static void user_write(void *opaque, hwaddr addr,
 {
     NV2AState *d = opaque;
 
-    reg_log_write(NV_USER, addr, val);
+    reg_log_write(NV_USER, addr, size, val);
 
     unsigned int channel_id = addr >> 16;
     assert(channel_id < NV2A_NUM_CHANNELS);
@@ -4122,14 +8447,18 @@ static void user_write(void *opaque, hwaddr addr,
         /* DMA Mode */
         switch (addr & 0xFFFF) {
         case NV_USER_DMA_PUT:
-            control->dma_put = val;
+            atomic_set(&control->dma_put, val);
 
             if (d->pfifo.cache1.push_enabled) {
-                pfifo_run_pusher(d);
+                qemu_mutex_lock(&d->pfifo.pusher_lock);
+                pfifo_kick_pusher(d);
+                qemu_mutex_unlock(&d->pfifo.pusher_lock);
             }
             break;
         case NV_USER_DMA_GET:
-            control->dma_get = val;
+            pfifo_pusher_hold(d);
+            atomic_set(&control->dma_get, val);
+            pfifo_pusher_release(d);
             break;
         case NV_USER_REF:
             control->ref = val;
@@ -4337,158 +8666,1126 @@ static const struct NV2ABlockInfo blocktable[] = {
     },
 };
 
-static const char* nv2a_reg_names[] = {};
-static const char* nv2a_method_names[] = {};
+static inline void reg_log_read(int block, hwaddr addr, unsigned int size,
+                                uint64_t val)
+{
+    trace_nv2a_reg_read(blocktable[block].name, addr, size, val);
+}
+
+static inline void reg_log_write(int block, hwaddr addr, unsigned int size,
+                                 uint64_t val)
+{
+    trace_nv2a_reg_write(blocktable[block].name, addr, size, val);
+}
+
+
+static int nv2a_get_bpp(VGACommonState *s)
+{
+    if ((s->cr[0x28] & 3) == 3) {
+        return 32;
+    }
+    return (s->cr[0x28] & 3) * 8;
+}
+
+static void nv2a_get_offsets(VGACommonState *s,
+                             uint32_t *pline_offset,
+                             uint32_t *pstart_addr,
+                             uint32_t *pline_compare)
+{
+    NV2AState *d = container_of(s, NV2AState, vga);
+    uint32_t start_addr, line_offset, line_compare;
+
+    line_offset = s->cr[0x13]
+        | ((s->cr[0x19] & 0xe0) << 3)
+        | ((s->cr[0x25] & 0x20) << 6);
+    line_offset <<= 3;
+    *pline_offset = line_offset;
+
+    start_addr = d->pcrtc.scanout_start / 4;
+    *pstart_addr = start_addr;
+
+    line_compare = s->cr[VGA_CRTC_LINE_COMPARE] |
+        ((s->cr[VGA_CRTC_OVERFLOW] & 0x10) << 4) |
+        ((s->cr[VGA_CRTC_MAX_SCAN] & 0x40) << 3);
+    *pline_compare = line_compare;
+}
+
+
+/* Frame period from the video PLL and the programmed CRTC totals.
+ * Returns 0 if the timings don't look like a real mode. */
+static int64_t nv2a_video_frame_period(NV2AState *d)
+{
+    VGACommonState *s = &d->vga;
+    uint32_t coeff = d->pramdac.video_clock_coeff;
+    unsigned int m = GET_MASK(coeff, NV_PRAMDAC_VPLL_COEFF_MDIV);
+    unsigned int n = GET_MASK(coeff, NV_PRAMDAC_VPLL_COEFF_NDIV);
+    unsigned int p = GET_MASK(coeff, NV_PRAMDAC_VPLL_COEFF_PDIV);
+    uint64_t pixel_clock;
+    unsigned int htotal, vtotal;
+    int64_t period;
+
+    if (m == 0) {
+        return 0;
+    }
+    pixel_clock = ((uint64_t)NV2A_CRYSTAL_FREQ * n) / (m << p);
+
+    htotal = s->cr[VGA_CRTC_H_TOTAL]
+        | ((s->cr[0x2D] & 0x01) << 8);
+    htotal = (htotal + 5) * 8;
+
+    vtotal = s->cr[VGA_CRTC_V_TOTAL]
+        | ((s->cr[VGA_CRTC_OVERFLOW] & 0x01) << 8)
+        | ((s->cr[VGA_CRTC_OVERFLOW] & 0x20) << 4)
+        | ((s->cr[0x25] & 0x01) << 10);
+    vtotal += 2;
+
+    if (pixel_clock == 0) {
+        return 0;
+    }
+    period = muldiv64((uint64_t)htotal * vtotal, get_ticks_per_sec(),
+                      pixel_clock);
+
+    /* anything outside 24-120Hz is a half-programmed mode */
+    if (period < get_ticks_per_sec() / 120
+        || period > get_ticks_per_sec() / 24) {
+        return 0;
+    }
+    return period;
+}
+
+static int64_t nv2a_vblank_period(NV2AState *d)
+{
+    int64_t period;
+
+    if (d->vblank_rate) {
+        return get_ticks_per_sec() / d->vblank_rate;
+    }
+    period = nv2a_video_frame_period(d);
+    if (period == 0) {
+        period = get_ticks_per_sec() / NV2A_DEFAULT_VBLANK_RATE;
+    }
+    return period;
+}
+
+/* Runs on vm_clock, so the guest sees a steady vblank no matter how often
+ * (or whether) the display backend refreshes. */
+static void nv2a_vblank_tick(void *opaque)
+{
+    NV2AState *d = opaque;
+    int64_t now = qemu_get_clock_ns(vm_clock);
+    int64_t period = nv2a_vblank_period(d);
+
+    atomic_set(&d->pcrtc.vblank_period, period);
+    d->pcrtc.vblank_count++;
+
+    /* the display only ever sees completed frames */
+    pcrtc_latch_flip(d);
+
+    pvideo_vblank(d);
+
+    d->pcrtc.pending_interrupts |= NV_PCRTC_INTR_0_VBLANK;
+    update_irq(d);
+
+    /* schedule against the ideal timeline so the rate doesn't drift, but
+     * drop vblanks rather than firing a burst if we've fallen behind */
+    d->pcrtc.vblank_next += period;
+    if (now - d->pcrtc.vblank_next > period * NV2A_VBLANK_MAX_CATCHUP) {
+        int64_t missed = (now - d->pcrtc.vblank_next) / period;
+        d->pcrtc.vblanks_dropped += missed;
+        d->pcrtc.vblank_next = now + period;
+        trace_nv2a_pcrtc_vblank_missed(missed);
+    }
+    qemu_mod_timer(d->pcrtc.vblank_timer, d->pcrtc.vblank_next);
+}
+
+/* Scale and convert one overlay row into the composited scanout line.
+ * Returns false if the row isn't inside the buffer. */
+static bool pvideo_draw_row(NV2AState *d, int i, unsigned int row,
+                            const uint8_t *fb_line, int depth,
+                            uint32_t *out, int width)
+{
+    uint32_t *regs = d->pvideo.regs;
+    uint32_t line[NV_PVIDEO_SIZE_IN_WIDTH + 1];
+    hwaddr vram_size = memory_region_size(d->vram);
+
+    unsigned int in_width = GET_MASK(regs[NV_PVIDEO_SIZE_IN(i)],
+                                     NV_PVIDEO_SIZE_IN_WIDTH);
+    unsigned int in_s = GET_MASK(regs[NV_PVIDEO_POINT_IN(i)],
+                                 NV_PVIDEO_POINT_IN_S);
+    uint32_t ds_dx = regs[NV_PVIDEO_DS_DX(i)];
+    int out_x = GET_MASK(regs[NV_PVIDEO_POINT_OUT(i)],
+                         NV_PVIDEO_POINT_OUT_X);
+    int out_width = GET_MASK(regs[NV_PVIDEO_SIZE_OUT(i)],
+                             NV_PVIDEO_SIZE_OUT_WIDTH);
+    uint32_t format = regs[NV_PVIDEO_FORMAT(i)];
+    unsigned int pitch = GET_MASK(format, NV_PVIDEO_FORMAT_PITCH);
+    bool color_key = format & NV_PVIDEO_FORMAT_DISPLAY;
+    uint32_t key = regs[NV_PVIDEO_COLOR_KEY];
+
+    hwaddr limit = regs[NV_PVIDEO_LIMIT(i)] & 0x03FFFFFF;
+    hwaddr addr = ((regs[NV_PVIDEO_BASE(i)] + regs[NV_PVIDEO_OFFSET(i)])
+                      & 0x03FFFFFF) + (hwaddr)row * pitch;
+    hwaddr len = ((in_width + 1) & ~1) * 2;
+
+    if (in_width == 0 || addr + len > MIN(limit + 1, vram_size)) {
+        return false;
+    }
+
+    if (GET_MASK(format, NV_PVIDEO_FORMAT_COLOR)
+            == NV_PVIDEO_FORMAT_COLOR_LE_CR8YB8CB8YA8) {
+        yuv_convert_yuy2(d->vram_ptr + addr, in_width, line);
+    } else {
+        yuv_convert_uyvy(d->vram_ptr + addr, in_width, line);
+    }
+
+    if (ds_dx == 0) {
+        ds_dx = 1 << 20;
+    }
+
+    /* in_s is 12.4 and ds_dx 12.20 fixed point */
+    int x_start = MAX(out_x, 0);
+    int x_end = MIN(out_x + out_width, width);
+    uint64_t s = ((uint64_t)in_s << 16)
+                    + (uint64_t)(x_start - out_x) * ds_dx;
+    int x;
+    for (x = x_start; x < x_end; x++, s += ds_dx) {
+        if (color_key) {
+            uint32_t pixel;
+            if (depth == 32) {
+                pixel = le32_to_cpupu((uint32_t*)(fb_line + x * 4))
+                            & 0xFFFFFF;
+                key &= 0xFFFFFF;
+            } else {
+                pixel = le16_to_cpupu((uint16_t*)(fb_line + x * 2));
+                key &= 0xFFFF;
+            }
+            if (pixel != key) {
+                continue;
+            }
+        }
+        out[x] = line[MIN(s >> 20, in_width - 1)];
+    }
+
+    return true;
+}
+
+/* With the overlay up, the console gets a copy of the scanout with the
+ * video composited over it, since vga would otherwise show vram
+ * directly. Returns false if vga should draw the frame itself. */
+static bool pvideo_composite(NV2AState *d)
+{
+    VGACommonState *vga = &d->vga;
+    DisplaySurface *surface;
+    uint32_t *regs = d->pvideo.regs;
+    int i = d->pvideo.current_buffer;
+    int width, height, depth;
+    uint32_t line_offset, start_addr, line_compare;
+    hwaddr fb_addr;
+    int x, y;
+
+    if (i < 0 || !(vga->gr[VGA_GFX_MISC] & 1)) {
+        return false;
+    }
+
+    depth = vga->get_bpp(vga);
+    if (depth != 16 && depth != 32) {
+        return false;
+    }
+
+    vga->get_resolution(vga, &width, &height);
+    vga->get_offsets(vga, &line_offset, &start_addr, &line_compare);
+    fb_addr = start_addr * 4;
+    if (width <= 0 || height <= 0
+        || fb_addr + (hwaddr)line_offset * height
+               > memory_region_size(d->vram)) {
+        return false;
+    }
+
+    surface = qemu_console_surface(vga->con);
+    if (!d->pvideo.composited
+        || surface_width(surface) != width
+        || surface_height(surface) != height) {
+        surface = qemu_create_displaysurface(width, height);
+        dpy_gfx_replace_surface(vga->con, surface);
+        d->pvideo.composited = true;
+    }
+
+    unsigned int in_height = GET_MASK(regs[NV_PVIDEO_SIZE_IN(i)],
+                                      NV_PVIDEO_SIZE_IN_HEIGHT);
+    unsigned int in_t = GET_MASK(regs[NV_PVIDEO_POINT_IN(i)],
+                                 NV_PVIDEO_POINT_IN_T);
+    uint32_t dt_dy = regs[NV_PVIDEO_DT_DY(i)];
+    int out_y = GET_MASK(regs[NV_PVIDEO_POINT_OUT(i)],
+                         NV_PVIDEO_POINT_OUT_Y);
+    int out_height = GET_MASK(regs[NV_PVIDEO_SIZE_OUT(i)],
+                              NV_PVIDEO_SIZE_OUT_HEIGHT);
+
+    if (dt_dy == 0) {
+        dt_dy = 1 << 20;
+    }
+
+    for (y = 0; y < height; y++) {
+        const uint8_t *fb_line = d->vram_ptr + fb_addr + y * line_offset;
+        uint32_t *out = (uint32_t *)((uint8_t *)surface_data(surface)
+                                        + y * surface_stride(surface));
+
+        if (depth == 32) {
+            memcpy(out, fb_line, width * 4);
+        } else {
+            for (x = 0; x < width; x++) {
+                uint16_t p = le16_to_cpupu((uint16_t*)(fb_line + x * 2));
+                out[x] = ((p & 0xF800) << 8) | ((p & 0xE000) << 3)
+                       | ((p & 0x07E0) << 5) | ((p & 0x0600) >> 1)
+                       | ((p & 0x001F) << 3) | ((p & 0x001C) >> 2);
+            }
+        }
+
+        if (y >= out_y && y < out_y + out_height && in_height) {
+            /* in_t is 12.3 and dt_dy 12.20 fixed point */
+            uint64_t t = ((uint64_t)in_t << 17)
+                            + (uint64_t)(y - out_y) * dt_dy;
+            pvideo_draw_row(d, i, MIN(t >> 20, in_height - 1),
+                            fb_line, depth, out, width);
+        }
+    }
+
+    dpy_gfx_update(vga->con, 0, 0, width, height);
+    return true;
+}
+
+static void nv2a_vga_gfx_update(void *opaque)
+{
+    VGACommonState *vga = opaque;
+    NV2AState *d = container_of(vga, NV2AState, vga);
+
+    if (pvideo_composite(d)) {
+        return;
+    }
+    if (d->pvideo.composited) {
+        /* hand the console back to vga */
+        d->pvideo.composited = false;
+        vga->hw_ops->invalidate(vga);
+    }
+    vga->hw_ops->gfx_update(vga);
+}
+
+static void nv2a_init_memory(NV2AState *d, MemoryRegion *ram)
+{
+    /* xbox is UMA - vram *is* ram */
+    d->vram = ram;
+
+     /* PCI exposed vram */
+    memory_region_init_alias(&d->vram_pci, OBJECT(d), "nv2a-vram-pci", d->vram,
+                             0, memory_region_size(d->vram));
+    pci_register_bar(&d->dev, 1, PCI_BASE_ADDRESS_MEM_PREFETCH, &d->vram_pci);
+
+
+    /* RAMIN - should be in vram somewhere, but not quite sure where atm */
+    memory_region_init_ram(&d->ramin, OBJECT(d), "nv2a-ramin", 0x100000);
+    /* memory_region_init_alias(&d->ramin, "nv2a-ramin", &d->vram,
+                         memory_region_size(&d->vram) - 0x100000,
+                         0x100000); */
+
+    memory_region_add_subregion(&d->mmio, 0x700000, &d->ramin);
+
+
+    d->vram_ptr = memory_region_get_ram_ptr(d->vram);
+    d->ramin_ptr = memory_region_get_ram_ptr(&d->ramin);
+    d->vram_page_generation = g_new0(uint64_t,
+        memory_region_size(d->vram) >> TARGET_PAGE_BITS);
+
+    memory_region_set_log(d->vram, true, DIRTY_MEMORY_NV2A);
+    /* guest writes to ramin invalidate the decoded object caches */
+    memory_region_set_log(&d->ramin, true, DIRTY_MEMORY_NV2A);
+
+    /* hacky. swap out vga's vram */
+    memory_region_destroy(&d->vga.vram);
+    memory_region_init_alias(&d->vga.vram, OBJECT(d), "vga.vram",
+                             d->vram, 0, memory_region_size(d->vram));
+    d->vga.vram_ptr = memory_region_get_ram_ptr(&d->vga.vram);
+    vga_dirty_log_start(&d->vga);
+}
+
+/* Snapshots. The fifo threads are stopped along with the vm, so the
+ * state below only changes under the main loop while it's saved or
+ * loaded. GL objects aren't saved: they're rebuilt lazily from vram and
+ * the method state as they're next used. */
+
+static void pfifo_pause(NV2AState *d)
+{
+    Cache1State *state = &d->pfifo.cache1;
+
+    pfifo_pusher_hold(d);
+    d->pfifo.pusher_paused = true;
+    pfifo_pusher_release(d);
+
+    qemu_mutex_lock(&state->cache_lock);
+    state->paused = true;
+    qemu_cond_broadcast(&state->cache_cond);
+    while (atomic_read(&state->puller_alive)
+           && state->puller_state != PULLER_PARKED
+           && state->puller_state != PULLER_BLOCKED) {
+        qemu_cond_wait(&state->pause_cond, &state->cache_lock);
+    }
+    qemu_mutex_unlock(&state->cache_lock);
+}
+
+static void pfifo_resume(NV2AState *d)
+{
+    Cache1State *state = &d->pfifo.cache1;
+
+    qemu_mutex_lock(&state->cache_lock);
+    state->paused = false;
+    qemu_cond_broadcast(&state->cache_cond);
+    qemu_cond_broadcast(&state->pause_cond);
+    qemu_mutex_unlock(&state->cache_lock);
+
+    qemu_mutex_lock(&d->pfifo.pusher_lock);
+    d->pfifo.pusher_paused = false;
+    qemu_cond_signal(&d->pfifo.pusher_cond);
+    qemu_mutex_unlock(&d->pfifo.pusher_lock);
+}
+
+static void nv2a_vm_state_change(void *opaque, int running, RunState state)
+{
+    NV2AState *d = opaque;
+
+    if (running) {
+        pfifo_resume(d);
+    } else {
+        pfifo_pause(d);
+    }
+}
+
+/* A puller blocked on the guest is in the middle of a method. It's got
+ * to let go of it before the state is loaded over it. */
+static void pfifo_abort_puller(NV2AState *d)
+{
+    Cache1State *state = &d->pfifo.cache1;
+    PGRAPHState *pg = &d->pgraph;
+
+    qemu_mutex_lock(&state->cache_lock);
+    if (state->puller_state != PULLER_BLOCKED) {
+        qemu_mutex_unlock(&state->cache_lock);
+        return;
+    }
+    state->puller_abort = true;
+    qemu_cond_broadcast(&state->pause_cond);
+    qemu_mutex_unlock(&state->cache_lock);
+
+    qemu_mutex_lock(&pg->lock);
+    qemu_cond_broadcast(&pg->interrupt_cond);
+    qemu_cond_broadcast(&pg->fifo_access_cond);
+    if (pg->flip_stalled) {
+        atomic_inc(&pg->read_3d_count);
+        qemu_sem_post(&pg->read_3d);
+    }
+    qemu_mutex_unlock(&pg->lock);
+
+    qemu_mutex_lock(&state->cache_lock);
+    while (atomic_read(&state->puller_alive)
+           && state->puller_state != PULLER_PARKED) {
+        qemu_cond_wait(&state->pause_cond, &state->cache_lock);
+    }
+    state->puller_abort = false;
+    qemu_mutex_unlock(&state->cache_lock);
+}
+
+static void put_cache_entry(QEMUFile *f, const CacheEntry *command)
+{
+    qemu_put_be32(f, command->method);
+    qemu_put_byte(f, command->subchannel);
+    qemu_put_byte(f, command->nonincreasing);
+    qemu_put_be32(f, command->parameter);
+}
+
+static void put_pfifo_cache1(QEMUFile *f, void *pv, size_t size)
+{
+    Cache1State *state = pv;
+    CacheEntry *command;
+    int i;
+
+    qemu_put_be32(f, state->channel_id);
+    qemu_put_be32(f, state->mode);
+
+    qemu_put_byte(f, state->push_enabled);
+    qemu_put_byte(f, state->dma_push_enabled);
+    qemu_put_byte(f, state->dma_push_suspended);
+    qemu_put_be64(f, state->dma_instance);
+
+    qemu_put_byte(f, state->method_nonincreasing);
+    qemu_put_be32(f, state->method);
+    qemu_put_be32(f, state->subchannel);
+    qemu_put_be32(f, state->method_count);
+    qemu_put_be32(f, state->dcount);
+    qemu_put_byte(f, state->subroutine_active);
+    qemu_put_be64(f, state->subroutine_return);
+    qemu_put_be64(f, state->get_jmp_shadow);
+    qemu_put_be32(f, state->rsvd_shadow);
+    qemu_put_be32(f, state->data_shadow);
+    qemu_put_be32(f, state->error);
+
+    qemu_put_byte(f, state->pull_enabled);
+    for (i = 0; i < NV2A_NUM_SUBCHANNELS; i++) {
+        qemu_put_be32(f, state->bound_engines[i]);
+    }
+    qemu_put_be32(f, state->last_engine);
+
+    /* the command a blocked puller is in goes first, to be run again */
+    qemu_put_be32(f, state->cache_size + (state->current ? 1 : 0));
+    if (state->current) {
+        put_cache_entry(f, state->current);
+    }
+    QSIMPLEQ_FOREACH(command, &state->cache, entry) {
+        put_cache_entry(f, command);
+    }
+}
+
+static int get_pfifo_cache1(QEMUFile *f, void *pv, size_t size)
+{
+    Cache1State *state = pv;
+    CacheEntry *command;
+    uint32_t count;
+    int i;
+
+    state->channel_id = qemu_get_be32(f);
+    state->mode = qemu_get_be32(f);
+
+    state->push_enabled = qemu_get_byte(f);
+    state->dma_push_enabled = qemu_get_byte(f);
+    state->dma_push_suspended = qemu_get_byte(f);
+    state->dma_instance = qemu_get_be64(f);
+
+    state->method_nonincreasing = qemu_get_byte(f);
+    state->method = qemu_get_be32(f);
+    state->subchannel = qemu_get_be32(f);
+    state->method_count = qemu_get_be32(f);
+    state->dcount = qemu_get_be32(f);
+    state->subroutine_active = qemu_get_byte(f);
+    state->subroutine_return = qemu_get_be64(f);
+    state->get_jmp_shadow = qemu_get_be64(f);
+    state->rsvd_shadow = qemu_get_be32(f);
+    state->data_shadow = qemu_get_be32(f);
+    state->error = qemu_get_be32(f);
+
+    state->pull_enabled = qemu_get_byte(f);
+    for (i = 0; i < NV2A_NUM_SUBCHANNELS; i++) {
+        state->bound_engines[i] = qemu_get_be32(f);
+    }
+    state->last_engine = qemu_get_be32(f);
+
+    qemu_mutex_lock(&state->cache_lock);
+    while (!QSIMPLEQ_EMPTY(&state->cache)) {
+        command = QSIMPLEQ_FIRST(&state->cache);
+        QSIMPLEQ_REMOVE_HEAD(&state->cache, entry);
+        g_free(command);
+    }
+    count = qemu_get_be32(f);
+    for (i = 0; i < count; i++) {
+        command = g_malloc0(sizeof(CacheEntry));
+        command->method = qemu_get_be32(f);
+        command->subchannel = qemu_get_byte(f);
+        command->nonincreasing = qemu_get_byte(f);
+        command->parameter = qemu_get_be32(f);
+        QSIMPLEQ_INSERT_TAIL(&state->cache, command, entry);
+    }
+    state->cache_size = count;
+    qemu_mutex_unlock(&state->cache_lock);
+
+    return 0;
+}
+
+static const VMStateInfo vmstate_info_pfifo_cache1 = {
+    .name = "nv2a_pfifo_cache1",
+    .get  = get_pfifo_cache1,
+    .put  = put_pfifo_cache1,
+};
+
+static void put_kelvin(QEMUFile *f, KelvinState *kelvin)
+{
+    int i, j;
+
+    qemu_put_be64(f, kelvin->dma_notifies);
+    qemu_put_be64(f, kelvin->dma_state);
+    qemu_put_be64(f, kelvin->dma_vertex_a);
+    qemu_put_be64(f, kelvin->dma_vertex_b);
+    qemu_put_be64(f, kelvin->dma_semaphore);
+    qemu_put_be32(f, kelvin->semaphore_offset);
+    qemu_put_be32(f, kelvin->gl_primitive_mode);
+    qemu_put_byte(f, kelvin->enable_vertex_program_write);
+
+    qemu_put_be32(f, kelvin->vertexshader_start_slot);
+    qemu_put_be32(f, kelvin->vertexshader_load_slot);
+    for (i = 0; i < NV2A_VERTEXSHADER_SLOTS; i++) {
+        VertexShader *shader = &kelvin->vertexshaders[i];
+        qemu_put_be32(f, shader->program_length);
+        for (j = 0; j < shader->program_length; j++) {
+            qemu_put_be32(f, shader->program_data[j]);
+        }
+    }
+
+    qemu_put_be32(f, kelvin->constant_load_slot);
+    for (i = 0; i < NV2A_VERTEXSHADER_CONSTANTS; i++) {
+        for (j = 0; j < 4; j++) {
+            qemu_put_be32(f, kelvin->constants[i].data[j]);
+        }
+    }
+
+    for (i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
+        VertexAttribute *attribute = &kelvin->vertex_attributes[i];
+        qemu_put_byte(f, attribute->dma_select);
+        qemu_put_be64(f, attribute->offset);
+        qemu_put_be32(f, attribute->inline_array_offset);
+        qemu_put_be32(f, attribute->inline_value);
+        qemu_put_be32(f, attribute->format);
+        qemu_put_be32(f, attribute->size);
+        qemu_put_be32(f, attribute->count);
+        qemu_put_be32(f, attribute->stride);
+        qemu_put_byte(f, attribute->needs_conversion);
+        qemu_put_be32(f, attribute->converted_size);
+        qemu_put_be32(f, attribute->converted_count);
+        qemu_put_be32(f, attribute->gl_type);
+        qemu_put_byte(f, attribute->gl_normalize);
+    }
 
-static void reg_log_read(int block, hwaddr addr, uint64_t val) {
-    if (blocktable[block].name) {
-        hwaddr naddr = blocktable[block].offset + addr;
-        if (naddr < sizeof(nv2a_reg_names)/sizeof(const char*)
-                && nv2a_reg_names[naddr]) {
-            NV2A_DPRINTF("%s: read [%s] -> 0x%" PRIx64 "\n",
-                    blocktable[block].name, nv2a_reg_names[naddr], val);
+    /* only the part of the batch buffers that's in use */
+    qemu_put_be32(f, kelvin->inline_array_length);
+    for (i = 0; i < kelvin->inline_array_length; i++) {
+        qemu_put_be32(f, kelvin->inline_array[i]);
+    }
+
+    qemu_put_be32(f, kelvin->inline_elements_length);
+    qemu_put_byte(f, kelvin->inline_elements_32);
+    for (i = 0; i < kelvin->inline_elements_length; i++) {
+        if (kelvin->inline_elements_32) {
+            qemu_put_be32(f, kelvin->inline_elements.u32[i]);
         } else {
-            NV2A_DPRINTF("%s: read [" TARGET_FMT_plx "] -> 0x%" PRIx64 "\n",
-                    blocktable[block].name, addr, val);
+            qemu_put_be16(f, kelvin->inline_elements.u16[i]);
         }
-    } else {
-        NV2A_DPRINTF("(%d?): read [" TARGET_FMT_plx "] -> 0x%" PRIx64 "\n",
-                block, addr, val);
+    }
+
+    qemu_put_be32(f, kelvin->inline_buffer_length);
+    for (i = 0; i < kelvin->inline_buffer_length; i++) {
+        InlineVertexBufferEntry *entry = &kelvin->inline_buffer[i];
+        for (j = 0; j < 4; j++) {
+            qemu_put_be32(f, entry->position[j]);
+        }
+        qemu_put_be32(f, entry->diffuse);
     }
 }
 
-static void reg_log_write(int block, hwaddr addr, uint64_t val) {
-    if (blocktable[block].name) {
-        hwaddr naddr = blocktable[block].offset + addr;
-        if (naddr < sizeof(nv2a_reg_names)/sizeof(const char*)
-                && nv2a_reg_names[naddr]) {
-            NV2A_DPRINTF("%s: [%s] = 0x%" PRIx64 "\n",
-                    blocktable[block].name, nv2a_reg_names[naddr], val);
-        } else {
-            NV2A_DPRINTF("%s: [" TARGET_FMT_plx "] = 0x%" PRIx64 "\n",
-                    blocktable[block].name, addr, val);
+static int get_kelvin(QEMUFile *f, KelvinState *kelvin)
+{
+    int i, j;
+
+    kelvin->dma_notifies = qemu_get_be64(f);
+    kelvin->dma_state = qemu_get_be64(f);
+    kelvin->dma_vertex_a = qemu_get_be64(f);
+    kelvin->dma_vertex_b = qemu_get_be64(f);
+    kelvin->dma_semaphore = qemu_get_be64(f);
+    kelvin->semaphore_offset = qemu_get_be32(f);
+    kelvin->gl_primitive_mode = qemu_get_be32(f);
+    kelvin->enable_vertex_program_write = qemu_get_byte(f);
+
+    kelvin->vertexshader_start_slot = qemu_get_be32(f);
+    kelvin->vertexshader_load_slot = qemu_get_be32(f);
+    if (kelvin->vertexshader_start_slot >= NV2A_VERTEXSHADER_SLOTS) {
+        return -EINVAL;
+    }
+    for (i = 0; i < NV2A_VERTEXSHADER_SLOTS; i++) {
+        VertexShader *shader = &kelvin->vertexshaders[i];
+        shader->program_length = qemu_get_be32(f);
+        if (shader->program_length > NV2A_MAX_VERTEXSHADER_LENGTH) {
+            return -EINVAL;
         }
-    } else {
-        NV2A_DPRINTF("(%d?): [" TARGET_FMT_plx "] = 0x%" PRIx64 "\n",
-                block, addr, val);
-    }
-}
-static void pgraph_method_log(unsigned int subchannel,
-                              unsigned int graphics_class,
-                              unsigned int method, uint32_t parameter) {
-    static unsigned int last = 0;
-    static unsigned int count = 0;
-    if (last == 0x1800 && method != last) {
-        NV2A_DPRINTF("pgraph method (%d) 0x%x * %d\n",
-                        subchannel, last, count);  
-    }
-    if (method != 0x1800) {
-        const char* method_name = NULL;
-        unsigned int nmethod = 0;
-        switch (graphics_class) {
-            case NV_KELVIN_PRIMITIVE:
-                nmethod = method | (0x5c << 16);
-                break;
-            case NV_CONTEXT_SURFACES_2D:
-                nmethod = method | (0x6d << 16);
-                break;
-            default:
-                break;
+        for (j = 0; j < shader->program_length; j++) {
+            shader->program_data[j] = qemu_get_be32(f);
         }
-        if (nmethod != 0
-            && nmethod < sizeof(nv2a_method_names)/sizeof(const char*)) {
-            method_name = nv2a_method_names[nmethod];
+        shader->dirty = true;
+    }
+
+    kelvin->constant_load_slot = qemu_get_be32(f);
+    for (i = 0; i < NV2A_VERTEXSHADER_CONSTANTS; i++) {
+        for (j = 0; j < 4; j++) {
+            kelvin->constants[i].data[j] = qemu_get_be32(f);
         }
-        if (method_name) {
-            NV2A_DPRINTF("pgraph method (%d): %s (0x%x)\n",
-                     subchannel, method_name, parameter);
+        kelvin->constants[i].dirty = true;
+    }
+
+    for (i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
+        VertexAttribute *attribute = &kelvin->vertex_attributes[i];
+        attribute->dma_select = qemu_get_byte(f);
+        attribute->offset = qemu_get_be64(f);
+        attribute->inline_array_offset = qemu_get_be32(f);
+        attribute->inline_value = qemu_get_be32(f);
+        attribute->format = qemu_get_be32(f);
+        attribute->size = qemu_get_be32(f);
+        attribute->count = qemu_get_be32(f);
+        attribute->stride = qemu_get_be32(f);
+        attribute->needs_conversion = qemu_get_byte(f);
+        attribute->converted_size = qemu_get_be32(f);
+        attribute->converted_count = qemu_get_be32(f);
+        attribute->gl_type = qemu_get_be32(f);
+        attribute->gl_normalize = qemu_get_byte(f);
+        attribute->converted_elements = 0;
+    }
+
+    kelvin->inline_array_length = qemu_get_be32(f);
+    if (kelvin->inline_array_length > NV2A_MAX_BATCH_LENGTH) {
+        return -EINVAL;
+    }
+    for (i = 0; i < kelvin->inline_array_length; i++) {
+        kelvin->inline_array[i] = qemu_get_be32(f);
+    }
+
+    kelvin->inline_elements_length = qemu_get_be32(f);
+    kelvin->inline_elements_32 = qemu_get_byte(f);
+    if (kelvin->inline_elements_length > NV2A_MAX_BATCH_LENGTH) {
+        return -EINVAL;
+    }
+    for (i = 0; i < kelvin->inline_elements_length; i++) {
+        if (kelvin->inline_elements_32) {
+            kelvin->inline_elements.u32[i] = qemu_get_be32(f);
         } else {
-            NV2A_DPRINTF("pgraph method (%d): 0x%x -> 0x%04x (0x%x)\n",
-                     subchannel, graphics_class, method, parameter);
+            kelvin->inline_elements.u16[i] = qemu_get_be16(f);
         }
+    }
 
+    kelvin->inline_buffer_length = qemu_get_be32(f);
+    if (kelvin->inline_buffer_length > NV2A_MAX_BATCH_LENGTH) {
+        return -EINVAL;
+    }
+    for (i = 0; i < kelvin->inline_buffer_length; i++) {
+        InlineVertexBufferEntry *entry = &kelvin->inline_buffer[i];
+        for (j = 0; j < 4; j++) {
+            entry->position[j] = qemu_get_be32(f);
+        }
+        entry->diffuse = qemu_get_be32(f);
     }
-    if (method == last) { count++; }
-    else {count = 0; }
-    last = method;
-}
 
+    return 0;
+}
 
-static int nv2a_get_bpp(VGACommonState *s)
+static void put_graphics_object(QEMUFile *f, void *pv, size_t size)
 {
-    if ((s->cr[0x28] & 3) == 3) {
-        return 32;
+    GraphicsObject *obj = pv;
+    ContextSurfaces2DState *context_surfaces_2d
+        = &obj->data.context_surfaces_2d;
+    ImageBlitState *image_blit = &obj->data.image_blit;
+
+    qemu_put_byte(f, obj->graphics_class);
+
+    switch (obj->graphics_class) {
+    case NV_CONTEXT_SURFACES_2D:
+        qemu_put_be64(f, context_surfaces_2d->dma_image_source);
+        qemu_put_be64(f, context_surfaces_2d->dma_image_dest);
+        qemu_put_be32(f, context_surfaces_2d->color_format);
+        qemu_put_be32(f, context_surfaces_2d->source_pitch);
+        qemu_put_be32(f, context_surfaces_2d->dest_pitch);
+        qemu_put_be64(f, context_surfaces_2d->source_offset);
+        qemu_put_be64(f, context_surfaces_2d->dest_offset);
+        break;
+    case NV_IMAGE_BLIT:
+        qemu_put_be64(f, image_blit->context_surfaces);
+        qemu_put_be32(f, image_blit->operation);
+        qemu_put_be32(f, image_blit->in_x);
+        qemu_put_be32(f, image_blit->in_y);
+        qemu_put_be32(f, image_blit->out_x);
+        qemu_put_be32(f, image_blit->out_y);
+        qemu_put_be32(f, image_blit->width);
+        qemu_put_be32(f, image_blit->height);
+        break;
+    case NV_KELVIN_PRIMITIVE:
+        put_kelvin(f, &obj->data.kelvin);
+        break;
+    default:
+        break;
     }
-    return (s->cr[0x28] & 3) * 8;
 }
 
-static void nv2a_get_offsets(VGACommonState *s,
-                             uint32_t *pline_offset,
-                             uint32_t *pstart_addr,
-                             uint32_t *pline_compare)
+static int get_graphics_object(QEMUFile *f, void *pv, size_t size)
 {
-    NV2AState *d = container_of(s, NV2AState, vga);
-    uint32_t start_addr, line_offset, line_compare;
+    GraphicsObject *obj = pv;
+    ContextSurfaces2DState *context_surfaces_2d
+        = &obj->data.context_surfaces_2d;
+    ImageBlitState *image_blit = &obj->data.image_blit;
+    KelvinState *kelvin = &obj->data.kelvin;
+    uint8_t graphics_class;
 
-    line_offset = s->cr[0x13]
-        | ((s->cr[0x19] & 0xe0) << 3)
-        | ((s->cr[0x25] & 0x20) << 6);
-    line_offset <<= 3;
-    *pline_offset = line_offset;
+    graphics_class = qemu_get_byte(f);
 
-    start_addr = d->pcrtc.start / 4;
-    *pstart_addr = start_addr;
+    /* always into a fresh set (see nv2a_pre_load), so there's nothing
+     * here to release */
+    assert(!obj->graphics_class);
+    obj->graphics_class = graphics_class;
 
-    line_compare = s->cr[VGA_CRTC_LINE_COMPARE] |
-        ((s->cr[VGA_CRTC_OVERFLOW] & 0x10) << 4) |
-        ((s->cr[VGA_CRTC_MAX_SCAN] & 0x40) << 3);
-    *pline_compare = line_compare;
+    switch (obj->graphics_class) {
+    case NV_CONTEXT_SURFACES_2D:
+        context_surfaces_2d->dma_image_source = qemu_get_be64(f);
+        context_surfaces_2d->dma_image_dest = qemu_get_be64(f);
+        context_surfaces_2d->color_format = qemu_get_be32(f);
+        context_surfaces_2d->source_pitch = qemu_get_be32(f);
+        context_surfaces_2d->dest_pitch = qemu_get_be32(f);
+        context_surfaces_2d->source_offset = qemu_get_be64(f);
+        context_surfaces_2d->dest_offset = qemu_get_be64(f);
+        break;
+    case NV_IMAGE_BLIT:
+        image_blit->context_surfaces = qemu_get_be64(f);
+        image_blit->operation = qemu_get_be32(f);
+        image_blit->in_x = qemu_get_be32(f);
+        image_blit->in_y = qemu_get_be32(f);
+        image_blit->out_x = qemu_get_be32(f);
+        image_blit->out_y = qemu_get_be32(f);
+        image_blit->width = qemu_get_be32(f);
+        image_blit->height = qemu_get_be32(f);
+        break;
+    case NV_KELVIN_PRIMITIVE:
+        return get_kelvin(f, kelvin);
+    default:
+        break;
+    }
+
+    return 0;
 }
 
+static const VMStateInfo vmstate_info_graphics_object = {
+    .name = "nv2a_graphics_object",
+    .get  = get_graphics_object,
+    .put  = put_graphics_object,
+};
 
-static void nv2a_vga_gfx_update(void *opaque)
+static void put_float(QEMUFile *f, void *pv, size_t size)
 {
-    VGACommonState *vga = opaque;
-    vga->hw_ops->gfx_update(vga);
+    uint32_t v;
+    memcpy(&v, pv, sizeof(v));
+    qemu_put_be32(f, v);
+}
 
-    NV2AState *d = container_of(vga, NV2AState, vga);
-    d->pcrtc.pending_interrupts |= NV_PCRTC_INTR_0_VBLANK;
-    update_irq(d);
+static int get_float(QEMUFile *f, void *pv, size_t size)
+{
+    uint32_t v = qemu_get_be32(f);
+    memcpy(pv, &v, sizeof(v));
+    return 0;
 }
 
-static void nv2a_init_memory(NV2AState *d, MemoryRegion *ram)
+static const VMStateInfo vmstate_info_float = {
+    .name = "float",
+    .get  = get_float,
+    .put  = put_float,
+};
+
+static const VMStateDescription vmstate_nv2a_subchannel = {
+    .name = "nv2a/subchannel",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT64(object_instance, GraphicsSubchannel),
+        {
+            .name = "object",
+            .size = sizeof(GraphicsObject),
+            .info = &vmstate_info_graphics_object,
+            .flags = VMS_SINGLE,
+            .offset = offsetof(GraphicsSubchannel, object),
+        },
+        VMSTATE_UINT32_ARRAY(object_cache, GraphicsSubchannel, 5),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_nv2a_context = {
+    .name = "nv2a/context",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(channel_3d, GraphicsContext),
+        VMSTATE_UINT32(subchannel, GraphicsContext),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_nv2a_surface = {
+    .name = "nv2a/surface",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(pitch, Surface),
+        VMSTATE_UINT32(format, Surface),
+        VMSTATE_UINT64(offset, Surface),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_nv2a_texture = {
+    .name = "nv2a/texture",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(enabled, Texture),
+        VMSTATE_UINT32(dimensionality, Texture),
+        VMSTATE_BOOL(cubemap, Texture),
+        VMSTATE_UINT32(color_format, Texture),
+        VMSTATE_UINT32(levels, Texture),
+        VMSTATE_UINT32(log_width, Texture),
+        VMSTATE_UINT32(log_height, Texture),
+        VMSTATE_UINT32(log_depth, Texture),
+        VMSTATE_UINT32(rect_width, Texture),
+        VMSTATE_UINT32(rect_height, Texture),
+        VMSTATE_UINT32(min_mipmap_level, Texture),
+        VMSTATE_UINT32(max_mipmap_level, Texture),
+        VMSTATE_UINT32(pitch, Texture),
+        VMSTATE_UINT32(lod_bias, Texture),
+        VMSTATE_UINT32(min_filter, Texture),
+        VMSTATE_UINT32(mag_filter, Texture),
+        VMSTATE_UINT32(address, Texture),
+        VMSTATE_UINT32(log_max_anisotropy, Texture),
+        VMSTATE_BOOL(dma_select, Texture),
+        VMSTATE_UINT64(offset, Texture),
+        VMSTATE_BOOL(palette_dma_select, Texture),
+        VMSTATE_UINT64(palette_offset, Texture),
+        VMSTATE_UINT32(palette_length, Texture),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_nv2a_channel_control = {
+    .name = "nv2a/channel_control",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT64(dma_put, ChannelControl),
+        VMSTATE_UINT64(dma_get, ChannelControl),
+        VMSTATE_UINT32(ref, ChannelControl),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static int nv2a_pre_load(void *opaque)
 {
-    /* xbox is UMA - vram *is* ram */
-    d->vram = ram;
+    NV2AState *d = opaque;
 
-     /* PCI exposed vram */
-    memory_region_init_alias(&d->vram_pci, OBJECT(d), "nv2a-vram-pci", d->vram,
-                             0, memory_region_size(d->vram));
-    pci_register_bar(&d->dev, 1, PCI_BASE_ADDRESS_MEM_PREFETCH, &d->vram_pci);
+    pfifo_abort_puller(d);
 
+    /* The objects are loaded into a fresh set rather than over the live
+     * one, whose gl programs can only be freed on the puller thread.
+     * post_load hands the old sets over to it. */
+    d->pgraph.subchannel_data = g_new0(GraphicsSubchannel,
+                                       NV2A_NUM_SUBCHANNELS);
 
-    /* RAMIN - should be in vram somewhere, but not quite sure where atm */
-    memory_region_init_ram(&d->ramin, OBJECT(d), "nv2a-ramin", 0x100000);
-    /* memory_region_init_alias(&d->ramin, "nv2a-ramin", &d->vram,
-                         memory_region_size(&d->vram) - 0x100000,
-                         0x100000); */
+    return 0;
+}
 
-    memory_region_add_subregion(&d->mmio, 0x700000, &d->ramin);
+static int nv2a_post_load(void *opaque, int version_id)
+{
+    NV2AState *d = opaque;
+    PGRAPHState *pg = &d->pgraph;
+    Cache1State *state = &d->pfifo.cache1;
+    int i;
 
+    if (d->pcrtc.flip_queue_len > NV2A_FLIP_QUEUE_LEN) {
+        return -EINVAL;
+    }
 
-    d->vram_ptr = memory_region_get_ram_ptr(d->vram);
-    d->ramin_ptr = memory_region_get_ram_ptr(&d->ramin);
+    /* everything that was drawn is in vram now, and gets reuploaded
+     * along with the textures from there */
+    pg->surface_color.draw_dirty = false;
+    pg->surface_zeta.draw_dirty = false;
+    pg->gl_zeta_valid = false;
+    pg->gl_alias_valid = false;
+    for (i = 0; i < NV2A_MAX_TEXTURES; i++) {
+        pg->textures[i].dirty = true;
+        pg->textures[i].gl_storage_valid = false;
+    }
+    pg->shaders_dirty = true;
+    memory_region_set_dirty(d->vram, 0, memory_region_size(d->vram));
+
+    /* queries in flight belong to the old guest, they're dropped on the
+     * puller thread, which has the gl context */
+    pg->reports_stale = true;
+
+    /* the objects just loaded are the current channel's. Every set from
+     * before the load is dropped by the puller thread. */
+    for (i = 0; i < NV2A_NUM_CHANNELS; i++) {
+        GraphicsContext *context = &pg->context[i];
+        if (context->subchannel_data) {
+            pg->stale_subchannel_data = g_slist_prepend(
+                pg->stale_subchannel_data, context->subchannel_data);
+            context->subchannel_data = NULL;
+        }
+    }
+    pg->context[pg->channel_id].subchannel_data = pg->subchannel_data;
 
-    memory_region_set_log(d->vram, true, DIRTY_MEMORY_NV2A);
+    ptimer_update_mult(d);
+    ptimer_arm_alarm(d);
 
-    /* hacky. swap out vga's vram */
-    memory_region_destroy(&d->vga.vram);
-    memory_region_init_alias(&d->vga.vram, OBJECT(d), "vga.vram",
-                             d->vram, 0, memory_region_size(d->vram));
-    d->vga.vram_ptr = memory_region_get_ram_ptr(&d->vga.vram);
-    vga_dirty_log_start(&d->vga);
+    qemu_mutex_lock(&d->ramin_cache.lock);
+    memset(d->ramin_cache.ramht, 0, sizeof(d->ramin_cache.ramht));
+    memset(d->ramin_cache.dma, 0, sizeof(d->ramin_cache.dma));
+    qemu_mutex_unlock(&d->ramin_cache.lock);
+
+    /* the semaphore's count can't be set, drain and refill it */
+    while (qemu_sem_timedwait(&pg->read_3d, 0) == 0) {
+    }
+    for (i = 0; i < pg->read_3d_count; i++) {
+        qemu_sem_post(&pg->read_3d);
+    }
+
+    qemu_mutex_lock(&state->pull_lock);
+    if (state->pull_enabled && !atomic_read(&state->puller_alive)) {
+        atomic_set(&state->puller_alive, true);
+        qemu_thread_create(&d->pfifo.puller_thread,
+                           pfifo_puller_thread,
+                           d, QEMU_THREAD_DETACHED);
+    } else if (!state->pull_enabled) {
+        qemu_cond_broadcast(&state->cache_cond);
+    }
+    qemu_mutex_unlock(&state->pull_lock);
+
+    return 0;
 }
 
+static const VMStateDescription vmstate_nv2a = {
+    .name = "nv2a",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .pre_load = nv2a_pre_load,
+    .post_load = nv2a_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_PCI_DEVICE(dev, NV2AState),
+        VMSTATE_STRUCT(vga, NV2AState, 0, vmstate_vga_common, VGACommonState),
+
+        VMSTATE_UINT32(pmc.pending_interrupts, NV2AState),
+        VMSTATE_UINT32(pmc.enabled_interrupts, NV2AState),
+
+        VMSTATE_UINT32(pfifo.pending_interrupts, NV2AState),
+        VMSTATE_UINT32(pfifo.enabled_interrupts, NV2AState),
+        VMSTATE_UINT64(pfifo.ramht_address, NV2AState),
+        VMSTATE_UINT32(pfifo.ramht_size, NV2AState),
+        VMSTATE_UINT32(pfifo.ramht_search, NV2AState),
+        VMSTATE_UINT64(pfifo.ramfc_address1, NV2AState),
+        VMSTATE_UINT64(pfifo.ramfc_address2, NV2AState),
+        VMSTATE_UINT32(pfifo.ramfc_size, NV2AState),
+        VMSTATE_UINT32(pfifo.channel_modes, NV2AState),
+        VMSTATE_UINT32(pfifo.channels_pending_push, NV2AState),
+        {
+            .name = "pfifo.cache1",
+            .size = sizeof(Cache1State),
+            .info = &vmstate_info_pfifo_cache1,
+            .flags = VMS_SINGLE,
+            .offset = offsetof(NV2AState, pfifo.cache1),
+        },
+
+        VMSTATE_UINT32(pvideo.pending_interrupts, NV2AState),
+        VMSTATE_UINT32(pvideo.enabled_interrupts, NV2AState),
+        VMSTATE_UINT32_ARRAY(pvideo.regs, NV2AState, 0x1000),
+        VMSTATE_INT32(pvideo.current_buffer, NV2AState),
+        VMSTATE_BOOL(pvideo.stop_pending, NV2AState),
+
+        VMSTATE_UINT32(ptimer.pending_interrupts, NV2AState),
+        VMSTATE_UINT32(ptimer.enabled_interrupts, NV2AState),
+        VMSTATE_UINT32(ptimer.numerator, NV2AState),
+        VMSTATE_UINT32(ptimer.denominator, NV2AState),
+        VMSTATE_UINT32(ptimer.alarm_time, NV2AState),
+        VMSTATE_INT64(ptimer.ns_base, NV2AState),
+        VMSTATE_UINT64(ptimer.ticks_base, NV2AState),
+
+        VMSTATE_UINT32_ARRAY(pfb.regs, NV2AState, 0x1000),
+
+        VMSTATE_UINT32(pgraph.pending_interrupts, NV2AState),
+        VMSTATE_UINT32(pgraph.enabled_interrupts, NV2AState),
+        VMSTATE_UINT64(pgraph.context_table, NV2AState),
+        VMSTATE_UINT64(pgraph.context_address, NV2AState),
+        VMSTATE_UINT32(pgraph.trapped_method, NV2AState),
+        VMSTATE_UINT32(pgraph.trapped_subchannel, NV2AState),
+        VMSTATE_UINT32(pgraph.trapped_channel_id, NV2AState),
+        VMSTATE_UINT32_ARRAY(pgraph.trapped_data, NV2AState, 2),
+        VMSTATE_UINT32(pgraph.notify_source, NV2AState),
+        VMSTATE_BOOL(pgraph.fifo_access, NV2AState),
+        VMSTATE_INT32(pgraph.read_3d_count, NV2AState),
+        VMSTATE_UINT64(pgraph.frame_count, NV2AState),
+        VMSTATE_BOOL(pgraph.skip_frame, NV2AState),
+        VMSTATE_UINT64_ARRAY(pgraph.scanout_surfaces, NV2AState,
+                             NV2A_SCANOUT_HISTORY),
+        VMSTATE_UINT32(pgraph.scanout_surface_index, NV2AState),
+        VMSTATE_UINT32(pgraph.channel_id, NV2AState),
+        VMSTATE_BOOL(pgraph.channel_valid, NV2AState),
+        VMSTATE_STRUCT_ARRAY(pgraph.context, NV2AState, NV2A_NUM_CHANNELS, 0,
+                             vmstate_nv2a_context, GraphicsContext),
+        VMSTATE_UINT64(pgraph.dma_color, NV2AState),
+        VMSTATE_UINT64(pgraph.dma_zeta, NV2AState),
+        VMSTATE_STRUCT(pgraph.surface_color, NV2AState, 0,
+                       vmstate_nv2a_surface, Surface),
+        VMSTATE_STRUCT(pgraph.surface_zeta, NV2AState, 0,
+                       vmstate_nv2a_surface, Surface),
+        VMSTATE_UINT32(pgraph.surface_x, NV2AState),
+        VMSTATE_UINT32(pgraph.surface_y, NV2AState),
+        VMSTATE_UINT32(pgraph.surface_width, NV2AState),
+        VMSTATE_UINT32(pgraph.surface_height, NV2AState),
+        VMSTATE_UINT32(pgraph.surface_type, NV2AState),
+        VMSTATE_UINT32(pgraph.surface_log_width, NV2AState),
+        VMSTATE_UINT32(pgraph.surface_log_height, NV2AState),
+        VMSTATE_UINT32(pgraph.color_mask, NV2AState),
+        VMSTATE_UINT64(pgraph.dma_a, NV2AState),
+        VMSTATE_UINT64(pgraph.dma_b, NV2AState),
+        VMSTATE_UINT64(pgraph.dma_report, NV2AState),
+        VMSTATE_BOOL(pgraph.zpass_pixel_count_enable, NV2AState),
+        VMSTATE_UINT32(pgraph.zpass_count, NV2AState),
+        VMSTATE_BOOL(pgraph.zpass_cleared, NV2AState),
+        VMSTATE_BOOL(pgraph.zpass_skipped, NV2AState),
+        VMSTATE_STRUCT_ARRAY(pgraph.textures, NV2AState, NV2A_MAX_TEXTURES, 0,
+                             vmstate_nv2a_texture, Texture),
+        {
+            .name = "pgraph.composite_matrix",
+            .num = 16,
+            .size = sizeof(float),
+            .info = &vmstate_info_float,
+            .flags = VMS_ARRAY,
+            .offset = offsetof(NV2AState, pgraph.composite_matrix),
+        },
+        /* the same as the array this used to be */
+        {
+            .name = "pgraph.subchannel_data",
+            .num = NV2A_NUM_SUBCHANNELS,
+            .size = sizeof(GraphicsSubchannel),
+            .vmsd = &vmstate_nv2a_subchannel,
+            .flags = VMS_STRUCT | VMS_ARRAY | VMS_POINTER,
+            .offset = offsetof(NV2AState, pgraph.subchannel_data),
+        },
+        VMSTATE_UINT32_ARRAY(pgraph.regs, NV2AState, 0x2000),
+
+        VMSTATE_UINT32(pcrtc.pending_interrupts, NV2AState),
+        VMSTATE_UINT32(pcrtc.enabled_interrupts, NV2AState),
+        VMSTATE_UINT64(pcrtc.start, NV2AState),
+        VMSTATE_UINT64(pcrtc.scanout_start, NV2AState),
+        VMSTATE_TIMER(pcrtc.vblank_timer, NV2AState),
+        VMSTATE_INT64(pcrtc.vblank_next, NV2AState),
+        VMSTATE_UINT64(pcrtc.vblank_count, NV2AState),
+        VMSTATE_UINT64(pcrtc.vblanks_dropped, NV2AState),
+        VMSTATE_UINT64(pcrtc.flip_count, NV2AState),
+        VMSTATE_UINT64(pcrtc.last_flip_vblank, NV2AState),
+        VMSTATE_UINT64_ARRAY(pcrtc.flip_queue, NV2AState,
+                             NV2A_FLIP_QUEUE_LEN),
+        VMSTATE_UINT32(pcrtc.flip_queue_len, NV2AState),
+        VMSTATE_UINT32(pcrtc.flip_interval, NV2AState),
+        VMSTATE_UINT64(pcrtc.last_start_vblank, NV2AState),
+
+        VMSTATE_UINT32(pramdac.core_clock_coeff, NV2AState),
+        VMSTATE_UINT64(pramdac.core_clock_freq, NV2AState),
+        VMSTATE_UINT32(pramdac.memory_clock_coeff, NV2AState),
+        VMSTATE_UINT32(pramdac.video_clock_coeff, NV2AState),
+
+        VMSTATE_STRUCT_ARRAY(user.channel_control, NV2AState,
+                             NV2A_NUM_CHANNELS, 0,
+                             vmstate_nv2a_channel_control, ChannelControl),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 static int nv2a_initfn(PCIDevice *dev)
 {
     int i;
@@ -4497,6 +9794,10 @@ static int nv2a_initfn(PCIDevice *dev)
     d = NV2A_DEVICE(dev);
 
     d->pcrtc.start = 0;
+    d->pcrtc.scanout_start = 0;
+    d->pcrtc.flip_interval = 1 << NV2A_FLIP_INTERVAL_SHIFT;
+
+    d->pvideo.current_buffer = -1;
 
     d->pramdac.core_clock_coeff = 0x00011c01; /* 189MHz...? */
     d->pramdac.core_clock_freq = 189000000;
@@ -4537,10 +9838,36 @@ static int nv2a_initfn(PCIDevice *dev)
     qemu_mutex_init(&d->pfifo.cache1.pull_lock);
     qemu_mutex_init(&d->pfifo.cache1.cache_lock);
     qemu_cond_init(&d->pfifo.cache1.cache_cond);
+    qemu_cond_init(&d->pfifo.cache1.pause_cond);
     QSIMPLEQ_INIT(&d->pfifo.cache1.cache);
 
+    /* the fifo only runs along with the vm */
+    d->pfifo.cache1.paused = !runstate_is_running();
+    d->pfifo.pusher_paused = !runstate_is_running();
+    d->vmstate_change = qemu_add_vm_change_state_handler(nv2a_vm_state_change,
+                                                         d);
+
+    qemu_mutex_init(&d->pfifo.pusher_lock);
+    qemu_cond_init(&d->pfifo.pusher_cond);
+    qemu_cond_init(&d->pfifo.pusher_idle_cond);
+    qemu_thread_create(&d->pfifo.pusher_thread, pfifo_pusher_thread,
+                       d, QEMU_THREAD_JOINABLE);
+
+    d->irq_bh = qemu_bh_new(nv2a_irq_bh, d);
+
+    qemu_mutex_init(&d->ramin_cache.lock);
+
     pgraph_init(&d->pgraph);
 
+    d->ptimer.alarm_timer = qemu_new_timer_ns(vm_clock, ptimer_alarm, d);
+    d->ptimer.ns_base = qemu_get_clock_ns(vm_clock);
+
+    d->pcrtc.vblank_timer = qemu_new_timer_ns(vm_clock, nv2a_vblank_tick, d);
+    d->pcrtc.vblank_period = nv2a_vblank_period(d);
+    d->pcrtc.vblank_next = qemu_get_clock_ns(vm_clock)
+                            + d->pcrtc.vblank_period;
+    qemu_mod_timer(d->pcrtc.vblank_timer, d->pcrtc.vblank_next);
+
     return 0;
 }
 
@@ -4549,13 +9876,87 @@ static void nv2a_exitfn(PCIDevice *dev)
     NV2AState *d;
     d = NV2A_DEVICE(dev);
 
+    qemu_del_vm_change_state_handler(d->vmstate_change);
+
+    qemu_del_timer(d->pcrtc.vblank_timer);
+    qemu_free_timer(d->pcrtc.vblank_timer);
+    qemu_del_timer(d->ptimer.alarm_timer);
+    qemu_free_timer(d->ptimer.alarm_timer);
+
+    qemu_mutex_lock(&d->pfifo.pusher_lock);
+    d->pfifo.pusher_exit = true;
+    qemu_cond_signal(&d->pfifo.pusher_cond);
+    qemu_mutex_unlock(&d->pfifo.pusher_lock);
+    qemu_thread_join(&d->pfifo.pusher_thread);
+    qemu_mutex_destroy(&d->pfifo.pusher_lock);
+    qemu_cond_destroy(&d->pfifo.pusher_cond);
+    qemu_cond_destroy(&d->pfifo.pusher_idle_cond);
+
     qemu_mutex_destroy(&d->pfifo.cache1.pull_lock);
     qemu_mutex_destroy(&d->pfifo.cache1.cache_lock);
     qemu_cond_destroy(&d->pfifo.cache1.cache_cond);
+    qemu_cond_destroy(&d->pfifo.cache1.pause_cond);
+
+    qemu_bh_delete(d->irq_bh);
+
+    qemu_mutex_destroy(&d->ramin_cache.lock);
 
     pgraph_destroy(&d->pgraph);
+
+    g_free(d->vram_page_generation);
+}
+
+void qmp_nv2a_set_frameskip(int64_t frameskip, Error **errp)
+{
+    bool ambiguous;
+    Object *obj = object_resolve_path_type("", "nv2a", &ambiguous);
+
+    if (!obj) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, "nv2a");
+        return;
+    }
+    if (frameskip < 0 || frameskip > UINT32_MAX) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "frameskip",
+                  "a non-negative 32-bit integer");
+        return;
+    }
+
+    /* takes effect from the next flip */
+    atomic_set(&NV2A_DEVICE(obj)->pgraph.frameskip, frameskip);
+}
+
+void qmp_nv2a_set_gl_buffered(bool enable, Error **errp)
+{
+    bool ambiguous;
+    Object *obj = object_resolve_path_type("", "nv2a", &ambiguous);
+
+    if (!obj) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, "nv2a");
+        return;
+    }
+
+    PGRAPHState *pg = &NV2A_DEVICE(obj)->pgraph;
+    if (enable && !pg->gl_buffered_supported) {
+        error_setg(errp, "the host OpenGL can't run the buffered path");
+        return;
+    }
+
+    /* takes effect from the next flip */
+    atomic_set(&pg->gl_buffered_request, enable);
 }
 
+static Property nv2a_properties[] = {
+    DEFINE_PROP_UINT32("vblank-rate", NV2AState, vblank_rate, 0),
+    DEFINE_PROP_BOOL("frame-pacing", NV2AState, frame_pacing, true),
+    DEFINE_PROP_UINT32("frameskip", NV2AState, pgraph.frameskip, 0),
+    DEFINE_PROP_BOOL("gl-buffered", NV2AState, pgraph.gl_buffered_request,
+                     false),
+    DEFINE_PROP_STRING("frame-dump", NV2AState, pgraph.frame_dump.path),
+    DEFINE_PROP_UINT32("frame-dump-interval", NV2AState,
+                       pgraph.frame_dump.interval, 1),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void nv2a_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -4569,6 +9970,8 @@ static void nv2a_class_init(ObjectClass *klass, void *data)
     k->exit = nv2a_exitfn;
 
     dc->desc = "GeForce NV2A Integrated Graphics";
+    dc->props = nv2a_properties;
+    dc->vmsd = &vmstate_nv2a;
 }
 
 static const TypeInfo nv2a_info = {
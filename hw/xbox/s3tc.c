@@ -0,0 +1,276 @@
+/*
+ * QEMU S3TC texture decompression
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "hw/xbox/s3tc.h"
+
+/*
+ * Used when the host GL can't sample compressed textures itself.
+ *
+ * Each block is decoded by building its colour (and alpha) palette once
+ * and then expanding the 2/3-bit indices into whole 32-bit texels. With
+ * sse2 a row of four texels is expanded at a time, selecting palette
+ * entries with compare masks; otherwise the indices are plain table
+ * lookups. Both paths produce identical texels.
+ */
+
+static inline uint16_t read_le16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t read_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* store one texel as R, G, B, A bytes */
+static inline uint32_t pack_rgba(unsigned int r, unsigned int g,
+                                 unsigned int b, unsigned int a)
+{
+    uint8_t texel[4] = { r, g, b, a };
+    uint32_t v;
+    memcpy(&v, texel, 4);
+    return v;
+}
+
+static inline void unpack_565(uint16_t c, unsigned int *r,
+                              unsigned int *g, unsigned int *b)
+{
+    *r = ((c >> 11) & 0x1f) * 255 / 31;
+    *g = ((c >> 5) & 0x3f) * 255 / 63;
+    *b = (c & 0x1f) * 255 / 31;
+}
+
+/* Colour palette for a block. The three-colour-plus-transparent mode only
+ * exists in DXT1; DXT3/5 colour blocks always interpolate four colours. */
+static void build_color_palette(const uint8_t *block, bool dxt1,
+                                uint32_t palette[4])
+{
+    uint16_t c0 = read_le16(block);
+    uint16_t c1 = read_le16(block + 2);
+    unsigned int r0, g0, b0, r1, g1, b1;
+
+    unpack_565(c0, &r0, &g0, &b0);
+    unpack_565(c1, &r1, &g1, &b1);
+
+    palette[0] = pack_rgba(r0, g0, b0, 255);
+    palette[1] = pack_rgba(r1, g1, b1, 255);
+
+    if (c0 > c1 || !dxt1) {
+        palette[2] = pack_rgba((2*r0 + r1) / 3, (2*g0 + g1) / 3,
+                               (2*b0 + b1) / 3, 255);
+        palette[3] = pack_rgba((r0 + 2*r1) / 3, (g0 + 2*g1) / 3,
+                               (b0 + 2*b1) / 3, 255);
+    } else {
+        palette[2] = pack_rgba((r0 + r1) / 2, (g0 + g1) / 2,
+                               (b0 + b1) / 2, 255);
+        palette[3] = pack_rgba(0, 0, 0, 0);
+    }
+}
+
+static void build_alpha_palette(const uint8_t *block, uint8_t palette[8])
+{
+    unsigned int a0 = block[0];
+    unsigned int a1 = block[1];
+    int i;
+
+    palette[0] = a0;
+    palette[1] = a1;
+    if (a0 > a1) {
+        for (i = 1; i < 7; i++) {
+            palette[i + 1] = ((7 - i) * a0 + i * a1) / 7;
+        }
+    } else {
+        for (i = 1; i < 5; i++) {
+            palette[i + 1] = ((5 - i) * a0 + i * a1) / 5;
+        }
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+}
+
+#ifdef __SSE2__
+/* Give each lane one of the four 2-bit indices in the low byte of row.
+ * There are no per-lane shifts before AVX2, so the shift left is done by
+ * multiplying the 16-bit lanes instead. */
+static inline __m128i expand_color_indices(unsigned int row)
+{
+    __m128i v = _mm_set1_epi32(row & 0xff);
+    v = _mm_mullo_epi16(v, _mm_set_epi32(1, 4, 16, 64));
+    return _mm_and_si128(_mm_srli_epi32(v, 6), _mm_set1_epi32(3));
+}
+
+/* Look up palette[idx] per lane. pshufb needs SSSE3, so or together the
+ * entries picked out by a compare mask each. */
+static inline __m128i select_texels(__m128i idx, const uint32_t *palette,
+                                    int entries)
+{
+    __m128i r = _mm_setzero_si128();
+    int i;
+
+    for (i = 0; i < entries; i++) {
+        __m128i m = _mm_cmpeq_epi32(idx, _mm_set1_epi32(i));
+        r = _mm_or_si128(r, _mm_and_si128(m, _mm_set1_epi32(palette[i])));
+    }
+    return r;
+}
+
+/* Decode one 4x4 block into a tile of 16 texels */
+static void decode_block(const uint8_t *block, int format, uint32_t tile[16])
+{
+    uint32_t colors[4];
+    uint32_t alphas[8];
+    uint32_t indices;
+    uint64_t alpha_indices = 0;
+    int i, y;
+
+    const uint8_t *color_block = (format == 1) ? block : block + 8;
+    build_color_palette(color_block, format == 1, colors);
+    indices = read_le32(color_block + 4);
+
+    if (format == 5) {
+        uint8_t a[8];
+        build_alpha_palette(block, a);
+        for (i = 0; i < 8; i++) {
+            alphas[i] = (uint32_t)a[i] << 24;
+        }
+        for (i = 0; i < 6; i++) {
+            alpha_indices |= (uint64_t)block[2 + i] << (8 * i);
+        }
+    }
+
+    for (y = 0; y < 4; y++) {
+        __m128i row = select_texels(expand_color_indices(indices >> (8 * y)),
+                                    colors, 4);
+
+        if (format == 3) {
+            /* explicit 4-bit alpha, scaled to 8 bits by * 17 */
+            unsigned int a = read_le16(block + 2 * y);
+            __m128i alpha = _mm_set_epi32(a >> 12, (a >> 8) & 0xf,
+                                          (a >> 4) & 0xf, a & 0xf);
+            alpha = _mm_slli_epi32(_mm_mullo_epi16(alpha,
+                                                   _mm_set1_epi32(17)), 24);
+            row = _mm_or_si128(_mm_and_si128(row,
+                                             _mm_set1_epi32(0x00ffffff)),
+                               alpha);
+        } else if (format == 5) {
+            unsigned int a = (alpha_indices >> (12 * y)) & 0xfff;
+            __m128i idx = _mm_set_epi32(a >> 9, (a >> 6) & 7,
+                                        (a >> 3) & 7, a & 7);
+            row = _mm_or_si128(_mm_and_si128(row,
+                                             _mm_set1_epi32(0x00ffffff)),
+                               select_texels(idx, alphas, 8));
+        }
+
+        _mm_storeu_si128((__m128i *)&tile[y * 4], row);
+    }
+}
+#else
+/* Decode one 4x4 block into a tile of 16 texels */
+static void decode_block(const uint8_t *block, int format, uint32_t tile[16])
+{
+    uint32_t colors[4];
+    uint32_t indices;
+    int i;
+
+    const uint8_t *color_block = (format == 1) ? block : block + 8;
+    build_color_palette(color_block, format == 1, colors);
+
+    indices = read_le32(color_block + 4);
+    for (i = 0; i < 16; i++) {
+        tile[i] = colors[(indices >> (2 * i)) & 3];
+    }
+
+    if (format == 3) {
+        /* explicit 4-bit alpha */
+        uint8_t *texels = (uint8_t *)tile;
+        for (i = 0; i < 16; i++) {
+            unsigned int a = (block[i / 2] >> ((i & 1) * 4)) & 0xf;
+            texels[i * 4 + 3] = a * 17;
+        }
+    } else if (format == 5) {
+        uint8_t alphas[8];
+        uint64_t alpha_indices = 0;
+        uint8_t *texels = (uint8_t *)tile;
+
+        build_alpha_palette(block, alphas);
+        for (i = 0; i < 6; i++) {
+            alpha_indices |= (uint64_t)block[2 + i] << (8 * i);
+        }
+        for (i = 0; i < 16; i++) {
+            texels[i * 4 + 3] = alphas[(alpha_indices >> (3 * i)) & 7];
+        }
+    }
+}
+#endif
+
+static void decompress(const uint8_t *data,
+                       unsigned int width, unsigned int height,
+                       uint8_t *out, int format)
+{
+    unsigned int block_size = (format == 1) ? 8 : 16;
+    unsigned int blocks_x = (width + 3) / 4;
+    unsigned int blocks_y = (height + 3) / 4;
+    unsigned int bx, by, y;
+    uint32_t tile[16];
+
+    for (by = 0; by < blocks_y; by++) {
+        for (bx = 0; bx < blocks_x; bx++) {
+            decode_block(data, format, tile);
+            data += block_size;
+
+            unsigned int x0 = bx * 4, y0 = by * 4;
+            unsigned int w = width - x0 < 4 ? width - x0 : 4;
+            unsigned int h = height - y0 < 4 ? height - y0 : 4;
+            for (y = 0; y < h; y++) {
+                memcpy(out + ((y0 + y) * width + x0) * 4,
+                       &tile[y * 4], w * 4);
+            }
+        }
+    }
+}
+
+void s3tc_decompress_dxt1(const uint8_t *data,
+                          unsigned int width, unsigned int height,
+                          uint8_t *out)
+{
+    decompress(data, width, height, out, 1);
+}
+
+void s3tc_decompress_dxt3(const uint8_t *data,
+                          unsigned int width, unsigned int height,
+                          uint8_t *out)
+{
+    decompress(data, width, height, out, 3);
+}
+
+void s3tc_decompress_dxt5(const uint8_t *data,
+                          unsigned int width, unsigned int height,
+                          uint8_t *out)
+{
+    decompress(data, width, height, out, 5);
+}
@@ -0,0 +1,38 @@
+/*
+ * QEMU S3TC texture decompression
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HW_S3TC_H
+#define HW_S3TC_H
+
+#include <stdint.h>
+
+/* Decompress a DXTn image into 8-bit RGBA (bytes in R, G, B, A order).
+ * out must hold width * height * 4 bytes. Images smaller than a block
+ * still read a whole 4x4 block. */
+void s3tc_decompress_dxt1(const uint8_t *data,
+                          unsigned int width, unsigned int height,
+                          uint8_t *out);
+void s3tc_decompress_dxt3(const uint8_t *data,
+                          unsigned int width, unsigned int height,
+                          uint8_t *out);
+void s3tc_decompress_dxt5(const uint8_t *data,
+                          unsigned int width, unsigned int height,
+                          uint8_t *out);
+
+#endif
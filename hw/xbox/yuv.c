@@ -0,0 +1,148 @@
+/*
+ * QEMU packed YUV to RGB conversion
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "hw/xbox/yuv.h"
+
+/*
+ * Used by the video overlay, which scans out a whole frame of this per
+ * refresh, and to upload YUY2/UYVY textures.
+ *
+ * The coefficients are the BT.601 ones in 10.6 fixed point. Every
+ * intermediate fits in a signed 16-bit lane (the sse2 path saturates
+ * where the scalar path would just clamp, which gives the same answer),
+ * so both paths produce identical pixels.
+ */
+
+#define YUV_Y_SCALE   75    /* 1.164 */
+#define YUV_R_V       102   /* 1.596 */
+#define YUV_G_U       25    /* 0.391 */
+#define YUV_G_V       52    /* 0.813 */
+#define YUV_B_U       129   /* 2.018 */
+
+static inline uint32_t clamp_channel(int v)
+{
+    v >>= 6;
+    if (v < 0) {
+        return 0;
+    }
+    if (v > 255) {
+        return 255;
+    }
+    return v;
+}
+
+static inline uint32_t yuv_to_rgb(int y, int u, int v)
+{
+    int c = (y - 16) * YUV_Y_SCALE + 32;
+    u -= 128;
+    v -= 128;
+
+    return clamp_channel(c + YUV_R_V * v) << 16
+         | clamp_channel(c - YUV_G_U * u - YUV_G_V * v) << 8
+         | clamp_channel(c + YUV_B_U * u);
+}
+
+#ifdef __SSE2__
+/* y holds eight luma samples and chroma four u/v pairs, both as 16-bit
+ * lanes */
+static inline void convert8_sse2(__m128i y, __m128i chroma, uint32_t *out)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i u, v, c, r, g, b, bg, rx;
+
+    u = _mm_shufflehi_epi16(_mm_shufflelo_epi16(chroma,
+                                                _MM_SHUFFLE(2, 2, 0, 0)),
+                            _MM_SHUFFLE(2, 2, 0, 0));
+    v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(chroma,
+                                                _MM_SHUFFLE(3, 3, 1, 1)),
+                            _MM_SHUFFLE(3, 3, 1, 1));
+    u = _mm_sub_epi16(u, _mm_set1_epi16(128));
+    v = _mm_sub_epi16(v, _mm_set1_epi16(128));
+
+    c = _mm_add_epi16(_mm_mullo_epi16(_mm_sub_epi16(y, _mm_set1_epi16(16)),
+                                      _mm_set1_epi16(YUV_Y_SCALE)),
+                      _mm_set1_epi16(32));
+
+    r = _mm_adds_epi16(c, _mm_mullo_epi16(v, _mm_set1_epi16(YUV_R_V)));
+    g = _mm_subs_epi16(c, _mm_mullo_epi16(u, _mm_set1_epi16(YUV_G_U)));
+    g = _mm_subs_epi16(g, _mm_mullo_epi16(v, _mm_set1_epi16(YUV_G_V)));
+    b = _mm_adds_epi16(c, _mm_mullo_epi16(u, _mm_set1_epi16(YUV_B_U)));
+
+    r = _mm_packus_epi16(_mm_srai_epi16(r, 6), zero);
+    g = _mm_packus_epi16(_mm_srai_epi16(g, 6), zero);
+    b = _mm_packus_epi16(_mm_srai_epi16(b, 6), zero);
+
+    /* b g r x byte order is 0x00RRGGBB in memory */
+    bg = _mm_unpacklo_epi8(b, g);
+    rx = _mm_unpacklo_epi8(r, zero);
+    _mm_storeu_si128((__m128i *)out, _mm_unpacklo_epi16(bg, rx));
+    _mm_storeu_si128((__m128i *)(out + 4), _mm_unpackhi_epi16(bg, rx));
+}
+#endif
+
+/* y_first selects YUY2 (y0 u y1 v) over UYVY (u y0 v y1) */
+static inline void convert_row(const uint8_t *in, unsigned int width,
+                               uint32_t *out, bool y_first)
+{
+    unsigned int x = 0;
+    int y_off = y_first ? 0 : 1;
+    int c_off = y_first ? 1 : 0;
+
+#ifdef __SSE2__
+    const __m128i low_bytes = _mm_set1_epi16(0x00ff);
+
+    for (; x + 8 <= width; x += 8) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(in + x * 2));
+        __m128i lo = _mm_and_si128(p, low_bytes);
+        __m128i hi = _mm_srli_epi16(p, 8);
+
+        if (y_first) {
+            convert8_sse2(lo, hi, out + x);
+        } else {
+            convert8_sse2(hi, lo, out + x);
+        }
+    }
+#endif
+
+    for (; x < width; x += 2) {
+        const uint8_t *p = in + x * 2;
+        int u = p[c_off];
+        int v = p[c_off + 2];
+
+        out[x] = yuv_to_rgb(p[y_off], u, v);
+        out[x + 1] = yuv_to_rgb(p[y_off + 2], u, v);
+    }
+}
+
+void yuv_convert_yuy2(const uint8_t *in, unsigned int width, uint32_t *out)
+{
+    convert_row(in, width, out, true);
+}
+
+void yuv_convert_uyvy(const uint8_t *in, unsigned int width, uint32_t *out)
+{
+    convert_row(in, width, out, false);
+}
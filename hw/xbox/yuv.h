@@ -0,0 +1,31 @@
+/*
+ * QEMU packed YUV to RGB conversion
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HW_YUV_H
+#define HW_YUV_H
+
+#include <stdint.h>
+
+/* Convert a row of 4:2:2 video (BT.601, studio range) into 0x00RRGGBB
+ * pixels. width is rounded up to a whole pixel pair, so in must hold
+ * ((width + 1) & ~1) * 2 bytes and out that many pixels. */
+void yuv_convert_yuy2(const uint8_t *in, unsigned int width, uint32_t *out);
+void yuv_convert_uyvy(const uint8_t *in, unsigned int width, uint32_t *out);
+
+#endif
@@ -3123,4 +3123,54 @@ Example:
       ]
    }
 
+EQMP
+
+    {
+        .name       = "nv2a-set-frameskip",
+        .args_type  = "frameskip:i",
+        .mhandler.cmd_new = qmp_marshal_input_nv2a_set_frameskip,
+    },
+
+SQMP
+nv2a-set-frameskip
+------------------
+
+Render only every Nth frame on the host. PGRAPH still processes every
+method, semaphore and notify; only GL draws into scanned-out surfaces
+are skipped. Takes effect from the next flip.
+
+Arguments:
+
+- "frameskip": draw one frame in this many, 0 or 1 draws all (json-int)
+
+Example:
+
+-> { "execute": "nv2a-set-frameskip", "arguments": { "frameskip": 10 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "nv2a-set-gl-buffered",
+        .args_type  = "enable:b",
+        .mhandler.cmd_new = qmp_marshal_input_nv2a_set_gl_buffered,
+    },
+
+SQMP
+nv2a-set-gl-buffered
+--------------------
+
+Switch the nv2a renderer between its legacy OpenGL path and the buffered one,
+which keeps vertex data in buffer objects and uploads surfaces through
+textures. Takes effect from the next flip.
+
+Arguments:
+
+- "enable": true for the buffered path, false for the legacy one (json-bool)
+
+Example:
+
+-> { "execute": "nv2a-set-gl-buffered", "arguments": { "enable": true } }
+<- { "return": {} }
+
 EQMP
@@ -0,0 +1,8 @@
+#include "qemu-common.h"
+#include "qmp-commands.h"
+#include "qapi/qmp/qerror.h"
+
+void qmp_nv2a_set_gl_buffered(bool enable, Error **errp)
+{
+    error_set(errp, QERR_DEVICE_NOT_FOUND, "nv2a");
+}
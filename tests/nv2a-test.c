@@ -0,0 +1,984 @@
+/*
+ * qtest nv2a rendering test cases
+ *
+ * Each case builds a small pushbuffer, feeds it to the nv2a through the
+ * channel 0 DMA pusher and compares what lands in vram against a
+ * reference image under tests/nv2a/. The same frame is then submitted
+ * repeatedly to report method throughput and frame time.
+ *
+ * Set NV2A_TEST_UPDATE_REFERENCES=1 to rewrite the reference images
+ * from the current output instead of comparing against them, e.g.
+ *
+ *   NV2A_TEST_UPDATE_REFERENCES=1 SRC_PATH=. \
+ *   QTEST_QEMU_BINARY=xbox-softmmu/qemu-system-xbox tests/nv2a-test
+ *
+ * How far each new image is from the old one is logged (run with
+ * --verbose to see it), and the images should be looked over before
+ * they are committed. The images in the tree were generated from what
+ * each case is meant to draw, not captured from the renderer, so they
+ * need regenerating this way on a host with a display.
+ *
+ * Without a display (DISPLAY unset on Linux) every case is reported as
+ * skipped rather than passed.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "libqtest.h"
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ARRAY_SIZE(array) (sizeof(array) / sizeof((array)[0]))
+
+/* pci: the nv2a sits alone on the bus behind the agp bridge */
+#define AGP_BRIDGE_DEVFN        ((30 << 3) | 0)
+#define NV2A_BUS                1
+#define NV2A_DEVFN              0
+
+#define NV2A_BAR0               0xFD000000
+#define NV2A_BAR0_SIZE          0x01000000
+
+#define NV_PFIFO                (NV2A_BAR0 + 0x002000)
+#define NV_PGRAPH               (NV2A_BAR0 + 0x400000)
+#define NV_PRAMIN               (NV2A_BAR0 + 0x700000)
+#define NV_USER                 (NV2A_BAR0 + 0x800000)
+
+#define NV_PFIFO_RAMHT                  0x0210
+#define NV_PFIFO_MODE                   0x0504
+#define NV_PFIFO_CACHE1_PUSH0           0x1200
+#define NV_PFIFO_CACHE1_PUSH1           0x1204
+#   define NV_PFIFO_CACHE1_PUSH1_MODE_DMA   (1 << 8)
+#define NV_PFIFO_CACHE1_DMA_PUSH        0x1220
+#define NV_PFIFO_CACHE1_DMA_INSTANCE    0x122C
+#define NV_PFIFO_CACHE1_DMA_PUT         0x1240
+#define NV_PFIFO_CACHE1_DMA_GET         0x1244
+#define NV_PFIFO_CACHE1_PULL0           0x1250
+
+#define NV_PGRAPH_INTR                  0x0100
+#   define NV_PGRAPH_INTR_NOTIFY            (1 << 0)
+#define NV_PGRAPH_INTR_EN               0x0140
+#define NV_PGRAPH_CTX_CONTROL           0x0144
+#   define NV_PGRAPH_CTX_CONTROL_CHID       (1 << 16)
+#define NV_PGRAPH_CTX_USER              0x0148
+#   define NV_PGRAPH_CTX_USER_CHANNEL_3D    (1 << 0)
+#   define NV_PGRAPH_CTX_USER_CHANNEL_3D_VALID (1 << 4)
+#define NV_PGRAPH_FIFO                  0x0720
+
+#define NV_USER_DMA_PUT                 0x40
+
+#define NV_DMA_IN_MEMORY_CLASS          0x3d
+#define NV_RAMHT_ENGINE_GRAPHICS        0x00010000
+#define NV_RAMHT_STATUS                 0x80000000
+
+/* object classes and the methods the cases use */
+#define NV_CONTEXT_SURFACES_2D          0x62
+#define NV_KELVIN_PRIMITIVE             0x97
+#define NV_IMAGE_BLIT                   0x9f
+
+#define NV_SET_OBJECT                           0x0000
+
+#define NV062_SET_CONTEXT_DMA_IMAGE_SOURCE      0x0184
+#define NV062_SET_CONTEXT_DMA_IMAGE_DESTIN      0x0188
+#define NV062_SET_COLOR_FORMAT                  0x0300
+#   define NV062_SET_COLOR_FORMAT_LE_A8R8G8B8       0x0A
+#define NV062_SET_PITCH                         0x0304
+#define NV062_SET_OFFSET_SOURCE                 0x0308
+#define NV062_SET_OFFSET_DESTIN                 0x030C
+
+#define NV09F_SET_CONTEXT_SURFACES              0x019C
+#define NV09F_SET_OPERATION                     0x02FC
+#   define NV09F_SET_OPERATION_SRCCOPY              3
+#define NV09F_CONTROL_POINT_IN                  0x0300
+#define NV09F_CONTROL_POINT_OUT                 0x0304
+#define NV09F_SIZE                              0x0308
+
+#define NV097_NO_OPERATION                      0x0100
+#define NV097_WAIT_FOR_IDLE                     0x0110
+#define NV097_SET_CONTEXT_DMA_A                 0x0184
+#define NV097_SET_CONTEXT_DMA_COLOR             0x0194
+#define NV097_SET_CONTEXT_DMA_VERTEX_A          0x019C
+#define NV097_SET_SURFACE_CLIP_HORIZONTAL       0x0200
+#define NV097_SET_SURFACE_CLIP_VERTICAL         0x0204
+#define NV097_SET_SURFACE_FORMAT                0x0208
+#   define NV097_SET_SURFACE_FORMAT_COLOR_LE_A8R8G8B8 0x08
+#define NV097_SET_SURFACE_PITCH                 0x020C
+#define NV097_SET_SURFACE_COLOR_OFFSET          0x0210
+#define NV097_SET_COMBINER_ALPHA_ICW            0x0260
+#define NV097_SET_COLOR_MASK                    0x0358
+#define NV097_SET_COMPOSITE_MATRIX              0x0680
+#define NV097_SET_VIEWPORT_OFFSET               0x0A20
+#define NV097_SET_COMBINER_FACTOR0              0x0A60
+#define NV097_SET_COMBINER_ALPHA_OCW            0x0AA0
+#define NV097_SET_COMBINER_COLOR_ICW            0x0AC0
+#define NV097_SET_VIEWPORT_SCALE                0x0AF0
+#define NV097_SET_TRANSFORM_PROGRAM             0x0B00
+#define NV097_SET_TRANSFORM_CONSTANT            0x0B80
+#define NV097_SET_VERTEX4F                      0x1518
+#define NV097_SET_VERTEX_DATA_ARRAY_OFFSET      0x1720
+#define NV097_SET_VERTEX_DATA_ARRAY_FORMAT      0x1760
+#   define NV097_SET_VERTEX_DATA_ARRAY_FORMAT_TYPE_F 2
+#define NV097_SET_BEGIN_END                     0x17FC
+#   define NV097_SET_BEGIN_END_OP_END               0x00
+#   define NV097_SET_BEGIN_END_OP_QUADS             0x08
+#define NV097_DRAW_ARRAYS                       0x1810
+#define NV097_SET_VERTEX_DATA4UB                0x1940
+#define NV097_SET_TEXTURE_OFFSET                0x1B00
+#define NV097_SET_TEXTURE_FORMAT                0x1B04
+#define NV097_SET_TEXTURE_CONTROL0              0x1B0C
+#   define NV097_SET_TEXTURE_CONTROL0_ENABLE        (1 << 30)
+#define NV097_SET_TEXTURE_FILTER                0x1B14
+#define NV097_SET_COLOR_CLEAR_VALUE             0x1D90
+#define NV097_CLEAR_SURFACE                     0x1D94
+#   define NV097_CLEAR_SURFACE_COLOR                0xF0
+#define NV097_SET_CLEAR_RECT_HORIZONTAL         0x1D98
+#define NV097_SET_CLEAR_RECT_VERTICAL           0x1D9C
+#define NV097_SET_COMBINER_COLOR_OCW            0x1E40
+#define NV097_SET_COMBINER_CONTROL              0x1E60
+#define NV097_SET_SHADER_STAGE_PROGRAM          0x1E70
+#define NV097_SET_TRANSFORM_EXECUTION_MODE      0x1E94
+#define NV097_SET_TRANSFORM_PROGRAM_LOAD        0x1E9C
+#define NV097_SET_TRANSFORM_PROGRAM_START       0x1EA0
+#define NV097_SET_TRANSFORM_CONSTANT_LOAD       0x1EA4
+
+#define NV2A_VERTEX_ATTR_POSITION   0
+#define NV2A_VERTEX_ATTR_DIFFUSE    3
+#define NV2A_VERTEX_ATTR_TEXTURE0   9
+
+/* register combiner encodings: A in the top byte of the input word,
+ * destinations in the output word */
+#define PS_REGISTER_ZERO        0x00
+#define PS_REGISTER_C0          0x01
+#define PS_REGISTER_V0          0x04
+#define PS_REGISTER_T0          0x08
+#define PS_REGISTER_R0          0x0c
+#define PS_CHANNEL_ALPHA        0x10
+#define PS_REGISTER_ONE         0x20
+#define PS_COMBINER_INPUTS(a, b)    (((a) << 24) | ((b) << 16))
+#define PS_COMBINER_AB_TO(reg)      ((reg) << 4)
+
+/* guest ram: vram is the bottom of physical memory */
+#define PUSHBUF_ADDR            0x00100000
+#define PUSHBUF_SIZE            0x00010000
+#define SURFACE_ADDR            0x00200000
+#define TEXTURE_ADDR            0x00400000
+#define VERTEX_ADDR             0x00410000
+#define BLIT_SRC_ADDR           0x00420000
+#define BLIT_DST_ADDR           0x00430000
+
+/* pgraph always renders to a 640x480 target, so the surface has to be
+ * that size; only the top left corner is compared */
+#define SURFACE_WIDTH           640
+#define SURFACE_HEIGHT          480
+#define SURFACE_PITCH           (SURFACE_WIDTH * 4)
+#define IMAGE_WIDTH             128
+#define IMAGE_HEIGHT            128
+
+#define BLIT_SRC_PITCH          128
+#define BLIT_DST_PITCH          (IMAGE_WIDTH * 4)
+
+/* ramin layout */
+#define RAMHT_OFFSET            0x10000
+#define RAMHT_SIZE              0x1000
+#define DMA_VRAM_INSTANCE       0x11000
+#define KELVIN_INSTANCE         0x11010
+#define SURF2D_INSTANCE         0x11020
+#define BLIT_INSTANCE           0x11030
+
+/* small handles hash to themselves on channel 0 */
+#define HANDLE_DMA_VRAM         0x11
+#define HANDLE_KELVIN           0x12
+#define HANDLE_SURF2D           0x13
+#define HANDLE_BLIT             0x14
+
+#define SUBCH_KELVIN            0
+#define SUBCH_SURF2D            1
+#define SUBCH_BLIT              2
+
+#define FENCE_TIMEOUT_US        (10 * 1000 * 1000)
+
+typedef struct PushBuffer {
+    uint32_t words[2048];
+    unsigned int length;
+    unsigned int methods;
+} PushBuffer;
+
+typedef struct Image {
+    unsigned int width;
+    unsigned int height;
+    uint8_t *rgb;
+} Image;
+
+typedef struct NV2ATestCase {
+    const char *name;
+    void (*prepare)(void);
+    void (*build)(PushBuffer *pb);
+    uint32_t image_addr;
+    unsigned int image_pitch;
+    /* per channel difference allowed, and how many pixels may exceed it */
+    unsigned int tolerance;
+    unsigned int max_bad_pixels;
+} NV2ATestCase;
+
+static char bios_path[] = "/tmp/qtest-nv2a.XXXXXX";
+static uint32_t pushbuf_put;
+
+static uint32_t float_bits(float f)
+{
+    union {
+        float f;
+        uint32_t u;
+    } v = { .f = f };
+    return v.u;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static void write_le32(uint64_t addr, uint32_t v)
+{
+    uint8_t buf[4];
+
+    put_le32(buf, v);
+    memwrite(addr, buf, sizeof(buf));
+}
+
+/* pushbuffer construction */
+
+static void pb_methods(PushBuffer *pb, unsigned int subchannel,
+                       uint32_t method, unsigned int count,
+                       const uint32_t *params)
+{
+    unsigned int i;
+
+    g_assert(count > 0 && count < 0x800);
+    g_assert(pb->length + 1 + count <= ARRAY_SIZE(pb->words));
+
+    pb->words[pb->length++] = (count << 18) | (subchannel << 13) | method;
+    for (i = 0; i < count; i++) {
+        pb->words[pb->length++] = params[i];
+    }
+    pb->methods += count;
+}
+
+static void pb_method(PushBuffer *pb, unsigned int subchannel,
+                      uint32_t method, uint32_t param)
+{
+    pb_methods(pb, subchannel, method, 1, &param);
+}
+
+static void pb_method_floats(PushBuffer *pb, unsigned int subchannel,
+                             uint32_t method, unsigned int count,
+                             const float *params)
+{
+    uint32_t words[16];
+    unsigned int i;
+
+    g_assert(count <= ARRAY_SIZE(words));
+    for (i = 0; i < count; i++) {
+        words[i] = float_bits(params[i]);
+    }
+    pb_methods(pb, subchannel, method, count, words);
+}
+
+/* machine setup */
+
+static void pci_config_writel(int bus, int devfn, uint8_t offset,
+                              uint32_t value)
+{
+    outl(0xcf8, (1U << 31) | (bus << 16) | (devfn << 8) | offset);
+    outl(0xcfc, value);
+}
+
+static void ramin_write_ramht(uint32_t handle, uint32_t instance)
+{
+    uint32_t hash = handle & (RAMHT_SIZE / 8 - 1);
+
+    g_assert_cmphex(hash, ==, handle);
+    write_le32(NV_PRAMIN + RAMHT_OFFSET + hash * 8, handle);
+    write_le32(NV_PRAMIN + RAMHT_OFFSET + hash * 8 + 4,
+               (instance >> 4) | NV_RAMHT_ENGINE_GRAPHICS | NV_RAMHT_STATUS);
+}
+
+static void nv2a_setup(void)
+{
+    /* open the bridge window and map bar0 */
+    pci_config_writel(0, AGP_BRIDGE_DEVFN, 0x18, (1 << 16) | (1 << 8));
+    pci_config_writel(0, AGP_BRIDGE_DEVFN, 0x20,
+                      ((NV2A_BAR0 + NV2A_BAR0_SIZE - 1) & 0xFFF00000)
+                      | (NV2A_BAR0 >> 16));
+    pci_config_writel(0, AGP_BRIDGE_DEVFN, 0x04, 0x0006);
+    pci_config_writel(NV2A_BUS, NV2A_DEVFN, 0x10, NV2A_BAR0);
+    pci_config_writel(NV2A_BUS, NV2A_DEVFN, 0x04, 0x0006);
+
+    /* a dma object covering vram, and the objects bound by the cases */
+    write_le32(NV_PRAMIN + DMA_VRAM_INSTANCE, NV_DMA_IN_MEMORY_CLASS);
+    write_le32(NV_PRAMIN + DMA_VRAM_INSTANCE + 4, 0x03FFFFFF);
+    write_le32(NV_PRAMIN + DMA_VRAM_INSTANCE + 8, 0);
+    write_le32(NV_PRAMIN + KELVIN_INSTANCE, NV_KELVIN_PRIMITIVE);
+    write_le32(NV_PRAMIN + SURF2D_INSTANCE, NV_CONTEXT_SURFACES_2D);
+    write_le32(NV_PRAMIN + BLIT_INSTANCE, NV_IMAGE_BLIT);
+
+    ramin_write_ramht(HANDLE_DMA_VRAM, DMA_VRAM_INSTANCE);
+    ramin_write_ramht(HANDLE_KELVIN, KELVIN_INSTANCE);
+    ramin_write_ramht(HANDLE_SURF2D, SURF2D_INSTANCE);
+    ramin_write_ramht(HANDLE_BLIT, BLIT_INSTANCE);
+
+    /* pgraph owns channel 0 and accepts methods */
+    writel(NV_PGRAPH + NV_PGRAPH_INTR_EN, NV_PGRAPH_INTR_NOTIFY);
+    writel(NV_PGRAPH + NV_PGRAPH_CTX_USER,
+           NV_PGRAPH_CTX_USER_CHANNEL_3D
+           | NV_PGRAPH_CTX_USER_CHANNEL_3D_VALID);
+    writel(NV_PGRAPH + NV_PGRAPH_CTX_CONTROL, NV_PGRAPH_CTX_CONTROL_CHID);
+    writel(NV_PGRAPH + NV_PGRAPH_FIFO, 1);
+
+    /* channel 0 in dma mode, pushing from the pushbuffer */
+    writel(NV_PFIFO + NV_PFIFO_RAMHT, (RAMHT_OFFSET >> 12) << 4);
+    writel(NV_PFIFO + NV_PFIFO_MODE, 1 << 0);
+    writel(NV_PFIFO + NV_PFIFO_CACHE1_PUSH1, NV_PFIFO_CACHE1_PUSH1_MODE_DMA);
+    writel(NV_PFIFO + NV_PFIFO_CACHE1_DMA_INSTANCE, DMA_VRAM_INSTANCE >> 4);
+    writel(NV_PFIFO + NV_PFIFO_CACHE1_DMA_PUT, PUSHBUF_ADDR);
+    writel(NV_PFIFO + NV_PFIFO_CACHE1_DMA_GET, PUSHBUF_ADDR);
+    writel(NV_PFIFO + NV_PFIFO_CACHE1_DMA_PUSH, 1);
+    writel(NV_PFIFO + NV_PFIFO_CACHE1_PUSH0, 1);
+    writel(NV_PFIFO + NV_PFIFO_CACHE1_PULL0, 1);
+
+    pushbuf_put = 0;
+}
+
+static void nv2a_start(void)
+{
+    char *args;
+    int fd, ret;
+
+    /* the bios is never run, but the machine wants one */
+    fd = mkstemp(bios_path);
+    g_assert(fd >= 0);
+    ret = ftruncate(fd, 256 * 1024);
+    g_assert(ret == 0);
+    close(fd);
+
+    args = g_strdup_printf("-machine xbox -bios %s -m 64", bios_path);
+    qtest_start(args);
+    g_free(args);
+
+    nv2a_setup();
+}
+
+static void nv2a_stop(void)
+{
+    qtest_end();
+    unlink(bios_path);
+    strcpy(bios_path, "/tmp/qtest-nv2a.XXXXXX");
+}
+
+/* submission */
+
+static void nv2a_submit(const PushBuffer *pb)
+{
+    uint32_t bytes = pb->length * 4;
+    uint8_t *buf;
+    unsigned int i;
+
+    /* the wrap below needs the pusher to see the jump before the new
+     * put, so a batch can't fill half the ring */
+    g_assert(bytes * 2 + 8 < PUSHBUF_SIZE);
+
+    if (pushbuf_put + bytes + 4 > PUSHBUF_SIZE) {
+        write_le32(PUSHBUF_ADDR + pushbuf_put, PUSHBUF_ADDR | 1);
+        pushbuf_put = 0;
+    }
+
+    buf = g_malloc(bytes);
+    for (i = 0; i < pb->length; i++) {
+        put_le32(buf + i * 4, pb->words[i]);
+    }
+    memwrite(PUSHBUF_ADDR + pushbuf_put, buf, bytes);
+    g_free(buf);
+
+    pushbuf_put += bytes;
+    writel(NV_USER + NV_USER_DMA_PUT, PUSHBUF_ADDR + pushbuf_put);
+}
+
+/* The fence is a nop with a nonzero parameter: pgraph raises NOTIFY and
+ * stalls the puller until it's acknowledged. WAIT_FOR_IDLE in front of it
+ * gets the rendered surface written back to vram. */
+static void pb_fence(PushBuffer *pb)
+{
+    pb_method(pb, SUBCH_KELVIN, NV097_WAIT_FOR_IDLE, 0);
+    pb_method(pb, SUBCH_KELVIN, NV097_NO_OPERATION, 1);
+}
+
+static void nv2a_wait_fence(void)
+{
+    gint64 deadline = g_get_monotonic_time() + FENCE_TIMEOUT_US;
+
+    while (!(readl(NV_PGRAPH + NV_PGRAPH_INTR) & NV_PGRAPH_INTR_NOTIFY)) {
+        g_assert(g_get_monotonic_time() < deadline);
+        g_usleep(50);
+    }
+    writel(NV_PGRAPH + NV_PGRAPH_INTR, NV_PGRAPH_INTR_NOTIFY);
+}
+
+/* common state */
+
+static void pb_bind_objects(PushBuffer *pb)
+{
+    pb_method(pb, SUBCH_KELVIN, NV_SET_OBJECT, HANDLE_KELVIN);
+    pb_method(pb, SUBCH_SURF2D, NV_SET_OBJECT, HANDLE_SURF2D);
+    pb_method(pb, SUBCH_BLIT, NV_SET_OBJECT, HANDLE_BLIT);
+}
+
+static void pb_setup_surface(PushBuffer *pb)
+{
+    static const float identity[16] = {
+        1, 0, 0, 0,
+        0, 1, 0, 0,
+        0, 0, 1, 0,
+        0, 0, 0, 1,
+    };
+
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_CONTEXT_DMA_COLOR, HANDLE_DMA_VRAM);
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_CONTEXT_DMA_A, HANDLE_DMA_VRAM);
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_CONTEXT_DMA_VERTEX_A,
+              HANDLE_DMA_VRAM);
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_SURFACE_CLIP_HORIZONTAL,
+              SURFACE_WIDTH << 16);
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_SURFACE_CLIP_VERTICAL,
+              SURFACE_HEIGHT << 16);
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_SURFACE_FORMAT,
+              NV097_SET_SURFACE_FORMAT_COLOR_LE_A8R8G8B8);
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_SURFACE_PITCH,
+              SURFACE_PITCH | (SURFACE_PITCH << 16));
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_SURFACE_COLOR_OFFSET, SURFACE_ADDR);
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_COLOR_MASK, 0x01010101);
+
+    pb_method_floats(pb, SUBCH_KELVIN, NV097_SET_COMPOSITE_MATRIX,
+                     16, identity);
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_TRANSFORM_EXECUTION_MODE, 0);
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_SHADER_STAGE_PROGRAM, 0);
+}
+
+/* one combiner stage computing r0 = a * b */
+static void pb_combiner_multiply(PushBuffer *pb, uint32_t a, uint32_t b)
+{
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_COMBINER_CONTROL, 1);
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_COMBINER_COLOR_ICW,
+              PS_COMBINER_INPUTS(a, b));
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_COMBINER_ALPHA_ICW,
+              PS_COMBINER_INPUTS(a | PS_CHANNEL_ALPHA,
+                                 b | PS_CHANNEL_ALPHA));
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_COMBINER_COLOR_OCW,
+              PS_COMBINER_AB_TO(PS_REGISTER_R0));
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_COMBINER_ALPHA_OCW,
+              PS_COMBINER_AB_TO(PS_REGISTER_R0));
+}
+
+static void pb_clear(PushBuffer *pb, uint32_t argb,
+                     unsigned int x0, unsigned int y0,
+                     unsigned int x1, unsigned int y1)
+{
+    /* the rect is inclusive */
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_CLEAR_RECT_HORIZONTAL,
+              x0 | (x1 << 16));
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_CLEAR_RECT_VERTICAL,
+              y0 | (y1 << 16));
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_COLOR_CLEAR_VALUE, argb);
+    pb_method(pb, SUBCH_KELVIN, NV097_CLEAR_SURFACE,
+              NV097_CLEAR_SURFACE_COLOR);
+}
+
+static void pb_clear_surface(PushBuffer *pb, uint32_t argb)
+{
+    pb_clear(pb, argb, 0, 0, SURFACE_WIDTH - 1, SURFACE_HEIGHT - 1);
+}
+
+/* an axis aligned quad in surface pixels, through inline vertices.
+ * diffuse is packed the way SET_VERTEX_DATA4UB takes it, 0xAABBGGRR */
+static void pb_inline_quad(PushBuffer *pb, uint32_t diffuse,
+                           float x0, float y0, float x1, float y1)
+{
+    const float corners[4][2] = {
+        { x0, y0 }, { x1, y0 }, { x1, y1 }, { x0, y1 },
+    };
+    unsigned int i;
+
+    pb_method(pb, SUBCH_KELVIN,
+              NV097_SET_VERTEX_DATA4UB + NV2A_VERTEX_ATTR_DIFFUSE * 4,
+              diffuse);
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_BEGIN_END,
+              NV097_SET_BEGIN_END_OP_QUADS);
+    for (i = 0; i < 4; i++) {
+        float v[4] = { corners[i][0], corners[i][1], 0.5f, 1.0f };
+        pb_method_floats(pb, SUBCH_KELVIN, NV097_SET_VERTEX4F, 4, v);
+    }
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_BEGIN_END,
+              NV097_SET_BEGIN_END_OP_END);
+}
+
+/* cases */
+
+static void build_clear(PushBuffer *pb)
+{
+    pb_bind_objects(pb);
+    pb_setup_surface(pb);
+    pb_clear_surface(pb, 0xFF204060);
+    pb_clear(pb, 0xFFC08020, 16, 24, 79, 55);
+}
+
+static void build_fixed_function_quads(PushBuffer *pb)
+{
+    pb_bind_objects(pb);
+    pb_setup_surface(pb);
+    pb_clear_surface(pb, 0xFF000000);
+    pb_combiner_multiply(pb, PS_REGISTER_V0, PS_REGISTER_ONE);
+    pb_inline_quad(pb, 0xFF20C0FF, 8, 16, 72, 104);
+    pb_inline_quad(pb, 0xFFFF4000, 48, 64, 120, 112);
+}
+
+static void build_combiner_factor(PushBuffer *pb)
+{
+    pb_bind_objects(pb);
+    pb_setup_surface(pb);
+    pb_clear_surface(pb, 0xFF000000);
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_COMBINER_FACTOR0, 0x80FF8040);
+    pb_combiner_multiply(pb, PS_REGISTER_C0, PS_REGISTER_V0);
+    pb_inline_quad(pb, 0xFFFFFFFF, 8, 8, 56, 56);
+    pb_inline_quad(pb, 0xFF00FF00, 64, 32, 120, 96);
+}
+
+static void build_vertex_program(PushBuffer *pb)
+{
+    static const uint32_t program[] = {
+        /* MOV oPos, v0 */
+        0x00000000, 0x0020001B, 0x08000000, 0x1000F800,
+        /* MOV oD0, c[100] (final) */
+        0x00000000, 0x002C801B, 0x0C000000, 0x1000F819,
+    };
+    static const float viewport_scale[4] = {
+        SURFACE_WIDTH / 2, -SURFACE_HEIGHT / 2, 0, 0,
+    };
+    static const float viewport_offset[4] = {
+        SURFACE_WIDTH / 2, SURFACE_HEIGHT / 2, 0, 0,
+    };
+    static const float cyan[4] = { 0.0f, 1.0f, 1.0f, 1.0f };
+
+    pb_bind_objects(pb);
+    pb_setup_surface(pb);
+    pb_clear_surface(pb, 0xFF000000);
+    pb_combiner_multiply(pb, PS_REGISTER_V0, PS_REGISTER_ONE);
+
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_TRANSFORM_PROGRAM_LOAD, 0);
+    pb_methods(pb, SUBCH_KELVIN, NV097_SET_TRANSFORM_PROGRAM,
+               ARRAY_SIZE(program), program);
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_TRANSFORM_PROGRAM_START, 0);
+    pb_method_floats(pb, SUBCH_KELVIN, NV097_SET_VIEWPORT_SCALE,
+                     4, viewport_scale);
+    pb_method_floats(pb, SUBCH_KELVIN, NV097_SET_VIEWPORT_OFFSET,
+                     4, viewport_offset);
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_TRANSFORM_CONSTANT_LOAD, 100);
+    pb_method_floats(pb, SUBCH_KELVIN, NV097_SET_TRANSFORM_CONSTANT,
+                     4, cyan);
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_TRANSFORM_EXECUTION_MODE, 2);
+
+    pb_inline_quad(pb, 0xFFFFFFFF, 24, 40, 104, 88);
+}
+
+/* 8x8 swizzled A8R8G8B8 texture, red across and green down */
+static uint32_t texture_texel(unsigned int x, unsigned int y)
+{
+    return 0xFF000080 | ((x * 32 + 16) << 16) | ((y * 32 + 16) << 8);
+}
+
+static void prepare_texture(void)
+{
+    static const float vertices[4][6] = {
+        /* x, y, z, w, s, t */
+        { 16, 16, 0.5f, 1, 0, 0 },
+        { 80, 16, 0.5f, 1, 1, 0 },
+        { 80, 80, 0.5f, 1, 1, 1 },
+        { 16, 80, 0.5f, 1, 0, 1 },
+    };
+    uint8_t texels[8 * 8 * 4];
+    uint8_t data[sizeof(vertices)];
+    unsigned int x, y, i, index;
+
+    for (y = 0; y < 8; y++) {
+        for (x = 0; x < 8; x++) {
+            /* morton order, u in the low bit */
+            index = 0;
+            for (i = 0; i < 3; i++) {
+                index |= ((x >> i) & 1) << (2 * i);
+                index |= ((y >> i) & 1) << (2 * i + 1);
+            }
+            put_le32(texels + index * 4, texture_texel(x, y));
+        }
+    }
+    memwrite(TEXTURE_ADDR, texels, sizeof(texels));
+
+    for (i = 0; i < sizeof(vertices) / 4; i++) {
+        put_le32(data + i * 4, float_bits(((const float *)vertices)[i]));
+    }
+    memwrite(VERTEX_ADDR, data, sizeof(data));
+}
+
+static void build_textured_quad(PushBuffer *pb)
+{
+    pb_bind_objects(pb);
+    pb_setup_surface(pb);
+    pb_clear_surface(pb, 0xFF000000);
+    pb_combiner_multiply(pb, PS_REGISTER_T0, PS_REGISTER_ONE);
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_SHADER_STAGE_PROGRAM, 1);
+
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_TEXTURE_OFFSET, TEXTURE_ADDR);
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_TEXTURE_FORMAT,
+              1                 /* context dma a */
+              | (2 << 4)        /* 2d */
+              | (0x06 << 8)     /* SZ_A8R8G8B8 */
+              | (1 << 16)       /* one level */
+              | (3 << 20)       /* log2 width */
+              | (3 << 24));     /* log2 height */
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_TEXTURE_CONTROL0,
+              NV097_SET_TEXTURE_CONTROL0_ENABLE | (1 << 6));
+    /* nearest, so every texel covers an exact 8x8 block */
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_TEXTURE_FILTER,
+              (1 << 16) | (1 << 24));
+
+    pb_method(pb, SUBCH_KELVIN,
+              NV097_SET_VERTEX_DATA_ARRAY_FORMAT
+                + NV2A_VERTEX_ATTR_POSITION * 4,
+              NV097_SET_VERTEX_DATA_ARRAY_FORMAT_TYPE_F | (4 << 4) | (24 << 8));
+    pb_method(pb, SUBCH_KELVIN,
+              NV097_SET_VERTEX_DATA_ARRAY_FORMAT
+                + NV2A_VERTEX_ATTR_TEXTURE0 * 4,
+              NV097_SET_VERTEX_DATA_ARRAY_FORMAT_TYPE_F | (2 << 4) | (24 << 8));
+    pb_method(pb, SUBCH_KELVIN,
+              NV097_SET_VERTEX_DATA_ARRAY_OFFSET
+                + NV2A_VERTEX_ATTR_POSITION * 4,
+              VERTEX_ADDR);
+    pb_method(pb, SUBCH_KELVIN,
+              NV097_SET_VERTEX_DATA_ARRAY_OFFSET
+                + NV2A_VERTEX_ATTR_TEXTURE0 * 4,
+              VERTEX_ADDR + 16);
+
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_BEGIN_END,
+              NV097_SET_BEGIN_END_OP_QUADS);
+    pb_method(pb, SUBCH_KELVIN, NV097_DRAW_ARRAYS, 0 | (3 << 24));
+    pb_method(pb, SUBCH_KELVIN, NV097_SET_BEGIN_END,
+              NV097_SET_BEGIN_END_OP_END);
+}
+
+/* 32x32 linear source for the blit */
+static uint32_t blit_source_pixel(unsigned int x, unsigned int y)
+{
+    return 0xFF000055 | ((x * 8) << 16) | ((y * 8) << 8);
+}
+
+static void prepare_blit(void)
+{
+    uint8_t source[32 * BLIT_SRC_PITCH];
+    uint8_t *dest;
+    unsigned int x, y;
+
+    for (y = 0; y < 32; y++) {
+        for (x = 0; x < 32; x++) {
+            put_le32(source + y * BLIT_SRC_PITCH + x * 4,
+                     blit_source_pixel(x, y));
+        }
+    }
+    memwrite(BLIT_SRC_ADDR, source, sizeof(source));
+
+    dest = g_malloc0(IMAGE_HEIGHT * BLIT_DST_PITCH);
+    memwrite(BLIT_DST_ADDR, dest, IMAGE_HEIGHT * BLIT_DST_PITCH);
+    g_free(dest);
+}
+
+static void build_blit(PushBuffer *pb)
+{
+    pb_bind_objects(pb);
+
+    pb_method(pb, SUBCH_SURF2D, NV062_SET_CONTEXT_DMA_IMAGE_SOURCE,
+              HANDLE_DMA_VRAM);
+    pb_method(pb, SUBCH_SURF2D, NV062_SET_CONTEXT_DMA_IMAGE_DESTIN,
+              HANDLE_DMA_VRAM);
+    pb_method(pb, SUBCH_SURF2D, NV062_SET_COLOR_FORMAT,
+              NV062_SET_COLOR_FORMAT_LE_A8R8G8B8);
+    pb_method(pb, SUBCH_SURF2D, NV062_SET_PITCH,
+              BLIT_SRC_PITCH | (BLIT_DST_PITCH << 16));
+    pb_method(pb, SUBCH_SURF2D, NV062_SET_OFFSET_SOURCE, BLIT_SRC_ADDR);
+    pb_method(pb, SUBCH_SURF2D, NV062_SET_OFFSET_DESTIN, BLIT_DST_ADDR);
+
+    pb_method(pb, SUBCH_BLIT, NV09F_SET_CONTEXT_SURFACES, HANDLE_SURF2D);
+    pb_method(pb, SUBCH_BLIT, NV09F_SET_OPERATION,
+              NV09F_SET_OPERATION_SRCCOPY);
+    pb_method(pb, SUBCH_BLIT, NV09F_CONTROL_POINT_IN, 4 | (6 << 16));
+    pb_method(pb, SUBCH_BLIT, NV09F_CONTROL_POINT_OUT, 40 | (50 << 16));
+    pb_method(pb, SUBCH_BLIT, NV09F_SIZE, 20 | (12 << 16));
+}
+
+static const NV2ATestCase test_cases[] = {
+    {
+        .name = "clear",
+        .build = build_clear,
+        .image_addr = SURFACE_ADDR,
+        .image_pitch = SURFACE_PITCH,
+    }, {
+        .name = "fixed-function-quads",
+        .build = build_fixed_function_quads,
+        .image_addr = SURFACE_ADDR,
+        .image_pitch = SURFACE_PITCH,
+        .tolerance = 2,
+        .max_bad_pixels = 16,
+    }, {
+        .name = "combiner-factor",
+        .build = build_combiner_factor,
+        .image_addr = SURFACE_ADDR,
+        .image_pitch = SURFACE_PITCH,
+        .tolerance = 2,
+        .max_bad_pixels = 16,
+    }, {
+        .name = "vertex-program",
+        .build = build_vertex_program,
+        .image_addr = SURFACE_ADDR,
+        .image_pitch = SURFACE_PITCH,
+        .tolerance = 2,
+        .max_bad_pixels = 16,
+    }, {
+        .name = "textured-quad",
+        .prepare = prepare_texture,
+        .build = build_textured_quad,
+        .image_addr = SURFACE_ADDR,
+        .image_pitch = SURFACE_PITCH,
+        .tolerance = 2,
+        .max_bad_pixels = 16,
+    }, {
+        .name = "blit",
+        .prepare = prepare_blit,
+        .build = build_blit,
+        .image_addr = BLIT_DST_ADDR,
+        .image_pitch = BLIT_DST_PITCH,
+    },
+};
+
+/* reference images, binary ppm */
+
+static char *reference_path(const char *name)
+{
+    const char *src_path = getenv("SRC_PATH");
+
+    return g_strdup_printf("%s/tests/nv2a/%s.ppm",
+                           src_path ? src_path : ".", name);
+}
+
+static bool image_load(Image *image, const char *path)
+{
+    unsigned int width, height, maxval;
+    size_t size;
+    bool ok = false;
+    FILE *f;
+
+    f = fopen(path, "rb");
+    if (!f) {
+        return false;
+    }
+    if (fscanf(f, "P6 %u %u %u", &width, &height, &maxval) == 3
+        && maxval == 255 && fgetc(f) != EOF) {
+        size = width * height * 3;
+        image->width = width;
+        image->height = height;
+        image->rgb = g_malloc(size);
+        ok = fread(image->rgb, 1, size, f) == size;
+    }
+    fclose(f);
+    return ok;
+}
+
+static void image_save(const Image *image, const char *path)
+{
+    size_t size = image->width * image->height * 3;
+    FILE *f = fopen(path, "wb");
+    size_t written;
+
+    g_assert(f);
+    fprintf(f, "P6\n%u %u\n255\n", image->width, image->height);
+    written = fwrite(image->rgb, 1, size, f);
+    g_assert(written == size);
+    fclose(f);
+}
+
+/* A8R8G8B8 in vram to rgb */
+static void image_read(Image *image, uint32_t addr, unsigned int pitch)
+{
+    uint8_t *data = g_malloc(IMAGE_HEIGHT * pitch);
+    unsigned int x, y;
+    uint8_t *in, *out;
+
+    memread(addr, data, IMAGE_HEIGHT * pitch);
+
+    image->width = IMAGE_WIDTH;
+    image->height = IMAGE_HEIGHT;
+    image->rgb = g_malloc(IMAGE_WIDTH * IMAGE_HEIGHT * 3);
+    for (y = 0; y < IMAGE_HEIGHT; y++) {
+        in = data + y * pitch;
+        out = image->rgb + y * IMAGE_WIDTH * 3;
+        for (x = 0; x < IMAGE_WIDTH; x++, in += 4, out += 3) {
+            out[0] = in[2];
+            out[1] = in[1];
+            out[2] = in[0];
+        }
+    }
+    g_free(data);
+}
+
+/* the number of pixels off by more than tolerance in any channel, and
+ * the first of them */
+static unsigned int image_diff(const Image *result, const Image *reference,
+                               unsigned int tolerance,
+                               unsigned int *first_bad)
+{
+    unsigned int i, c, bad = 0;
+
+    for (i = 0; i < result->width * result->height; i++) {
+        for (c = 0; c < 3; c++) {
+            int diff = result->rgb[i * 3 + c] - reference->rgb[i * 3 + c];
+            if (abs(diff) > tolerance) {
+                if (!bad++) {
+                    *first_bad = i;
+                }
+                break;
+            }
+        }
+    }
+    return bad;
+}
+
+static void image_compare(const NV2ATestCase *tc, const Image *result,
+                          const Image *reference)
+{
+    unsigned int i, bad, first_bad = 0;
+
+    g_assert_cmpuint(reference->width, ==, result->width);
+    g_assert_cmpuint(reference->height, ==, result->height);
+
+    bad = image_diff(result, reference, tc->tolerance, &first_bad);
+    if (bad) {
+        i = first_bad;
+        g_test_message("%s: %u pixels differ, first at %u,%u: "
+                       "%02x%02x%02x, expected %02x%02x%02x", tc->name, bad,
+                       i % result->width, i / result->width,
+                       result->rgb[i * 3], result->rgb[i * 3 + 1],
+                       result->rgb[i * 3 + 2], reference->rgb[i * 3],
+                       reference->rgb[i * 3 + 1], reference->rgb[i * 3 + 2]);
+    }
+    g_assert_cmpuint(bad, <=, tc->max_bad_pixels);
+}
+
+static void test_nv2a_case(gconstpointer opaque)
+{
+    const NV2ATestCase *tc = opaque;
+    PushBuffer *pb = g_new0(PushBuffer, 1);
+    Image result, reference;
+    unsigned int i, frames;
+    char *path;
+    double duration;
+
+    nv2a_start();
+
+    if (tc->prepare) {
+        tc->prepare();
+    }
+    tc->build(pb);
+    pb_fence(pb);
+
+    nv2a_submit(pb);
+    nv2a_wait_fence();
+
+    image_read(&result, tc->image_addr, tc->image_pitch);
+    path = reference_path(tc->name);
+    if (getenv("NV2A_TEST_UPDATE_REFERENCES")) {
+        if (image_load(&reference, path)) {
+            unsigned int first_bad = 0;
+            if (reference.width == result.width
+                && reference.height == result.height) {
+                g_test_message("%s: %u pixels changed", tc->name,
+                               image_diff(&result, &reference, 0,
+                                          &first_bad));
+            }
+            g_free(reference.rgb);
+        }
+        image_save(&result, path);
+        g_test_message("%s: wrote %s", tc->name, path);
+    } else {
+        if (!image_load(&reference, path)) {
+            g_test_message("%s: can't load reference %s", tc->name, path);
+            g_assert_not_reached();
+        }
+        image_compare(tc, &result, &reference);
+        g_free(reference.rgb);
+    }
+    g_free(result.rgb);
+    g_free(path);
+
+    /* throughput: the same frame again, fenced each time */
+    frames = g_test_perf() ? 500 : 16;
+    g_test_timer_start();
+    for (i = 0; i < frames; i++) {
+        nv2a_submit(pb);
+        nv2a_wait_fence();
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("%s: %u frames of %u methods in %f s, "
+                   "%.0f methods/s, %.3f ms/frame", tc->name, frames,
+                   pb->methods, duration, pb->methods * frames / duration,
+                   duration * 1000 / frames);
+
+    g_free(pb);
+    nv2a_stop();
+}
+
+/* Stands in for every case when pgraph can't get a context, so the run
+ * doesn't pass without having drawn anything */
+static void test_nv2a_no_display(gconstpointer opaque)
+{
+#if GLIB_CHECK_VERSION(2, 38, 0)
+    g_test_skip("pgraph needs a glx context and DISPLAY is unset");
+#else
+    const NV2ATestCase *tc = opaque;
+    g_test_message("%s: pgraph needs a glx context and DISPLAY is unset",
+                   tc->name);
+    g_assert_not_reached();
+#endif
+}
+
+int main(int argc, char **argv)
+{
+    void (*func)(gconstpointer) = test_nv2a_case;
+    unsigned int i;
+    char *name;
+
+    g_test_init(&argc, &argv, NULL);
+
+#ifdef __linux__
+    if (!getenv("DISPLAY")) {
+        func = test_nv2a_no_display;
+    }
+#endif
+
+    for (i = 0; i < ARRAY_SIZE(test_cases); i++) {
+        name = g_strdup_printf("/nv2a/%s", test_cases[i].name);
+        g_test_add_data_func(name, &test_cases[i], func);
+        g_free(name);
+    }
+
+    return g_test_run();
+}